@@ -0,0 +1,19 @@
+#ifndef _ALLOCATIONCOUNTER_H_
+#define _ALLOCATIONCOUNTER_H_
+
+/**
+ * Counts heap allocations made through operator new by any thread.
+ * Only enabled in debug builds (_DEBUG), where it replaces the global
+ * operator new; in release builds the count is always zero.
+ */
+class AllocationCounter {
+public:
+	static bool isEnabled();
+
+	/**
+	 * @return Number of allocations since the program started
+	 */
+	static unsigned long getCount();
+};
+
+#endif // _ALLOCATIONCOUNTER_H_
@@ -0,0 +1,96 @@
+#ifndef _ANIMATEDCROWD_H_
+#define _ANIMATEDCROWD_H_
+
+#include <memory>
+#include <vector>
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include "GLUtils/GLUtils.hpp"
+#include "GLUtils/StreamingBuffer.hpp"
+#include "JobSystem.h"
+#include "Model.h"
+#include "Skeleton.h"
+
+/**
+ * Many copies of one animated model, each playing its own clips from its
+ * own point in time, drawn with a single instanced call. Every update,
+ * the poses are sampled and turned into bone palettes on the job system,
+ * straight into a streaming texture buffer, which the SKINNING variants
+ * of basic_phong read by instance. The character transforms go in as the
+ * INSTANCING attribute.
+ * Must be used on the OpenGL thread.
+ */
+class AnimatedCrowd {
+public:
+	struct Character {
+		Character() : transform(1.0f), clip(0), blend_clip(0), blend_weight(0.0f), time_offset(0.0f), speed(1.0f) {}
+		glm::mat4 transform; //< From model to world space
+		unsigned int clip;
+		unsigned int blend_clip; //< Blended over clip by blend_weight
+		float blend_weight;
+		float time_offset; //< In seconds
+		float speed; //< Of playback
+	};
+
+	/**
+	 * The model must have a skeleton. The vertex array is set up for
+	 * program, but works with every variant of basic_phong with SKINNING
+	 * and INSTANCING, as they share attribute locations. Needs a current context.
+	 */
+	AnimatedCrowd(Model* model, JobSystem* job_system, GLUtils::Program& program, unsigned int max_characters = 1024,
+			GLenum palette_unit = GL_TEXTURE7);
+	~AnimatedCrowd();
+
+	/**
+	 * @return Index of the character
+	 */
+	unsigned int addCharacter(const Character& character);
+
+	inline const Character& getCharacter(unsigned int index) const {return characters[index];}
+	inline void setCharacter(unsigned int index, const Character& character) {
+		characters[index] = character;
+		transforms_changed = true;
+	}
+
+	inline void setColour(const glm::vec3& colour) {this->colour = colour;}
+
+	/**
+	 * Poses all characters at time seconds, and uploads their palettes
+	 */
+	void update(double time);
+
+	/**
+	 * Draws the characters as posed by the latest update. The light
+	 * position is in world space.
+	 */
+	void render(GLUtils::Program& program, const glm::mat4& view, const glm::mat4& projection, const glm::vec3& light_position);
+
+	inline unsigned int getNumCharacters() const {return static_cast<unsigned int>(characters.size());}
+	inline double getUpdateTime() const {return update_time;} //< Seconds the latest update took on the CPU
+
+private:
+	AnimatedCrowd(const AnimatedCrowd&);
+	AnimatedCrowd& operator=(const AnimatedCrowd&);
+
+	Model* model;
+	const Skeleton* skeleton;
+	JobSystem* job_system;
+	unsigned int max_characters;
+	GLenum palette_unit;
+
+	std::vector<Character> characters;
+	std::vector<Skeleton::Pose> thread_poses; //< Two per thread of the job system, to blend
+	std::shared_ptr<GLUtils::StreamingBuffer<GL_TEXTURE_BUFFER> > palettes; //< A region holds the palettes of max_characters
+	GLuint palette_texture;
+	GLintptr palette_offset; //< Of the latest update, in bytes
+	std::shared_ptr<GLUtils::VBO<GL_ARRAY_BUFFER> > instances; //< Transform of each character
+	bool transforms_changed;
+	GLuint vao;
+
+	glm::vec3 colour;
+	double update_time;
+};
+
+#endif // _ANIMATEDCROWD_H_
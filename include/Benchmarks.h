@@ -0,0 +1,39 @@
+#ifndef _BENCHMARKS_H_
+#define _BENCHMARKS_H_
+
+#include <string>
+
+/**
+ * Microbenchmarks for engine subsystems. Those that need OpenGL
+ * create a hidden window of their own.
+ * Run with "--benchmark <name>" on the command line.
+ */
+class Benchmarks {
+public:
+	/**
+	 * Runs the benchmark with the given name, printing results to stdout
+	 * @return false if there is no benchmark with that name
+	 */
+	static bool run(const std::string& name);
+
+	/**
+	 * Compares JobSystem::submit, JobSystem::parallelFor and std::async
+	 * for tasks taking from 1 microsecond to 1 millisecond
+	 */
+	static void jobSystem();
+
+	/**
+	 * Compares triangle throughput of a vertex+fragment program with the
+	 * same program plus a pass-through geometry shader ("geometry_shader")
+	 */
+	static void geometryShader();
+
+	/**
+	 * Compares computing draw packet transforms for 100k parts with glm,
+	 * as mat4 products and two full inverses per part, against the
+	 * scalar and SIMD kernels of TransformBatch ("transforms")
+	 */
+	static void transforms();
+};
+
+#endif // _BENCHMARKS_H_
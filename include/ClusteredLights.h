@@ -0,0 +1,101 @@
+#ifndef _CLUSTEREDLIGHTS_H_
+#define _CLUSTEREDLIGHTS_H_
+
+#include <vector>
+#include <cstdint>
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include "GLUtils/Program.hpp"
+#include "JobSystem.h"
+
+/**
+ * Clustered forward shading for many point lights. The view frustum is
+ * split into screen tiles and exponential depth slices, and every frame
+ * each light is assigned on the CPU to the clusters its sphere of
+ * influence overlaps. The lights, the per-cluster ranges and the light
+ * index lists go to the shaders as texture buffers, so a fragment only
+ * loops over the lights of its own cluster.
+ */
+class ClusteredLights {
+public:
+	struct PointLight {
+		glm::vec3 position; //< World space
+		float radius; //< Distance at which the light has faded out
+		glm::vec3 colour;
+	};
+
+	/**
+	 * Assigns lights using job_system. Texture units first_unit to first_unit+2
+	 * are used for the buffers.
+	 */
+	ClusteredLights(JobSystem* job_system, unsigned int tiles_x = 16, unsigned int tiles_y = 9, unsigned int slices = 24,
+			GLenum first_unit = GL_TEXTURE3);
+	~ClusteredLights();
+
+	/**
+	 * Assigns the lights to the clusters of the given camera and uploads
+	 * the result. The viewport size is in pixels.
+	 */
+	void update(const PointLight* lights, unsigned int num_lights, const glm::mat4& view, const glm::mat4& projection,
+			unsigned int viewport_width, unsigned int viewport_height);
+
+	/**
+	 * Binds the buffers and sets the uniforms the CLUSTERED_LIGHTS variants of basic_phong need
+	 */
+	void apply(GLUtils::Program& program) const;
+
+	inline unsigned int getNumLights() const {return num_lights;}
+	inline unsigned int getNumLightIndices() const {return num_indices;} //< Light to cluster assignments in the last update
+	inline unsigned int getMaxLightsPerCluster() const {return max_lights_per_cluster;} //< Most lights any cluster had so far
+
+private:
+	ClusteredLights(const ClusteredLights&);
+	ClusteredLights& operator=(const ClusteredLights&);
+
+	/**
+	 * Tiles covered by one light in one slice, inclusive
+	 */
+	struct LightRect {
+		uint32_t light;
+		uint16_t min_x, min_y, max_x, max_y;
+	};
+
+	/**
+	 * Finds the lights overlapping each cluster of the slice, and
+	 * writes their indices to the slice's own index list
+	 */
+	void assignSlice(unsigned int slice);
+
+	/**
+	 * Replaces the contents of a texture buffer, growing it if needed
+	 */
+	static void upload(GLuint buffer, size_t& capacity, const void* data, size_t bytes);
+
+	JobSystem* job_system;
+	unsigned int tiles_x, tiles_y, slices;
+	GLenum first_unit;
+
+	// Camera of the current update, as the assignment needs it
+	glm::vec2 projection_scale; //< Diagonal of the projection matrix, view to NDC
+	float z_near, z_far;
+	float slice_scale, slice_bias; //< slice = log(depth) * slice_scale + slice_bias
+	glm::vec2 tile_size; //< In pixels
+
+	std::vector<glm::vec4> view_lights; //< View space position and radius
+	std::vector<glm::vec4> light_data; //< As uploaded: two texels per light, position and radius, colour
+
+	std::vector<std::vector<LightRect> > slice_rects; //< Per slice, kept to avoid allocating every frame
+	std::vector<std::vector<uint32_t> > slice_indices;
+	std::vector<uint32_t> grid; //< Offset into the index list and light count per cluster
+	std::vector<uint32_t> indices;
+
+	unsigned int num_lights, num_indices, max_lights_per_cluster;
+
+	GLuint buffers[3]; //< Light data, grid and indices
+	GLuint textures[3];
+	size_t capacities[3]; //< Bytes allocated for each buffer
+};
+
+#endif // _CLUSTEREDLIGHTS_H_
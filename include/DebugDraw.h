@@ -0,0 +1,140 @@
+#ifndef _DEBUGDRAW_H_
+#define _DEBUGDRAW_H_
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include "GLUtils/GLUtils.hpp"
+#include "GLUtils/ProgramCache.hpp"
+#include "GLUtils/StreamingBuffer.hpp"
+#include "ShaderReloader.h"
+
+#if defined(_DEBUG) && !defined(DEBUGDRAW_DISABLED)
+#define DEBUGDRAW_ENABLED
+#endif
+
+// In release builds every function has an empty inline body, so calls
+// compile away without being wrapped in #ifdefs
+#ifdef DEBUGDRAW_ENABLED
+#define DEBUGDRAW_BODY(...) ;
+#else
+#define DEBUGDRAW_BODY(...) {__VA_ARGS__}
+#endif
+
+/**
+ * Immediate mode lines for visualizing bounds, lights, axes and such.
+ * Primitives are written between begin() and render() straight into a
+ * streaming vertex buffer, and drawn with one call for the lines in the
+ * world, depth tested, and one for text on top of everything. Text is
+ * drawn as strokes of a segment font, so it needs no texture.
+ * Only compiled in debug builds (_DEBUG); must be used on the OpenGL thread.
+ */
+class DebugDraw {
+public:
+	/**
+	 * Lines past max_lines in a frame are dropped. Needs a current context.
+	 */
+	DebugDraw(GLUtils::ProgramCache* cache, ShaderReloader* reloader = NULL, unsigned int max_lines = 1 << 17)
+		DEBUGDRAW_BODY()
+	~DebugDraw() DEBUGDRAW_BODY()
+
+	/**
+	 * Starts a frame. Text anchored in the world is placed with
+	 * view_projection and the size of the viewport in pixels.
+	 */
+	void begin(const glm::mat4& view_projection, unsigned int width, unsigned int height) DEBUGDRAW_BODY()
+
+	void line(const glm::vec3& a, const glm::vec3& b, const glm::vec3& colour) DEBUGDRAW_BODY()
+
+	/**
+	 * Axis aligned in the space transform maps from
+	 */
+	void box(const glm::vec3& min_corner, const glm::vec3& max_corner, const glm::vec3& colour, const glm::mat4& transform = glm::mat4(1.0f))
+		DEBUGDRAW_BODY()
+
+	/**
+	 * Three great circles
+	 */
+	void sphere(const glm::vec3& center, float radius, const glm::vec3& colour, const glm::mat4& transform = glm::mat4(1.0f))
+		DEBUGDRAW_BODY()
+
+	/**
+	 * The frustum that view_projection maps to clip space
+	 */
+	void frustum(const glm::mat4& view_projection, const glm::vec3& colour) DEBUGDRAW_BODY()
+
+	/**
+	 * The x, y and z axes of transform in red, green and blue
+	 */
+	void axes(const glm::mat4& transform, float size) DEBUGDRAW_BODY()
+
+	/**
+	 * Text with its lower left corner at a point in the world. Only
+	 * letters, digits and a little punctuation are drawn.
+	 */
+	void text(const glm::vec3& position, const std::string& str, const glm::vec3& colour) DEBUGDRAW_BODY()
+
+	/**
+	 * Text at a position in pixels from the lower left corner of the viewport
+	 */
+	void screenText(float x, float y, const std::string& str, const glm::vec3& colour) DEBUGDRAW_BODY()
+
+	/**
+	 * Draws everything since begin(). Leaves the depth test enabled.
+	 */
+	void render() DEBUGDRAW_BODY()
+
+	unsigned long getDroppedLines() const DEBUGDRAW_BODY(return 0;) //< Over all frames
+
+	static const float glyph_size; //< Height of text in pixels
+
+#ifdef DEBUGDRAW_ENABLED
+private:
+	DebugDraw(const DebugDraw&);
+	DebugDraw& operator=(const DebugDraw&);
+
+	struct Vertex {
+		float position[3];
+		uint32_t colour; //< RGBA8
+	};
+
+	static uint32_t packColour(const glm::vec3& colour);
+
+	inline void addLine(const glm::vec3& a, const glm::vec3& b, uint32_t colour) {
+		if (num_lines == max_lines) {
+			++dropped_lines;
+			return;
+		}
+		Vertex* v = lines + 2*num_lines++;
+		v[0].position[0] = a.x; v[0].position[1] = a.y; v[0].position[2] = a.z; v[0].colour = colour;
+		v[1].position[0] = b.x; v[1].position[1] = b.y; v[1].position[2] = b.z; v[1].colour = colour;
+	}
+
+	/**
+	 * Adds the strokes of str to the overlay, starting at a point in
+	 * normalized device coordinates
+	 */
+	void addText(glm::vec2 position, const std::string& str, uint32_t colour);
+
+	std::shared_ptr<GLUtils::Program> program;
+	std::shared_ptr<GLUtils::StreamingBuffer<GL_ARRAY_BUFFER> > buffer;
+	GLuint vao;
+
+	unsigned int max_lines;
+	Vertex* lines; //< Mapped, between begin() and render()
+	GLintptr lines_offset; //< In the buffer, in bytes
+	unsigned int num_lines;
+	std::vector<Vertex> overlay; //< Line vertices of the text, in normalized device coordinates
+
+	glm::mat4 view_projection;
+	glm::vec2 pixel_size; //< In normalized device coordinates
+	unsigned long dropped_lines;
+#endif
+};
+
+#endif // _DEBUGDRAW_H_
@@ -0,0 +1,94 @@
+#ifndef _DRAWLIST_H_
+#define _DRAWLIST_H_
+
+#include <vector>
+#include <utility>
+#include <cstdint>
+
+#include <glm/glm.hpp>
+
+#include "GLUtils/GLUtils.hpp"
+#include "LinearAllocator.h"
+
+/**
+ * Everything needed to issue one draw call for a mesh part
+ */
+struct DrawPacket {
+	uint64_t sort_key; //< Packets are submitted in increasing key order
+	glm::mat4 model_view;
+	glm::vec3 light_position; //< In model space, as the shaders expect
+	glm::vec3 camera_position; //< In model space
+	glm::vec3 colour;
+	unsigned int first;
+	unsigned int count;
+};
+
+/**
+ * Collects draw packets recorded by several threads in parallel,
+ * each into its own frame arena, and replays them on the OpenGL thread.
+ * The packets live until the arenas are reset.
+ */
+class DrawList {
+public:
+	/**
+	 * Empties the list, and takes the memory for this frame's packets
+	 * from the given arenas, one per recording thread. The thread with
+	 * index 0 must be the one that calls sort().
+	 */
+	void reset(LinearAllocator* frame_arenas, unsigned int num_threads);
+
+	/**
+	 * Appends a packet to the arena of the given thread. Threads may
+	 * record concurrently as long as they use different indices.
+	 */
+	inline void record(unsigned int thread_index, const DrawPacket& packet) {
+		threads[thread_index].packets.push_back(packet);
+	}
+
+	/**
+	 * Merges the arenas and sorts the packets by key. Call once all
+	 * threads have finished recording.
+	 */
+	void sort();
+
+	/**
+	 * Issues one draw call per packet with the given program. The
+	 * vertex array object must already be bound. Uniforms the program
+	 * does not use are skipped.
+	 */
+	void submit(GLUtils::Program& program, const glm::mat4& projection) const;
+
+	/**
+	 * @return Number of packets after the last sort()
+	 */
+	inline size_t size() const {
+		return sorted.size();
+	}
+
+	/**
+	 * Builds a key that sorts by layer first (e.g., program or
+	 * render state), and then front to back by view space depth
+	 */
+	static inline uint64_t makeSortKey(unsigned int layer, float depth) {
+		// Positive floats order the same way as their bit patterns
+		union { float f; uint32_t u; } bits;
+		bits.f = (depth > 0.0f) ? depth : 0.0f;
+		return (static_cast<uint64_t>(layer) << 32) | bits.u;
+	}
+
+private:
+	typedef std::vector<DrawPacket, ArenaAllocator<DrawPacket> > PacketVector;
+	typedef std::pair<uint64_t, const DrawPacket*> SortEntry;
+	typedef std::vector<SortEntry, ArenaAllocator<SortEntry> > SortVector;
+
+	struct ThreadPackets {
+		PacketVector packets;
+		size_t last_size; //< Packets recorded last frame, to reserve up front
+		char padding[64]; //< Keep vectors of different threads on separate cache lines
+	};
+
+	std::vector<ThreadPackets> threads;
+	SortVector sorted;
+};
+
+#endif // _DRAWLIST_H_
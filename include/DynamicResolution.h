@@ -0,0 +1,48 @@
+#ifndef _DYNAMICRESOLUTION_H_
+#define _DYNAMICRESOLUTION_H_
+
+/**
+ * Picks the scale of the internal render resolution so that the GPU
+ * time of a frame stays close to a target. Timings arrive a few frames
+ * late from timer queries, so after each change the controller waits
+ * for measurements of the new resolution before it adjusts again.
+ */
+class DynamicResolution {
+public:
+	/**
+	 * @param target_time GPU seconds per frame to aim for
+	 * @param latency Measurements to skip after a change, at least the timer query latency
+	 */
+	DynamicResolution(double target_time, float min_scale = 0.5f, float max_scale = 1.0f, unsigned int latency = 4);
+
+	/**
+	 * Feeds the GPU time of one frame, and adjusts the scale if needed
+	 */
+	void addMeasurement(double seconds);
+
+	void setTargetTime(double seconds) { target_time = seconds; }
+	double getTargetTime() const { return target_time; }
+
+	/**
+	 * @return Factor to multiply both window dimensions with
+	 */
+	float getScale() const { return scale; }
+
+	float getAverageScale() const { return (measurements > 0) ? static_cast<float>(scale_sum / measurements) : scale; }
+	unsigned long getNumChanges() const { return changes; }
+
+private:
+	static const double smoothing; //< Weight of the newest measurement in the average
+	static const double headroom; //< Relative deviation from the target that is tolerated
+	static const float max_step; //< Largest relative change of the scale at once
+
+	double target_time;
+	float min_scale, max_scale, scale;
+	unsigned int latency, settling; //< Measurements left before the average reflects the current scale
+	double average_time;
+
+	double scale_sum;
+	unsigned long measurements, changes;
+};
+
+#endif // _DYNAMICRESOLUTION_H_
@@ -0,0 +1,67 @@
+#ifndef _ENVIRONMENTLIGHTING_H_
+#define _ENVIRONMENTLIGHTING_H_
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include "GLUtils/CubeMap.hpp"
+#include "GLUtils/ProgramCache.hpp"
+#include "JobSystem.h"
+
+/**
+ * Image based lighting precomputed from an environment cube map: the
+ * diffuse irradiance as nine spherical harmonics coefficients, projected
+ * on the CPU, and a specular cube map whose mip levels are prefiltered
+ * for increasing roughness on the GPU. Both are cached in a file keyed
+ * by the environment's pixels, so later runs only upload them.
+ */
+class EnvironmentLighting {
+public:
+	/**
+	 * The environment must have kept its pixels. The cache file is
+	 * written to cache_filename, and the specular map is bound to unit.
+	 */
+	EnvironmentLighting(const GLUtils::CubeMap& environment, std::string cache_filename, GLUtils::ProgramCache* cache,
+			JobSystem* job_system, unsigned int specular_size = 128, GLenum unit = GL_TEXTURE6);
+	~EnvironmentLighting();
+
+	inline void setRoughness(float roughness) {this->roughness = roughness;}
+	inline bool wasCached() const {return cached;} //< If the last run's results were loaded
+
+	/**
+	 * Binds the specular map and sets the uniforms cube_map.frag needs
+	 */
+	void apply(GLUtils::Program& program) const;
+
+	/**
+	 * Projects the environment's radiance onto the first nine spherical
+	 * harmonics, convolved with the cosine lobe and divided by pi, so the
+	 * result scales a diffuse albedo directly
+	 */
+	static void computeIrradianceSH(const GLUtils::CubeMap& environment, JobSystem* job_system, glm::vec3 coefficients[9]);
+
+private:
+	EnvironmentLighting(const EnvironmentLighting&);
+	EnvironmentLighting& operator=(const EnvironmentLighting&);
+
+	static const uint32_t cache_version = 1;
+
+	bool loadCache(const std::string& filename, uint64_t key);
+	void saveCache(const std::string& filename, uint64_t key) const;
+	void prefilterSpecular(const GLUtils::CubeMap& environment, GLUtils::ProgramCache* cache);
+	void uploadSpecular() const;
+
+	glm::vec3 sh_coefficients[9];
+	GLuint specular_map;
+	unsigned int specular_size, specular_levels;
+	std::vector<uint16_t> specular_texels; //< Half float RGB, level by level and face by face
+	GLenum unit;
+	float roughness;
+	bool cached;
+};
+
+#endif // _ENVIRONMENTLIGHTING_H_
@@ -0,0 +1,53 @@
+#ifndef _FILEWATCHER_H_
+#define _FILEWATCHER_H_
+
+#include <string>
+#include <vector>
+
+#include "Timer.h"
+
+/**
+ * Reports files in one directory that have been written to. Uses
+ * inotify on Linux, and otherwise polls the modification times of the
+ * watched files a few times per second. Only files added with
+ * addFile() are reported.
+ */
+class FileWatcher {
+public:
+	explicit FileWatcher(std::string directory);
+	~FileWatcher();
+
+	/**
+	 * Starts watching directory/filename
+	 */
+	void addFile(const std::string& filename);
+
+	/**
+	 * Appends the paths (directory/filename) of watched files changed
+	 * since the last call to changed. Never blocks, and does not allocate
+	 * unless something changed.
+	 */
+	void poll(std::vector<std::string>& changed);
+
+private:
+	FileWatcher(const FileWatcher&);
+	FileWatcher& operator=(const FileWatcher&);
+
+	struct WatchedFile {
+		std::string path;
+		std::string filename;
+		long long modified; //< Used when polling
+	};
+
+	void pollModificationTimes(std::vector<std::string>& changed);
+	static long long getModificationTime(const std::string& path);
+
+	static const double poll_interval; //< Seconds between modification time checks
+
+	std::string directory;
+	std::vector<WatchedFile> files;
+	int inotify_fd; //< -1 when polling
+	Timer poll_timer;
+};
+
+#endif // _FILEWATCHER_H_
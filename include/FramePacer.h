@@ -0,0 +1,87 @@
+#ifndef _FRAMEPACER_H_
+#define _FRAMEPACER_H_
+
+#include "Timer.h"
+
+/**
+ * Controls the swap interval and frame rate of the main loop,
+ * and measures the latency from input is sampled until the frame
+ * has been handed to SDL_GL_SwapWindow.
+ */
+class FramePacer {
+public:
+	enum SwapMode {
+		SWAPMODE_IMMEDIATE, //< No vsync, tearing allowed
+		SWAPMODE_VSYNC, //< Wait for vertical retrace
+		SWAPMODE_ADAPTIVE, //< Vsync, but tear instead of stalling when we miss a retrace
+	};
+
+	FramePacer();
+
+	/**
+	 * Sets the swap interval through SDL_GL_SetSwapInterval. Adaptive
+	 * vsync falls back to regular vsync if the driver does not support it.
+	 * Requires a current OpenGL context.
+	 * @return The mode that was actually set
+	 */
+	SwapMode setSwapMode(SwapMode mode);
+	SwapMode getSwapMode() const { return swap_mode; }
+
+	/**
+	 * Limits the frame rate to fps frames per second. Zero disables the cap.
+	 */
+	void setFrameRateCap(double fps);
+	double getFrameRateCap() const { return frame_rate_cap; }
+
+	/**
+	 * Marks the start of a frame
+	 * @param input_time When the input this frame reflects was sampled.
+	 * Latency is only measured the first time a new input time is seen.
+	 */
+	void beginFrame(double input_time);
+
+	/**
+	 * Blocks until the frame rate cap allows the next frame to be presented.
+	 * Sleeps for most of the remaining time and spins for the last part
+	 * to avoid oversleeping on coarse OS timers.
+	 */
+	void waitForNextFrame();
+
+	/**
+	 * Marks the frame as presented. Call right after SDL_GL_SwapWindow.
+	 */
+	void endFrame();
+
+	/**
+	 * @return Smoothed time between presented frames in seconds
+	 */
+	double getAverageFrameTime() const { return average_frame_time; }
+
+	/**
+	 * @return Smoothed input-to-present latency in seconds
+	 */
+	double getAverageLatency() const { return average_latency; }
+
+	/**
+	 * @return Largest input-to-present latency seen in seconds
+	 */
+	double getMaxLatency() const { return max_latency; }
+
+private:
+	static const double spin_threshold; //< Time before a deadline we stop sleeping and start spinning
+	static const double smoothing; //< Weight of the newest sample in the running averages
+
+	SwapMode swap_mode;
+	double frame_rate_cap;
+
+	double input_time; //< Time when input for the current frame was sampled
+	double last_measured_input; //< Input time of the last latency sample
+	double next_deadline; //< Earliest time the next frame may be presented
+	double last_present;
+
+	double average_frame_time;
+	double average_latency;
+	double max_latency;
+};
+
+#endif // _FRAMEPACER_H_
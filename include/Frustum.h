@@ -0,0 +1,59 @@
+#ifndef _FRUSTUM_H_
+#define _FRUSTUM_H_
+
+#include <glm/glm.hpp>
+
+/**
+ * The six clipping planes of a view frustum, used for culling
+ */
+class Frustum {
+public:
+	Frustum() {}
+
+	/**
+	 * Extracts the planes from a projection matrix (Gribb and Hartmann).
+	 * The planes end up in the space the matrix transforms from, so pass
+	 * the projection matrix to get planes in view space.
+	 */
+	explicit Frustum(const glm::mat4& m) {
+		glm::vec4 rows[4];
+		for (int i=0; i<4; ++i)
+			rows[i] = glm::vec4(m[0][i], m[1][i], m[2][i], m[3][i]);
+
+		planes[0] = rows[3] + rows[0]; //left
+		planes[1] = rows[3] - rows[0]; //right
+		planes[2] = rows[3] + rows[1]; //bottom
+		planes[3] = rows[3] - rows[1]; //top
+		planes[4] = rows[3] + rows[2]; //near
+		planes[5] = rows[3] - rows[2]; //far
+
+		for (int i=0; i<6; ++i)
+			planes[i] /= glm::length(glm::vec3(planes[i]));
+	}
+
+	/**
+	 * @return false if the sphere is completely outside the frustum
+	 */
+	inline bool intersectsSphere(const glm::vec3& center, float radius) const {
+		for (int i=0; i<6; ++i)
+			if (glm::dot(glm::vec3(planes[i]), center) + planes[i].w < -radius)
+				return false;
+		return true;
+	}
+
+	/**
+	 * @return The largest scale factor a matrix applies along any axis,
+	 * for transforming bounding sphere radii
+	 */
+	static inline float getMaxScale(const glm::mat4& m) {
+		float x = glm::dot(glm::vec3(m[0]), glm::vec3(m[0]));
+		float y = glm::dot(glm::vec3(m[1]), glm::vec3(m[1]));
+		float z = glm::dot(glm::vec3(m[2]), glm::vec3(m[2]));
+		return sqrtf(glm::max(x, glm::max(y, z)));
+	}
+
+private:
+	glm::vec4 planes[6]; //< (normal, distance), normals pointing inwards
+};
+
+#endif // _FRUSTUM_H_
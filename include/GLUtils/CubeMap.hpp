@@ -10,18 +10,52 @@
 #include <GL/glew.h>
 
 #include "GLUtils/GLUtils.hpp"
+#include "JobSystem.h"
 
 namespace GLUtils {
 
 	class CubeMap {
 	public:
-		CubeMap(std::string base_filename, std::string extension) {
+		/**
+		 * Loads the six faces base_filename{pos,neg}{x,y,z}.extension.
+		 * If a job system is given, the files are read in parallel on it.
+		 * With keep_pixels, the decoded faces stay available on the CPU
+		 * until releasePixels() is called.
+		 */
+		CubeMap(std::string base_filename, std::string extension, JobSystem* job_system=NULL, bool keep_pixels=false) {
+			face_size = 0;
 			//Load cubemap from file
-			load(base_filename, extension);
+			load(base_filename, extension, job_system, keep_pixels);
 			CHECK_GL_ERROR();
 		}
 
-		~CubeMap() {};
+		~CubeMap() {
+			glDeleteTextures(1, &cubemap);
+		};
+
+		/**
+		 * Filters minified lookups through a mip chain instead of the nearest texel
+		 */
+		void generateMipmaps() {
+			glBindTexture(GL_TEXTURE_CUBE_MAP, cubemap);
+			glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+			glGenerateMipmap(GL_TEXTURE_CUBE_MAP);
+			glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+		}
+
+		/**
+		 * @return RGB bytes of a face, rows in the order they were uploaded,
+		 * or an empty vector unless the pixels were kept
+		 */
+		inline const std::vector<unsigned char>& getFacePixels(unsigned int face) const {return pixels[face];}
+		inline unsigned int getFaceSize() const {return face_size;} //< Texels across a face
+
+		void releasePixels() {
+			for (int i=0; i<6; ++i)
+				std::vector<unsigned char>().swap(pixels[i]);
+		}
+
+		inline GLuint getTexture() const {return cubemap;}
 
 		void bindTexture(GLenum texture_unit = GL_TEXTURE0) {
 			glActiveTexture(texture_unit);
@@ -33,12 +67,30 @@ namespace GLUtils {
 		}
 
 	private:
-		inline void load(std::string base_filename, std::string extension) {
+		inline void load(std::string base_filename, std::string extension, JobSystem* job_system, bool keep_pixels) {
 			const char name_exts[6][5] = { "posx", "negx", "posy", "negy", "posz", "negz" };
 			const GLenum faces[6] = { GL_TEXTURE_CUBE_MAP_POSITIVE_X, GL_TEXTURE_CUBE_MAP_NEGATIVE_X,
 				GL_TEXTURE_CUBE_MAP_POSITIVE_Y, GL_TEXTURE_CUBE_MAP_NEGATIVE_Y,
 				GL_TEXTURE_CUBE_MAP_POSITIVE_Z, GL_TEXTURE_CUBE_MAP_NEGATIVE_Z };
-			std::vector<float> data;
+			std::vector<unsigned char> data;
+			std::string filenames[6];
+			std::vector<char> files[6];
+
+			//Read the files in parallel. DevIL is not thread safe, so decoding
+			//and uploading stays on this thread
+			for (int i=0; i<6; ++i)
+				filenames[i] = base_filename + name_exts[i] + "." + extension;
+			if (job_system) {
+				std::vector<JobSystem::JobHandle> reads;
+				for (int i=0; i<6; ++i)
+					reads.push_back(job_system->submit([&files, &filenames, i]() { files[i] = readBinaryFile(filenames[i]); }));
+				for (int i=0; i<6; ++i)
+					job_system->wait(reads[i]);
+			}
+			else {
+				for (int i=0; i<6; ++i)
+					files[i] = readBinaryFile(filenames[i]);
+			}
 
 			//Allocate texture name and set parameters
 			glGenTextures(1, &cubemap);
@@ -50,16 +102,13 @@ namespace GLUtils {
 
 			//Load each face and set texture
 			for (int i = 0; i<6; ++i) {
-				std::stringstream filename;
 				ILuint ImageName;
 				unsigned int width, height;
 
 				ilGenImages(1, &ImageName); // Grab a new image name.
 				ilBindImage(ImageName);
 
-				filename << base_filename << name_exts[i] << "." << extension;
-
-				if (!ilLoadImage(filename.str().c_str())) {
+				if (!ilLoadL(IL_TYPE_UNKNOWN, files[i].data(), static_cast<ILuint>(files[i].size()))) {
 					ILenum e;
 					std::stringstream error;
 					while ((e = ilGetError()) != IL_NO_ERROR) {
@@ -76,13 +125,21 @@ namespace GLUtils {
 				ilCopyPixels(0, 0, 0, width, height, 1, IL_RGB, IL_UNSIGNED_BYTE, data.data());
 				ilDeleteImages(1, &ImageName); // Delete the image name. 
 
+				glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
 				glTexImage2D(faces[i], 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data.data());
+				glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+				face_size = width;
+				if (keep_pixels)
+					pixels[i] = data;
 			}
 
 			glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
 		}
 
 		GLuint cubemap;
+		std::vector<unsigned char> pixels[6]; //< Only kept if asked for
+		unsigned int face_size;
 		std::shared_ptr<GLUtils::VBO<GL_ARRAY_BUFFER> > vertices;
 		std::shared_ptr<GLUtils::VBO<GL_ELEMENT_ARRAY_BUFFER> > indices;
 		GLuint vao; //< Vertex array object
@@ -7,6 +7,7 @@
 #include <assert.h>
 #include <iostream>
 #include <fstream>
+#include <cstdint>
 
 #include <GL/glew.h>
 
@@ -73,5 +74,68 @@ inline std::string readFile(std::string file) {
 
 	return contents;
 }
+
+inline std::vector<char> readBinaryFile(std::string file) {
+	std::ifstream is(file.c_str(), std::ios::binary);
+
+	if (!is.good()) {
+		std::string err = "Could not open ";
+		err.append(file);
+		THROW_EXCEPTION(err);
+	}
+
+	is.seekg(0, std::ios::end);
+	std::vector<char> contents(static_cast<size_t>(is.tellg()));
+	is.seekg(0, std::ios::beg);
+	is.read(contents.data(), contents.size());
+
+	return contents;
+}
+
+/**
+ * Adds a #define for each of the given names right after the #version
+ * line. Names the source does not mention are left out, so sources that
+ * do not depend on them stay identical. A #line directive keeps the line
+ * numbers in compiler messages matching the file.
+ */
+inline std::string insertDefines(const std::string& source, const std::vector<std::string>& defines) {
+	std::stringstream define_lines;
+	for (size_t i=0; i<defines.size(); ++i)
+		if (source.find(defines[i]) != std::string::npos)
+			define_lines << "#define " << defines[i] << std::endl;
+	if (define_lines.str().empty())
+		return source;
+
+	size_t insert_at = 0;
+	size_t version = source.find("#version");
+	if (version != std::string::npos) {
+		size_t end_of_line = source.find('\n', version);
+		insert_at = (end_of_line == std::string::npos) ? source.size() : end_of_line + 1;
+	}
+	size_t next_line = 1;
+	for (size_t i=0; i<insert_at; ++i)
+		if (source[i] == '\n')
+			++next_line;
+
+	std::stringstream result;
+	result << source.substr(0, insert_at);
+	if (insert_at > 0 && source[insert_at - 1] != '\n')
+		result << std::endl;
+	result << define_lines.str() << "#line " << next_line << std::endl << source.substr(insert_at);
+	return result.str();
+}
+
+/**
+ * 64-bit FNV-1a, chained through seed. Used to key data cached on disk.
+ */
+inline uint64_t hash(const void* data, size_t bytes, uint64_t seed = 14695981039346656037ULL) {
+	const unsigned char* bytes_ptr = static_cast<const unsigned char*>(data);
+	uint64_t h = seed;
+	for (size_t i=0; i<bytes; ++i) {
+		h ^= bytes_ptr[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
 }; //Namespace GLUtils
 #endif
\ No newline at end of file
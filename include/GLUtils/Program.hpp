@@ -6,6 +6,7 @@
 #include <string>
 #include <sstream>
 #include <vector>
+#include <assert.h>
 
 #include <GL/glew.h>
 
@@ -18,7 +19,7 @@ public:
 		attachShader(vs, GL_VERTEX_SHADER);
 
 		attachShader(fs, GL_FRAGMENT_SHADER);
-		link();
+		link(name);
 	}
 
 	Program(std::string vs, std::string gs, std::string fs) {
@@ -26,7 +27,25 @@ public:
 		attachShader(vs, GL_VERTEX_SHADER);
 		attachShader(gs, GL_GEOMETRY_SHADER);
 		attachShader(fs, GL_FRAGMENT_SHADER);
-		link();
+		link(name);
+	}
+
+	/**
+	 * Takes ownership of an already linked program
+	 */
+	explicit Program(GLuint name) : name(name) {}
+
+	~Program() {
+		glDeleteProgram(name);
+	}
+
+	/**
+	 * Swaps in another linked program, e.g., after reloading the
+	 * sources, so everyone holding this Program uses the new one
+	 */
+	void replace(GLuint new_name) {
+		glDeleteProgram(name);
+		name = new_name;
 	}
 
 	inline void use() {
@@ -37,14 +56,14 @@ public:
 		glUseProgram(0);
 	}
 
-	inline GLint getUniform(std::string var) {
-		GLint loc = glGetUniformLocation(name, var.c_str());
+	inline GLint getUniform(const char* var) {
+		GLint loc = glGetUniformLocation(name, var);
 		assert(loc >= 0);
 		return loc;
 	}
 
-	inline void setAttributePointer(std::string var, unsigned int size, GLenum type=GL_FLOAT, GLboolean normalized=GL_FALSE, GLsizei stride=0, GLvoid* pointer=NULL) {
-		GLint loc = glGetAttribLocation(name, var.c_str());
+	inline void setAttributePointer(const char* var, unsigned int size, GLenum type=GL_FLOAT, GLboolean normalized=GL_FALSE, GLsizei stride=0, GLvoid* pointer=NULL) {
+		GLint loc = glGetAttribLocation(name, var);
 		assert(loc >= 0);
 		glVertexAttribPointer(loc, size, type, normalized, stride, pointer);
 		glEnableVertexAttribArray(loc);
@@ -52,8 +71,10 @@ public:
 
 	GLuint name; //< OpenGL shader program
 
-private:
-	void link() {
+	/**
+	 * Links the program, and throws with the info log on failure
+	 */
+	static void link(GLuint name) {
 		std::stringstream log;
 		glLinkProgram(name);
 
@@ -62,23 +83,16 @@ private:
 		glGetProgramiv(name, GL_LINK_STATUS, &linkstatus);
 		if (linkstatus != GL_TRUE) {
 			log << "Linking failed!" << std::endl;
-
-			GLint logsize;
-			glGetProgramiv(name, GL_INFO_LOG_LENGTH, &logsize);
-
-			if (logsize > 0) {
-				std::vector < GLchar > infolog(logsize + 1);
-				glGetProgramInfoLog(name, logsize, NULL, &infolog[0]);
-				log << "--- error log ---" << std::endl;
-				log << std::string(infolog.begin(), infolog.end()) << std::endl;
-			} else {
-				log << "--- empty log message ---" << std::endl;
-			}
+			log << getProgramLog(name);
 			THROW_EXCEPTION(log.str());
 		}
 	}
 
-	void attachShader(std::string& src, unsigned int type) {
+	/**
+	 * Compiles a shader of the given type, and throws with the
+	 * source and info log on failure
+	 */
+	static GLuint compileShader(const std::string& src, GLenum type) {
 		std::stringstream log;
 		// create shader object
 		GLuint s = glCreateShader(type);
@@ -100,25 +114,56 @@ private:
 			log << "Compilation failed!" << std::endl;
 			log << "--- source code ---" << std::endl;
 			log << src << std::endl;
+			log << getShaderLog(s);
+			glDeleteShader(s);
+			THROW_EXCEPTION(log.str());
+		}
+
+		return s;
+	}
 
-			GLint logsize;
-			glGetShaderiv(s, GL_INFO_LOG_LENGTH, &logsize);
+	static std::string getProgramLog(GLuint name) {
+		std::stringstream log;
+		GLint logsize;
+		glGetProgramiv(name, GL_INFO_LOG_LENGTH, &logsize);
+
+		if (logsize > 0) {
+			std::vector < GLchar > infolog(logsize + 1);
+			glGetProgramInfoLog(name, logsize, NULL, &infolog[0]);
+			log << "--- error log ---" << std::endl;
+			log << std::string(infolog.begin(), infolog.end()) << std::endl;
+		} else {
+			log << "--- empty log message ---" << std::endl;
+		}
+		return log.str();
+	}
 
-			if (logsize > 0) {
-				std::vector<GLchar> infolog(logsize + 1);
-				glGetShaderInfoLog(s, logsize, NULL, &infolog[0]);
+	static std::string getShaderLog(GLuint s) {
+		std::stringstream log;
+		GLint logsize;
+		glGetShaderiv(s, GL_INFO_LOG_LENGTH, &logsize);
 
-				log << "--- error log ---" << std::endl;
-				log << std::string(infolog.begin(), infolog.end()) << std::endl;
-			} else {
-				log << "--- empty log message ---" << std::endl;
-			}
-			THROW_EXCEPTION(log.str());
+		if (logsize > 0) {
+			std::vector<GLchar> infolog(logsize + 1);
+			glGetShaderInfoLog(s, logsize, NULL, &infolog[0]);
+
+			log << "--- error log ---" << std::endl;
+			log << std::string(infolog.begin(), infolog.end()) << std::endl;
+		} else {
+			log << "--- empty log message ---" << std::endl;
 		}
-		
-		glAttachShader(name, s);
+		return log.str();
 	}
 
+private:
+	Program(const Program&);
+	Program& operator=(const Program&);
+
+	void attachShader(std::string& src, unsigned int type) {
+		GLuint s = compileShader(src, type);
+		glAttachShader(name, s);
+		glDeleteShader(s); // Only flagged, goes away with the program
+	}
 };
 
 }; //Namespace GLUtils
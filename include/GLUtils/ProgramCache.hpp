@@ -0,0 +1,300 @@
+#ifndef _PROGRAMCACHE_HPP__
+#define _PROGRAMCACHE_HPP__
+
+#include <map>
+#include <memory>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+#include <GL/glew.h>
+
+#include "GLUtils/Program.hpp"
+#include "GLUtils/GLUtils.hpp"
+
+namespace GLUtils {
+
+/**
+ * Creates programs from shader sources, and remembers them in three ways:
+ * identical stages are compiled only once, identical programs are only
+ * linked once, and linked programs are stored on disk as driver binaries
+ * (ARB_get_program_binary), so the next run skips compiling altogether.
+ * Binaries are keyed by a hash of the sources, the driver string and the
+ * attribute locations, and are compiled again when the driver rejects them.
+ * Common vertex attributes get the same location in every program, so
+ * one vertex array object can be drawn with any of them.
+ * Must be used on the thread that owns the OpenGL context.
+ */
+class ProgramCache {
+public:
+	/**
+	 * Stores binaries in the given directory, which is created if needed
+	 */
+	explicit ProgramCache(std::string directory = "shader_cache") : directory(directory) {
+		binary_loads = 0;
+		linked_programs = 0;
+		compiled_shaders = 0;
+		reused_shaders = 0;
+
+		std::stringstream driver_stream;
+		driver_stream << glGetString(GL_VENDOR) << '|' << glGetString(GL_RENDERER) << '|' << glGetString(GL_VERSION);
+		driver = driver_stream.str();
+
+		GLint num_formats = 0;
+		if (GLEW_ARB_get_program_binary)
+			glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &num_formats);
+		binaries_supported = (num_formats > 0);
+
+		if (binaries_supported) {
+#ifdef _WIN32
+			_mkdir(directory.c_str());
+#else
+			mkdir(directory.c_str(), 0755);
+#endif
+		}
+	}
+
+	~ProgramCache() {
+		for (std::map<uint64_t, Shader>::iterator i=shaders.begin(); i!=shaders.end(); ++i)
+			glDeleteShader(i->second.name);
+	}
+
+	std::shared_ptr<Program> getProgram(const std::string& vs, const std::string& fs) {
+		Stage stages[] = { { GL_VERTEX_SHADER, &vs }, { GL_FRAGMENT_SHADER, &fs } };
+		return getProgram(stages, 2);
+	}
+
+	std::shared_ptr<Program> getProgram(const std::string& vs, const std::string& gs, const std::string& fs) {
+		Stage stages[] = { { GL_VERTEX_SHADER, &vs }, { GL_GEOMETRY_SHADER, &gs }, { GL_FRAGMENT_SHADER, &fs } };
+		return getProgram(stages, 3);
+	}
+
+	/**
+	 * A program with only a vertex shader, whose outputs are captured
+	 * with transform feedback, interleaved in the given order. Draw
+	 * with it while GL_RASTERIZER_DISCARD is enabled.
+	 */
+	std::shared_ptr<Program> getFeedbackProgram(const std::string& vs, const std::vector<std::string>& varyings) {
+		Stage stages[] = { { GL_VERTEX_SHADER, &vs } };
+		return getProgram(stages, 1, &varyings);
+	}
+
+	inline bool areBinariesSupported() const {return binaries_supported;}
+	inline unsigned int getBinaryLoads() const {return binary_loads;} //< Programs loaded from disk
+	inline unsigned int getLinkedPrograms() const {return linked_programs;} //< Programs compiled and linked from source
+	inline unsigned int getCompiledShaders() const {return compiled_shaders;}
+	inline unsigned int getReusedShaders() const {return reused_shaders;} //< Stages shared with an earlier program
+
+private:
+	ProgramCache(const ProgramCache&);
+	ProgramCache& operator=(const ProgramCache&);
+
+	struct Stage {
+		GLenum type;
+		const std::string* source;
+	};
+
+	struct Shader {
+		GLenum type;
+		std::string source;
+		GLuint name;
+	};
+
+	std::shared_ptr<Program> getProgram(const Stage* stages, unsigned int num_stages, const std::vector<std::string>* varyings = NULL) {
+		uint64_t key = hash(driver.data(), driver.size());
+		unsigned int num_attributes;
+		const Attribute* attributes = getAttributes(num_attributes);
+		for (unsigned int i=0; i<num_attributes; ++i) {
+			key = hash(attributes[i].name, std::strlen(attributes[i].name) + 1, key);
+			key = hash(&attributes[i].location, sizeof(GLuint), key);
+		}
+		for (unsigned int i=0; i<num_stages; ++i) {
+			key = hash(&stages[i].type, sizeof(GLenum), key);
+			key = hash(stages[i].source->data(), stages[i].source->size(), key);
+		}
+		// The separators keep e.g. "ab", "c" apart from "a", "bc"
+		if (varyings != NULL)
+			for (size_t i=0; i<varyings->size(); ++i)
+				key = hash((*varyings)[i].c_str(), (*varyings)[i].size() + 1, key);
+
+		std::map<uint64_t, std::shared_ptr<Program> >::iterator found = programs.find(key);
+		if (found != programs.end())
+			return found->second;
+
+		std::stringstream filename;
+		filename << directory << '/' << std::hex << key << ".bin";
+
+		GLuint name = glCreateProgram();
+		if (!binaries_supported || !loadBinary(name, filename.str())) {
+			std::vector<GLuint> attached;
+			for (unsigned int i=0; i<num_stages; ++i) {
+				attached.push_back(getShader(stages[i].type, *stages[i].source));
+				glAttachShader(name, attached.back());
+			}
+			if (binaries_supported)
+				glProgramParameteri(name, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+			bindAttributeLocations(name);
+			if (varyings != NULL) {
+				std::vector<const GLchar*> varying_names;
+				for (size_t i=0; i<varyings->size(); ++i)
+					varying_names.push_back((*varyings)[i].c_str());
+				glTransformFeedbackVaryings(name, static_cast<GLsizei>(varying_names.size()), varying_names.data(), GL_INTERLEAVED_ATTRIBS);
+			}
+
+			try {
+				Program::link(name);
+			}
+			catch (...) {
+				glDeleteProgram(name);
+				throw;
+			}
+			++linked_programs;
+
+			// The shaders stay in the cache for other programs
+			for (size_t i=0; i<attached.size(); ++i)
+				glDetachShader(name, attached[i]);
+
+			if (binaries_supported)
+				saveBinary(name, filename.str());
+		}
+
+		std::shared_ptr<Program> program(new Program(name));
+		programs[key] = program;
+		return program;
+	}
+
+	/**
+	 * @return A compiled shader for the source, compiling it only the first time
+	 */
+	GLuint getShader(GLenum type, const std::string& source) {
+		uint64_t key = hash(source.data(), source.size(), hash(&type, sizeof(GLenum)));
+		std::map<uint64_t, Shader>::iterator found = shaders.find(key);
+		if (found != shaders.end() && found->second.type == type && found->second.source == source) {
+			++reused_shaders;
+			return found->second.name;
+		}
+
+		Shader shader;
+		shader.type = type;
+		shader.source = source;
+		shader.name = Program::compileShader(source, type);
+		++compiled_shaders;
+
+		// On the off chance of a hash collision, the newest one wins
+		if (found != shaders.end())
+			glDeleteShader(found->second.name);
+		shaders[key] = shader;
+		return shader.name;
+	}
+
+	/**
+	 * Binary file layout: driver string length and driver string, binary
+	 * format, binary length and binary. Returns false unless the driver
+	 * matches and accepts the binary.
+	 */
+	bool loadBinary(GLuint name, const std::string& filename) {
+		std::ifstream file(filename.c_str(), std::ios::binary);
+		if (!file.good())
+			return false;
+
+		uint32_t driver_length = 0;
+		file.read(reinterpret_cast<char*>(&driver_length), sizeof(driver_length));
+		if (!file.good() || driver_length != driver.size())
+			return false;
+		std::string file_driver(driver_length, ' ');
+		file.read(&file_driver[0], driver_length);
+		if (!file.good() || file_driver != driver)
+			return false;
+
+		GLenum format = 0;
+		uint32_t length = 0;
+		file.read(reinterpret_cast<char*>(&format), sizeof(format));
+		file.read(reinterpret_cast<char*>(&length), sizeof(length));
+		if (!file.good() || length == 0)
+			return false;
+		std::vector<char> binary(length);
+		file.read(binary.data(), length);
+		if (!file.good())
+			return false;
+
+		glProgramBinary(name, format, binary.data(), static_cast<GLsizei>(length));
+		GLint link_status = GL_FALSE;
+		glGetProgramiv(name, GL_LINK_STATUS, &link_status);
+		if (link_status != GL_TRUE)
+			return false;
+
+		++binary_loads;
+		return true;
+	}
+
+	void saveBinary(GLuint name, const std::string& filename) {
+		GLint length = 0;
+		glGetProgramiv(name, GL_PROGRAM_BINARY_LENGTH, &length);
+		if (length <= 0)
+			return;
+
+		std::vector<char> binary(length);
+		GLenum format = 0;
+		glGetProgramBinary(name, length, NULL, &format, binary.data());
+
+		// A missing cache only costs time, so failing to write is not an error
+		std::ofstream file(filename.c_str(), std::ios::binary);
+		uint32_t driver_length = static_cast<uint32_t>(driver.size());
+		uint32_t binary_length = static_cast<uint32_t>(length);
+		file.write(reinterpret_cast<const char*>(&driver_length), sizeof(driver_length));
+		file.write(driver.data(), driver_length);
+		file.write(reinterpret_cast<const char*>(&format), sizeof(format));
+		file.write(reinterpret_cast<const char*>(&binary_length), sizeof(binary_length));
+		file.write(binary.data(), binary_length);
+	}
+
+	struct Attribute {
+		const char* name;
+		GLuint location;
+	};
+
+	/**
+	 * The common vertex attributes. They are part of the key, so
+	 * binaries linked with other locations are not loaded.
+	 */
+	static const Attribute* getAttributes(unsigned int& count) {
+		// A mat4 attribute takes four locations, so instance_transform
+		// covers 3 to 6
+		static const Attribute attributes[] = { { "position", 0 }, { "normal", 1 }, { "color", 2 }, { "instance_transform", 3 },
+			{ "bone_indices", 7 }, { "bone_weights", 8 }, { "instance_time_offset", 9 } };
+		count = sizeof(attributes)/sizeof(attributes[0]);
+		return attributes;
+	}
+
+	static void bindAttributeLocations(GLuint name) {
+		unsigned int num_attributes;
+		const Attribute* attributes = getAttributes(num_attributes);
+		for (unsigned int i=0; i<num_attributes; ++i)
+			glBindAttribLocation(name, attributes[i].location, attributes[i].name);
+	}
+
+	std::string directory;
+	std::string driver; //< Vendor, renderer and version; binaries are only valid for the same driver
+	bool binaries_supported;
+
+	std::map<uint64_t, std::shared_ptr<Program> > programs;
+	std::map<uint64_t, Shader> shaders;
+
+	unsigned int binary_loads;
+	unsigned int linked_programs;
+	unsigned int compiled_shaders;
+	unsigned int reused_shaders;
+};
+
+}; //Namespace GLUtils
+
+#endif
@@ -0,0 +1,173 @@
+#ifndef _STREAMINGBUFFER_HPP__
+#define _STREAMINGBUFFER_HPP__
+
+#include <vector>
+#include <cstddef>
+#include <cassert>
+
+#include <GL/glew.h>
+
+#include "GameException.h"
+
+namespace GLUtils {
+
+/**
+ * Buffer for data that is written anew every frame, e.g., debug lines,
+ * particles or instance data. It is split into regions that are used
+ * in turn, one per frame, and a fence after each frame's draws tells
+ * when the GPU is done with a region, so it can be written again
+ * without the driver copying or synchronizing anything.
+ * Where ARB_buffer_storage is available, the buffer stays mapped for
+ * its whole life. Otherwise each region is mapped unsynchronized while
+ * it is written, which is safe as the fence has been waited for.
+ */
+template <GLenum T>
+class StreamingBuffer {
+public:
+	StreamingBuffer(unsigned int region_size, unsigned int num_regions = 3)
+			: region_size(region_size), regions(num_regions), current(0), used(0), mapped(NULL), persistent_base(NULL), stalls(0) {
+		for (size_t i=0; i<regions.size(); ++i)
+			regions[i] = NULL;
+
+		GLsizeiptr total = static_cast<GLsizeiptr>(region_size) * num_regions;
+		glGenBuffers(1, &buffer);
+		glBindBuffer(T, buffer);
+		persistent = (GLEW_ARB_buffer_storage != 0);
+		if (persistent) {
+			const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+			glBufferStorage(T, total, NULL, flags);
+			persistent_base = static_cast<char*>(glMapBufferRange(T, 0, total, flags));
+			if (persistent_base == NULL)
+				THROW_EXCEPTION("Unable to map the streaming buffer persistently");
+		}
+		else {
+			glBufferData(T, total, NULL, GL_STREAM_DRAW);
+		}
+		glBindBuffer(T, 0);
+	}
+
+	~StreamingBuffer() {
+		for (size_t i=0; i<regions.size(); ++i)
+			if (regions[i] != NULL)
+				glDeleteSync(regions[i]);
+		glBindBuffer(T, buffer);
+		if (persistent || mapped != NULL)
+			glUnmapBuffer(T);
+		glBindBuffer(T, 0);
+		glDeleteBuffers(1, &buffer);
+	}
+
+	/**
+	 * Fences the draws from the previous region, and moves on to the
+	 * next one. Blocks only if the GPU is still reading it, which with
+	 * three regions means it is more than two frames behind.
+	 * Call once per frame, before allocate().
+	 */
+	void begin() {
+		assert(mapped == NULL);
+		if (used > 0)
+			regions[current] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		current = (current + 1) % regions.size();
+		used = 0;
+
+		GLsync& fence = regions[current];
+		if (fence != NULL) {
+			if (glClientWaitSync(fence, 0, 0) == GL_TIMEOUT_EXPIRED) {
+				++stalls;
+				while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED) {}
+			}
+			glDeleteSync(fence);
+			fence = NULL;
+		}
+
+		if (persistent) {
+			mapped = persistent_base + current*static_cast<size_t>(region_size);
+		}
+		else {
+			const GLbitfield access = GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_FLUSH_EXPLICIT_BIT;
+			glBindBuffer(T, buffer);
+			mapped = static_cast<char*>(glMapBufferRange(T, getRegionOffset(), region_size, access));
+			glBindBuffer(T, 0);
+			if (mapped == NULL)
+				THROW_EXCEPTION("Unable to map the streaming buffer");
+		}
+	}
+
+	/**
+	 * Takes bytes bytes of write-only memory from the current region
+	 * @param offset Set to where the memory starts in the buffer, for attribute pointers
+	 * @return NULL if the region is full
+	 */
+	void* allocate(size_t bytes, GLintptr& offset, size_t alignment = 16) {
+		assert(mapped != NULL);
+		size_t start = (used + alignment - 1) / alignment * alignment;
+		if (start + bytes > region_size)
+			return NULL;
+		used = start + bytes;
+		offset = getRegionOffset() + start;
+		return mapped + start;
+	}
+
+	/**
+	 * Gives back the unused end of the latest allocation, so that
+	 * end() only flushes what was written
+	 */
+	void unallocate(size_t bytes) {
+		assert(bytes <= used);
+		used -= bytes;
+	}
+
+	/**
+	 * Makes what was written visible to OpenGL. Draws may read the
+	 * current region from here on, until the next begin().
+	 */
+	void end() {
+		assert(mapped != NULL);
+		if (!persistent) {
+			// Only the part that was written needs to reach the GPU. If the
+			// contents were lost while mapped, this frame's data is lost too
+			glBindBuffer(T, buffer);
+			if (used > 0)
+				glFlushMappedBufferRange(T, 0, used);
+			glUnmapBuffer(T);
+			glBindBuffer(T, 0);
+		}
+		mapped = NULL;
+	}
+
+	inline void bind() {
+		glBindBuffer(T, buffer);
+	}
+
+	static inline void unbind() {
+		glBindBuffer(T, 0);
+	}
+
+	inline GLuint name() const {return buffer;}
+	inline unsigned int getRegionSize() const {return region_size;}
+	inline size_t getBytesUsed() const {return used;} //< In the current region
+	inline bool isPersistent() const {return persistent;}
+	inline unsigned long getStalls() const {return stalls;} //< Times begin() had to wait for the GPU
+
+private:
+	StreamingBuffer(const StreamingBuffer&);
+	StreamingBuffer& operator=(const StreamingBuffer&);
+
+	inline GLintptr getRegionOffset() const {
+		return static_cast<GLintptr>(current) * region_size;
+	}
+
+	GLuint buffer;
+	unsigned int region_size; //< In bytes
+	std::vector<GLsync> regions; //< Fence after the last draw from each region, NULL once passed
+	size_t current;
+	size_t used; //< Bytes of the current region handed out
+	char* mapped; //< Start of the current region while it is being written
+	char* persistent_base; //< Start of the buffer, if it is always mapped
+	bool persistent;
+	unsigned long stalls;
+};
+
+}; //Namespace GLUtils
+
+#endif
@@ -0,0 +1,98 @@
+#ifndef _TIMERQUERY_HPP__
+#define _TIMERQUERY_HPP__
+
+#include <vector>
+#include <cstddef>
+
+#include <GL/glew.h>
+
+namespace GLUtils {
+
+/**
+ * Measures GPU time between begin() and end() with GL_TIME_ELAPSED
+ * queries. Several queries are kept in flight, so results are read a
+ * few frames late instead of stalling the pipeline to wait for them.
+ * Each measurement can carry a tag, e.g., the mode the frame used.
+ */
+class TimerQuery {
+public:
+	explicit TimerQuery(unsigned int latency = 4) : slots(latency), next(0), active(false) {
+		for (size_t i=0; i<slots.size(); ++i) {
+			glGenQueries(1, &slots[i].query);
+			slots[i].pending = false;
+			slots[i].tag = 0;
+		}
+	}
+
+	~TimerQuery() {
+		for (size_t i=0; i<slots.size(); ++i)
+			glDeleteQueries(1, &slots[i].query);
+	}
+
+	/**
+	 * Starts a measurement. Only one TimerQuery may be active at a time,
+	 * as OpenGL cannot nest GL_TIME_ELAPSED queries.
+	 */
+	void begin(unsigned int tag = 0) {
+		// If the GPU is so far behind that the slot is still in use,
+		// this measurement is skipped rather than waited for
+		Slot& slot = slots[next];
+		if (slot.pending)
+			return;
+		slot.tag = tag;
+		glBeginQuery(GL_TIME_ELAPSED, slot.query);
+		active = true;
+	}
+
+	void end() {
+		if (!active)
+			return;
+		glEndQuery(GL_TIME_ELAPSED);
+		slots[next].pending = true;
+		next = (next + 1) % slots.size();
+		active = false;
+	}
+
+	/**
+	 * Reads the oldest finished measurement, without waiting for the GPU
+	 * @return false if no measurement has finished
+	 */
+	bool getResult(double& seconds, unsigned int& tag) {
+		for (size_t i=0; i<slots.size(); ++i) {
+			Slot& slot = slots[(next + i) % slots.size()];
+			if (!slot.pending)
+				continue;
+
+			GLint available = 0;
+			glGetQueryObjectiv(slot.query, GL_QUERY_RESULT_AVAILABLE, &available);
+			if (!available)
+				return false;
+
+			GLuint64 nanoseconds = 0;
+			glGetQueryObjectui64v(slot.query, GL_QUERY_RESULT, &nanoseconds);
+			slot.pending = false;
+			seconds = nanoseconds * 1.0e-9;
+			tag = slot.tag;
+			return true;
+		}
+		return false;
+	}
+
+private:
+	TimerQuery(const TimerQuery&);
+	TimerQuery& operator=(const TimerQuery&);
+
+	struct Slot {
+		GLuint query;
+		bool pending; //< Ended, but not read back yet
+		unsigned int tag;
+	};
+
+	std::vector<Slot> slots;
+	size_t next; //< Slot of the next measurement, and the oldest pending one
+	bool active;
+};
+
+}; //Namespace GLUtils
+
+#endif
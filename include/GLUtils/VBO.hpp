@@ -8,7 +8,7 @@ namespace GLUtils {
 	template <GLenum T>
 	class VBO {
 	public:
-		VBO(const void* data, unsigned int bytes, int usage = GL_STATIC_DRAW) {
+		VBO(const void* data, GLsizeiptr bytes, int usage = GL_STATIC_DRAW) {
 			glGenBuffers(1, &vbo_name);
 			bind();
 			glBufferData(T, bytes, data, usage);
@@ -32,6 +32,23 @@ namespace GLUtils {
 			return vbo_name;
 		}
 
+		/**
+		 * Maps part of the buffer for writing, binding it first.
+		 * The buffer stays mapped when another one is bound.
+		 */
+		inline void* mapRange(GLintptr offset, GLsizeiptr bytes, GLbitfield access) {
+			bind();
+			return glMapBufferRange(T, offset, bytes, access);
+		}
+
+		/**
+		 * @return false if the contents were lost while mapped, e.g., on a mode switch
+		 */
+		inline bool unmap() {
+			bind();
+			return glUnmapBuffer(T) == GL_TRUE;
+		}
+
 	private:
 		VBO() {}
 		GLuint vbo_name; //< VBO name
@@ -3,30 +3,58 @@
 
 #include <memory>
 #include <map>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <exception>
 
 #include <GL/glew.h>
 #include <SDL.h>
 #include <glm/glm.hpp>
 
 #include "Timer.h"
+#include "FramePacer.h"
+#include "TripleBuffer.h"
+#include "JobSystem.h"
+#include "DrawList.h"
+#include "LinearAllocator.h"
+#include "Frustum.h"
 #include "GLUtils/GLUtils.hpp"
 #include "GLUtils/CubeMap.hpp"
+#include "GLUtils/ProgramCache.hpp"
+#include "GLUtils/TimerQuery.hpp"
+#include "ShaderReloader.h"
+#include "ShaderVariants.h"
+#include "Skybox.h"
+#include "ShadowMaps.h"
+#include "ClusteredLights.h"
+#include "EnvironmentLighting.h"
+#include "DynamicResolution.h"
 #include "Model.h"
+#include "GeometryPager.h"
+#include "DebugDraw.h"
+#include "ParticleSystem.h"
+#include "AnimatedCrowd.h"
+#include "VertexAnimation.h"
 #include "VirtualTrackball.h"
 #include "ScreenshotFBO.h"
 
 /**
  * This class handles the game logic and display.
  * Uses SDL as the display manager, and glm for 
- * vector and matrix computations
+ * vector and matrix computations.
+ * Input and simulation run on the thread calling play(), while
+ * all OpenGL calls happen on a separate render thread that draws
+ * the newest snapshot of the simulation state.
  */
 class GameManager {
 public:
 
 	/**
 	 * Constructor
+	 * @param window_width, window_height Initial size of the window, which can be resized later
 	 */
-	GameManager();
+	GameManager(unsigned int window_width = 800, unsigned int window_height = 600);
 
 	/**
 	 * Destructor
@@ -40,7 +68,26 @@ public:
 	void init();
 
 	/**
-	 * The main loop of the game. Runs the SDL main loop
+	 * Adds a model that is paged in from disk as the camera moves,
+	 * for scenes too large for video memory. Call before init().
+	 */
+	inline void setPagedModel(const std::string& filename) {paged_model_filename = filename;}
+
+	/**
+	 * Adds a crowd of copies of an animated model, each playing its
+	 * animations from a different point in time. Call before init().
+	 */
+	inline void setAnimatedModel(const std::string& filename) {animated_model_filename = filename;}
+
+	/**
+	 * Adds a much larger crowd of copies of an animated model, with its
+	 * first clip baked into vertex animation. Call before init().
+	 */
+	inline void setBakedModel(const std::string& filename) {baked_model_filename = filename;}
+
+	/**
+	 * The main loop of the game. Runs the SDL main loop and the
+	 * simulation, and starts the render thread
 	 */
 	void play();
 
@@ -50,9 +97,9 @@ public:
 	void quit();
 
 	/**
-	 * Function that handles rendering into the OpenGL context
+	 * Advances the simulation by one fixed timestep
 	 */
-	void render();
+	void update(float dt);
 
 protected:
 	/**
@@ -88,17 +135,31 @@ protected:
 	 */
 	void createVAO();
 
-	static const unsigned int window_width = 800;
-	static const unsigned int window_height = 600;
+	/**
+	 * Scatters small point lights on orbits around the model
+	 */
+	void createPointLights();
+
+	unsigned int window_width; //< Updated by the simulation thread when the window is resized
+	unsigned int window_height;
+
+	static const float simulation_timestep; //< Seconds per fixed update
+	static const float max_frame_time; //< Longest frame we try to catch up on
+	static const unsigned long warm_up_frames; //< Frames left out of the allocation statistics
+	static const unsigned int num_point_lights = 1024;
+	static const double gpu_time_target; //< Seconds of GPU time per frame dynamic resolution aims for
+	static const float paged_model_size; //< Largest extent of the paged model in world space
+	static const unsigned int fountain_particles = 1 << 20; //< All of them from the one fountain, so that is all the system holds
+	static const unsigned int crowd_size = 16; //< Characters along each side of the animated crowd
+	static const unsigned int baked_crowd_size = 64; //< Instances along each side of the baked crowd
 
-	static const float cube_vertices_data[];
-	static const float cube_normals_data[];
 
 	float near_plane;
 	float far_plane;
 	float fovy;
 
 	bool showDebugView;
+	bool showDebugDraw;
 
 	int screenshot_number;
 
@@ -110,15 +171,110 @@ private:
 		RENDERMODE_FLAT,
 	};
 
+	struct RenderObject {
+		RenderObject(Model* model, const glm::mat4& transform) : model(model), transform(transform) {}
+		Model* model; //< Owned by GameManager, outlives the render thread
+		glm::mat4 transform;
+	};
+
+	/**
+	 * Everything the render thread needs to draw one frame. Written by the
+	 * simulation thread and never modified after it has been published.
+	 */
+	struct FrameSnapshot {
+		FrameSnapshot() : input_time(0), step_time(0), directional_light(false), shadow_filter(ShadowMaps::FILTER_PCF3X3),
+			render_mode(RENDERMODE_FLAT), show_debug_view(false), show_debug_draw(false), particles(false), screenshot_requests(0), swap_mode(FramePacer::SWAPMODE_VSYNC),
+			frame_rate_cap(0), anti_aliasing(ScreenshotFBO::AA_MSAA), window_width(0), window_height(0), dynamic_resolution(false) {}
+
+		double input_time; //< When the input this snapshot reflects was sampled
+		double step_time; //< When the latest simulation step was due
+
+		struct {
+			glm::mat4 projection;
+			glm::mat4 view; //< Including the trackball rotation
+		} camera;
+
+		struct {
+			glm::vec3 position;
+			glm::vec3 previous_position;
+		} light;
+		bool directional_light; //< Light infinitely far away in the direction of the light position
+		ShadowMaps::Filter shadow_filter;
+
+		RenderMode render_mode;
+		bool show_debug_view;
+		bool show_debug_draw; //< Bounds, lights and axes drawn over the scene, in debug builds
+		bool particles; //< Simulated and drawn only while on
+		unsigned int screenshot_requests; //< Total number of screenshots asked for
+		FramePacer::SwapMode swap_mode;
+		double frame_rate_cap;
+		ScreenshotFBO::AntiAliasing anti_aliasing;
+		unsigned int window_width;
+		unsigned int window_height;
+		bool dynamic_resolution; //< Otherwise the scene is rendered at window size
+
+		std::vector<RenderObject> objects; //< Objects to draw this frame
+		std::vector<ClusteredLights::PointLight> point_lights; //< Empty when the point lights are off
+	};
+
+	/**
+	 * Applies one SDL event to the simulation state
+	 */
+	void handleEvent(const SDL_Event& event);
+
+	/**
+	 * Copies the simulation state into the next snapshot and hands it to the render thread
+	 */
+	void publishSnapshot(double input_time, double step_time);
+
+	/**
+	 * Entry point of the render thread. Owns the OpenGL context until play() returns
+	 */
+	void renderLoop();
+
+	/**
+	 * Function that handles rendering a snapshot into the OpenGL context
+	 */
+	void render(const FrameSnapshot& frame);
+
 	void zoomIn();
 	void zoomOut();
 	void GameManager::initDebugView();
-	void GameManager::renderDebugView();
+	void GameManager::renderDebugView(unsigned int width, unsigned int height);
 
 	void (GameManager::*render_model)(); // TODO
-	static void renderMeshRecursive(MeshPart& mesh, const std::shared_ptr<GLUtils::Program>& program, const glm::mat4& modelview, const glm::mat4& transform, 
-		glm::mat4& projection_matrix, glm::vec3 light_position);
-	void GameManager::renderCubeMap(glm::mat4 view);
+
+	/**
+	 * Culls all mesh parts of the objects in the snapshot against the
+	 * camera frustum, and records packets for the visible ones into
+	 * draw_list using all threads of the job system
+	 */
+	void recordDrawList(const FrameSnapshot& frame, glm::vec3 light_position);
+
+	/**
+	 * Submits the draw list, and the paged geometry if there is any,
+	 * each with its own vertex array object
+	 */
+	void submitDrawLists(GLUtils::Program& program, const glm::mat4& projection);
+
+	/**
+	 * Draws the bounds of the parts and their clusters, the lights and
+	 * the axes over the scene. Does nothing in release builds.
+	 */
+	void renderDebugDraw(const FrameSnapshot& frame, const glm::vec3& light_position);
+
+	/**
+	 * Creates the particle system with its fountain, the first time
+	 * particles are turned on, as its buffers are large
+	 */
+	void createParticleSystem();
+
+	/**
+	 * Poses the animated crowd for the current time and draws it with
+	 * the skinned variant of the render mode's program, and the baked
+	 * crowd with the vertex animation variant
+	 */
+	void renderCrowd(const FrameSnapshot& frame, const glm::vec3& light_position);
 
 	void GameManager::screenshot();
 
@@ -127,7 +283,7 @@ private:
 	RenderMode render_mode; //< The current method of rendering
 
 	// vao arrays like this is handy for one "scene"
-	GLuint main_scene_vao[2]; //< number of different "collection" of vbo's we have
+	GLuint main_scene_vao[1]; //< number of different "collection" of vbo's we have
 	// Different scenes can be structured with different vaos
 	GLuint debugview_vao;
 
@@ -135,7 +291,14 @@ private:
 	std::map<std::string, std::shared_ptr<GLUtils::Program>> shaders;
 
 	std::shared_ptr<GLUtils::CubeMap> diffuse_cubemap;
-	std::shared_ptr<GLUtils::VBO<GL_ARRAY_BUFFER> > cube_vertices, cube_normals;
+	std::shared_ptr<Skybox> skybox;
+	std::shared_ptr<EnvironmentLighting> environment_lighting; //< Precomputed from diffuse_cubemap
+	std::shared_ptr<ShadowMaps> shadow_maps;
+	std::shared_ptr<DebugDraw> debug_draw; //< Only used by the render thread
+	std::shared_ptr<ParticleSystem> particle_system; //< Created and used by the render thread
+	double particle_time; //< When the particles were last updated
+	std::shared_ptr<ClusteredLights> clustered_lights; //< Only used by the render thread
+	std::vector<ShadowMaps::Caster> shadow_casters; //< Only used by the render thread
 
 	// we make the quad vbo without help from program.hpp
 	// this is just like the code for triangle primitives in lab_01_solution
@@ -144,13 +307,54 @@ private:
 
 	// FBO screenshot
 	std::shared_ptr<ScreenshotFBO> screenshot_fbo;
+	std::vector<unsigned char> screenshot_data; //< Kept between screenshots to avoid reallocating
+	ScreenshotFBO::AntiAliasing anti_aliasing;
+	std::shared_ptr<GLUtils::TimerQuery> aa_timer; //< GPU time of the scene and its resolve, tagged with the mode
+	std::shared_ptr<DynamicResolution> dynamic_resolution; //< Fed by aa_timer, only used by the render thread
+	bool dynamic_resolution_enabled;
+	struct {
+		double total; //< Seconds
+		unsigned long frames;
+	} aa_timings[3]; //< Per anti-aliasing mode, only used by the render thread
 
 	float zoom;
 	Timer fps_timer;
+	FramePacer frame_pacer; //< Only used by the render thread
+	FramePacer::SwapMode swap_mode; //< Requested by the user, applied by the render thread
+	double frame_rate_cap;
+	unsigned int screenshot_requests;
+	bool directional_light;
+	ShadowMaps::Filter shadow_filter;
+	bool point_lights_enabled;
+	bool particles_enabled;
+	std::vector<ClusteredLights::PointLight> point_lights;
+	std::vector<float> point_light_speeds; //< Degrees per second around the y axis
+
+	std::thread render_thread;
+	std::atomic<bool> running; //< Cleared by either thread to shut down
+	std::exception_ptr render_error; //< Set if the render thread died, rethrown by play()
+	TripleBuffer<FrameSnapshot> snapshots;
+
+	std::shared_ptr<JobSystem> job_system;
+	DrawList draw_list; //< Only used by the render thread
+	DrawList paged_draw_list; //< Chunks of geometry_pager, only used by the render thread
+	std::vector<LinearAllocator> frame_arenas; //< Per-frame memory, one per job system thread, reset after every swap
+
+	struct {
+		unsigned long frames; //< Frames rendered after warm-up
+		unsigned long frames_allocating; //< Of those, frames that used the heap
+		unsigned long max_allocations; //< Most heap allocations in a single frame
+	} allocation_stats; //< Only collected in debug builds
+
+	struct {
+		std::atomic<unsigned long long> triangles; //< In clusters of parts inside the frustum
+		std::atomic<unsigned long long> culled_triangles; //< Of those, in clusters facing away or outside the frustum
+	} cluster_stats; //< Added to by the jobs recording the draw list
 	VirtualTrackball cam_trackball;
 
 	struct {
 		glm::vec3 position;
+		glm::vec3 previous_position; //< Position at the previous simulation step
 		glm::mat4 projection;
 		glm::mat4 view;
 	} light;
@@ -161,7 +365,19 @@ private:
 	} camera;
 
 	std::shared_ptr<Model> model;
-	std::shared_ptr<GLUtils::Program> program, cube_program, debugview_program;
+	std::string paged_model_filename;
+	std::shared_ptr<GeometryPager> geometry_pager; //< Only if a paged model was given, used by the render thread after init
+	glm::mat4 paged_model_matrix; //< Fixed after init
+	std::string animated_model_filename;
+	std::shared_ptr<Model> animated_model;
+	std::shared_ptr<AnimatedCrowd> animated_crowd; //< Only if an animated model was given, used by the render thread after init
+	std::string baked_model_filename;
+	std::shared_ptr<Model> baked_model;
+	std::shared_ptr<VertexAnimation> vertex_animation; //< Only if a baked model was given, used by the render thread after init
+	std::shared_ptr<GLUtils::ProgramCache> program_cache;
+	std::shared_ptr<ShaderReloader> shader_reloader; //< Only used by the render thread after init
+	std::shared_ptr<ShaderVariants> phong_variants; //< Of basic_phong, compiled on first use by the render thread
+	std::shared_ptr<GLUtils::Program> program, cube_program, debugview_program, fxaa_program, upscale_program;
 	glm::mat4 model_matrix; // TODO should be in a struct with the model mesh
 };
 
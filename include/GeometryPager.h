@@ -0,0 +1,166 @@
+#ifndef _GEOMETRYPAGER_H_
+#define _GEOMETRYPAGER_H_
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include "GLUtils/VBO.hpp"
+#include "JobSystem.h"
+#include "DrawList.h"
+#include "Frustum.h"
+
+/**
+ * Out-of-core geometry for scenes too large for video memory. The model
+ * is split once into spatial chunks of at most a fixed number of
+ * triangles, which are stored in a cache file. Only the chunks near the
+ * camera or inside the frustum are kept in video memory, in equally
+ * sized slots of one vertex buffer, and the largest on screen win when
+ * there are not enough slots. Missing chunks are read from the cache by
+ * the job system and uploaded a few per frame, replacing chunks that
+ * are no longer wanted.
+ * Vertices are interleaved positions and normals, at the attribute
+ * locations ProgramCache binds. Must be used on the OpenGL thread.
+ */
+class GeometryPager {
+public:
+	/**
+	 * Opens the chunk cache, or builds it from the model first if it is
+	 * missing or stale. The budget is in bytes of vertex data.
+	 */
+	GeometryPager(const std::string& model_filename, const std::string& cache_filename, JobSystem* job_system,
+			size_t vram_budget = 256 << 20, unsigned int triangles_per_chunk = 32768);
+	~GeometryPager();
+
+	/**
+	 * Ranks the chunks by their size on screen, uploads reads that have
+	 * finished, and starts reading the most important missing chunks.
+	 * Chunks within resident_distance of the camera are kept as well,
+	 * at lower priority, so turning around does not leave holes.
+	 */
+	void update(const glm::mat4& model, const glm::mat4& view, const glm::mat4& projection, unsigned int viewport_height);
+
+	/**
+	 * Records a packet for every resident chunk inside the frustum, as
+	 * seen in the last update(). The vertex array object must be bound
+	 * when the packets are submitted.
+	 */
+	void record(DrawList& draw_list, unsigned int thread_index, const glm::mat4& model, const glm::mat4& view,
+			const glm::vec3& light_position) const;
+
+	inline GLuint getVAO() const {return vao;}
+
+	/**
+	 * Bounds of the whole model, in the space of the model file
+	 */
+	inline const glm::vec3& getMin() const {return min_dim;}
+	inline const glm::vec3& getMax() const {return max_dim;}
+
+	inline void setResidentDistance(float distance) {resident_distance = distance;}
+
+	inline bool wasCached() const {return cached;}
+	inline unsigned int getNumChunks() const {return static_cast<unsigned int>(chunks.size());}
+	inline unsigned int getNumSlots() const {return static_cast<unsigned int>(slots.size());}
+	inline unsigned int getNumResident() const {return num_resident;}
+	inline unsigned long getPageIns() const {return page_ins;}
+	inline unsigned long getPageOuts() const {return page_outs;}
+	inline unsigned long getMissingFrames() const {return missing_frames;} //< Frames where a visible chunk was not resident
+
+private:
+	GeometryPager(const GeometryPager&);
+	GeometryPager& operator=(const GeometryPager&);
+
+	enum ChunkState {
+		CHUNK_ON_DISK,
+		CHUNK_LOADING, //< Being read, or read and waiting for a slot
+		CHUNK_RESIDENT,
+	};
+
+	struct Chunk {
+		glm::vec3 center; //< Bounding sphere in model space
+		float radius;
+		uint64_t offset; //< Of the vertices in the cache file, in bytes
+		unsigned int num_vertices;
+		ChunkState state;
+		int slot; //< -1 unless resident
+		float priority; //< Pixels on screen, zero if not wanted
+		float distance; //< From the camera, in view space
+		float view_depth;
+		bool visible;
+	};
+
+	/**
+	 * One read in flight. Reads keep their buffer and file stream, so
+	 * paging does not allocate once every read slot has been used.
+	 */
+	struct Read {
+		Read() : chunk(-1), done(false), failed(false) {}
+		int chunk; //< -1 when free
+		std::ifstream file;
+		std::vector<float> vertices;
+		std::atomic<bool> done;
+		bool failed;
+		JobSystem::JobHandle job;
+	};
+
+	static const uint32_t cache_version = 1;
+	static const unsigned int floats_per_vertex = 6;
+	static const unsigned int max_reads = 4; //< Reads in flight
+	static const unsigned int max_uploads_per_frame = 2;
+
+	/**
+	 * @return The key of the cache for the model file as it is now
+	 */
+	uint64_t computeKey(const std::string& model_filename) const;
+
+	bool loadCache(uint64_t key);
+
+	/**
+	 * Imports the model, splits its triangles at the median of the
+	 * longest axis of their centroids until every part fits a slot, and
+	 * writes the parts to the cache file
+	 */
+	void buildCache(const std::string& model_filename, uint64_t key);
+
+	/**
+	 * Evicts the farthest unwanted chunk if no slot is free
+	 * @return A free slot, or -1 if all slots hold wanted chunks
+	 */
+	int allocateSlot();
+
+	void upload(Read& read);
+	void startRead(Read& read, unsigned int chunk);
+
+	std::string cache_filename;
+	JobSystem* job_system;
+	unsigned int triangles_per_chunk;
+	unsigned int slot_vertices;
+	bool cached;
+
+	std::vector<Chunk> chunks;
+	std::vector<int> slots; //< Chunk in each slot, or -1
+	std::vector<unsigned int> ranked; //< Chunk indices by decreasing priority, reused every frame
+	Read reads[max_reads];
+
+	GLuint vao;
+	std::shared_ptr<GLUtils::VBO<GL_ARRAY_BUFFER>> vertices; //< The slots, back to back
+
+	glm::vec3 min_dim;
+	glm::vec3 max_dim;
+	float resident_distance; //< In view space units
+	Frustum frustum; //< In view space
+
+	unsigned int num_resident;
+	unsigned long page_ins;
+	unsigned long page_outs;
+	unsigned long missing_frames;
+};
+
+#endif // _GEOMETRYPAGER_H_
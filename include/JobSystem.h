@@ -0,0 +1,168 @@
+#ifndef _JOBSYSTEM_H_
+#define _JOBSYSTEM_H_
+
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <exception>
+
+/**
+ * Work-stealing task scheduler. Every worker has its own queue that it
+ * pushes to and pops from at the back, while idle workers steal from
+ * the front of other queues. Threads that are not workers share one
+ * extra queue. A thread waiting for a job runs other jobs meanwhile,
+ * so jobs may wait for jobs they have submitted themselves.
+ */
+class JobSystem {
+public:
+	typedef std::function<void()> Function;
+
+	/**
+	 * Function called for the range [begin, end) by the thread with index thread_index
+	 */
+	typedef std::function<void(unsigned int begin, unsigned int end, unsigned int thread_index)> RangeFunction;
+
+	class Job;
+	typedef std::shared_ptr<Job> JobHandle;
+
+	/**
+	 * Starts num_workers threads in addition to the calling thread
+	 */
+	explicit JobSystem(unsigned int num_workers = getDefaultWorkerCount());
+	~JobSystem();
+
+	/**
+	 * @return The number of threads that may run jobs, including the caller
+	 */
+	inline unsigned int getNumThreads() const {
+		return static_cast<unsigned int>(workers.size()) + 1;
+	}
+
+	/**
+	 * @return Index of the calling thread, from 1 for workers of this
+	 * job system, and 0 for all other threads
+	 */
+	unsigned int getThreadIndex() const;
+
+	/**
+	 * Schedules function to run on any thread
+	 */
+	JobHandle submit(const Function& function);
+
+	/**
+	 * Schedules function to run once all dependencies have finished
+	 */
+	JobHandle submit(const Function& function, const std::vector<JobHandle>& dependencies);
+
+	/**
+	 * Runs other jobs until the given job has finished.
+	 * Rethrows the exception the job threw, if any.
+	 */
+	void wait(const JobHandle& job);
+
+	/**
+	 * Calls function(begin, end, thread_index) for consecutive chunks of
+	 * at most grain indices until [0, count) is covered, and returns when
+	 * all are done. A grain of zero picks one that gives each thread a few
+	 * chunks. Does not allocate memory. The function must not throw.
+	 */
+	template <typename Callable>
+	inline void parallelFor(unsigned int count, unsigned int grain, const Callable& function) {
+		parallelFor(count, grain, &invokeRange<Callable>, &function);
+	}
+
+	/**
+	 * @return One worker per hardware thread, except the one we run on
+	 */
+	static unsigned int getDefaultWorkerCount();
+
+private:
+	JobSystem(const JobSystem&);
+	JobSystem& operator=(const JobSystem&);
+
+	/**
+	 * The unit the queues hold. Plain function and data pointers, so
+	 * queuing work never allocates once the queues have grown.
+	 */
+	struct Task {
+		void (*run)(JobSystem* system, void* data, unsigned int thread_index);
+		void* data;
+	};
+
+	/**
+	 * Growable ring buffer protected by a mutex. The owner uses the
+	 * back, thieves the front.
+	 */
+	class TaskQueue {
+	public:
+		TaskQueue() : tasks(64), head(0), size(0) {}
+		void pushBack(const Task& task);
+		bool popBack(Task& task);
+		bool popFront(Task& task);
+
+	private:
+		std::mutex mutex;
+		std::vector<Task> tasks;
+		size_t head;
+		size_t size;
+		char padding[64]; //< Keep queues of different threads on separate cache lines
+	};
+
+	struct ParallelFor;
+
+	typedef void (*RangeEntry)(const void* function, unsigned int begin, unsigned int end, unsigned int thread_index);
+
+	template <typename Callable>
+	static void invokeRange(const void* function, unsigned int begin, unsigned int end, unsigned int thread_index) {
+		(*static_cast<const Callable*>(function))(begin, end, thread_index);
+	}
+
+	void parallelFor(unsigned int count, unsigned int grain, RangeEntry entry, const void* function);
+
+	void workerLoop(unsigned int thread_index);
+	void push(const Task& task);
+	bool findTask(unsigned int thread_index, Task& task);
+	bool runOneTask(unsigned int thread_index);
+	void schedule(const JobHandle& job);
+
+	static void runJob(JobSystem* system, void* data, unsigned int thread_index);
+	static void runRange(JobSystem* system, void* data, unsigned int thread_index);
+
+	std::vector<std::thread> workers;
+	std::vector<std::unique_ptr<TaskQueue> > queues; //< 0 is shared by non-worker threads
+
+	std::atomic<bool> quit;
+	std::atomic<unsigned int> queued_tasks;
+	std::atomic<unsigned int> sleeping_workers;
+	std::mutex sleep_mutex;
+	std::condition_variable wake_workers;
+};
+
+/**
+ * A function scheduled on the job system, and the jobs waiting for it
+ */
+class JobSystem::Job {
+public:
+	Job(const Function& function) : function(function), finished(false), pending(1) {}
+
+	inline bool isFinished() const {
+		return finished.load(std::memory_order_acquire);
+	}
+
+private:
+	friend class JobSystem;
+
+	Function function;
+	std::atomic<bool> finished;
+	std::atomic<int> pending; //< Unfinished dependencies, plus one until submit() is done
+	std::mutex mutex; //< Protects continuations
+	std::vector<JobHandle> continuations; //< Jobs depending on this one
+	std::exception_ptr error;
+	JobHandle self; //< Keeps the job alive while it sits in a queue
+};
+
+#endif // _JOBSYSTEM_H_
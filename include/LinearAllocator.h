@@ -0,0 +1,87 @@
+#ifndef _LINEARALLOCATOR_H_
+#define _LINEARALLOCATOR_H_
+
+#include <vector>
+#include <cstddef>
+#include <type_traits>
+
+/**
+ * Bump allocator for data that lives until the next reset(), e.g.,
+ * one frame. Individual allocations are never freed. If a frame needs
+ * more than the current capacity, extra blocks are added and merged
+ * into one at the next reset, so a steady state never touches the heap.
+ * Not thread safe; give each thread its own.
+ */
+class LinearAllocator {
+public:
+	explicit LinearAllocator(size_t block_size = 1 << 20);
+
+	/**
+	 * @return Uninitialized memory for bytes bytes with the given alignment
+	 */
+	void* allocate(size_t bytes, size_t alignment = 16);
+
+	/**
+	 * @return Uninitialized memory for n objects of type T
+	 */
+	template <typename T>
+	inline T* allocateArray(size_t n) {
+		return static_cast<T*>(allocate(n*sizeof(T), std::alignment_of<T>::value));
+	}
+
+	/**
+	 * Releases everything allocated since the last reset
+	 */
+	void reset();
+
+	/**
+	 * @return Bytes handed out since the last reset, including alignment padding
+	 */
+	inline size_t getBytesUsed() const {
+		return used;
+	}
+
+private:
+	std::vector<std::vector<char> > blocks;
+	size_t offset; //< Into the last block
+	size_t used;
+};
+
+/**
+ * Standard library allocator that takes its memory from a LinearAllocator,
+ * so containers can be used for per-frame data. deallocate() does nothing;
+ * the memory comes back when the arena is reset.
+ */
+template <typename T>
+class ArenaAllocator {
+public:
+	typedef T value_type;
+	typedef std::true_type propagate_on_container_copy_assignment;
+	typedef std::true_type propagate_on_container_move_assignment;
+	typedef std::true_type propagate_on_container_swap;
+
+	ArenaAllocator() : arena(nullptr) {}
+	explicit ArenaAllocator(LinearAllocator* arena) : arena(arena) {}
+	template <typename U>
+	ArenaAllocator(const ArenaAllocator<U>& other) : arena(other.arena) {}
+
+	inline T* allocate(size_t n) {
+		return arena->allocateArray<T>(n);
+	}
+
+	inline void deallocate(T*, size_t) {}
+
+	LinearAllocator* arena;
+};
+
+template <typename T, typename U>
+inline bool operator==(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) {
+	return a.arena == b.arena;
+}
+
+template <typename T, typename U>
+inline bool operator!=(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) {
+	return a.arena != b.arena;
+}
+
+#endif // _LINEARALLOCATOR_H_
@@ -0,0 +1,24 @@
+#ifndef _MEMORYUSAGE_H_
+#define _MEMORYUSAGE_H_
+
+#include <cstddef>
+
+/**
+ * Resident memory of the process, as reported by the operating system.
+ * Includes memory the driver maps into the process, e.g., buffers
+ * while they are mapped. Returns zero where it is not supported.
+ */
+class MemoryUsage {
+public:
+	/**
+	 * @return Bytes currently resident
+	 */
+	static size_t getResidentBytes();
+
+	/**
+	 * @return Most bytes resident at any time since the program started
+	 */
+	static size_t getPeakResidentBytes();
+};
+
+#endif // _MEMORYUSAGE_H_
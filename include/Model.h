@@ -13,38 +13,210 @@
 #include <glm/gtc/type_ptr.hpp>
 
 #include "GLUtils/VBO.hpp"
+#include "JobSystem.h"
+#include "PoolAllocator.h"
+#include "TransformBatch.h"
+#include "Skeleton.h"
 
+/**
+ * A node of the model hierarchy. Nodes live in the pool of their
+ * model, and link to their children as a list of siblings.
+ */
 struct MeshPart {
-	MeshPart() : first(0), count(0) {}
+	MeshPart() : first(0), count(0), radius(0), first_cluster(0), num_clusters(0), first_child(NULL), next_sibling(NULL) {}
 	glm::mat4 transform;
 	unsigned int first;
 	unsigned int count;
-	std::vector<MeshPart> children;
+	glm::vec3 center; //< Bounding sphere of this part's own vertices
+	float radius;
+	unsigned int first_cluster; //< Into the clusters of the model, if it has any
+	unsigned int num_clusters;
+	MeshPart* first_child;
+	MeshPart* next_sibling;
+};
+
+/**
+ * A mesh part with the transforms of all its parents applied, so
+ * that parts can be processed independently of the hierarchy
+ */
+struct FlatMeshPart {
+	glm::mat4 transform; //< From part to model space
+	glm::vec3 center; //< Bounding sphere in part space
+	float radius;
+	unsigned int first;
+	unsigned int count;
+	unsigned int first_cluster;
+	unsigned int num_clusters;
+};
+
+/**
+ * A run of up to Model::cluster_faces consecutive triangles of a mesh,
+ * with bounds to cull it on its own: a bounding sphere, and a cone
+ * that contains the normals of all its triangles
+ */
+struct MeshCluster {
+	glm::vec3 center; //< Bounding sphere in part space
+	float radius;
+	glm::vec3 cone_axis; //< Unit average of the face normals, in part space
+	float cone_cutoff; //< Sine of the half angle of the cone, 1 if the triangles face too many ways to cull
+	unsigned int first;
+	unsigned int count;
+
+	/**
+	 * @return true if all triangles face away from a camera at the
+	 * given position in part space. A mirroring transform swaps which
+	 * side OpenGL treats as the front.
+	 */
+	inline bool isBackFacing(const glm::vec3& camera_position, bool mirrored) const {
+		glm::vec3 direction = center - camera_position;
+		float facing = glm::dot(direction, cone_axis);
+		if (mirrored)
+			facing = -facing;
+		return facing >= cone_cutoff*glm::length(direction) + radius;
+	}
+};
+
+/**
+ * The anim meshes of one copy of a mesh, which vertex animation can be
+ * baked from. Their positions and normals are per vertex of the mesh,
+ * in part space like those of the model.
+ */
+struct MorphMesh {
+	std::string name; //< Of the mesh, which the mesh channels of clips refer to
+	unsigned int first; //< Expanded vertices of the copy
+	unsigned int count;
+	std::vector<unsigned int> sources; //< Vertex of the mesh each expanded vertex came from
+	std::vector<std::vector<glm::vec3> > positions; //< Per anim mesh
+	std::vector<std::vector<glm::vec3> > normals;
 };
 
 class Model {
 public:
-	Model(std::string filename, bool invert=0);
+	/**
+	 * Loads the model from file. If a job system is given, the
+	 * meshes are processed in parallel on it. Bounds, normals and
+	 * tangents are all computed in the same pass that expands the
+	 * vertices, four at a time with SSE where available.
+	 * When streaming, the vertices are written straight into mapped
+	 * ranges of the buffers, a fixed number at a time, instead of
+	 * into full size copies in memory first. Needs a current context.
+	 * When clustered, the bounds of every cluster_faces consecutive
+	 * triangles are kept, so they can be culled separately.
+	 * Models with bones or animations get a skeleton, and a buffer with
+	 * the bones of every vertex. The anim meshes of animated models are
+	 * kept as morph meshes.
+	 */
+	Model(std::string filename, bool invert=0, JobSystem* job_system=NULL, bool streaming=false, bool clustered=false);
 	~Model();
 
-	inline MeshPart getMesh() {return root;}
+	inline const MeshPart& getMesh() const {return *root;}
+	inline const std::vector<FlatMeshPart>& getFlatParts() const {return flat_parts;}
+	inline const TransformBatch& getPartTransforms() const {return part_transforms;} //< Of the flat parts, in the same order
+	inline const std::vector<MeshCluster>& getClusters() const {return clusters;} //< Empty unless clustered
+	/**
+	 * Finds the transform from a node of the hierarchy to model space
+	 * @return false if the node is not part of this model
+	 */
+	bool getNodeTransform(const MeshPart& node, glm::mat4& transform) const;
+	inline const Skeleton* getSkeleton() const {return skeleton.get();} //< NULL unless the model is animated
+	inline const std::vector<MorphMesh>& getMorphMeshes() const {return morph_meshes;}
+	inline unsigned int getNumVertices() const {return n_vertices;}
+
 	inline std::shared_ptr<GLUtils::VBO<GL_ARRAY_BUFFER>> getVertices() {return vertices;}
 	inline std::shared_ptr<GLUtils::VBO<GL_ARRAY_BUFFER>> getNormals() {return normals;}
 	inline std::shared_ptr<GLUtils::VBO<GL_ARRAY_BUFFER>> getColors() {return colors;}
+	inline std::shared_ptr<GLUtils::VBO<GL_ARRAY_BUFFER>> getTangents() {return tangents;} //< Only if there are normals
+	inline std::shared_ptr<GLUtils::VBO<GL_ARRAY_BUFFER>> getBones() {return bones;} //< Four bone indices, then four weights, as bytes; only with a skeleton
 
 private:
-	static void loadRecursive(MeshPart& part, bool invert,
-			std::vector<float>& vertex_data, std::vector<float>& normal_data, 
-			std::vector<float>& color_data, const aiScene* scene, const aiNode* node);
+	/**
+	 * A range of faces of one mesh, where its vertices go, and the
+	 * bounds of those vertices once the chunk has been loaded
+	 */
+	struct MeshChunk {
+		const aiMesh* mesh;
+		unsigned int mesh_index; //< In the scene
+		const aiNode* node;
+		const uint8_t* influences; //< Of the mesh's vertices, see Skeleton::getInfluences(), or NULL
+		MeshPart* part;
+		glm::mat4 transform; //< From part to model space, before centering
+		unsigned int first_face;
+		unsigned int num_faces;
+		unsigned int first_vertex;
+		unsigned int first_cluster;
+		glm::vec3 part_min, part_max; //< In part space
+		glm::vec3 model_min, model_max; //< In model space
+	};
+
+	/**
+	 * Where loadChunk() writes the expanded vertices. Arrays that
+	 * are not needed are NULL.
+	 */
+	struct VertexArrays {
+		unsigned int first_vertex; //< The vertex at the start of the arrays
+		float* vertices;
+		float* normals;
+		float* tangents;
+		float* colors;
+		uint8_t* bones; //< Skeleton::max_influences indices, then as many weights
+		MeshCluster* clusters; //< All clusters of the model, not offset by first_vertex
+		unsigned int* sources; //< Index into its mesh of every vertex of the model, not offset by first_vertex
+	};
+
+	static const unsigned int faces_per_chunk; //< A multiple of cluster_faces, so clusters never span chunks
+	static const unsigned int vertices_per_upload; //< Budget of a streaming upload, in whole chunks
+	static const unsigned int cluster_faces;
+
+	void loadRecursive(MeshPart& part, const glm::mat4& parent_transform, const aiScene* scene, const aiNode* node,
+			std::vector<MeshChunk>& chunks, unsigned int& n_loaded, unsigned int& n_clusters, bool& has_normals, bool& has_colors);
+
+	static void loadChunk(MeshChunk& chunk, bool invert, const VertexArrays& arrays);
+
+	/**
+	 * Finds the bounding spheres and normal cones of the clusters of a
+	 * chunk, with its faces in the given order, from the face normals,
+	 * which do not depend on invert
+	 */
+	static void computeClusters(const MeshChunk& chunk, const unsigned int* order, MeshCluster* clusters);
+
+	/**
+	 * Loads chunks [begin, end) into the arrays in parallel
+	 */
+	static void loadChunks(std::vector<MeshChunk>& chunks, unsigned int begin, unsigned int end, bool invert,
+			const VertexArrays& arrays, JobSystem* job_system);
+
+	/**
+	 * Creates the buffers from full size arrays
+	 */
+	void uploadAll(std::vector<MeshChunk>& chunks, unsigned int n_loaded, bool invert,
+			bool has_normals, bool has_colors, JobSystem* job_system);
+
+	/**
+	 * Creates empty buffers, and fills them through mapped ranges of
+	 * at most vertices_per_upload vertices, in the order of the nodes
+	 */
+	void uploadStreaming(std::vector<MeshChunk>& chunks, unsigned int n_loaded, bool invert,
+			bool has_normals, bool has_colors, JobSystem* job_system);
+
+	static void flattenRecursive(const MeshPart& part, const glm::mat4& parent_transform, std::vector<FlatMeshPart>& flat_parts);
+
+	static bool findNodeRecursive(const MeshPart& part, const MeshPart& node, const glm::mat4& parent_transform, glm::mat4& transform);
+
 
-	static void findBBoxRecursive(const aiScene* scene, const aiNode* node, glm::vec3& min_dim, glm::vec3& max_dim, aiMatrix4x4* trafo);
-			
-	const aiScene* scene;
-	MeshPart root;
+	PoolAllocator<MeshPart> part_pool;
+	MeshPart* root;
+	std::vector<FlatMeshPart> flat_parts; //< Parts with geometry, in depth-first order
+	TransformBatch part_transforms;
+	std::vector<MeshCluster> clusters;
+	std::shared_ptr<Skeleton> skeleton;
+	std::vector<MorphMesh> morph_meshes;
+	std::vector<unsigned int> vertex_sources; //< Only while loading a model with morph meshes
 
 	std::shared_ptr<GLUtils::VBO<GL_ARRAY_BUFFER>> normals;
 	std::shared_ptr<GLUtils::VBO<GL_ARRAY_BUFFER>> vertices;
 	std::shared_ptr<GLUtils::VBO<GL_ARRAY_BUFFER>> colors;
+	std::shared_ptr<GLUtils::VBO<GL_ARRAY_BUFFER>> tangents;
+	std::shared_ptr<GLUtils::VBO<GL_ARRAY_BUFFER>> bones;
 
 	glm::vec3 min_dim;
 	glm::vec3 max_dim;
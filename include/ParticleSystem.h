@@ -0,0 +1,104 @@
+#ifndef _PARTICLESYSTEM_H_
+#define _PARTICLESYSTEM_H_
+
+#include <memory>
+#include <vector>
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include "GLUtils/GLUtils.hpp"
+#include "GLUtils/ProgramCache.hpp"
+#include "ShaderReloader.h"
+#include "Model.h"
+
+/**
+ * Particles simulated entirely on the GPU. Each emitter owns a fixed
+ * range of particles, and every frame a vertex shader reads their state
+ * from one buffer and writes the next state to the other with transform
+ * feedback. Dead particles are born again at their emitter, so the
+ * emission rate is the number of particles over their lifetime, and the
+ * CPU never touches particle data after an emitter has been added.
+ * Particles are drawn as camera facing quads, one instance each, with
+ * additive blending, which does not depend on the order they are drawn
+ * in, so they need no sorting.
+ * Must be used on the OpenGL thread.
+ */
+class ParticleSystem {
+public:
+	struct Emitter {
+		Emitter() : model(NULL), node(NULL), position(0.0f), velocity(0.0f, 1.0f, 0.0f), spread(0.5f),
+			lifetime(2.0f), size(0.05f), colour(1.0f), num_particles(10000) {}
+		const Model* model; //< Followed by the emitter if given, see setModelTransform()
+		const MeshPart* node; //< Node of model the emitter is attached to, or NULL for model space
+		glm::vec3 position; //< In node space
+		glm::vec3 velocity; //< Of new particles, in node space
+		float spread; //< Largest random change of each component of the velocity
+		float lifetime; //< In seconds
+		float size; //< Half the width of the quads, in world units
+		glm::vec3 colour;
+		unsigned int num_particles;
+	};
+
+	static const unsigned int max_emitters = 16;
+
+	/**
+	 * Allocates buffers for max_particles particles in total. Needs a
+	 * current context.
+	 */
+	ParticleSystem(GLUtils::ProgramCache* cache, ShaderReloader* reloader = NULL, unsigned int max_particles = 1 << 21);
+	~ParticleSystem();
+
+	/**
+	 * Adds an emitter, whose particles are born over the first lifetime
+	 * @return Index of the emitter
+	 */
+	unsigned int addEmitter(const Emitter& emitter);
+
+	/**
+	 * Sets where the emitters attached to model are, as its transform
+	 * from model to world space
+	 */
+	void setModelTransform(const Model* model, const glm::mat4& transform);
+
+	inline void setGravity(const glm::vec3& gravity) {this->gravity = gravity;}
+
+	/**
+	 * Advances all particles by dt seconds
+	 */
+	void update(float dt);
+
+	/**
+	 * Draws the particles, depth tested against but not written to the
+	 * depth buffer. Leaves blending disabled.
+	 */
+	void render(const glm::mat4& view, const glm::mat4& projection);
+
+	inline unsigned int getNumParticles() const {return num_particles;}
+
+private:
+	ParticleSystem(const ParticleSystem&);
+	ParticleSystem& operator=(const ParticleSystem&);
+
+	struct EmitterState {
+		Emitter emitter;
+		glm::mat4 model_transform;
+	};
+
+	static const unsigned int floats_per_particle = 8; //< Position and age, velocity and emitter
+
+	std::shared_ptr<GLUtils::Program> update_program, render_program;
+	std::shared_ptr<GLUtils::VBO<GL_ARRAY_BUFFER> > buffers[2]; //< Particle states, read and written in turns
+	GLuint update_vaos[2]; //< Reading from each buffer
+	GLuint render_vaos[2]; //< The quad, with the particles in each buffer as instances
+	std::shared_ptr<GLUtils::VBO<GL_ARRAY_BUFFER> > quad;
+	unsigned int current; //< Buffer with the latest state
+
+	std::vector<EmitterState> emitters;
+	unsigned int max_particles;
+	unsigned int num_particles;
+	glm::vec3 gravity;
+	unsigned int seed; //< Changed every update, so every generation is random
+};
+
+#endif // _PARTICLESYSTEM_H_
@@ -0,0 +1,79 @@
+#ifndef _POOLALLOCATOR_H_
+#define _POOLALLOCATOR_H_
+
+#include <vector>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+/**
+ * Pool of fixed-size slots for objects of type T, allocated in chunks
+ * so that many small objects (e.g., scene nodes) do not each need a
+ * trip to the heap. Freed slots are reused. Objects still alive when
+ * the pool is destroyed are not destructed. Not thread safe.
+ */
+template <typename T>
+class PoolAllocator {
+public:
+	explicit PoolAllocator(size_t objects_per_chunk = 256) : free_list(nullptr), objects_per_chunk(objects_per_chunk), live_objects(0) {}
+
+	~PoolAllocator() {
+		for (size_t i=0; i<chunks.size(); ++i)
+			delete[] chunks[i];
+	}
+
+	/**
+	 * Constructs a T in a free slot
+	 */
+	template <typename... Args>
+	T* create(Args&&... args) {
+		if (free_list == nullptr)
+			addChunk();
+		Slot* slot = free_list;
+		free_list = slot->next;
+		++live_objects;
+		return new (slot->storage()) T(std::forward<Args>(args)...);
+	}
+
+	/**
+	 * Destructs the object and returns its slot to the pool
+	 */
+	void destroy(T* object) {
+		object->~T();
+		Slot* slot = reinterpret_cast<Slot*>(object);
+		slot->next = free_list;
+		free_list = slot;
+		--live_objects;
+	}
+
+	inline size_t getLiveObjects() const {
+		return live_objects;
+	}
+
+private:
+	PoolAllocator(const PoolAllocator&);
+	PoolAllocator& operator=(const PoolAllocator&);
+
+	union Slot {
+		typename std::aligned_storage<sizeof(T), std::alignment_of<T>::value>::type object;
+		Slot* next; //< While the slot is free
+
+		inline void* storage() { return &object; }
+	};
+
+	void addChunk() {
+		Slot* chunk = new Slot[objects_per_chunk];
+		chunks.push_back(chunk);
+		for (size_t i=0; i<objects_per_chunk; ++i) {
+			chunk[i].next = free_list;
+			free_list = &chunk[i];
+		}
+	}
+
+	std::vector<Slot*> chunks;
+	Slot* free_list;
+	size_t objects_per_chunk;
+	size_t live_objects;
+};
+
+#endif // _POOLALLOCATOR_H_
@@ -3,24 +3,91 @@
 
 #include "GLUtils/GLUtils.hpp"
 
+/**
+ * Offscreen target the scene is rendered into. The anti-aliased result
+ * ends up in one texture, which is shown on screen, in the debug view
+ * and saved by screenshots, so they all match.
+ * The scene may cover only the lower left part of the buffers, so the
+ * resolution can change every frame without reallocating them.
+ */
 class ScreenshotFBO
 {
 public:
-	ScreenshotFBO();
-	ScreenshotFBO(unsigned int width, unsigned int height);
+	enum AntiAliasing {
+		AA_NONE,
+		AA_MSAA, //< Multisampled buffers, resolved with glBlitFramebuffer
+		AA_FXAA, //< Post-process on the single-sampled image
+	};
+
+	ScreenshotFBO(unsigned int width, unsigned int height, unsigned int samples = 4);
 	~ScreenshotFBO();
-	void bind();
+
+	/**
+	 * Sets the size of the part that is rendered to. The buffers are only
+	 * reallocated when they are too small, and then with some room to grow.
+	 */
+	void resize(unsigned int width, unsigned int height);
+
+	/**
+	 * Binds the framebuffer the scene should be rendered into for the given mode
+	 */
+	void bind(AntiAliasing mode = AA_NONE);
 	static void unbind();
 
+	/**
+	 * Produces the final texture from what was rendered after bind(mode).
+	 * FXAA draws quad_vao, a strip from (-1, -1) to (1, 1), with fxaa_program.
+	 */
+	void resolve(AntiAliasing mode, GLUtils::Program& fxaa_program, GLuint quad_vao);
+
+	/**
+	 * Copies the final texture to the window. If the sizes differ, it is
+	 * upscaled by drawing quad_vao with upscale_program, which sharpens it.
+	 */
+	void present(unsigned int window_width, unsigned int window_height, GLUtils::Program& upscale_program, GLuint quad_vao);
+
+	/**
+	 * Binds the final image for glReadPixels
+	 */
+	void bindForReading();
+
 	unsigned int getWidth() { return width; }
 	unsigned int getHeight() { return height; }
+	unsigned int getAllocatedWidth() { return allocated_width; }
+	unsigned int getAllocatedHeight() { return allocated_height; }
+	unsigned int getSamples() { return samples; }
+	unsigned int getReallocations() { return reallocations; }
 
 	GLuint getTexture() { return texture; }
 
 private:
-	GLuint fbo;
-	GLuint depth;
+	ScreenshotFBO(const ScreenshotFBO&);
+	ScreenshotFBO& operator=(const ScreenshotFBO&);
+
+	static const unsigned int granularity = 128; //< Allocations are rounded up to multiples of this
+
+	void allocate(unsigned int width, unsigned int height);
+	void release();
+	static GLuint createTexture(unsigned int width, unsigned int height);
+
+	/**
+	 * Draws quad_vao with program, reading the rendered part of source
+	 */
+	void drawQuad(GLUtils::Program& program, GLuint source, GLuint quad_vao);
+
+	GLuint fbo; //< Final image, and the scene without anti-aliasing
+	GLuint depth; //< Shared by fbo and fxaa_fbo
 	GLuint texture;
-	unsigned int width, height;
+
+	GLuint msaa_fbo;
+	GLuint msaa_colour, msaa_depth;
+
+	GLuint fxaa_fbo; //< Scene before FXAA
+	GLuint fxaa_texture;
+
+	unsigned int width, height; //< Rendered part
+	unsigned int allocated_width, allocated_height;
+	unsigned int samples;
+	unsigned int reallocations;
 };
 #endif
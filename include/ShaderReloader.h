@@ -0,0 +1,80 @@
+#ifndef _SHADERRELOADER_H_
+#define _SHADERRELOADER_H_
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <functional>
+
+#include <GL/glew.h>
+
+#include "FileWatcher.h"
+#include "GLUtils/Program.hpp"
+
+/**
+ * Rebuilds programs when their shader files change on disk. Builds
+ * run in the background of the driver where KHR_parallel_shader_compile
+ * is available, and a program is only swapped in once it has linked,
+ * so the frame loop never waits for the compiler. On errors the old
+ * program stays in use and the log is printed.
+ */
+class ShaderReloader {
+public:
+	/**
+	 * Called after a program has been replaced, e.g., to set uniforms again
+	 */
+	typedef std::function<void(GLUtils::Program& program)> ReloadCallback;
+
+	/**
+	 * Must be created on the thread that owns the OpenGL context
+	 */
+	explicit ShaderReloader(std::string directory = "shaders");
+	~ShaderReloader();
+
+	/**
+	 * Rebuilds program whenever one of the given files in the directory
+	 * changes. The geometry shader gs may be empty. The defines are
+	 * inserted into the sources as by GLUtils::insertDefines().
+	 */
+	void add(std::shared_ptr<GLUtils::Program> program, std::string vs, std::string gs, std::string fs,
+			ReloadCallback on_reload = ReloadCallback(), const std::vector<std::string>& defines = std::vector<std::string>());
+
+	/**
+	 * Starts builds for changed files and swaps in programs that have
+	 * finished building. Call once per frame on the OpenGL thread.
+	 */
+	void update();
+
+private:
+	ShaderReloader(const ShaderReloader&);
+	ShaderReloader& operator=(const ShaderReloader&);
+
+	struct Build {
+		Build() : program(0) {}
+		GLuint program; //< 0 when no build is running
+		std::vector<GLuint> shaders;
+	};
+
+	struct Entry {
+		std::shared_ptr<GLUtils::Program> program;
+		std::vector<std::string> paths;
+		std::vector<GLenum> types;
+		ReloadCallback on_reload;
+		std::vector<std::string> defines;
+		bool changed; //< Files changed since the current build started
+		Build build;
+	};
+
+	void startBuild(Entry& entry);
+	bool isBuildDone(const Build& build) const;
+	void finishBuild(Entry& entry);
+	static void discardBuild(Build& build);
+
+	std::string directory;
+	FileWatcher watcher;
+	std::vector<Entry> entries;
+	std::vector<std::string> changed_files; //< Kept to avoid allocating every frame
+	bool parallel_compile;
+};
+
+#endif // _SHADERRELOADER_H_
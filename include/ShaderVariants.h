@@ -0,0 +1,73 @@
+#ifndef _SHADERVARIANTS_H_
+#define _SHADERVARIANTS_H_
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <ostream>
+
+#include "GLUtils/Program.hpp"
+#include "GLUtils/ProgramCache.hpp"
+#include "ShaderReloader.h"
+
+/**
+ * Variants of one program, specialized at compile time by #defines
+ * for a set of features instead of branching on uniforms. Variants
+ * are compiled the first time they are asked for, and kept by their
+ * feature bitmask.
+ */
+class ShaderVariants {
+public:
+	enum Feature {
+		FEATURE_LIGHTING = 1 << 0,
+		FEATURE_INSTANCING = 1 << 1,
+		FEATURE_SHADOWS = 1 << 2,
+		FEATURE_DIRECTIONAL_LIGHT = 1 << 3,
+		FEATURE_CLUSTERED_LIGHTS = 1 << 4,
+		FEATURE_SKINNING = 1 << 5,
+		FEATURE_VERTEX_ANIMATION = 1 << 6,
+	};
+	static const unsigned int num_features = 7;
+
+	/**
+	 * Reads the shaders from the given files in directory, where gs may be
+	 * empty. Variants are built through cache, and registered with reloader
+	 * if one is given. Must be used on the thread that owns the OpenGL context.
+	 */
+	ShaderVariants(GLUtils::ProgramCache* cache, std::string directory, std::string vs, std::string gs, std::string fs,
+			ShaderReloader* reloader = NULL);
+
+	/**
+	 * @return The variant with the given combination of features
+	 */
+	inline const std::shared_ptr<GLUtils::Program>& getVariant(unsigned int features) {
+		if (!variants[features])
+			compileVariant(features);
+		return variants[features];
+	}
+
+	/**
+	 * Prints the variants compiled so far, and the time spent on them
+	 */
+	void printReport(std::ostream& out) const;
+
+	/**
+	 * @return The defines that turn on the given features
+	 */
+	static std::vector<std::string> getDefines(unsigned int features);
+
+private:
+	void compileVariant(unsigned int features);
+
+	static const char* const feature_names[num_features];
+
+	GLUtils::ProgramCache* cache;
+	ShaderReloader* reloader;
+	std::string vs_file, gs_file, fs_file;
+	std::string vs_src, gs_src, fs_src;
+
+	std::vector<std::shared_ptr<GLUtils::Program> > variants; //< Indexed by feature bitmask
+	std::vector<double> compile_times; //< Seconds spent on each variant
+};
+
+#endif // _SHADERVARIANTS_H_
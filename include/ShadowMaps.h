@@ -0,0 +1,114 @@
+#ifndef _SHADOWMAPS_H_
+#define _SHADOWMAPS_H_
+
+#include <memory>
+#include <vector>
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include "GLUtils/GLUtils.hpp"
+#include "GLUtils/ProgramCache.hpp"
+#include "ShaderReloader.h"
+#include "Model.h"
+#include "Frustum.h"
+
+/**
+ * Depth-only shadow maps for the scene light. A point light gets a cube
+ * map rendered in a single pass (a geometry shader sends each triangle
+ * to all six layers), a directional light gets cascaded shadow maps
+ * fitted to the camera frustum. Maps are only rendered again when the
+ * light, the casters or (for cascades) the camera have changed.
+ */
+class ShadowMaps {
+public:
+	/**
+	 * Percentage closer filtering kernel. Every tap is already a 2x2
+	 * bilinear comparison done by the hardware.
+	 */
+	enum Filter {
+		FILTER_HARD = 0, //< One tap
+		FILTER_PCF3X3 = 1,
+		FILTER_PCF5X5 = 2,
+	};
+
+	/**
+	 * An object that casts shadows. The vertex array object must have
+	 * its positions at attribute location 0.
+	 */
+	struct Caster {
+		const Model* model;
+		glm::mat4 transform; //< Model to world
+		GLuint vao;
+	};
+
+	static const unsigned int max_cascades = 4; //< Must match MAX_CASCADES in basic_phong.frag
+
+	ShadowMaps(GLUtils::ProgramCache* cache, ShaderReloader* reloader = NULL,
+			unsigned int cube_size = 512, unsigned int cascade_size = 1024, unsigned int num_cascades = 3);
+	~ShadowMaps();
+
+	inline void setFilter(Filter filter) {this->filter = filter;}
+	inline Filter getFilter() const {return filter;}
+
+	/**
+	 * Renders the cube map for a point light at position, covering
+	 * distances from z_near to z_far
+	 */
+	void updatePointLight(const glm::vec3& position, float z_near, float z_far, const Caster* casters, unsigned int num_casters);
+
+	/**
+	 * Renders cascades for a light infinitely far away in the direction
+	 * to_light, covering the view frustum of the given perspective camera
+	 */
+	void updateDirectionalLight(const glm::vec3& to_light, const glm::mat4& camera_view, const glm::mat4& camera_projection,
+			const Caster* casters, unsigned int num_casters);
+
+	/**
+	 * Binds the maps of the light updated last, and sets the uniforms
+	 * the SHADOWS variants of basic_phong need
+	 */
+	void apply(GLUtils::Program& program, const glm::mat4& camera_view) const;
+
+	inline unsigned int getRenderedUpdates() const {return rendered_updates;}
+	inline unsigned int getCachedUpdates() const {return cached_updates;} //< Updates skipped as nothing had changed
+
+private:
+	ShadowMaps(const ShadowMaps&);
+	ShadowMaps& operator=(const ShadowMaps&);
+
+	/**
+	 * @return true if state differs from the one the maps were last rendered with
+	 */
+	bool hasChanged();
+	void addCasterState(const Caster* casters, unsigned int num_casters);
+
+	/**
+	 * Draws all parts of the casters, leaving out those outside frustum if one is given
+	 */
+	void renderCasters(GLint matrix_loc, const glm::mat4& pre_transform, const Frustum* frustum,
+			const Caster* casters, unsigned int num_casters) const;
+
+	static void createDepthTexture(GLuint texture, GLenum target);
+
+	std::shared_ptr<GLUtils::Program> cube_program; //< Layered rendering into all cube faces
+	std::shared_ptr<GLUtils::Program> depth_program;
+
+	GLuint cube_fbo, cube_texture;
+	GLuint cascade_fbo, cascade_texture;
+	unsigned int cube_size, cascade_size, num_cascades;
+
+	Filter filter;
+	bool directional; //< Which maps apply() uses
+
+	glm::vec3 point_position;
+	float point_near, point_far;
+
+	glm::mat4 cascade_matrices[max_cascades]; //< World to shadow texture space
+	float cascade_splits[max_cascades]; //< Far end of each cascade, as view depth
+
+	std::vector<float> state, last_state; //< Everything the maps depend on, for caching
+	unsigned int rendered_updates, cached_updates;
+};
+
+#endif // _SHADOWMAPS_H_
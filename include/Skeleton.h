@@ -0,0 +1,150 @@
+#ifndef _SKELETON_H_
+#define _SKELETON_H_
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include <assimp/scene.h>
+
+#include <glm/glm.hpp>
+
+/**
+ * The node hierarchy, bones and animations of a model, copied out of
+ * Assimp's scene so they outlive it. Every node that has meshes but no
+ * bones of its own also becomes a bone, with an identity offset, so that
+ * rigid parts are skinned along with the rest and the whole model can be
+ * drawn with one call.
+ * Poses are sampled and blended as translation, rotation and scale per
+ * node, with quaternions as (x, y, z, w), and blended four nodes at a
+ * time with SSE where available. A skeleton is never modified after
+ * loading, so any number of threads may sample it at once.
+ */
+class Skeleton {
+public:
+	struct Node {
+		int parent; //< Index of the parent, which always comes first, or -1 for the root
+		glm::vec3 translation; //< Bind pose relative to the parent
+		glm::vec4 rotation;
+		glm::vec3 scale;
+		std::string name;
+	};
+
+	struct Bone {
+		unsigned int node;
+		glm::mat4 offset; //< From mesh space to the node in the bind pose
+	};
+
+	/**
+	 * Keys of the nodes one animation moves, in seconds. Nodes without
+	 * a channel keep their bind pose.
+	 */
+	struct Channel {
+		unsigned int node;
+		std::vector<float> translation_times, rotation_times, scale_times;
+		std::vector<glm::vec3> translations;
+		std::vector<glm::vec4> rotations;
+		std::vector<glm::vec3> scales;
+	};
+
+	/**
+	 * Which of the anim meshes of a mesh it takes on when, in seconds.
+	 * The mesh is named, as there may be several copies of it.
+	 */
+	struct MeshChannel {
+		std::string mesh;
+		std::vector<float> times;
+		std::vector<unsigned int> shapes; //< Index of the anim mesh at each key
+	};
+
+	struct Clip {
+		std::string name;
+		float duration; //< In seconds
+		std::vector<Channel> channels;
+		std::vector<MeshChannel> mesh_channels; //< Morphs, only used when baking vertex animation
+	};
+
+	/**
+	 * Local transforms of all nodes. Rotations are unit quaternions.
+	 */
+	struct Pose {
+		std::vector<glm::vec4> translations; //< w is unused
+		std::vector<glm::vec4> rotations;
+		std::vector<glm::vec4> scales; //< w is unused
+		std::vector<glm::mat4> node_transforms; //< From each node to model space, set by computePalette()
+	};
+
+	static const unsigned int max_bones = 256; //< Bone indices are stored in bytes
+	static const unsigned int max_influences = 4; //< Bones per vertex
+	static const unsigned int floats_per_bone = 12; //< Rows of a 3x4 matrix in the palette
+
+	Skeleton(const aiScene* scene);
+
+	/**
+	 * Finds the bones of each vertex of a mesh of scene under node, and
+	 * writes max_influences bone indices followed by as many weights,
+	 * which add up to 255, per vertex. The strongest influences are kept.
+	 */
+	void getInfluences(const aiScene* scene, unsigned int mesh, const aiNode* node, std::vector<uint8_t>& influences) const;
+
+	/**
+	 * Sets a transform applied right after the local transform of the
+	 * root, as the model is centered and scaled after loading
+	 */
+	inline void setRootTransform(const glm::mat4& transform) {root_transform = transform;}
+
+	/**
+	 * @return Index of the clip with the given name, or -1
+	 */
+	int findClip(const std::string& name) const;
+
+	void getBindPose(Pose& pose) const;
+
+	/**
+	 * Samples clip at time seconds, looping, into pose. Nodes the clip
+	 * does not move get their bind pose.
+	 */
+	void samplePose(unsigned int clip, float time, Pose& pose) const;
+
+	/**
+	 * Finds the anim meshes a mesh channel blends between at time
+	 * seconds, which is not wrapped
+	 * @param fraction Set to the weight of shape_b
+	 */
+	static void sampleShapes(const MeshChannel& channel, float time, unsigned int& shape_a, unsigned int& shape_b, float& fraction);
+
+	/**
+	 * Blends from pose a towards pose b by weight, into out, which may be either of them
+	 */
+	static void blendPoses(const Pose& a, const Pose& b, float weight, Pose& out);
+
+	/**
+	 * Writes the skinning matrices of the pose to palette, floats_per_bone
+	 * floats per bone: the rows of the matrix that takes a vertex from
+	 * mesh to model space. Also sets the node transforms of the pose.
+	 */
+	void computePalette(Pose& pose, float* palette) const;
+
+	inline unsigned int getNumNodes() const {return static_cast<unsigned int>(nodes.size());}
+	inline unsigned int getNumBones() const {return static_cast<unsigned int>(bones.size());}
+	inline const std::vector<Node>& getNodes() const {return nodes;}
+	inline const std::vector<Clip>& getClips() const {return clips;}
+
+private:
+	void addNodeRecursive(const aiScene* scene, const aiNode* node, int parent);
+	unsigned int findNode(const std::string& name) const;
+
+	/**
+	 * @return Index of the bone of the node with the given offset, added if it is new
+	 */
+	unsigned int addBone(unsigned int node, const glm::mat4& offset);
+
+	std::vector<Node> nodes; //< Depth-first, so parents come before their children
+	std::vector<Bone> bones;
+	std::vector<Clip> clips;
+	std::vector<std::vector<unsigned int> > mesh_bones; //< Bone of each aiBone, per mesh of the scene
+	std::vector<unsigned int> node_bones; //< Bone of the meshes of each node that have no bones, or max_bones
+	glm::mat4 root_transform;
+};
+
+#endif // _SKELETON_H_
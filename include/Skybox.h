@@ -0,0 +1,46 @@
+#ifndef _SKYBOX_H_
+#define _SKYBOX_H_
+
+#include <memory>
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include "GLUtils/GLUtils.hpp"
+#include "GLUtils/CubeMap.hpp"
+#include "GLUtils/ProgramCache.hpp"
+#include "ShaderReloader.h"
+
+/**
+ * Draws a cube map as the background. It is drawn after the opaque
+ * geometry at the far plane, so the depth test rejects every pixel
+ * that is already covered, and only the rest run the (unlit) shader.
+ */
+class Skybox {
+public:
+	/**
+	 * The program is built through cache, and registered with reloader
+	 * if one is given. Needs a current OpenGL context.
+	 */
+	Skybox(GLUtils::ProgramCache* cache, std::shared_ptr<GLUtils::CubeMap> cubemap, ShaderReloader* reloader = NULL);
+	~Skybox();
+
+	/**
+	 * Draws the sky around the camera. Expects the depth test to
+	 * pass for equal depths (GL_LEQUAL), and leaves the depth buffer
+	 * untouched.
+	 */
+	void render(const glm::mat4& view, const glm::mat4& projection);
+
+private:
+	Skybox(const Skybox&);
+	Skybox& operator=(const Skybox&);
+
+	std::shared_ptr<GLUtils::CubeMap> cubemap;
+	std::shared_ptr<GLUtils::Program> program;
+	std::shared_ptr<GLUtils::VBO<GL_ARRAY_BUFFER> > vertices;
+	GLuint vao;
+	unsigned int n_vertices;
+};
+
+#endif // _SKYBOX_H_
@@ -0,0 +1,76 @@
+#ifndef _TRANSFORMBATCH_H_
+#define _TRANSFORMBATCH_H_
+
+#include <vector>
+
+#include <glm/glm.hpp>
+
+/**
+ * Affine transforms and bounding spheres of many mesh parts, stored as
+ * structure of arrays so that four parts are handled by each SSE
+ * instruction. Only the upper 3x4 part of the matrices is kept; the
+ * last row must be (0, 0, 0, 1).
+ */
+class TransformBatch {
+public:
+	/**
+	 * What the draw list needs to know about one part
+	 */
+	struct Result {
+		glm::mat4 model_view;
+		glm::vec3 view_center; //< Bounding sphere in view space
+		float view_radius;
+		glm::vec3 light_position; //< Light direction in part space, as the shaders expect
+		glm::vec3 camera_position; //< In part space
+	};
+
+	TransformBatch() : count(0), stride(0) {}
+
+	void resize(unsigned int count);
+	inline unsigned int size() const {return count;}
+
+	void set(unsigned int i, const glm::mat4& transform, const glm::vec3& center, float radius);
+	glm::mat4 getTransform(unsigned int i) const;
+
+	/**
+	 * Computes the results of parts [begin, end), given the transform
+	 * from model to world space, the view matrix and the light position
+	 * in world space. Both matrices must be affine. Only one 3x3 inverse
+	 * per part is needed, as the inverses of the model and view matrices
+	 * are shared by all parts. Uses SSE where available.
+	 */
+	void compute(const glm::mat4& model, const glm::mat4& view, const glm::vec3& light_position,
+			unsigned int begin, unsigned int end, Result* results) const;
+
+	/**
+	 * The same without SIMD, for comparison
+	 */
+	void computeScalar(const glm::mat4& model, const glm::mat4& view, const glm::vec3& light_position,
+			unsigned int begin, unsigned int end, Result* results) const;
+
+private:
+	/**
+	 * Per call values shared by all parts
+	 */
+	struct Shared {
+		float view_model[12]; //< Rows of the upper 3x4 part
+		float light[3]; //< Light in model space, without the model translation
+		float camera[3]; //< Camera in model space
+	};
+
+	enum Stream {
+		STREAM_TRANSFORM = 0, //< 12 streams, row by row
+		STREAM_CENTER = 12, //< x, y, z
+		STREAM_RADIUS = 15,
+		NUM_STREAMS = 16,
+	};
+
+	static Shared computeShared(const glm::mat4& model, const glm::mat4& view, const glm::vec3& light_position);
+
+	inline const float* stream(unsigned int s) const {return &data[s*stride];}
+
+	std::vector<float> data; //< NUM_STREAMS streams of stride floats
+	unsigned int count, stride;
+};
+
+#endif // _TRANSFORMBATCH_H_
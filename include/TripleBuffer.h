@@ -0,0 +1,66 @@
+#ifndef _TRIPLEBUFFER_H_
+#define _TRIPLEBUFFER_H_
+
+#include <atomic>
+
+/**
+ * Lock-free triple buffer for handing data from one producer thread
+ * to one consumer thread. The producer fills the write buffer and
+ * publishes it, the consumer picks up the newest published buffer.
+ * Neither side ever waits for the other, and buffers the consumer
+ * never got around to reading are simply overwritten.
+ */
+template <typename T>
+class TripleBuffer {
+public:
+	TripleBuffer() : shared(1), write_index(0), read_index(2) {}
+
+	/**
+	 * @return The buffer the producer may fill. Only call from the producer thread.
+	 */
+	inline T& getWriteBuffer() {
+		return buffers[write_index];
+	}
+
+	/**
+	 * Makes the write buffer available to the consumer, and hands the
+	 * producer a new buffer to write to.
+	 */
+	inline void publish() {
+		unsigned int previous = shared.exchange(write_index | dirty_bit, std::memory_order_acq_rel);
+		write_index = previous & index_mask;
+	}
+
+	/**
+	 * Swaps in the newest published buffer, if any. Only call from the consumer thread.
+	 * @return true if the read buffer changed
+	 */
+	inline bool update() {
+		if ((shared.load(std::memory_order_relaxed) & dirty_bit) == 0)
+			return false;
+		unsigned int previous = shared.exchange(read_index, std::memory_order_acq_rel);
+		read_index = previous & index_mask;
+		return true;
+	}
+
+	/**
+	 * @return The buffer the consumer may read from
+	 */
+	inline const T& getReadBuffer() const {
+		return buffers[read_index];
+	}
+
+private:
+	TripleBuffer(const TripleBuffer&);
+	TripleBuffer& operator=(const TripleBuffer&);
+
+	static const unsigned int index_mask = 3;
+	static const unsigned int dirty_bit = 4;
+
+	T buffers[3];
+	std::atomic<unsigned int> shared; //< Index of the buffer in the middle, and whether it is unread
+	unsigned int write_index; //< Owned by the producer
+	unsigned int read_index; //< Owned by the consumer
+};
+
+#endif // _TRIPLEBUFFER_H_
@@ -0,0 +1,92 @@
+#ifndef _VERTEXANIMATION_H_
+#define _VERTEXANIMATION_H_
+
+#include <memory>
+#include <vector>
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include "GLUtils/GLUtils.hpp"
+#include "JobSystem.h"
+#include "Model.h"
+#include "Skeleton.h"
+
+/**
+ * One clip of an animated model baked into a half float texture of the
+ * model space position and normal of every vertex in every frame, for
+ * crowds where posing skeletons would cost too much. The bones and anim
+ * meshes of the model both go into the bake, on the job system. The
+ * VERTEX_ANIMATION variants of basic_phong look the vertices up by
+ * gl_VertexID and interpolate between frames, so all instances are drawn
+ * with a single call, and the CPU does nothing per instance after adding
+ * it. Each instance has its own transform and time offset, but they all
+ * play the clip at the same speed.
+ * Must be used on the OpenGL thread.
+ */
+class VertexAnimation {
+public:
+	/**
+	 * Bakes clip of the model's skeleton at frame_rate frames per
+	 * second, rounded so that the clip loops on a whole frame. The vertex
+	 * array is set up for program, but works with every variant of
+	 * basic_phong with VERTEX_ANIMATION and INSTANCING, as they share
+	 * attribute locations. Needs a current context.
+	 */
+	VertexAnimation(Model* model, unsigned int clip, JobSystem* job_system, GLUtils::Program& program,
+			float frame_rate = 30.0f, unsigned int max_instances = 1 << 14, GLenum unit = GL_TEXTURE8);
+	~VertexAnimation();
+
+	/**
+	 * @param transform From model to world space
+	 * @param time_offset Seconds into the clip
+	 * @return Index of the instance
+	 */
+	unsigned int addInstance(const glm::mat4& transform, float time_offset);
+	void setInstance(unsigned int index, const glm::mat4& transform, float time_offset);
+
+	inline void setColour(const glm::vec3& colour) {this->colour = colour;}
+
+	/**
+	 * Draws all instances at time seconds. The light position is in
+	 * world space.
+	 */
+	void render(GLUtils::Program& program, const glm::mat4& view, const glm::mat4& projection, const glm::vec3& light_position, double time);
+
+	inline unsigned int getNumInstances() const {return static_cast<unsigned int>(instance_data.size() / floats_per_instance);}
+	inline unsigned int getNumFrames() const {return num_frames;}
+	inline size_t getTextureBytes() const {return texture_bytes;}
+	inline double getBakeTime() const {return bake_time;} //< Seconds the bake took on the CPU
+
+	static const unsigned int floats_per_instance = 17; //< Transform, then time offset
+
+private:
+	VertexAnimation(const VertexAnimation&);
+	VertexAnimation& operator=(const VertexAnimation&);
+
+	/**
+	 * Poses the vertices at each frame of the clip, and writes them to
+	 * texels, two per vertex
+	 */
+	void bake(Model* model, unsigned int clip, JobSystem* job_system, std::vector<float>& texels);
+
+	Model* model;
+	unsigned int max_instances;
+	GLenum unit;
+
+	unsigned int num_frames;
+	float frame_rate; //< As rounded
+	float duration; //< Of the clip, in seconds
+	GLuint texture;
+	size_t texture_bytes;
+
+	std::vector<float> instance_data; //< floats_per_instance per instance
+	std::shared_ptr<GLUtils::VBO<GL_ARRAY_BUFFER> > instances;
+	bool instances_changed;
+	GLuint vao;
+
+	glm::vec3 colour;
+	double bake_time;
+};
+
+#endif // _VERTEXANIMATION_H_
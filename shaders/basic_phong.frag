@@ -1,24 +1,145 @@
-#version 130
+#version 140
 
-uniform bool lighting;
 uniform vec3 colour;
+#ifdef SHADOWS
+uniform int pcf_radius; // Taps in each direction, 0 for hard shadows
+uniform float shadow_texel_size;
+#ifdef DIRECTIONAL_LIGHT
+#define MAX_CASCADES 4
+uniform sampler2DArrayShadow cascade_map;
+uniform mat4 cascade_matrices[MAX_CASCADES]; // World to shadow texture space
+uniform float cascade_splits[MAX_CASCADES]; // Far end of each cascade, as view depth
+uniform int num_cascades;
+#else
+uniform samplerCubeShadow cube_shadow_map;
+uniform vec3 shadow_light_position; // World space
+uniform vec2 shadow_depth_range; // Near and far plane of the cube faces
+#endif
+#endif
+#ifdef CLUSTERED_LIGHTS
+uniform samplerBuffer light_data; // View space position and radius, then colour, per light
+uniform usamplerBuffer light_grid; // Offset into light_indices and number of lights, per cluster
+uniform usamplerBuffer light_indices;
+uniform ivec3 cluster_dims; // Tiles across, tiles up, depth slices
+uniform vec2 cluster_tile_size; // In pixels
+uniform vec2 cluster_slice_scale_bias; // slice = log(depth) * scale + bias
+#endif
 
 in vec3 ex_Normal;
 in vec3 ex_View;
 in vec3 ex_Light;
+#ifdef SHADOWS
+in float ex_Depth;
+in vec3 ex_World;
+#endif
+#ifdef CLUSTERED_LIGHTS
+in vec3 ex_ViewPosition;
+in vec3 ex_ViewNormal;
+#endif
 out vec4 res_Color;
 
-void main() {
-    if(lighting) {
-		vec3 v = normalize(ex_View);
-		vec3 l = normalize(ex_Light);
-		vec3 n = normalize(ex_Normal);
-		vec3 h = normalize(v+l);
-		float diff = max(0.f, dot(l, n));
-		float spec = pow(max(0.f, dot(h, n)), 128.f);
-	
-		res_Color = diff * vec4(colour, 1.0f) + vec4(spec);
-	} else {
-		res_Color = vec4(0.0f, 0.0f, 0.0f, 1.0f);
+#ifdef SHADOWS
+/**
+ * @return How much of the light reaches this fragment, from 0 to 1
+ */
+float shadow() {
+	float lit = 0.0;
+#ifdef DIRECTIONAL_LIGHT
+	int cascade = num_cascades - 1;
+	for (int i = 0; i < num_cascades - 1; ++i) {
+		if (ex_Depth < cascade_splits[i]) {
+			cascade = i;
+			break;
+		}
 	}
-}
\ No newline at end of file
+
+	vec4 coord = cascade_matrices[cascade] * vec4(ex_World, 1.0);
+	for (int y = -pcf_radius; y <= pcf_radius; ++y)
+		for (int x = -pcf_radius; x <= pcf_radius; ++x)
+			lit += texture(cascade_map, vec4(coord.xy + vec2(x, y) * shadow_texel_size, float(cascade), coord.z));
+#else
+	// The cube face is picked by the major axis, and its distance
+	// along that axis is what the face projection turned into depth
+	vec3 to_fragment = ex_World - shadow_light_position;
+	vec3 distances = abs(to_fragment);
+	float z = max(distances.x, max(distances.y, distances.z));
+	float n = shadow_depth_range.x;
+	float f = shadow_depth_range.y;
+	float depth = 0.5 * ((f + n) / (f - n) - 2.0 * f * n / ((f - n) * z)) + 0.5;
+
+	// Filter taps on the plane facing the light, one texel apart
+	vec3 dir = normalize(to_fragment);
+	vec3 tangent = normalize(cross(dir, abs(dir.y) < 0.99 ? vec3(0.0, 1.0, 0.0) : vec3(1.0, 0.0, 0.0)));
+	vec3 bitangent = cross(dir, tangent);
+	float texel = 2.0 * shadow_texel_size * z;
+	for (int y = -pcf_radius; y <= pcf_radius; ++y)
+		for (int x = -pcf_radius; x <= pcf_radius; ++x)
+			lit += texture(cube_shadow_map, vec4(to_fragment + (float(x) * tangent + float(y) * bitangent) * texel, depth));
+#endif
+	float taps = float(2 * pcf_radius + 1);
+	return lit / (taps * taps);
+}
+#endif
+
+#ifdef CLUSTERED_LIGHTS
+/**
+ * @return Light from the point lights of this fragment's cluster
+ */
+vec3 clusteredLighting(vec3 surface_colour) {
+	ivec2 tile = min(ivec2(gl_FragCoord.xy / cluster_tile_size), cluster_dims.xy - 1);
+	float depth = -ex_ViewPosition.z;
+	int slice = clamp(int(log(depth) * cluster_slice_scale_bias.x + cluster_slice_scale_bias.y), 0, cluster_dims.z - 1);
+	int cluster = (slice * cluster_dims.y + tile.y) * cluster_dims.x + tile.x;
+	uvec2 range = texelFetch(light_grid, cluster).xy;
+
+	vec3 v = normalize(-ex_ViewPosition);
+	vec3 n = normalize(ex_ViewNormal);
+	vec3 result = vec3(0.0);
+	for (uint i = 0u; i < range.y; ++i) {
+		int light = int(texelFetch(light_indices, int(range.x + i)).x);
+		vec4 position_radius = texelFetch(light_data, 2 * light);
+		vec3 colour = texelFetch(light_data, 2 * light + 1).rgb;
+
+		vec3 l = position_radius.xyz - ex_ViewPosition;
+		float light_distance = length(l);
+		if (light_distance >= position_radius.w)
+			continue;
+		l /= light_distance;
+
+		// Falls off smoothly to zero at the radius
+		float falloff = 1.0 - (light_distance * light_distance) / (position_radius.w * position_radius.w);
+		falloff *= falloff;
+
+		vec3 h = normalize(v + l);
+		float diff = max(0.0, dot(l, n));
+		float spec = pow(max(0.0, dot(h, n)), 128.0);
+		result += falloff * colour * (diff * surface_colour + vec3(spec));
+	}
+	return result;
+}
+#endif
+
+void main() {
+#ifdef LIGHTING
+	vec4 surface_colour = vec4(colour, 1.0f);
+
+	vec3 v = normalize(ex_View);
+	vec3 l = normalize(ex_Light);
+	vec3 n = normalize(ex_Normal);
+	vec3 h = normalize(v+l);
+	float diff = max(0.f, dot(l, n));
+	float spec = pow(max(0.f, dot(h, n)), 128.f);
+#ifdef SHADOWS
+	float light = shadow();
+	diff *= light;
+	spec *= light;
+#endif
+
+	res_Color = diff * surface_colour + vec4(spec);
+#ifdef CLUSTERED_LIGHTS
+	res_Color.rgb += clusteredLighting(surface_colour.rgb);
+#endif
+#else
+	res_Color = vec4(0.0f, 0.0f, 0.0f, 1.0f);
+#endif
+}
@@ -1,21 +1,113 @@
-#version 130
+#version 140
 
 uniform mat4 proj_mat;
 uniform mat4 model_view_mat;
-uniform mat3 normal_mat;
 uniform vec3 light_position;
+uniform vec3 camera_position;
+#ifdef SHADOWS
+uniform mat4 view_to_world;
+#endif
 
 in  vec3 position;
 in  vec3 normal;
+#ifdef INSTANCING
+in  mat4 instance_transform; // Applied before model_view_mat
+#endif
+#ifdef SKINNING
+uniform samplerBuffer bone_palette; // Three rows of a 3x4 matrix per bone, num_bones per instance
+uniform int num_bones;
+uniform int palette_offset; // Texel of the first palette
+in  vec4 bone_indices;
+in  vec4 bone_weights; // Add up to one
+#endif
+#ifdef VERTEX_ANIMATION
+uniform sampler2D vertex_animation; // Model space position, then normal, of every vertex in every frame, row after row
+uniform int animation_vertices; // Per frame
+uniform int animation_frames;
+uniform float animation_frame_rate;
+uniform float animation_time; // In seconds, wrapped to the duration
+#ifdef INSTANCING
+in  float instance_time_offset; // In seconds
+#endif
+#endif
 
 out vec3 ex_Normal;
 out vec3 ex_View;
 out vec3 ex_Light;
+#ifdef SHADOWS
+out float ex_Depth;
+out vec3 ex_World;
+#endif
+#ifdef CLUSTERED_LIGHTS
+out vec3 ex_ViewPosition;
+out vec3 ex_ViewNormal;
+#endif
 
 void main() {
-	vec4 pos = model_view_mat * vec4(position, 1.0);
+#ifdef SKINNING
+	// Blend the rows of the bone matrices, and transform once
+	int palette = palette_offset + 3*num_bones*gl_InstanceID;
+	vec4 rows[3] = vec4[3](vec4(0.0), vec4(0.0), vec4(0.0));
+	for (int i=0; i<4; ++i) {
+		int bone = palette + 3*int(bone_indices[i]);
+		for (int r=0; r<3; ++r)
+			rows[r] += bone_weights[i] * texelFetch(bone_palette, bone + r);
+	}
+	vec3 local_position = vec3(dot(rows[0], vec4(position, 1.0)), dot(rows[1], vec4(position, 1.0)), dot(rows[2], vec4(position, 1.0)));
+	vec3 local_normal = vec3(dot(rows[0].xyz, normal), dot(rows[1].xyz, normal), dot(rows[2].xyz, normal));
+#elif defined(VERTEX_ANIMATION)
+	// Interpolate between the two frames around the time of the instance
+#ifdef INSTANCING
+	float frame = mod((animation_time + instance_time_offset)*animation_frame_rate, float(animation_frames));
+#else
+	float frame = animation_time*animation_frame_rate;
+#endif
+	int frame_a = min(int(frame), animation_frames - 1);
+	int frame_b = (frame_a + 1) % animation_frames;
+	// The width is even, so a normal is in the same row as its position
+	int width = textureSize(vertex_animation, 0).x;
+	int texel_a = 2*(frame_a*animation_vertices + gl_VertexID);
+	int texel_b = 2*(frame_b*animation_vertices + gl_VertexID);
+	ivec2 coords_a = ivec2(texel_a % width, texel_a / width);
+	ivec2 coords_b = ivec2(texel_b % width, texel_b / width);
+	vec4 position_a = texelFetch(vertex_animation, coords_a, 0);
+	vec4 normal_a = texelFetch(vertex_animation, coords_a + ivec2(1, 0), 0);
+	vec4 position_b = texelFetch(vertex_animation, coords_b, 0);
+	vec4 normal_b = texelFetch(vertex_animation, coords_b + ivec2(1, 0), 0);
+	float t = frame - float(frame_a);
+	vec3 local_position = mix(position_a.xyz, position_b.xyz, t);
+	vec3 local_normal = mix(normal_a.xyz, normal_b.xyz, t);
+#else
+	vec3 local_position = position;
+	vec3 local_normal = normal;
+#endif
+
+#ifdef INSTANCING
+	vec3 model_position = (instance_transform * vec4(local_position, 1.0)).xyz;
+	vec3 model_normal = mat3(instance_transform) * local_normal;
+#else
+	vec3 model_position = local_position;
+	vec3 model_normal = local_normal;
+#endif
+
+	vec4 pos = model_view_mat * vec4(model_position, 1.0);
 	gl_Position = proj_mat * pos;
-	ex_Normal = normal_mat * normal;
-	ex_View =  -pos.xyz;
-	ex_Light = light_position - pos.xyz;
-}
\ No newline at end of file
+
+	// Light and camera positions are given in model space
+	ex_Normal = model_normal;
+	ex_View = camera_position - model_position;
+#ifdef DIRECTIONAL_LIGHT
+	ex_Light = light_position; // Direction towards the light
+#else
+	ex_Light = light_position - model_position;
+#endif
+#ifdef SHADOWS
+	ex_Depth = -pos.z;
+	ex_World = (view_to_world * pos).xyz;
+#endif
+#ifdef CLUSTERED_LIGHTS
+	// The point lights are given in view space
+	ex_ViewPosition = pos.xyz;
+	ex_ViewNormal = mat3(model_view_mat) * model_normal;
+#endif
+}
@@ -1,21 +1,42 @@
 #version 150
 
-uniform samplerCube cubemap;
+uniform vec3 sh_coefficients[9]; // Irradiance over pi, so it scales the albedo directly
+uniform samplerCube specular_map; // Prefiltered, rougher towards the last level
+uniform float specular_max_lod;
+uniform float roughness;
 uniform vec3 colour;
 
-in vec3 cube_map_coord;
 in vec3 view;
 in vec3 light;
-in vec3 normal;
+in vec3 normal_dir;
 
+/**
+ * Evaluates the irradiance stored as order 2 spherical harmonics
+ */
+vec3 irradiance(vec3 n) {
+	return sh_coefficients[0]
+		+ sh_coefficients[1] * n.y
+		+ sh_coefficients[2] * n.z
+		+ sh_coefficients[3] * n.x
+		+ sh_coefficients[4] * (n.x * n.y)
+		+ sh_coefficients[5] * (n.y * n.z)
+		+ sh_coefficients[6] * (3.0 * n.z * n.z - 1.0)
+		+ sh_coefficients[7] * (n.x * n.z)
+		+ sh_coefficients[8] * (n.x * n.x - n.y * n.y);
+}
 
 void main() {
 	vec3 l = normalize(light);
-    vec3 h = normalize(normalize(view) + l);
-    vec3 n = normalize(normal);
+	vec3 v = normalize(view);
+	vec3 h = normalize(v + l);
+	vec3 n = normalize(normal_dir);
 
 	float spec = pow(max(0.f, dot(h, n)), 128.f);
-	vec4 diffuse = texture(cubemap, cube_map_coord) * dot(l, n);
 
-	gl_FragColor = diffuse * vec4(colour, 1.f) + vec4(spec);
+	// Dielectric Fresnel reflectance, rising towards grazing angles
+	float fresnel = 0.04 + 0.96 * pow(1.0 - max(dot(n, v), 0.0), 5.0);
+	vec3 reflected = textureLod(specular_map, reflect(-v, n), roughness * specular_max_lod).rgb;
+
+	vec3 diffuse = colour * irradiance(n);
+	gl_FragColor = vec4(diffuse * (1.0 - fresnel) + reflected * fresnel + vec3(spec), 1.f);
 }
@@ -8,18 +8,17 @@ uniform vec3 camera_position;
 in vec3 position;
 in vec3 normal;
 
-out vec3 v;
-out vec3 l;
-out vec3 n;
-out vec3 cube_tex_coord;
+// Straight to the fragment shader; there is no geometry stage
+out vec3 view;
+out vec3 light;
+out vec3 normal_dir;
 
 void main() {
 	vec4 pos = model_view_mat * vec4(position, 1.f);
 	gl_Position = proj_mat * pos;
 
-	v = normalize(camera_position - position);
-	l = normalize(light_position - position);
-	n = normalize(normal);
-
-	cube_tex_coord = position;
+	// In model space, which the scene only scales, so it lines up with the environment
+	view = normalize(camera_position - position);
+	light = normalize(light_position - position);
+	normal_dir = normalize(normal);
 }
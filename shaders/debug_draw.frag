@@ -0,0 +1,9 @@
+#version 150
+
+in vec4 colour;
+
+out vec4 res_colour;
+
+void main() {
+	res_colour = colour;
+}
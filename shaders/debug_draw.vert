@@ -0,0 +1,13 @@
+#version 150
+
+uniform mat4 transform; // To clip space
+
+in vec3 position;
+in vec4 color;
+
+out vec4 colour;
+
+void main() {
+	colour = color;
+	gl_Position = transform * vec4(position, 1.0);
+}
@@ -6,7 +6,88 @@ in vec2 tex_coord;
 
 out vec4 res_colour;
 
+#if defined(FXAA) || defined(SHARPEN)
+uniform vec2 texel_size;
+uniform vec2 tex_max; //< Last texel centre inside the rendered part
+
+vec3 sampleRegion(vec2 uv) {
+	return texture2D(texture, min(uv, tex_max)).xyz;
+}
+#endif
+
+#ifdef FXAA
+float luma(vec3 colour) {
+	return dot(colour, vec3(0.299, 0.587, 0.114));
+}
+
+// A compact FXAA: finds the local edge direction from the luma of the
+// four diagonal neighbours, and blurs along it, never across it
+vec3 fxaa(vec2 uv) {
+	const float reduce_min = 1.0/128.0;
+	const float reduce_mul = 1.0/8.0;
+	const float span_max = 8.0;
+
+	vec3 rgb_nw = sampleRegion(uv + vec2(-1.0, -1.0)*texel_size);
+	vec3 rgb_ne = sampleRegion(uv + vec2(1.0, -1.0)*texel_size);
+	vec3 rgb_sw = sampleRegion(uv + vec2(-1.0, 1.0)*texel_size);
+	vec3 rgb_se = sampleRegion(uv + vec2(1.0, 1.0)*texel_size);
+	vec3 rgb_m = sampleRegion(uv);
+
+	float luma_nw = luma(rgb_nw);
+	float luma_ne = luma(rgb_ne);
+	float luma_sw = luma(rgb_sw);
+	float luma_se = luma(rgb_se);
+	float luma_m = luma(rgb_m);
+	float luma_min = min(luma_m, min(min(luma_nw, luma_ne), min(luma_sw, luma_se)));
+	float luma_max = max(luma_m, max(max(luma_nw, luma_ne), max(luma_sw, luma_se)));
+
+	vec2 direction = vec2(-((luma_nw + luma_ne) - (luma_sw + luma_se)), (luma_nw + luma_sw) - (luma_ne + luma_se));
+	float reduce = max((luma_nw + luma_ne + luma_sw + luma_se)*0.25*reduce_mul, reduce_min);
+	float scale = 1.0/(min(abs(direction.x), abs(direction.y)) + reduce);
+	direction = clamp(direction*scale, vec2(-span_max), vec2(span_max))*texel_size;
+
+	vec3 rgb_a = 0.5*(sampleRegion(uv + direction*(1.0/3.0 - 0.5))
+		+ sampleRegion(uv + direction*(2.0/3.0 - 0.5)));
+	vec3 rgb_b = 0.5*rgb_a + 0.25*(sampleRegion(uv - 0.5*direction)
+		+ sampleRegion(uv + 0.5*direction));
+
+	// The wider blur overshot if it picked up colours outside the local range
+	float luma_b = luma(rgb_b);
+	if (luma_b < luma_min || luma_b > luma_max)
+		return rgb_a;
+	return rgb_b;
+}
+#endif
+
+#ifdef SHARPEN
+const float sharpness = 0.5; //< 0 to 1
+
+// Contrast adaptive sharpening of the bilinearly upscaled image. The
+// neighbours are one source texel away, and the weight shrinks where
+// the neighbourhood already has a lot of contrast, to avoid ringing
+vec3 sharpen(vec2 uv) {
+	vec3 centre = sampleRegion(uv);
+	vec3 north = sampleRegion(uv + vec2(0.0, texel_size.y));
+	vec3 south = sampleRegion(uv - vec2(0.0, texel_size.y));
+	vec3 east = sampleRegion(uv + vec2(texel_size.x, 0.0));
+	vec3 west = sampleRegion(uv - vec2(texel_size.x, 0.0));
+
+	vec3 min_rgb = min(centre, min(min(north, south), min(east, west)));
+	vec3 max_rgb = max(centre, max(max(north, south), max(east, west)));
+	vec3 amount = sqrt(clamp(min(min_rgb, 1.0 - max_rgb)/max(max_rgb, vec3(1.0/256.0)), 0.0, 1.0));
+	vec3 weight = -amount/mix(8.0, 5.0, sharpness);
+
+	return clamp((centre + (north + south + east + west)*weight)/(1.0 + 4.0*weight), 0.0, 1.0);
+}
+#endif
+
 void main(){
+#if defined(FXAA)
+	res_colour = vec4(fxaa(tex_coord.xy), 1.0);
+#elif defined(SHARPEN)
+	res_colour = vec4(sharpen(tex_coord.xy), 1.0);
+#else
 	vec4 colour = texture2D(texture, tex_coord.xy);
 	res_colour = vec4(colour.xyz, 0.8f);
-}
\ No newline at end of file
+#endif
+}
@@ -1,6 +1,7 @@
 #version 150
 
 uniform mat3 transform;
+uniform vec2 tex_scale; //< Part of the texture to show
 
 in vec2 position;
 
@@ -11,5 +12,5 @@ void main(){
 
 	gl_Position = vec4(new_pos.x, new_pos.y, 0.5, 1.0);;
 
-	tex_coord = 0.5*position + vec2(0.5);
+	tex_coord = (0.5*position + vec2(0.5))*tex_scale;
 }
\ No newline at end of file
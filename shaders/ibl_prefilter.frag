@@ -0,0 +1,75 @@
+#version 150
+
+uniform samplerCube environment; // With a full mip chain
+uniform int face; // In the order of the cube map targets
+uniform float roughness;
+uniform float environment_size; // Texels across a face of level 0
+uniform int num_samples;
+
+in vec2 ex_Face;
+out vec4 res_Color;
+
+const float pi = 3.14159265;
+
+/**
+ * Direction through a point on a face, as OpenGL maps cube map texels
+ */
+vec3 faceDirection(int face, vec2 uv) {
+	if (face == 0) return vec3(1.0, -uv.y, -uv.x);
+	if (face == 1) return vec3(-1.0, -uv.y, uv.x);
+	if (face == 2) return vec3(uv.x, 1.0, uv.y);
+	if (face == 3) return vec3(uv.x, -1.0, -uv.y);
+	if (face == 4) return vec3(uv.x, -uv.y, 1.0);
+	return vec3(-uv.x, -uv.y, -1.0);
+}
+
+vec2 hammersley(int i, int n) {
+	uint bits = uint(i);
+	bits = (bits << 16u) | (bits >> 16u);
+	bits = ((bits & 0x55555555u) << 1u) | ((bits & 0xAAAAAAAAu) >> 1u);
+	bits = ((bits & 0x33333333u) << 2u) | ((bits & 0xCCCCCCCCu) >> 2u);
+	bits = ((bits & 0x0F0F0F0Fu) << 4u) | ((bits & 0xF0F0F0F0u) >> 4u);
+	bits = ((bits & 0x00FF00FFu) << 8u) | ((bits & 0xFF00FF00u) >> 8u);
+	return vec2(float(i) / float(n), float(bits) * 2.3283064365386963e-10);
+}
+
+void main() {
+	// The usual split sum approximation: view and reflection along the normal
+	vec3 n = normalize(faceDirection(face, ex_Face));
+	if (roughness <= 0.0) {
+		res_Color = vec4(textureLod(environment, n, 0.0).rgb, 1.0);
+		return;
+	}
+
+	vec3 up = abs(n.z) < 0.999 ? vec3(0.0, 0.0, 1.0) : vec3(1.0, 0.0, 0.0);
+	vec3 tangent = normalize(cross(up, n));
+	vec3 bitangent = cross(n, tangent);
+
+	float a = roughness * roughness;
+	float texel_solid_angle = 4.0 * pi / (6.0 * environment_size * environment_size);
+	vec3 colour = vec3(0.0);
+	float total_weight = 0.0;
+	for (int i = 0; i < num_samples; ++i) {
+		// GGX importance sampling of the half vector
+		vec2 xi = hammersley(i, num_samples);
+		float cos_theta = sqrt((1.0 - xi.y) / (1.0 + (a * a - 1.0) * xi.y));
+		float sin_theta = sqrt(1.0 - cos_theta * cos_theta);
+		float phi = 2.0 * pi * xi.x;
+		vec3 h = normalize(tangent * (sin_theta * cos(phi)) + bitangent * (sin_theta * sin(phi)) + n * cos_theta);
+		vec3 l = 2.0 * dot(n, h) * h - n;
+
+		float n_dot_l = dot(n, l);
+		if (n_dot_l <= 0.0)
+			continue;
+
+		// Sample a blurrier level where samples are sparse, so few samples do not alias
+		float d = (cos_theta * cos_theta) * (a * a - 1.0) + 1.0;
+		float pdf = (a * a) / (pi * d * d) / 4.0;
+		float sample_solid_angle = 1.0 / (float(num_samples) * pdf);
+		float lod = 0.5 * log2(sample_solid_angle / texel_solid_angle) + 1.0;
+
+		colour += textureLod(environment, l, max(lod, 0.0)).rgb * n_dot_l;
+		total_weight += n_dot_l;
+	}
+	res_Color = vec4(colour / max(total_weight, 0.0001), 1.0);
+}
@@ -0,0 +1,10 @@
+#version 150
+
+out vec2 ex_Face; // Position on the cube face, from -1 to 1
+
+void main() {
+	// One triangle covering the viewport, without any vertex buffer
+	vec2 corner = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+	ex_Face = corner * 2.0 - 1.0;
+	gl_Position = vec4(ex_Face, 0.0, 1.0);
+}
@@ -0,0 +1,13 @@
+#version 150
+
+in vec2 ex_Corner;
+in vec4 ex_Color;
+
+out vec4 res_Color;
+
+void main() {
+	// Round and soft, fading out with age. Blending is additive, so
+	// the order of the particles does not matter
+	float falloff = max(1.0 - dot(ex_Corner, ex_Corner), 0.0);
+	res_Color = vec4(ex_Color.rgb * (ex_Color.a * falloff), 1.0);
+}
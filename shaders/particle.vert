@@ -0,0 +1,33 @@
+#version 150
+
+#define MAX_EMITTERS 16
+
+uniform mat4 view_mat;
+uniform mat4 proj_mat;
+uniform vec4 emitter_appearances[MAX_EMITTERS]; // Colour, and half the width of the quads
+uniform float emitter_lifetimes[MAX_EMITTERS];
+
+in vec2 corner; // Of the quad, the same for all particles
+
+// One per instance
+in vec4 position_age;
+in vec4 velocity_emitter;
+
+out vec2 ex_Corner;
+out vec4 ex_Color;
+
+void main() {
+	int emitter = int(velocity_emitter.w);
+	vec4 appearance = emitter_appearances[emitter];
+	float life = position_age.w / emitter_lifetimes[emitter];
+
+	// Particles that are not yet born collapse to a point, which covers no pixels
+	float size = (life >= 0.0 && life < 1.0) ? appearance.w : 0.0;
+
+	// Offset in view space, so the quad faces the camera
+	vec4 center = view_mat * vec4(position_age.xyz, 1.0);
+	gl_Position = proj_mat * (center + vec4(corner * size, 0.0, 0.0));
+
+	ex_Corner = corner;
+	ex_Color = vec4(appearance.rgb, 1.0 - life);
+}
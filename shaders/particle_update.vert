@@ -0,0 +1,58 @@
+#version 150
+
+#define MAX_EMITTERS 16
+
+uniform mat4 emitter_transforms[MAX_EMITTERS]; // From emitter to world space
+uniform vec4 emitter_velocities[MAX_EMITTERS]; // Velocity of new particles in emitter space, and random spread
+uniform float emitter_lifetimes[MAX_EMITTERS];
+uniform vec3 gravity;
+uniform float dt;
+uniform uint seed;
+
+in vec4 position_age; // In world space, and seconds since birth
+in vec4 velocity_emitter; // Emitter index in w
+
+// Captured with transform feedback
+out vec4 out_position_age;
+out vec4 out_velocity_emitter;
+
+uint hash(uint x) {
+	x ^= x >> 16u;
+	x *= 0x7feb352du;
+	x ^= x >> 15u;
+	x *= 0x846ca68bu;
+	x ^= x >> 16u;
+	return x;
+}
+
+// Uniform in [-1, 1] for every component
+vec3 random3(uint x) {
+	uvec3 bits = uvec3(hash(x), hash(x ^ 0x9e3779b9u), hash(x ^ 0x7f4a7c15u));
+	return vec3(bits) * (2.0 / 4294967295.0) - 1.0;
+}
+
+void main() {
+	int emitter = int(velocity_emitter.w);
+	float lifetime = emitter_lifetimes[emitter];
+	float age = position_age.w + dt;
+	vec3 position = position_age.xyz;
+	vec3 velocity = velocity_emitter.xyz;
+
+	// Particles are born when their countdown runs out, and again
+	// every lifetime after that
+	if (age >= lifetime || (position_age.w < 0.0 && age >= 0.0)) {
+		age = mod(age, lifetime);
+		mat4 transform = emitter_transforms[emitter];
+		vec4 emitted = emitter_velocities[emitter];
+		vec3 random = random3(uint(gl_VertexID) * 0x9e3779b1u + hash(seed));
+		position = transform[3].xyz;
+		velocity = mat3(transform) * (emitted.xyz + random * emitted.w);
+	}
+	else if (age >= 0.0) {
+		velocity += gravity * dt;
+		position += velocity * dt;
+	}
+
+	out_position_age = vec4(position, age);
+	out_velocity_emitter = vec4(velocity, velocity_emitter.w);
+}
@@ -0,0 +1,10 @@
+#version 150
+
+uniform mat4 model_mat;
+
+in vec3 position;
+
+void main() {
+	// To world space, the geometry shader projects onto each face
+	gl_Position = model_mat * vec4(position, 1.0);
+}
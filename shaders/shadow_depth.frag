@@ -0,0 +1,5 @@
+#version 130
+
+void main() {
+	// Only depth is written
+}
@@ -0,0 +1,11 @@
+#version 150
+
+uniform samplerCube cubemap;
+
+in vec3 direction;
+
+out vec4 res_colour;
+
+void main() {
+	res_colour = texture(cubemap, direction);
+}
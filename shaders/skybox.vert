@@ -0,0 +1,14 @@
+#version 150
+
+uniform mat4 rotation_projection; // Projection times view, without the translation
+
+in vec3 position;
+
+out vec3 direction;
+
+void main() {
+	direction = position;
+
+	// w as depth ends up at the far plane after the perspective divide
+	gl_Position = (rotation_projection * vec4(position, 1.0)).xyww;
+}
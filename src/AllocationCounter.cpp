@@ -0,0 +1,45 @@
+#include "AllocationCounter.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#ifdef _DEBUG
+
+namespace {
+	std::atomic<unsigned long> allocation_count(0);
+}
+
+void* operator new(size_t size) {
+	allocation_count.fetch_add(1, std::memory_order_relaxed);
+	void* memory = malloc(size > 0 ? size : 1);
+	if (memory == nullptr)
+		throw std::bad_alloc();
+	return memory;
+}
+
+void operator delete(void* memory) noexcept {
+	free(memory);
+}
+
+// The array versions default to calling the ones above
+
+bool AllocationCounter::isEnabled() {
+	return true;
+}
+
+unsigned long AllocationCounter::getCount() {
+	return allocation_count.load(std::memory_order_relaxed);
+}
+
+#else
+
+bool AllocationCounter::isEnabled() {
+	return false;
+}
+
+unsigned long AllocationCounter::getCount() {
+	return 0;
+}
+
+#endif
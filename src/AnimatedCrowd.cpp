@@ -0,0 +1,170 @@
+#include "AnimatedCrowd.h"
+
+#include <cmath>
+#include <sstream>
+
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/type_ptr.hpp>
+
+#include "Timer.h"
+
+namespace {
+	/**
+	 * Seconds into a looping clip, wrapped in double precision so that
+	 * the animation does not start to stutter after running for hours
+	 */
+	inline float getClipTime(double time, float duration) {
+		return (duration > 0.0f) ? static_cast<float>(std::fmod(time, static_cast<double>(duration))) : 0.0f;
+	}
+}
+
+AnimatedCrowd::AnimatedCrowd(Model* model, JobSystem* job_system, GLUtils::Program& program, unsigned int max_characters,
+		GLenum palette_unit) : model(model), skeleton(model->getSkeleton()), job_system(job_system), max_characters(max_characters),
+		palette_unit(palette_unit), palette_offset(0), transforms_changed(false), colour(0.8f, 0.6f, 0.4f), update_time(0.0) {
+	if (skeleton == NULL)
+		THROW_EXCEPTION("An animated crowd needs a model with a skeleton");
+
+	// Three texels per bone, and three regions in flight
+	const unsigned int palette_bytes = max_characters*skeleton->getNumBones()*Skeleton::floats_per_bone*sizeof(float);
+	GLint max_texels = 0;
+	glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &max_texels);
+	if (3*static_cast<size_t>(palette_bytes)/16 > static_cast<size_t>(max_texels)) {
+		std::stringstream err;
+		err << "The palettes of " << max_characters << " characters with " << skeleton->getNumBones()
+			<< " bones do not fit in a texture buffer of " << max_texels << " texels";
+		THROW_EXCEPTION(err.str());
+	}
+	palettes.reset(new GLUtils::StreamingBuffer<GL_TEXTURE_BUFFER>(palette_bytes));
+	glGenTextures(1, &palette_texture);
+	glBindTexture(GL_TEXTURE_BUFFER, palette_texture);
+	glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, palettes->name());
+	glBindTexture(GL_TEXTURE_BUFFER, 0);
+
+	unsigned int num_threads = job_system ? job_system->getNumThreads() : 1;
+	thread_poses.resize(2*num_threads);
+
+	instances.reset(new GLUtils::VBO<GL_ARRAY_BUFFER>(NULL, max_characters*sizeof(glm::mat4)));
+
+	const GLsizei bone_stride = 2*Skeleton::max_influences;
+	glGenVertexArrays(1, &vao);
+	glBindVertexArray(vao);
+	model->getVertices()->bind();
+	program.setAttributePointer("position", 3);
+	model->getNormals()->bind();
+	program.setAttributePointer("normal", 3);
+	model->getBones()->bind();
+	program.setAttributePointer("bone_indices", Skeleton::max_influences, GL_UNSIGNED_BYTE, GL_FALSE, bone_stride, NULL);
+	program.setAttributePointer("bone_weights", Skeleton::max_influences, GL_UNSIGNED_BYTE, GL_TRUE, bone_stride,
+		reinterpret_cast<GLvoid*>(Skeleton::max_influences));
+
+	// A mat4 attribute is four columns at consecutive locations
+	instances->bind();
+	GLint transform_location = glGetAttribLocation(program.name, "instance_transform");
+	for (GLint i=0; i<4; ++i) {
+		glVertexAttribPointer(transform_location + i, 4, GL_FLOAT, GL_FALSE, sizeof(glm::mat4), reinterpret_cast<GLvoid*>(i*sizeof(glm::vec4)));
+		glEnableVertexAttribArray(transform_location + i);
+		glVertexAttribDivisor(transform_location + i, 1);
+	}
+	glBindVertexArray(0);
+	GLUtils::VBO<GL_ARRAY_BUFFER>::unbind();
+	CHECK_GL_ERROR();
+}
+
+AnimatedCrowd::~AnimatedCrowd() {
+	glDeleteVertexArrays(1, &vao);
+	glDeleteTextures(1, &palette_texture);
+}
+
+unsigned int AnimatedCrowd::addCharacter(const Character& character) {
+	if (characters.size() == max_characters) {
+		std::stringstream err;
+		err << "The crowd can have at most " << max_characters << " characters";
+		THROW_EXCEPTION(err.str());
+	}
+	// Without clips, characters stand in the bind pose
+	const std::vector<Skeleton::Clip>& clips = skeleton->getClips();
+	if (!clips.empty() && (character.clip >= clips.size() || character.blend_clip >= clips.size()))
+		THROW_EXCEPTION("The character plays a clip the skeleton does not have");
+
+	characters.push_back(character);
+	transforms_changed = true;
+	return static_cast<unsigned int>(characters.size() - 1);
+}
+
+void AnimatedCrowd::update(double time) {
+	if (characters.empty())
+		return;
+	Timer update_timer;
+
+	const unsigned int floats_per_character = skeleton->getNumBones()*Skeleton::floats_per_bone;
+	palettes->begin();
+	float* data = static_cast<float*>(palettes->allocate(characters.size()*floats_per_character*sizeof(float), palette_offset));
+
+	// The palettes go straight into the mapped buffer. Each thread has
+	// its own poses, so nothing is allocated once they have grown
+	const std::vector<Skeleton::Clip>& clips = skeleton->getClips();
+	JobSystem::RangeFunction pose_characters = [&](unsigned int begin, unsigned int end, unsigned int thread_index) {
+		Skeleton::Pose& pose = thread_poses[2*thread_index];
+		Skeleton::Pose& blend_pose = thread_poses[2*thread_index + 1];
+		for (unsigned int i=begin; i<end; ++i) {
+			const Character& character = characters[i];
+			double character_time = time*character.speed + character.time_offset;
+			if (clips.empty()) {
+				skeleton->getBindPose(pose);
+			}
+			else {
+				skeleton->samplePose(character.clip, getClipTime(character_time, clips[character.clip].duration), pose);
+				if (character.blend_weight > 0.0f) {
+					const Skeleton::Clip& blend_clip = clips[character.blend_clip];
+					skeleton->samplePose(character.blend_clip, getClipTime(character_time, blend_clip.duration), blend_pose);
+					Skeleton::blendPoses(pose, blend_pose, character.blend_weight, pose);
+				}
+			}
+			skeleton->computePalette(pose, data + i*floats_per_character);
+		}
+	};
+	static const unsigned int grain = 16;
+	if (job_system)
+		job_system->parallelFor(static_cast<unsigned int>(characters.size()), grain, pose_characters);
+	else
+		pose_characters(0, static_cast<unsigned int>(characters.size()), 0);
+
+	palettes->end();
+	update_time = update_timer.elapsed();
+}
+
+void AnimatedCrowd::render(GLUtils::Program& program, const glm::mat4& view, const glm::mat4& projection, const glm::vec3& light_position) {
+	if (characters.empty())
+		return;
+
+	if (transforms_changed) {
+		instances->bind();
+		for (size_t i=0; i<characters.size(); ++i)
+			glBufferSubData(GL_ARRAY_BUFFER, i*sizeof(glm::mat4), sizeof(glm::mat4), glm::value_ptr(characters[i].transform));
+		GLUtils::VBO<GL_ARRAY_BUFFER>::unbind();
+		transforms_changed = false;
+	}
+
+	// The instance transforms take the characters to world space, which
+	// is the space the lighting of the variant works in
+	GLuint name = program.name;
+	glm::vec3 camera_position = glm::vec3(glm::inverse(view)[3]);
+	glProgramUniformMatrix4fv(name, glGetUniformLocation(name, "proj_mat"), 1, 0, glm::value_ptr(projection));
+	glProgramUniformMatrix4fv(name, glGetUniformLocation(name, "model_view_mat"), 1, 0, glm::value_ptr(view));
+	glProgramUniform3fv(name, glGetUniformLocation(name, "light_position"), 1, glm::value_ptr(light_position));
+	glProgramUniform3fv(name, glGetUniformLocation(name, "camera_position"), 1, glm::value_ptr(camera_position));
+	glProgramUniform3fv(name, glGetUniformLocation(name, "colour"), 1, glm::value_ptr(colour));
+	glProgramUniform1i(name, glGetUniformLocation(name, "bone_palette"), palette_unit - GL_TEXTURE0);
+	glProgramUniform1i(name, glGetUniformLocation(name, "num_bones"), skeleton->getNumBones());
+	glProgramUniform1i(name, glGetUniformLocation(name, "palette_offset"), static_cast<GLint>(palette_offset / 16));
+
+	glActiveTexture(palette_unit);
+	glBindTexture(GL_TEXTURE_BUFFER, palette_texture);
+	glActiveTexture(GL_TEXTURE0);
+
+	program.use();
+	glBindVertexArray(vao);
+	glDrawArraysInstanced(GL_TRIANGLES, 0, model->getNumVertices(), static_cast<GLsizei>(characters.size()));
+	glBindVertexArray(0);
+	program.disuse();
+}
@@ -0,0 +1,334 @@
+#include "Benchmarks.h"
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <future>
+#include <algorithm>
+#include <random>
+
+#include <GL/glew.h>
+#include <SDL.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtx/transform.hpp>
+
+#include "Timer.h"
+#include "JobSystem.h"
+#include "Frustum.h"
+#include "TransformBatch.h"
+#include "GLUtils/GLUtils.hpp"
+
+namespace {
+	/**
+	 * Busy work taking roughly the given number of seconds,
+	 * without touching memory or sleeping
+	 */
+	unsigned int spin(double seconds, double iterations_per_second) {
+		unsigned int x = 1;
+		unsigned int iterations = static_cast<unsigned int>(seconds * iterations_per_second);
+		for (unsigned int i=0; i<iterations; ++i)
+			x = x*1664525u + 1013904223u;
+		return x;
+	}
+
+	double calibrateSpin() {
+		const double probe = 1e8;
+		Timer timer;
+		volatile unsigned int sink = spin(1.0, probe);
+		(void) sink;
+		return probe / timer.elapsed();
+	}
+
+	void printRow(const char* method, double task_time, unsigned int tasks, double elapsed, unsigned int threads) {
+		// Ideal time if the work was perfectly spread over all threads
+		double ideal = task_time * tasks / threads;
+		std::cout << std::setw(14) << method
+			<< std::setw(10) << task_time*1e6 << " us"
+			<< std::setw(8) << tasks << " tasks"
+			<< std::setw(12) << elapsed*1e3 << " ms"
+			<< std::setw(10) << ideal / elapsed * 100.0 << " % efficiency" << std::endl;
+	}
+
+	// Interface blocks match by block name, so the fragment shader
+	// works with and without the geometry stage in between
+	const char* grid_vs =
+		"#version 150\n"
+		"in vec2 position;\n"
+		"out Vertex { vec3 colour; } vertex_out;\n"
+		"void main() {\n"
+		"	vertex_out.colour = vec3(0.5*position + 0.5, 1.0);\n"
+		"	gl_Position = vec4(position, 0.0, 1.0);\n"
+		"}\n";
+	const char* passthrough_gs =
+		"#version 150\n"
+		"layout(triangles) in;\n"
+		"layout(triangle_strip, max_vertices = 3) out;\n"
+		"in Vertex { vec3 colour; } vertex_in[];\n"
+		"out Vertex { vec3 colour; } vertex_out;\n"
+		"void main() {\n"
+		"	for (int i = 0; i < gl_in.length(); i++) {\n"
+		"		vertex_out.colour = vertex_in[i].colour;\n"
+		"		gl_Position = gl_in[i].gl_Position;\n"
+		"		EmitVertex();\n"
+		"	}\n"
+		"	EndPrimitive();\n"
+		"}\n";
+	const char* grid_fs =
+		"#version 150\n"
+		"in Vertex { vec3 colour; } vertex_in;\n"
+		"out vec4 res_colour;\n"
+		"void main() {\n"
+		"	res_colour = vec4(vertex_in.colour, 1.0);\n"
+		"}\n";
+
+	/**
+	 * @return Seconds per frame drawing num_vertices with the program
+	 */
+	double timeGrid(GLUtils::Program& program, unsigned int num_vertices, unsigned int frames) {
+		program.use();
+		program.setAttributePointer("position", 2);
+
+		// One frame to get shader compilation and such out of the way
+		glClear(GL_COLOR_BUFFER_BIT);
+		glDrawArrays(GL_TRIANGLES, 0, num_vertices);
+		glFinish();
+
+		Timer timer;
+		for (unsigned int i=0; i<frames; ++i) {
+			glClear(GL_COLOR_BUFFER_BIT);
+			glDrawArrays(GL_TRIANGLES, 0, num_vertices);
+		}
+		glFinish();
+		double elapsed = timer.elapsed();
+
+		program.disuse();
+		return elapsed / frames;
+	}
+}
+
+bool Benchmarks::run(const std::string& name) {
+	if (name == "jobs")
+		jobSystem();
+	else if (name == "geometry_shader")
+		geometryShader();
+	else if (name == "transforms")
+		transforms();
+	else
+		return false;
+	return true;
+}
+
+void Benchmarks::jobSystem() {
+	const double task_times[] = { 1e-6, 1e-5, 1e-4, 1e-3 };
+	const double total_work = 0.5; // seconds of single threaded work per run
+
+	double iterations_per_second = calibrateSpin();
+	JobSystem job_system;
+	unsigned int threads = job_system.getNumThreads();
+	std::cout << std::fixed << std::setprecision(2);
+	std::cout << "Job system benchmark on " << threads << " threads" << std::endl;
+
+	for (size_t t=0; t<sizeof(task_times)/sizeof(task_times[0]); ++t) {
+		double task_time = task_times[t];
+		unsigned int tasks = static_cast<unsigned int>(total_work / task_time);
+		std::vector<unsigned int> results(tasks);
+		Timer timer;
+
+		// One job per task, all independent
+		{
+			std::vector<JobSystem::JobHandle> jobs;
+			jobs.reserve(tasks);
+			timer.restart();
+			for (unsigned int i=0; i<tasks; ++i)
+				jobs.push_back(job_system.submit([&results, i, task_time, iterations_per_second]() {
+					results[i] = spin(task_time, iterations_per_second);
+				}));
+			for (unsigned int i=0; i<tasks; ++i)
+				job_system.wait(jobs[i]);
+			printRow("submit", task_time, tasks, timer.elapsed(), threads);
+		}
+
+		// The same tasks as a loop, one task per index
+		timer.restart();
+		job_system.parallelFor(tasks, 1, [&](unsigned int begin, unsigned int end, unsigned int) {
+			for (unsigned int i=begin; i<end; ++i)
+				results[i] = spin(task_time, iterations_per_second);
+		});
+		printRow("parallelFor", task_time, tasks, timer.elapsed(), threads);
+
+		// std::async starts a thread per task on most platforms, so cap
+		// the number in flight to keep the machine responsive
+		{
+			std::vector<std::future<void> > futures;
+			futures.reserve(tasks);
+			timer.restart();
+			for (unsigned int i=0; i<tasks; ++i) {
+				if (futures.size() >= 4*threads) {
+					for (size_t j=0; j<futures.size(); ++j)
+						futures[j].get();
+					futures.clear();
+				}
+				futures.push_back(std::async(std::launch::async, [&results, i, task_time, iterations_per_second]() {
+					results[i] = spin(task_time, iterations_per_second);
+				}));
+			}
+			for (size_t j=0; j<futures.size(); ++j)
+				futures[j].get();
+			printRow("std::async", task_time, tasks, timer.elapsed(), threads);
+		}
+	}
+}
+
+void Benchmarks::geometryShader() {
+	const unsigned int grid_size = 1024; // Quads per side, two triangles each, about a pixel each
+	const unsigned int frames = 5;
+	const int size = 1024;
+
+	if (SDL_Init(SDL_INIT_VIDEO) < 0)
+		THROW_EXCEPTION("SDL_Init failed");
+	SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 3);
+	SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 3);
+	SDL_Window* window = SDL_CreateWindow("Benchmark", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
+		64, 64, SDL_WINDOW_OPENGL | SDL_WINDOW_HIDDEN);
+	if (!window)
+		THROW_EXCEPTION("SDL_CreateWindow failed");
+	SDL_GLContext context = SDL_GL_CreateContext(window);
+
+	glewExperimental = GL_TRUE;
+	if (glewInit() != GLEW_OK)
+		THROW_EXCEPTION("Error initializing GLEW");
+	glGetError();
+
+	std::cout << std::fixed << std::setprecision(2);
+	std::cout << "Geometry shader benchmark on " << glGetString(GL_RENDERER) << std::endl;
+	std::cout << "(set LIBGL_ALWAYS_SOFTWARE=1 to run on llvmpipe with Mesa)" << std::endl;
+
+	{
+		// Render off screen, so the window size does not matter
+		GLuint fbo, colour_buffer;
+		glGenFramebuffers(1, &fbo);
+		glGenRenderbuffers(1, &colour_buffer);
+		glBindRenderbuffer(GL_RENDERBUFFER, colour_buffer);
+		glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, size, size);
+		glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, colour_buffer);
+		CHECK_GL_FBO_COMPLETENESS();
+		glViewport(0, 0, size, size);
+		glDisable(GL_DEPTH_TEST);
+		glDisable(GL_CULL_FACE);
+
+		// Small triangles covering the whole viewport
+		std::vector<float> vertices;
+		vertices.reserve(grid_size*grid_size*12);
+		float step = 2.0f / grid_size;
+		for (unsigned int y=0; y<grid_size; ++y) {
+			for (unsigned int x=0; x<grid_size; ++x) {
+				float x0 = -1.0f + x*step, y0 = -1.0f + y*step;
+				float quad[] = { x0, y0, x0+step, y0, x0, y0+step, x0+step, y0, x0+step, y0+step, x0, y0+step };
+				vertices.insert(vertices.end(), quad, quad + 12);
+			}
+		}
+		unsigned int num_vertices = static_cast<unsigned int>(vertices.size() / 2);
+		double triangles = num_vertices / 3.0;
+
+		GLuint vao;
+		glGenVertexArrays(1, &vao);
+		glBindVertexArray(vao);
+		GLUtils::VBO<GL_ARRAY_BUFFER> vbo(vertices.data(), static_cast<unsigned int>(vertices.size()*sizeof(float)));
+		vbo.bind();
+
+		GLUtils::Program vertex_fragment(grid_vs, grid_fs);
+		GLUtils::Program with_geometry(grid_vs, passthrough_gs, grid_fs);
+
+		double vf_time = timeGrid(vertex_fragment, num_vertices, frames);
+		double gs_time = timeGrid(with_geometry, num_vertices, frames);
+
+		std::cout << std::setw(24) << "vertex+fragment" << std::setw(10) << vf_time*1e3 << " ms/frame"
+			<< std::setw(10) << triangles / vf_time * 1e-6 << " Mtris/s" << std::endl;
+		std::cout << std::setw(24) << "pass-through geometry" << std::setw(10) << gs_time*1e3 << " ms/frame"
+			<< std::setw(10) << triangles / gs_time * 1e-6 << " Mtris/s" << std::endl;
+		std::cout << "The geometry stage costs " << (gs_time / vf_time - 1.0) * 100.0 << " % extra" << std::endl;
+
+		vbo.unbind();
+		glBindVertexArray(0);
+		glDeleteVertexArrays(1, &vao);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		glDeleteRenderbuffers(1, &colour_buffer);
+		glDeleteFramebuffers(1, &fbo);
+		CHECK_GL_ERROR();
+	}
+
+	SDL_GL_DeleteContext(context);
+	SDL_DestroyWindow(window);
+	SDL_Quit();
+}
+
+void Benchmarks::transforms() {
+	const unsigned int num_parts = 100000;
+	const unsigned int repetitions = 20;
+
+	// Random rotations, scales and translations, like a scene graph
+	std::mt19937 generator(1234);
+	std::uniform_real_distribution<float> random(-1.0f, 1.0f);
+	std::vector<glm::mat4> part_transforms(num_parts);
+	std::vector<glm::vec3> centers(num_parts);
+	TransformBatch batch;
+	batch.resize(num_parts);
+	for (unsigned int i=0; i<num_parts; ++i) {
+		glm::vec3 axis = glm::normalize(glm::vec3(random(generator), random(generator), random(generator)) + glm::vec3(0.0f, 0.0f, 2.0f));
+		part_transforms[i] = glm::translate(glm::vec3(random(generator), random(generator), random(generator)) * 10.0f)
+			* glm::rotate(random(generator) * 180.0f, axis) * glm::scale(glm::vec3(1.5f + random(generator)));
+		centers[i] = glm::vec3(random(generator), random(generator), random(generator));
+		batch.set(i, part_transforms[i], centers[i], 1.0f);
+	}
+	glm::mat4 model = glm::scale(glm::vec3(0.5f));
+	glm::mat4 view = glm::lookAt(glm::vec3(0.0f, 5.0f, 20.0f), glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+	glm::vec3 light_position(10.0f, 0.0f, 0.0f);
+
+	std::vector<TransformBatch::Result> results(num_parts);
+	std::cout << std::fixed << std::setprecision(2);
+	std::cout << "Transforms of " << num_parts << " parts, best of " << repetitions << " runs" << std::endl;
+
+	// What recordDrawList did before batching
+	double glm_time = 1e9;
+	for (unsigned int r=0; r<repetitions; ++r) {
+		Timer timer;
+		for (unsigned int i=0; i<num_parts; ++i) {
+			TransformBatch::Result& result = results[i];
+			glm::mat4 model_matrix = model * part_transforms[i];
+			glm::mat4 model_view = view * model_matrix;
+			glm::mat4 model_inverse = glm::inverse(model_matrix);
+			glm::mat4 model_view_inverse = glm::inverse(model_view);
+			result.model_view = model_view;
+			result.view_center = glm::vec3(model_view * glm::vec4(centers[i], 1.0f));
+			result.view_radius = Frustum::getMaxScale(model_view);
+			result.light_position = glm::mat3(model_inverse) * light_position / model_inverse[3].w;
+			result.camera_position = glm::vec3(model_view_inverse[3] / model_view_inverse[3].w);
+		}
+		glm_time = std::min(glm_time, timer.elapsed());
+	}
+	glm::vec3 reference = results[num_parts / 2].camera_position;
+
+	double scalar_time = 1e9;
+	for (unsigned int r=0; r<repetitions; ++r) {
+		Timer timer;
+		batch.computeScalar(model, view, light_position, 0, num_parts, results.data());
+		scalar_time = std::min(scalar_time, timer.elapsed());
+	}
+
+	double simd_time = 1e9;
+	for (unsigned int r=0; r<repetitions; ++r) {
+		Timer timer;
+		batch.compute(model, view, light_position, 0, num_parts, results.data());
+		simd_time = std::min(simd_time, timer.elapsed());
+	}
+	float difference = glm::length(results[num_parts / 2].camera_position - reference) / glm::length(reference);
+
+	std::cout << std::setw(24) << "glm mat4 + inverse" << std::setw(10) << glm_time*1e9 / num_parts << " ns/part" << std::endl;
+	std::cout << std::setw(24) << "batch scalar" << std::setw(10) << scalar_time*1e9 / num_parts << " ns/part"
+		<< std::setw(10) << glm_time / scalar_time << "x" << std::endl;
+	std::cout << std::setw(24) << "batch SIMD" << std::setw(10) << simd_time*1e9 / num_parts << " ns/part"
+		<< std::setw(10) << glm_time / simd_time << "x" << std::endl;
+	std::cout << "Relative difference from glm: " << std::scientific << difference << std::endl;
+}
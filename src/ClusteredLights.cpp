@@ -0,0 +1,180 @@
+#include "ClusteredLights.h"
+
+#include <cmath>
+#include <algorithm>
+
+#include "GLUtils/GLUtils.hpp"
+
+ClusteredLights::ClusteredLights(JobSystem* job_system, unsigned int tiles_x, unsigned int tiles_y, unsigned int slices,
+		GLenum first_unit) : job_system(job_system), tiles_x(tiles_x), tiles_y(tiles_y), slices(slices), first_unit(first_unit) {
+	z_near = 1.0f;
+	z_far = 2.0f;
+	slice_scale = 0.0f;
+	slice_bias = 0.0f;
+	tile_size = glm::vec2(1.0f);
+	num_lights = 0;
+	num_indices = 0;
+	max_lights_per_cluster = 0;
+
+	slice_rects.resize(slices);
+	slice_indices.resize(slices);
+	grid.resize(2 * tiles_x * tiles_y * slices);
+
+	static const GLenum formats[3] = { GL_RGBA32F, GL_RG32UI, GL_R32UI };
+	glGenBuffers(3, buffers);
+	glGenTextures(3, textures);
+	for (unsigned int i=0; i<3; ++i) {
+		capacities[i] = 16;
+		glBindBuffer(GL_TEXTURE_BUFFER, buffers[i]);
+		glBufferData(GL_TEXTURE_BUFFER, capacities[i], NULL, GL_STREAM_DRAW);
+		glBindTexture(GL_TEXTURE_BUFFER, textures[i]);
+		glTexBuffer(GL_TEXTURE_BUFFER, formats[i], buffers[i]);
+	}
+	glBindTexture(GL_TEXTURE_BUFFER, 0);
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+	CHECK_GL_ERROR();
+}
+
+ClusteredLights::~ClusteredLights() {
+	glDeleteTextures(3, textures);
+	glDeleteBuffers(3, buffers);
+}
+
+void ClusteredLights::update(const PointLight* lights, unsigned int num_lights, const glm::mat4& view, const glm::mat4& projection,
+		unsigned int viewport_width, unsigned int viewport_height) {
+	this->num_lights = num_lights;
+
+	// Near and far plane of a glm::perspective matrix
+	projection_scale = glm::vec2(projection[0][0], projection[1][1]);
+	z_near = projection[3][2] / (projection[2][2] - 1.0f);
+	z_far = projection[3][2] / (projection[2][2] + 1.0f);
+	slice_scale = slices / std::log(z_far / z_near);
+	slice_bias = -std::log(z_near) * slice_scale;
+
+	view_lights.resize(num_lights);
+	light_data.resize(2 * num_lights);
+	for (unsigned int i=0; i<num_lights; ++i) {
+		glm::vec3 position = glm::vec3(view * glm::vec4(lights[i].position, 1.0f));
+		view_lights[i] = glm::vec4(position, lights[i].radius);
+		light_data[2*i] = view_lights[i];
+		light_data[2*i + 1] = glm::vec4(lights[i].colour, 0.0f);
+	}
+
+	// Slices touch disjoint parts of the grid, so they need no locking
+	job_system->parallelFor(slices, 1, [this](unsigned int begin, unsigned int end, unsigned int) {
+		for (unsigned int slice=begin; slice<end; ++slice)
+			assignSlice(slice);
+	});
+
+	// Concatenate the slices' lists, and make the offsets global
+	unsigned int clusters_per_slice = tiles_x * tiles_y;
+	indices.clear();
+	for (unsigned int slice=0; slice<slices; ++slice) {
+		uint32_t base = static_cast<uint32_t>(indices.size());
+		for (unsigned int i=slice*clusters_per_slice; i<(slice + 1)*clusters_per_slice; ++i) {
+			grid[2*i] += base;
+			max_lights_per_cluster = std::max<unsigned int>(max_lights_per_cluster, grid[2*i + 1]);
+		}
+		indices.insert(indices.end(), slice_indices[slice].begin(), slice_indices[slice].end());
+	}
+	num_indices = static_cast<unsigned int>(indices.size());
+
+	upload(buffers[0], capacities[0], light_data.data(), light_data.size() * sizeof(glm::vec4));
+	upload(buffers[1], capacities[1], grid.data(), grid.size() * sizeof(uint32_t));
+	upload(buffers[2], capacities[2], indices.data(), indices.size() * sizeof(uint32_t));
+
+	// Kept for apply(), as fragments find their tile from gl_FragCoord
+	tile_size = glm::vec2(viewport_width / static_cast<float>(tiles_x), viewport_height / static_cast<float>(tiles_y));
+	CHECK_GL_ERROR();
+}
+
+void ClusteredLights::assignSlice(unsigned int slice) {
+	float slice_near = z_near * std::pow(z_far / z_near, slice / static_cast<float>(slices));
+	float slice_far = z_near * std::pow(z_far / z_near, (slice + 1) / static_cast<float>(slices));
+
+	// Tiles covered by each light, from the view space bounding box of its
+	// sphere projected at the depths that make it largest on screen
+	std::vector<LightRect>& rects = slice_rects[slice];
+	rects.clear();
+	for (unsigned int i=0; i<num_lights; ++i) {
+		const glm::vec4& light = view_lights[i];
+		float depth = -light.z;
+		float radius = light.w;
+		if (depth + radius < slice_near || depth - radius > slice_far)
+			continue;
+		float min_depth = std::max(slice_near, depth - radius);
+		float max_depth = std::min(slice_far, depth + radius);
+
+		glm::vec2 low = glm::vec2(light) - radius;
+		glm::vec2 high = glm::vec2(light) + radius;
+		glm::vec2 ndc_low, ndc_high;
+		for (int axis=0; axis<2; ++axis) {
+			ndc_low[axis] = projection_scale[axis] * low[axis] / (low[axis] < 0.0f ? min_depth : max_depth);
+			ndc_high[axis] = projection_scale[axis] * high[axis] / (high[axis] > 0.0f ? min_depth : max_depth);
+		}
+		if (ndc_high.x < -1.0f || ndc_low.x > 1.0f || ndc_high.y < -1.0f || ndc_low.y > 1.0f)
+			continue;
+
+		LightRect rect;
+		rect.light = i;
+		rect.min_x = static_cast<uint16_t>(glm::clamp((ndc_low.x * 0.5f + 0.5f) * tiles_x, 0.0f, tiles_x - 1.0f));
+		rect.max_x = static_cast<uint16_t>(glm::clamp((ndc_high.x * 0.5f + 0.5f) * tiles_x, 0.0f, tiles_x - 1.0f));
+		rect.min_y = static_cast<uint16_t>(glm::clamp((ndc_low.y * 0.5f + 0.5f) * tiles_y, 0.0f, tiles_y - 1.0f));
+		rect.max_y = static_cast<uint16_t>(glm::clamp((ndc_high.y * 0.5f + 0.5f) * tiles_y, 0.0f, tiles_y - 1.0f));
+		rects.push_back(rect);
+	}
+
+	// Count the lights of each cluster, then place each list after the previous one
+	uint32_t* slice_grid = &grid[2 * slice * tiles_x * tiles_y];
+	for (unsigned int i=0; i<tiles_x*tiles_y; ++i)
+		slice_grid[2*i + 1] = 0;
+	for (size_t i=0; i<rects.size(); ++i)
+		for (unsigned int y=rects[i].min_y; y<=rects[i].max_y; ++y)
+			for (unsigned int x=rects[i].min_x; x<=rects[i].max_x; ++x)
+				++slice_grid[2*(y*tiles_x + x) + 1];
+
+	uint32_t offset = 0;
+	for (unsigned int i=0; i<tiles_x*tiles_y; ++i) {
+		slice_grid[2*i] = offset;
+		offset += slice_grid[2*i + 1];
+		slice_grid[2*i + 1] = 0; // Counted up again while filling
+	}
+
+	std::vector<uint32_t>& slice_list = slice_indices[slice];
+	slice_list.resize(offset);
+	for (size_t i=0; i<rects.size(); ++i) {
+		for (unsigned int y=rects[i].min_y; y<=rects[i].max_y; ++y) {
+			for (unsigned int x=rects[i].min_x; x<=rects[i].max_x; ++x) {
+				uint32_t* cluster = &slice_grid[2*(y*tiles_x + x)];
+				slice_list[cluster[0] + cluster[1]++] = rects[i].light;
+			}
+		}
+	}
+}
+
+void ClusteredLights::upload(GLuint buffer, size_t& capacity, const void* data, size_t bytes) {
+	glBindBuffer(GL_TEXTURE_BUFFER, buffer);
+	if (bytes > capacity)
+		capacity = std::max(bytes, 2 * capacity);
+
+	// Orphan the old storage, so we do not wait for draws still reading it
+	glBufferData(GL_TEXTURE_BUFFER, capacity, NULL, GL_STREAM_DRAW);
+	if (bytes > 0)
+		glBufferSubData(GL_TEXTURE_BUFFER, 0, bytes, data);
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+}
+
+void ClusteredLights::apply(GLUtils::Program& program) const {
+	static const char* const sampler_names[3] = { "light_data", "light_grid", "light_indices" };
+	for (unsigned int i=0; i<3; ++i) {
+		glActiveTexture(first_unit + i);
+		glBindTexture(GL_TEXTURE_BUFFER, textures[i]);
+		glProgramUniform1i(program.name, glGetUniformLocation(program.name, sampler_names[i]), first_unit - GL_TEXTURE0 + i);
+	}
+	glActiveTexture(GL_TEXTURE0);
+
+	glProgramUniform3i(program.name, glGetUniformLocation(program.name, "cluster_dims"), tiles_x, tiles_y, slices);
+	glProgramUniform2f(program.name, glGetUniformLocation(program.name, "cluster_tile_size"), tile_size.x, tile_size.y);
+	glProgramUniform2f(program.name, glGetUniformLocation(program.name, "cluster_slice_scale_bias"), slice_scale, slice_bias);
+	CHECK_GL_ERROR();
+}
@@ -0,0 +1,276 @@
+#include "DebugDraw.h"
+
+#include <cstring>
+#include <cmath>
+#include <cstddef>
+
+#include <glm/gtc/type_ptr.hpp>
+
+const float DebugDraw::glyph_size = 12.0f;
+
+#ifdef DEBUGDRAW_ENABLED
+
+namespace {
+	const unsigned int max_overlay_lines = 8192;
+	const unsigned int sphere_segments = 24;
+
+	/**
+	 * The segments of the font, on a grid from (0, 0) at the lower left
+	 * to (2, 2) at the upper right. a-h go clockwise around the border
+	 * from the upper left corner, i and j split the middle, and k-p are
+	 * the diagonals and the center line, upper then lower.
+	 */
+	const unsigned char segments[16][4] = {
+		{0, 2, 1, 2}, {1, 2, 2, 2}, {2, 2, 2, 1}, {2, 1, 2, 0}, // a b c d
+		{2, 0, 1, 0}, {1, 0, 0, 0}, {0, 0, 0, 1}, {0, 1, 0, 2}, // e f g h
+		{0, 1, 1, 1}, {1, 1, 2, 1},                             // i j
+		{0, 2, 1, 1}, {1, 2, 1, 1}, {2, 2, 1, 1},               // k l m
+		{1, 1, 0, 0}, {1, 1, 1, 0}, {1, 1, 2, 0},               // n o p
+	};
+
+	struct Glyph {
+		char character;
+		const char* segments;
+	};
+
+	const Glyph glyph_table[] = {
+		{'0', "abcdefghmn"}, {'1', "cd"}, {'2', "abcijgef"}, {'3', "abcjdef"}, {'4', "hijcd"},
+		{'5', "abhijdef"}, {'6', "abhgfedij"}, {'7', "abcd"}, {'8', "abcdefghij"}, {'9', "abcdefhij"},
+		{'A', "hgabcdij"}, {'B', "abcdefloj"}, {'C', "abhgfe"}, {'D', "abcdeflo"}, {'E', "abhgfei"},
+		{'F', "abhgi"}, {'G', "abhgfedj"}, {'H', "hgcdij"}, {'I', "abloef"}, {'J', "cdefg"},
+		{'K', "hgimp"}, {'L', "hgfe"}, {'M', "hgcdkm"}, {'N', "hgcdkp"}, {'O', "abcdefgh"},
+		{'P', "abchgij"}, {'Q', "abcdefghp"}, {'R', "abchgijp"}, {'S', "abhijdef"}, {'T', "ablo"},
+		{'U', "hgfedc"}, {'V', "hgnm"}, {'W', "hgcdnp"}, {'X', "kmnp"}, {'Y', "kmo"},
+		{'Z', "abmnef"}, {'-', "ij"}, {'+', "ijlo"}, {'.', "f"}, {'/', "mn"}, {'_', "ef"},
+		{'=', "ijef"}, {'(', "ahgf"}, {')', "bcde"}, {'<', "mp"}, {'>', "kn"}, {':', "lo"},
+		{'%', "mnah"}, {'?', "abcjo"}, {' ', ""},
+	};
+
+	/**
+	 * @return A bit per segment of every ASCII character. Lower case
+	 * is drawn as upper case, and anything missing as a question mark.
+	 */
+	const unsigned short* getGlyphs() {
+		static unsigned short glyphs[128];
+		static bool initialized = false;
+		if (initialized)
+			return glyphs;
+
+		unsigned short unknown = 0;
+		for (size_t i=0; i<sizeof(glyph_table)/sizeof(glyph_table[0]); ++i) {
+			unsigned short mask = 0;
+			for (const char* s = glyph_table[i].segments; *s != '\0'; ++s)
+				mask |= 1 << (*s - 'a');
+			glyphs[static_cast<unsigned char>(glyph_table[i].character)] = mask;
+			if (glyph_table[i].character == '?')
+				unknown = mask;
+		}
+		for (unsigned int c=0; c<128; ++c) {
+			if (c >= 'a' && c <= 'z')
+				glyphs[c] = glyphs[c - 'a' + 'A'];
+			else if (glyphs[c] == 0 && c != ' ')
+				glyphs[c] = unknown;
+		}
+		initialized = true;
+		return glyphs;
+	}
+}
+
+DebugDraw::DebugDraw(GLUtils::ProgramCache* cache, ShaderReloader* reloader, unsigned int max_lines)
+		: vao(0), max_lines(max_lines), lines(NULL), lines_offset(0), num_lines(0), dropped_lines(0) {
+	program = cache->getProgram(GLUtils::readFile("shaders/debug_draw.vert"), GLUtils::readFile("shaders/debug_draw.frag"));
+	if (reloader != NULL)
+		reloader->add(program, "debug_draw.vert", "", "debug_draw.frag");
+
+	// The lines and the text of a frame share a region
+	buffer.reset(new GLUtils::StreamingBuffer<GL_ARRAY_BUFFER>((max_lines + max_overlay_lines) * 2 * sizeof(Vertex)));
+	overlay.reserve(2*max_overlay_lines);
+
+	glGenVertexArrays(1, &vao);
+	glBindVertexArray(vao);
+	buffer->bind();
+	program->setAttributePointer("position", 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), reinterpret_cast<GLvoid*>(offsetof(Vertex, position)));
+	program->setAttributePointer("color", 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(Vertex), reinterpret_cast<GLvoid*>(offsetof(Vertex, colour)));
+	glBindVertexArray(0);
+	buffer->unbind();
+	CHECK_GL_ERROR();
+
+	getGlyphs();
+}
+
+DebugDraw::~DebugDraw() {
+	glDeleteVertexArrays(1, &vao);
+}
+
+uint32_t DebugDraw::packColour(const glm::vec3& colour) {
+	// Bytes in memory are red, green, blue, alpha on little endian machines
+	glm::vec3 c = glm::clamp(colour, 0.0f, 1.0f) * 255.0f + 0.5f;
+	return static_cast<uint32_t>(c.x) | (static_cast<uint32_t>(c.y) << 8) | (static_cast<uint32_t>(c.z) << 16) | 0xff000000u;
+}
+
+void DebugDraw::begin(const glm::mat4& view_projection, unsigned int width, unsigned int height) {
+	assert(lines == NULL);
+	this->view_projection = view_projection;
+	pixel_size = glm::vec2(2.0f / width, 2.0f / height);
+
+	// The whole capacity is taken up front, and what is left over
+	// is given back in render()
+	buffer->begin();
+	lines = static_cast<Vertex*>(buffer->allocate(max_lines * 2 * sizeof(Vertex), lines_offset, sizeof(Vertex)));
+	num_lines = 0;
+	overlay.clear();
+}
+
+void DebugDraw::line(const glm::vec3& a, const glm::vec3& b, const glm::vec3& colour) {
+	addLine(a, b, packColour(colour));
+}
+
+void DebugDraw::box(const glm::vec3& min_corner, const glm::vec3& max_corner, const glm::vec3& colour, const glm::mat4& transform) {
+	glm::vec3 corners[8];
+	for (unsigned int i=0; i<8; ++i) {
+		glm::vec3 corner((i & 1) ? max_corner.x : min_corner.x, (i & 2) ? max_corner.y : min_corner.y, (i & 4) ? max_corner.z : min_corner.z);
+		corners[i] = glm::vec3(transform * glm::vec4(corner, 1.0f));
+	}
+
+	// Corners one bit apart share an edge
+	uint32_t packed = packColour(colour);
+	for (unsigned int i=0; i<8; ++i)
+		for (unsigned int bit=1; bit<8; bit<<=1)
+			if ((i & bit) == 0)
+				addLine(corners[i], corners[i | bit], packed);
+}
+
+void DebugDraw::sphere(const glm::vec3& center, float radius, const glm::vec3& colour, const glm::mat4& transform) {
+	static float circle[sphere_segments + 1][2];
+	static bool initialized = false;
+	if (!initialized) {
+		for (unsigned int i=0; i<=sphere_segments; ++i) {
+			float angle = 6.2831853f * (i % sphere_segments) / sphere_segments;
+			circle[i][0] = cosf(angle);
+			circle[i][1] = sinf(angle);
+		}
+		initialized = true;
+	}
+
+	uint32_t packed = packColour(colour);
+	glm::vec3 world_center = glm::vec3(transform * glm::vec4(center, 1.0f));
+	glm::vec3 axes[3];
+	for (unsigned int k=0; k<3; ++k)
+		axes[k] = glm::vec3(transform[k]) * radius;
+	for (unsigned int k=0; k<3; ++k) {
+		const glm::vec3& u = axes[k];
+		const glm::vec3& v = axes[(k + 1) % 3];
+		glm::vec3 previous = world_center + u;
+		for (unsigned int i=1; i<=sphere_segments; ++i) {
+			glm::vec3 point = world_center + u*circle[i][0] + v*circle[i][1];
+			addLine(previous, point, packed);
+			previous = point;
+		}
+	}
+}
+
+void DebugDraw::frustum(const glm::mat4& view_projection, const glm::vec3& colour) {
+	glm::mat4 inverse = glm::inverse(view_projection);
+	glm::vec3 corners[8];
+	for (unsigned int i=0; i<8; ++i) {
+		glm::vec4 corner = inverse * glm::vec4((i & 1) ? 1.0f : -1.0f, (i & 2) ? 1.0f : -1.0f, (i & 4) ? 1.0f : -1.0f, 1.0f);
+		corners[i] = glm::vec3(corner) / corner.w;
+	}
+
+	uint32_t packed = packColour(colour);
+	for (unsigned int i=0; i<8; ++i)
+		for (unsigned int bit=1; bit<8; bit<<=1)
+			if ((i & bit) == 0)
+				addLine(corners[i], corners[i | bit], packed);
+}
+
+void DebugDraw::axes(const glm::mat4& transform, float size) {
+	glm::vec3 origin = glm::vec3(transform[3]);
+	for (unsigned int k=0; k<3; ++k) {
+		glm::vec3 colour(0.0f);
+		colour[k] = 1.0f;
+		addLine(origin, origin + glm::vec3(transform[k]) * size, packColour(colour));
+	}
+}
+
+void DebugDraw::text(const glm::vec3& position, const std::string& str, const glm::vec3& colour) {
+	glm::vec4 clip = view_projection * glm::vec4(position, 1.0f);
+	if (clip.w <= 0.0f)
+		return; // Behind the camera
+	addText(glm::vec2(clip.x, clip.y) / clip.w, str, packColour(colour));
+}
+
+void DebugDraw::screenText(float x, float y, const std::string& str, const glm::vec3& colour) {
+	addText(glm::vec2(x, y) * pixel_size - 1.0f, str, packColour(colour));
+}
+
+void DebugDraw::addText(glm::vec2 position, const std::string& str, uint32_t colour) {
+	// Glyphs are narrower than they are tall, with a gap between them
+	const unsigned short* glyphs = getGlyphs();
+	glm::vec2 scale = pixel_size * glm::vec2(0.3f, 0.5f) * glyph_size;
+	glm::vec2 cursor = position;
+	for (size_t i=0; i<str.size(); ++i) {
+		unsigned char c = static_cast<unsigned char>(str[i]);
+		if (c == '\n') {
+			cursor = glm::vec2(position.x, cursor.y - 1.5f*glyph_size*pixel_size.y);
+			continue;
+		}
+		unsigned short mask = glyphs[c & 127];
+		for (unsigned int s=0; s<16; ++s) {
+			if ((mask & (1 << s)) == 0)
+				continue;
+			if (overlay.size() >= 2*max_overlay_lines) {
+				++dropped_lines;
+				continue;
+			}
+			Vertex v[2];
+			for (unsigned int end=0; end<2; ++end) {
+				v[end].position[0] = cursor.x + segments[s][2*end] * scale.x;
+				v[end].position[1] = cursor.y + segments[s][2*end + 1] * scale.y;
+				v[end].position[2] = 0.0f;
+				v[end].colour = colour;
+			}
+			overlay.push_back(v[0]);
+			overlay.push_back(v[1]);
+		}
+		cursor.x += 3.0f*scale.x;
+	}
+}
+
+void DebugDraw::render() {
+	assert(lines != NULL);
+
+	// The text goes right after the lines, so only the part of the
+	// region that was written is flushed
+	buffer->unallocate((max_lines - num_lines) * 2 * sizeof(Vertex));
+	GLintptr overlay_offset = 0;
+	if (!overlay.empty()) {
+		void* overlay_data = buffer->allocate(overlay.size() * sizeof(Vertex), overlay_offset, sizeof(Vertex));
+		std::memcpy(overlay_data, overlay.data(), overlay.size() * sizeof(Vertex));
+	}
+	buffer->end();
+	lines = NULL;
+
+	program->use();
+	glBindVertexArray(vao);
+	glEnable(GL_DEPTH_TEST);
+	if (num_lines > 0) {
+		glUniformMatrix4fv(program->getUniform("transform"), 1, 0, glm::value_ptr(view_projection));
+		glDrawArrays(GL_LINES, static_cast<GLint>(lines_offset / sizeof(Vertex)), 2*num_lines);
+	}
+	if (!overlay.empty()) {
+		glm::mat4 identity(1.0f);
+		glDisable(GL_DEPTH_TEST);
+		glUniformMatrix4fv(program->getUniform("transform"), 1, 0, glm::value_ptr(identity));
+		glDrawArrays(GL_LINES, static_cast<GLint>(overlay_offset / sizeof(Vertex)), static_cast<GLsizei>(overlay.size()));
+		glEnable(GL_DEPTH_TEST);
+	}
+	glBindVertexArray(0);
+	program->disuse();
+}
+
+unsigned long DebugDraw::getDroppedLines() const {
+	return dropped_lines;
+}
+
+#endif // DEBUGDRAW_ENABLED
@@ -0,0 +1,60 @@
+#include "DrawList.h"
+
+#include <algorithm>
+
+#include <glm/gtc/type_ptr.hpp>
+
+void DrawList::reset(LinearAllocator* frame_arenas, unsigned int num_threads) {
+	if (threads.size() != num_threads) {
+		threads.resize(num_threads);
+		for (size_t i=0; i<threads.size(); ++i)
+			threads[i].last_size = 0;
+	}
+
+	// The old vectors point into arenas that have been reset since, so
+	// they are replaced rather than cleared. Nothing is freed either way.
+	size_t total = 0;
+	for (unsigned int i=0; i<num_threads; ++i) {
+		ThreadPackets& thread = threads[i];
+		thread.last_size = std::max(thread.last_size, thread.packets.size());
+		thread.packets = PacketVector(ArenaAllocator<DrawPacket>(&frame_arenas[i]));
+		thread.packets.reserve(thread.last_size);
+		total += thread.last_size;
+	}
+	sorted = SortVector(ArenaAllocator<SortEntry>(&frame_arenas[0]));
+	sorted.reserve(total);
+}
+
+void DrawList::sort() {
+	sorted.clear();
+	for (size_t i=0; i<threads.size(); ++i) {
+		const PacketVector& packets = threads[i].packets;
+		for (size_t j=0; j<packets.size(); ++j)
+			sorted.push_back(std::make_pair(packets[j].sort_key, &packets[j]));
+	}
+	std::sort(sorted.begin(), sorted.end());
+}
+
+void DrawList::submit(GLUtils::Program& program, const glm::mat4& projection) const {
+	program.use();
+
+	// Look the uniforms up once instead of once per draw call. Shader
+	// variants may not use all of them, and OpenGL ignores location -1
+	GLint model_view_loc = glGetUniformLocation(program.name, "model_view_mat");
+	GLint colour_loc = glGetUniformLocation(program.name, "colour");
+	GLint light_position_loc = glGetUniformLocation(program.name, "light_position");
+	GLint camera_position_loc = glGetUniformLocation(program.name, "camera_position");
+
+	glUniformMatrix4fv(program.getUniform("proj_mat"), 1, 0, glm::value_ptr(projection));
+
+	for (size_t i=0; i<sorted.size(); ++i) {
+		const DrawPacket& packet = *sorted[i].second;
+		glUniformMatrix4fv(model_view_loc, 1, 0, glm::value_ptr(packet.model_view));
+		glUniform3fv(colour_loc, 1, glm::value_ptr(packet.colour));
+		glUniform3fv(light_position_loc, 1, glm::value_ptr(packet.light_position));
+		glUniform3fv(camera_position_loc, 1, glm::value_ptr(packet.camera_position));
+		glDrawArrays(GL_TRIANGLES, packet.first, packet.count);
+	}
+
+	program.disuse();
+}
@@ -0,0 +1,53 @@
+#include "DynamicResolution.h"
+
+#include <algorithm>
+#include <cmath>
+
+const double DynamicResolution::smoothing = 0.2;
+const double DynamicResolution::headroom = 0.1;
+const float DynamicResolution::max_step = 0.1f;
+
+DynamicResolution::DynamicResolution(double target_time, float min_scale, float max_scale, unsigned int latency) {
+	this->target_time = target_time;
+	this->min_scale = min_scale;
+	this->max_scale = max_scale;
+	this->latency = latency;
+	scale = max_scale;
+	settling = latency;
+	average_time = 0.0;
+
+	scale_sum = 0.0;
+	measurements = 0;
+	changes = 0;
+}
+
+void DynamicResolution::addMeasurement(double seconds) {
+	scale_sum += scale;
+	++measurements;
+
+	// Measurements still in flight were rendered at an older scale
+	if (settling > 0) {
+		--settling;
+		if (settling == 0)
+			average_time = seconds;
+		return;
+	}
+	average_time += smoothing * (seconds - average_time);
+
+	// The cost scales with the number of pixels, i.e., the square of the scale.
+	// The band around the target keeps it from oscillating between two sizes
+	if (average_time > target_time * (1.0 - headroom) && average_time < target_time * (1.0 + headroom))
+		return;
+	if (average_time <= 0.0)
+		return;
+
+	float step = static_cast<float>(std::sqrt(target_time / average_time));
+	step = std::min(std::max(step, 1.0f - max_step), 1.0f + max_step);
+	float new_scale = std::min(std::max(scale * step, min_scale), max_scale);
+	if (new_scale == scale)
+		return;
+
+	scale = new_scale;
+	settling = latency;
+	++changes;
+}
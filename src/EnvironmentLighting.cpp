@@ -0,0 +1,341 @@
+#include "EnvironmentLighting.h"
+
+#include <fstream>
+#include <cmath>
+
+#include <glm/gtc/type_ptr.hpp>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define ENVIRONMENTLIGHTING_SSE
+#endif
+
+#include "GLUtils/GLUtils.hpp"
+
+namespace {
+	/**
+	 * Direction through (u, v) on a face is normal + u*u_axis + v*v_axis,
+	 * as OpenGL maps cube map texels, in the order of the cube map targets
+	 */
+	struct FaceAxes {
+		float normal[3];
+		float u_axis[3];
+		float v_axis[3];
+	};
+
+	const FaceAxes face_axes[6] = {
+		{ { 1, 0, 0 }, { 0, 0, -1 }, { 0, -1, 0 } },
+		{ { -1, 0, 0 }, { 0, 0, 1 }, { 0, -1, 0 } },
+		{ { 0, 1, 0 }, { 1, 0, 0 }, { 0, 0, 1 } },
+		{ { 0, -1, 0 }, { 1, 0, 0 }, { 0, 0, -1 } },
+		{ { 0, 0, 1 }, { 1, 0, 0 }, { 0, -1, 0 } },
+		{ { 0, 0, -1 }, { -1, 0, 0 }, { 0, -1, 0 } },
+	};
+
+	/**
+	 * Adds one texel's radiance times each basis polynomial times its
+	 * solid angle to sums (nine RGB triples), and returns the solid angle
+	 */
+	inline float accumulateTexel(const FaceAxes& axes, float u, float v, float texel_area, const unsigned char* rgb, float* sums) {
+		float inv_length = 1.0f / sqrtf(1.0f + u*u + v*v);
+		float x = (axes.normal[0] + u*axes.u_axis[0] + v*axes.v_axis[0]) * inv_length;
+		float y = (axes.normal[1] + u*axes.u_axis[1] + v*axes.v_axis[1]) * inv_length;
+		float z = (axes.normal[2] + u*axes.u_axis[2] + v*axes.v_axis[2]) * inv_length;
+		float weight = texel_area * inv_length * inv_length * inv_length;
+
+		float basis[9] = { 1.0f, y, z, x, x*y, y*z, 3.0f*z*z - 1.0f, x*z, x*x - y*y };
+		for (int k=0; k<9; ++k)
+			for (int c=0; c<3; ++c)
+				sums[3*k + c] += rgb[c] * (1.0f / 255.0f) * weight * basis[k];
+		return weight;
+	}
+
+	/**
+	 * Projects one face, four texels at a time where SSE is available
+	 */
+	float projectFace(const unsigned char* pixels, unsigned int size, unsigned int face, float* sums) {
+		const FaceAxes& axes = face_axes[face];
+		float texel_area = 4.0f / (size * size); // On the face, which spans [-1, 1]^2
+		float total_weight = 0.0f;
+
+		for (unsigned int row=0; row<size; ++row) {
+			float v = 2.0f * (row + 0.5f) / size - 1.0f;
+			const unsigned char* row_pixels = pixels + 3 * row * size;
+			unsigned int column = 0;
+
+#ifdef ENVIRONMENTLIGHTING_SSE
+			__m128 acc[27];
+			for (int k=0; k<27; ++k)
+				acc[k] = _mm_setzero_ps();
+			__m128 weight_acc = _mm_setzero_ps();
+
+			const __m128 one = _mm_set1_ps(1.0f);
+			const __m128 v4 = _mm_set1_ps(v);
+			const __m128 v2 = _mm_mul_ps(v4, v4);
+			__m128 base[3];
+			for (int i=0; i<3; ++i)
+				base[i] = _mm_set1_ps(axes.normal[i] + v*axes.v_axis[i]);
+			const __m128 area = _mm_set1_ps(texel_area);
+			const __m128 to_unit = _mm_set1_ps(1.0f / 255.0f);
+
+			for (; column + 4 <= size; column += 4) {
+				__m128 u = _mm_setr_ps(column + 0.5f, column + 1.5f, column + 2.5f, column + 3.5f);
+				u = _mm_sub_ps(_mm_mul_ps(u, _mm_set1_ps(2.0f / size)), one);
+
+				__m128 inv_length = _mm_div_ps(one, _mm_sqrt_ps(_mm_add_ps(one, _mm_add_ps(_mm_mul_ps(u, u), v2))));
+				__m128 x = _mm_mul_ps(_mm_add_ps(base[0], _mm_mul_ps(u, _mm_set1_ps(axes.u_axis[0]))), inv_length);
+				__m128 y = _mm_mul_ps(_mm_add_ps(base[1], _mm_mul_ps(u, _mm_set1_ps(axes.u_axis[1]))), inv_length);
+				__m128 z = _mm_mul_ps(_mm_add_ps(base[2], _mm_mul_ps(u, _mm_set1_ps(axes.u_axis[2]))), inv_length);
+				__m128 weight = _mm_mul_ps(area, _mm_mul_ps(inv_length, _mm_mul_ps(inv_length, inv_length)));
+				weight_acc = _mm_add_ps(weight_acc, weight);
+
+				const unsigned char* p = row_pixels + 3 * column;
+				__m128 colour[3];
+				for (int c=0; c<3; ++c) {
+					colour[c] = _mm_setr_ps(p[c], p[3 + c], p[6 + c], p[9 + c]);
+					colour[c] = _mm_mul_ps(_mm_mul_ps(colour[c], to_unit), weight);
+				}
+
+				__m128 basis[9];
+				basis[0] = one;
+				basis[1] = y;
+				basis[2] = z;
+				basis[3] = x;
+				basis[4] = _mm_mul_ps(x, y);
+				basis[5] = _mm_mul_ps(y, z);
+				basis[6] = _mm_sub_ps(_mm_mul_ps(_mm_set1_ps(3.0f), _mm_mul_ps(z, z)), one);
+				basis[7] = _mm_mul_ps(x, z);
+				basis[8] = _mm_sub_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y));
+				for (int k=0; k<9; ++k)
+					for (int c=0; c<3; ++c)
+						acc[3*k + c] = _mm_add_ps(acc[3*k + c], _mm_mul_ps(colour[c], basis[k]));
+			}
+
+			float lanes[4];
+			for (int k=0; k<27; ++k) {
+				_mm_storeu_ps(lanes, acc[k]);
+				sums[k] += (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+			}
+			_mm_storeu_ps(lanes, weight_acc);
+			total_weight += (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+#endif
+
+			for (; column<size; ++column) {
+				float u = 2.0f * (column + 0.5f) / size - 1.0f;
+				total_weight += accumulateTexel(axes, u, v, texel_area, row_pixels + 3 * column, sums);
+			}
+		}
+		return total_weight;
+	}
+}
+
+EnvironmentLighting::EnvironmentLighting(const GLUtils::CubeMap& environment, std::string cache_filename, GLUtils::ProgramCache* cache,
+		JobSystem* job_system, unsigned int specular_size, GLenum unit) : specular_size(specular_size), unit(unit) {
+	roughness = 0.3f;
+	cached = false;
+
+	// Stop at 8x8, below which bilinear filtering across faces shows
+	specular_levels = 1;
+	while ((specular_size >> specular_levels) >= 8)
+		++specular_levels;
+
+	unsigned int face_size = environment.getFaceSize();
+	uint64_t key = GLUtils::hash(&face_size, sizeof(face_size));
+	key = GLUtils::hash(&specular_size, sizeof(specular_size), key);
+	for (unsigned int i=0; i<6; ++i) {
+		const std::vector<unsigned char>& pixels = environment.getFacePixels(i);
+		if (pixels.empty())
+			THROW_EXCEPTION("EnvironmentLighting needs the pixels of the environment");
+		key = GLUtils::hash(pixels.data(), pixels.size(), key);
+	}
+
+	glGenTextures(1, &specular_map);
+	if (loadCache(cache_filename, key)) {
+		cached = true;
+		uploadSpecular();
+	}
+	else {
+		computeIrradianceSH(environment, job_system, sh_coefficients);
+		prefilterSpecular(environment, cache);
+		saveCache(cache_filename, key);
+	}
+	std::vector<uint16_t>().swap(specular_texels);
+	CHECK_GL_ERROR();
+}
+
+EnvironmentLighting::~EnvironmentLighting() {
+	glDeleteTextures(1, &specular_map);
+}
+
+void EnvironmentLighting::computeIrradianceSH(const GLUtils::CubeMap& environment, JobSystem* job_system, glm::vec3 coefficients[9]) {
+	unsigned int size = environment.getFaceSize();
+	float face_sums[6][27] = {};
+	float face_weights[6] = {};
+
+	job_system->parallelFor(6, 1, [&](unsigned int begin, unsigned int end, unsigned int) {
+		for (unsigned int face=begin; face<end; ++face)
+			face_weights[face] = projectFace(environment.getFacePixels(face).data(), size, face, face_sums[face]);
+	});
+
+	// The texels' solid angles only approximately add up to the sphere
+	double sums[27] = {};
+	double total_weight = 0.0;
+	for (unsigned int face=0; face<6; ++face) {
+		for (int k=0; k<27; ++k)
+			sums[k] += face_sums[face][k];
+		total_weight += face_weights[face];
+	}
+	double normalization = 4.0 * 3.14159265358979 / total_weight;
+
+	// Each basis function's normalization constant appears twice, once
+	// projecting and once evaluating. The cosine lobe over pi scales the
+	// bands by 1, 2/3 and 1/4
+	static const double basis_constants[9] = {
+		0.282095, 0.488603, 0.488603, 0.488603, 1.092548, 1.092548, 0.315392, 1.092548, 0.546274
+	};
+	static const double band_scales[9] = { 1.0, 2.0/3.0, 2.0/3.0, 2.0/3.0, 0.25, 0.25, 0.25, 0.25, 0.25 };
+	for (int k=0; k<9; ++k) {
+		double scale = normalization * basis_constants[k] * basis_constants[k] * band_scales[k];
+		coefficients[k] = glm::vec3(static_cast<float>(sums[3*k] * scale), static_cast<float>(sums[3*k + 1] * scale),
+			static_cast<float>(sums[3*k + 2] * scale));
+	}
+}
+
+void EnvironmentLighting::prefilterSpecular(const GLUtils::CubeMap& environment, GLUtils::ProgramCache* cache) {
+	std::shared_ptr<GLUtils::Program> program = cache->getProgram(GLUtils::readFile("shaders/ibl_prefilter.vert"),
+		GLUtils::readFile("shaders/ibl_prefilter.frag"));
+
+	specular_texels.clear();
+	uploadSpecular();
+
+	GLint viewport[4];
+	glGetIntegerv(GL_VIEWPORT, viewport);
+	GLboolean depth_test = glIsEnabled(GL_DEPTH_TEST);
+	glDisable(GL_DEPTH_TEST);
+
+	GLuint fbo, vao;
+	glGenFramebuffers(1, &fbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+	glGenVertexArrays(1, &vao); // The vertex shader makes up its own positions
+	glBindVertexArray(vao);
+
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_CUBE_MAP, environment.getTexture());
+	program->use();
+	glUniform1i(program->getUniform("environment"), 0);
+	glUniform1f(program->getUniform("environment_size"), static_cast<float>(environment.getFaceSize()));
+	glUniform1i(program->getUniform("num_samples"), 64);
+
+	for (unsigned int level=0; level<specular_levels; ++level) {
+		unsigned int size = specular_size >> level;
+		glViewport(0, 0, size, size);
+		glUniform1f(program->getUniform("roughness"), level / static_cast<float>(specular_levels - 1));
+		for (unsigned int face=0; face<6; ++face) {
+			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, specular_map, level);
+			CHECK_GL_FBO_COMPLETENESS();
+			glUniform1i(program->getUniform("face"), face);
+			glDrawArrays(GL_TRIANGLES, 0, 3);
+		}
+	}
+	program->disuse();
+
+	glBindVertexArray(0);
+	glDeleteVertexArrays(1, &vao);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glDeleteFramebuffers(1, &fbo);
+	glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+	if (depth_test)
+		glEnable(GL_DEPTH_TEST);
+
+	// Read back for the cache
+	glBindTexture(GL_TEXTURE_CUBE_MAP, specular_map);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	for (unsigned int level=0; level<specular_levels; ++level) {
+		unsigned int size = specular_size >> level;
+		for (unsigned int face=0; face<6; ++face) {
+			size_t offset = specular_texels.size();
+			specular_texels.resize(offset + 3 * size * size);
+			glGetTexImage(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, level, GL_RGB, GL_HALF_FLOAT, &specular_texels[offset]);
+		}
+	}
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+	glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+	CHECK_GL_ERROR();
+}
+
+void EnvironmentLighting::uploadSpecular() const {
+	glBindTexture(GL_TEXTURE_CUBE_MAP, specular_map);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_BASE_LEVEL, 0);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAX_LEVEL, specular_levels - 1);
+
+	// Without texels, only allocates the levels to render into
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	size_t offset = 0;
+	for (unsigned int level=0; level<specular_levels; ++level) {
+		unsigned int size = specular_size >> level;
+		for (unsigned int face=0; face<6; ++face) {
+			const uint16_t* texels = specular_texels.empty() ? NULL : &specular_texels[offset];
+			glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, level, GL_RGB16F, size, size, 0, GL_RGB, GL_HALF_FLOAT, texels);
+			offset += 3 * size * size;
+		}
+	}
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+}
+
+/**
+ * Cache layout: version, key, specular size and levels, the nine
+ * coefficients as floats, then the specular texels as half floats
+ */
+bool EnvironmentLighting::loadCache(const std::string& filename, uint64_t key) {
+	std::ifstream file(filename.c_str(), std::ios::binary);
+	if (!file.good())
+		return false;
+
+	uint32_t version = 0, size = 0, levels = 0;
+	uint64_t file_key = 0;
+	file.read(reinterpret_cast<char*>(&version), sizeof(version));
+	file.read(reinterpret_cast<char*>(&file_key), sizeof(file_key));
+	file.read(reinterpret_cast<char*>(&size), sizeof(size));
+	file.read(reinterpret_cast<char*>(&levels), sizeof(levels));
+	if (!file.good() || version != cache_version || file_key != key || size != specular_size || levels != specular_levels)
+		return false;
+
+	file.read(reinterpret_cast<char*>(sh_coefficients), sizeof(sh_coefficients));
+	size_t num_texels = 0;
+	for (unsigned int level=0; level<specular_levels; ++level)
+		num_texels += 6 * 3 * (specular_size >> level) * (specular_size >> level);
+	specular_texels.resize(num_texels);
+	file.read(reinterpret_cast<char*>(specular_texels.data()), num_texels * sizeof(uint16_t));
+	return file.good();
+}
+
+void EnvironmentLighting::saveCache(const std::string& filename, uint64_t key) const {
+	// A missing cache only costs time, so failing to write is not an error
+	std::ofstream file(filename.c_str(), std::ios::binary);
+	uint32_t version = cache_version;
+	uint32_t size = specular_size;
+	uint32_t levels = specular_levels;
+	file.write(reinterpret_cast<const char*>(&version), sizeof(version));
+	file.write(reinterpret_cast<const char*>(&key), sizeof(key));
+	file.write(reinterpret_cast<const char*>(&size), sizeof(size));
+	file.write(reinterpret_cast<const char*>(&levels), sizeof(levels));
+	file.write(reinterpret_cast<const char*>(sh_coefficients), sizeof(sh_coefficients));
+	file.write(reinterpret_cast<const char*>(specular_texels.data()), specular_texels.size() * sizeof(uint16_t));
+}
+
+void EnvironmentLighting::apply(GLUtils::Program& program) const {
+	glActiveTexture(unit);
+	glBindTexture(GL_TEXTURE_CUBE_MAP, specular_map);
+	glActiveTexture(GL_TEXTURE0);
+
+	glProgramUniform3fv(program.name, glGetUniformLocation(program.name, "sh_coefficients"), 9, glm::value_ptr(sh_coefficients[0]));
+	glProgramUniform1i(program.name, glGetUniformLocation(program.name, "specular_map"), unit - GL_TEXTURE0);
+	glProgramUniform1f(program.name, glGetUniformLocation(program.name, "specular_max_lod"), static_cast<float>(specular_levels - 1));
+	glProgramUniform1f(program.name, glGetUniformLocation(program.name, "roughness"), roughness);
+}
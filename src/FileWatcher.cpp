@@ -0,0 +1,84 @@
+#include "FileWatcher.h"
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#endif
+
+const double FileWatcher::poll_interval = 0.25;
+
+FileWatcher::FileWatcher(std::string directory) : directory(directory), inotify_fd(-1) {
+#ifdef __linux__
+	// Editors often save by writing a new file and renaming it over the old
+	inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (inotify_fd >= 0 && inotify_add_watch(inotify_fd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+		close(inotify_fd);
+		inotify_fd = -1;
+	}
+#endif
+}
+
+FileWatcher::~FileWatcher() {
+#ifdef __linux__
+	if (inotify_fd >= 0)
+		close(inotify_fd);
+#endif
+}
+
+void FileWatcher::addFile(const std::string& filename) {
+	WatchedFile file;
+	file.filename = filename;
+	file.path = directory + "/" + filename;
+	file.modified = getModificationTime(file.path);
+	files.push_back(file);
+}
+
+void FileWatcher::poll(std::vector<std::string>& changed) {
+#ifdef __linux__
+	if (inotify_fd >= 0) {
+		alignas(struct inotify_event) char buffer[4096];
+		while (true) {
+			ssize_t length = read(inotify_fd, buffer, sizeof(buffer));
+			if (length <= 0)
+				break;
+
+			for (ssize_t offset = 0; offset < length; ) {
+				const struct inotify_event* event = reinterpret_cast<const struct inotify_event*>(buffer + offset);
+				if (event->len > 0)
+					for (size_t i=0; i<files.size(); ++i)
+						if (files[i].filename == event->name)
+							changed.push_back(files[i].path);
+				offset += sizeof(struct inotify_event) + event->len;
+			}
+		}
+		return;
+	}
+#endif
+	pollModificationTimes(changed);
+}
+
+void FileWatcher::pollModificationTimes(std::vector<std::string>& changed) {
+	if (poll_timer.elapsed() < poll_interval)
+		return;
+	poll_timer.restart();
+
+	for (size_t i=0; i<files.size(); ++i) {
+		long long modified = getModificationTime(files[i].path);
+		if (modified != files[i].modified) {
+			files[i].modified = modified;
+			changed.push_back(files[i].path);
+		}
+	}
+}
+
+long long FileWatcher::getModificationTime(const std::string& path) {
+	struct stat info;
+	if (stat(path.c_str(), &info) != 0)
+		return 0;
+	return static_cast<long long>(info.st_mtime);
+}
@@ -0,0 +1,89 @@
+#include "FramePacer.h"
+
+#include <algorithm>
+#include <iostream>
+
+#include <SDL.h>
+
+const double FramePacer::spin_threshold = 0.002;
+const double FramePacer::smoothing = 0.05;
+
+FramePacer::FramePacer() {
+	swap_mode = SWAPMODE_IMMEDIATE;
+	frame_rate_cap = 0.0;
+
+	input_time = Timer::getCurrentTime();
+	last_measured_input = input_time;
+	next_deadline = input_time;
+	last_present = input_time;
+
+	average_frame_time = 0.0;
+	average_latency = 0.0;
+	max_latency = 0.0;
+}
+
+FramePacer::SwapMode FramePacer::setSwapMode(SwapMode mode) {
+	switch (mode) {
+	case SWAPMODE_ADAPTIVE:
+		// Late swap tearing is not supported everywhere; use plain vsync then
+		if (SDL_GL_SetSwapInterval(-1) == 0) {
+			swap_mode = SWAPMODE_ADAPTIVE;
+			break;
+		}
+		std::cerr << "Adaptive vsync not supported: " << SDL_GetError() << std::endl;
+		// fall through
+	case SWAPMODE_VSYNC:
+		SDL_GL_SetSwapInterval(1);
+		swap_mode = SWAPMODE_VSYNC;
+		break;
+	case SWAPMODE_IMMEDIATE:
+		SDL_GL_SetSwapInterval(0);
+		swap_mode = SWAPMODE_IMMEDIATE;
+		break;
+	}
+	return swap_mode;
+}
+
+void FramePacer::setFrameRateCap(double fps) {
+	frame_rate_cap = std::max(fps, 0.0);
+	next_deadline = Timer::getCurrentTime();
+}
+
+void FramePacer::beginFrame(double input_time) {
+	this->input_time = input_time;
+}
+
+void FramePacer::waitForNextFrame() {
+	if (frame_rate_cap <= 0.0)
+		return;
+
+	double remaining = next_deadline - Timer::getCurrentTime();
+	if (remaining > spin_threshold)
+		SDL_Delay(static_cast<Uint32>((remaining - spin_threshold) * 1000.0));
+
+	while (Timer::getCurrentTime() < next_deadline);
+}
+
+void FramePacer::endFrame() {
+	double now = Timer::getCurrentTime();
+
+	double frame_time = now - last_present;
+	last_present = now;
+	average_frame_time += smoothing * (frame_time - average_frame_time);
+
+	// Frames that re-present old input say nothing about responsiveness
+	if (input_time > last_measured_input) {
+		double latency = now - input_time;
+		last_measured_input = input_time;
+		average_latency += smoothing * (latency - average_latency);
+		max_latency = std::max(max_latency, latency);
+	}
+
+	// Schedule from the previous deadline so the cap does not drift, but
+	// never try to catch up on frames we were too slow to deliver
+	if (frame_rate_cap > 0.0) {
+		next_deadline += 1.0 / frame_rate_cap;
+		if (next_deadline < now)
+			next_deadline = now + 1.0 / frame_rate_cap;
+	}
+}
@@ -1,11 +1,15 @@
 #include "GameManager.h"
 #include "GeometryManager.h"
+#include "AllocationCounter.h"
+#include "MemoryUsage.h"
 #include <iostream>
 #include <string>
 #include <sstream>
 #include <vector>
+#include <algorithm>
 #include <assert.h>
 #include <stdexcept>
+#include <random>
 
 #include <GL/glew.h>
 #include <glm/glm.hpp>
@@ -19,97 +23,18 @@ using GLUtils::VBO;
 using GLUtils::Program;
 using GLUtils::readFile;
 
-const float GameManager::cube_vertices_data[] = {
-	-0.5f, 0.5f, 0.5f,
-	0.5f, 0.5f, 0.5f,
-	-0.5f, -0.5f, 0.5f,
-	-0.5f, -0.5f, 0.5f,
-	0.5f, 0.5f, 0.5f,
-	0.5f, -0.5f, 0.5f,
-
-	0.5f, 0.5f, 0.5f,
-	0.5f, 0.5f, -0.5f,
-	0.5f, -0.5f, 0.5f,
-	0.5f, -0.5f, 0.5f,
-	0.5f, 0.5f, -0.5f,
-	0.5f, -0.5f, -0.5f,
-
-	0.5f, 0.5f, -0.5f,
-	-0.5f, 0.5f, -0.5f,
-	0.5f, -0.5f, -0.5f,
-	0.5f, -0.5f, -0.5f,
-	-0.5f, 0.5f, -0.5f,
-	-0.5f, -0.5f, -0.5f,
-
-	-0.5f, 0.5f, -0.5f,
-	-0.5f, 0.5f, 0.5f,
-	-0.5f, -0.5f, -0.5f,
-	-0.5f, -0.5f, -0.5f,
-	-0.5f, 0.5f, 0.5f,
-	-0.5f, -0.5f, 0.5f,
-
-	-0.5f, 0.5f, 0.5f,
-	-0.5f, 0.5f, -0.5f,
-	0.5f, 0.5f, 0.5f,
-	0.5f, 0.5f, 0.5f,
-	-0.5f, 0.5f, -0.5f,
-	0.5f, 0.5f, -0.5f,
-
-	0.5f, -0.5f, 0.5f,
-	0.5f, -0.5f, -0.5f,
-	-0.5f, -0.5f, 0.5f,
-	-0.5f, -0.5f, 0.5f,
-	0.5f, -0.5f, -0.5f,
-	-0.5f, -0.5f, -0.5f,
-};
-
-const float GameManager::cube_normals_data[] = {
-	0.0f, 0.0f, -1.0f,
-	0.0f, 0.0f, -1.0f,
-	0.0f, 0.0f, -1.0f,
-	0.0f, 0.0f, -1.0f,
-	0.0f, 0.0f, -1.0f,
-	0.0f, 0.0f, -1.0f,
-
-	-1.0f, 0.0f, 0.0f,
-	-1.0f, 0.0f, 0.0f,
-	-1.0f, 0.0f, 0.0f,
-	-1.0f, 0.0f, 0.0f,
-	-1.0f, 0.0f, 0.0f,
-	-1.0f, 0.0f, 0.0f,
-
-	0.0f, 0.0f, 1.0f,
-	0.0f, 0.0f, 1.0f,
-	0.0f, 0.0f, 1.0f,
-	0.0f, 0.0f, 1.0f,
-	0.0f, 0.0f, 1.0f,
-	0.0f, 0.0f, 1.0f,
-
-	1.0f, 0.0f, 0.0f,
-	1.0f, 0.0f, 0.0f,
-	1.0f, 0.0f, 0.0f,
-	1.0f, 0.0f, 0.0f,
-	1.0f, 0.0f, 0.0f,
-	1.0f, 0.0f, 0.0f,
-
-	0.0f, -1.0f, 0.0f,
-	0.0f, -1.0f, 0.0f,
-	0.0f, -1.0f, 0.0f,
-	0.0f, -1.0f, 0.0f,
-	0.0f, -1.0f, 0.0f,
-	0.0f, -1.0f, 0.0f,
-
-	0.0f, 1.0f, 0.0f,
-	0.0f, 1.0f, 0.0f,
-	0.0f, 1.0f, 0.0f,
-	0.0f, 1.0f, 0.0f,
-	0.0f, 1.0f, 0.0f,
-	0.0f, 1.0f, 0.0f,
-};
-
-GameManager::GameManager() {
+const float GameManager::simulation_timestep = 1.0f / 60.0f;
+const float GameManager::max_frame_time = 0.25f;
+const unsigned long GameManager::warm_up_frames = 120;
+const double GameManager::gpu_time_target = 0.9 / 60.0;
+const float GameManager::paged_model_size = 20.0f;
+
+GameManager::GameManager(unsigned int window_width, unsigned int window_height) {
+	this->window_width = window_width;
+	this->window_height = window_height;
 	fps_timer.restart();
 	showDebugView = false;
+	showDebugDraw = false;
 
 	render_mode = RENDERMODE_FLAT;
 	zoom = 1;
@@ -117,6 +42,30 @@ GameManager::GameManager() {
 	far_plane = 30.0f;
 	fovy = 45.0f;
 	light.position = glm::vec3(10, 0, 0);
+	light.previous_position = light.position;
+
+	swap_mode = FramePacer::SWAPMODE_VSYNC;
+	frame_rate_cap = 0.0;
+	screenshot_requests = 0;
+	screenshot_number = 0;
+	directional_light = false;
+	shadow_filter = ShadowMaps::FILTER_PCF3X3;
+	point_lights_enabled = false;
+	particles_enabled = false;
+	particle_time = 0.0;
+	anti_aliasing = ScreenshotFBO::AA_MSAA;
+	dynamic_resolution_enabled = false;
+	for (unsigned int i=0; i<3; ++i) {
+		aa_timings[i].total = 0.0;
+		aa_timings[i].frames = 0;
+	}
+	running = false;
+
+	allocation_stats.frames = 0;
+	allocation_stats.frames_allocating = 0;
+	allocation_stats.max_allocations = 0;
+	cluster_stats.triangles = 0;
+	cluster_stats.culled_triangles = 0;
 }
 
 GameManager::~GameManager() {
@@ -134,12 +83,14 @@ void GameManager::createOpenGLContext() {
 	SDL_GL_SetAttribute(SDL_GL_GREEN_SIZE, 8); // Use framebuffer with 8 bit for green
 	SDL_GL_SetAttribute(SDL_GL_BLUE_SIZE, 8); // Use framebuffer with 8 bit for blue
 	SDL_GL_SetAttribute(SDL_GL_ALPHA_SIZE, 8); // Use framebuffer with 8 bit for alpha
-    SDL_GL_SetAttribute(SDL_GL_MULTISAMPLEBUFFERS, 1);
-    SDL_GL_SetAttribute(SDL_GL_MULTISAMPLESAMPLES, 4);
+	// Anti-aliasing is done offscreen, and the result cannot be blitted
+	// into a multisampled window
+	SDL_GL_SetAttribute(SDL_GL_MULTISAMPLEBUFFERS, 0);
+	SDL_GL_SetAttribute(SDL_GL_MULTISAMPLESAMPLES, 0);
 
 	// Initalize video
 	main_window = SDL_CreateWindow("Westerdals - PG6200 Reworked Template", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
-		window_width, window_height, SDL_WINDOW_OPENGL | SDL_WINDOW_SHOWN);
+		window_width, window_height, SDL_WINDOW_OPENGL | SDL_WINDOW_SHOWN | SDL_WINDOW_RESIZABLE);
 	if (!main_window) {
 		THROW_EXCEPTION("SDL_CreateWindow failed");
 	}
@@ -163,6 +114,8 @@ void GameManager::createOpenGLContext() {
 	// Lets do the ugly thing of swallowing the error....
 	glGetError();
 
+	frame_pacer.setSwapMode(swap_mode);
+
 	cam_trackball.setWindowSize(window_width, window_height);
 }
 
@@ -170,6 +123,7 @@ void GameManager::setOpenGLStates() {
 	glEnable(GL_DEPTH_TEST);
 	glDepthFunc(GL_LEQUAL);
 	glEnable(GL_CULL_FACE);
+	glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS); // Filter across cube map faces
 	glClearColor(0.0, 0.0, 0.5, 1.0);
 	glViewport(0, 0, window_width, window_height);
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
@@ -186,47 +140,76 @@ void GameManager::createMatrices() {
 }
 
 void GameManager::createSimpleProgram() {
-	std::string fs_src = readFile("shaders/basic_phong.frag");
-	std::string vs_src = readFile("shaders/basic_phong.vert");
+	Timer compile_timer;
+	program_cache.reset(new GLUtils::ProgramCache());
 
-	program.reset(new Program(vs_src, fs_src));
+	// Edit the files while running to see the changes right away
+	shader_reloader.reset(new ShaderReloader("shaders"));
 
-	//Set uniforms for the program.
-	program->use();
+	// Compiled with the features each render mode needs as it comes up
+	phong_variants.reset(new ShaderVariants(program_cache.get(), "shaders", "basic_phong.vert", "", "basic_phong.frag", shader_reloader.get()));
+	program = phong_variants->getVariant(ShaderVariants::FEATURE_LIGHTING);
 
-	program->disuse();
+	std::string fs_src = readFile("shaders/fbo.frag");
+	std::string vs_src = readFile("shaders/fbo.vert");
 
-	fs_src = readFile("shaders/fbo.frag");
-	vs_src = readFile("shaders/fbo.vert");
-
-	debugview_program.reset(new Program(vs_src, fs_src));
+	debugview_program = program_cache->getProgram(vs_src, fs_src);
+	std::vector<std::string> fxaa_defines(1, "FXAA");
+	fxaa_program = program_cache->getProgram(vs_src, GLUtils::insertDefines(fs_src, fxaa_defines));
+	std::vector<std::string> upscale_defines(1, "SHARPEN");
+	upscale_program = program_cache->getProgram(vs_src, GLUtils::insertDefines(fs_src, upscale_defines));
 
+	// Geometry shaders are slow on many GPUs and software rasterizers,
+	// so they are only used where they amplify geometry (layered rendering)
 	fs_src = readFile("shaders/cube_map.frag");
 	vs_src = readFile("shaders/cube_map.vert");
-	// For this one we will also add a geometry shader!
-	// we will need to do some primitive offsetting when we add shadows
-	std::string gs_src = readFile("shaders/cube_map.geom");
 
 	// alternativly to a separate variable to shader collections we could organize them into a map
 	//shaders.insert(std::make_pair("cube_shaders", new Program(vs_src, fs_src)));
 	//shaders["cube_shaders"]->use();
-	cube_program.reset(new Program(vs_src, gs_src, fs_src));
-
-	cube_program->use();
-	diffuse_cubemap.reset(new GLUtils::CubeMap("cubemaps/diffuse/", "jpg"));
-	glProgramUniform1i(cube_program->name, cube_program->getUniform("cubemap"), 0);
-	cube_program->disuse();
+	cube_program = program_cache->getProgram(vs_src, fs_src);
+
+	std::cout << "Shader programs: " << program_cache->getBinaryLoads() << " loaded from binary cache, "
+		<< program_cache->getLinkedPrograms() << " linked from " << program_cache->getCompiledShaders() << " compiled stages ("
+		<< program_cache->getReusedShaders() << " reused) in " << compile_timer.elapsed()*1000.0 << " ms";
+	if (!program_cache->areBinariesSupported())
+		std::cout << " (program binaries not supported by the driver)";
+	std::cout << std::endl;
+
+	// The pixels are only needed until the lighting has been precomputed
+	Timer ibl_timer;
+	diffuse_cubemap.reset(new GLUtils::CubeMap("cubemaps/diffuse/", "jpg", job_system.get(), true));
+	diffuse_cubemap->generateMipmaps();
+	environment_lighting.reset(new EnvironmentLighting(*diffuse_cubemap, "cubemaps/diffuse/ibl.cache", program_cache.get(), job_system.get()));
+	diffuse_cubemap->releasePixels();
+	std::cout << "Image based lighting " << (environment_lighting->wasCached() ? "loaded from cache" : "precomputed")
+		<< " in " << ibl_timer.elapsed()*1000.0 << " ms" << std::endl;
+
+	skybox.reset(new Skybox(program_cache.get(), diffuse_cubemap, shader_reloader.get()));
+	shadow_maps.reset(new ShadowMaps(program_cache.get(), shader_reloader.get()));
+	debug_draw.reset(new DebugDraw(program_cache.get(), shader_reloader.get()));
+	clustered_lights.reset(new ClusteredLights(job_system.get()));
+
+	shader_reloader->add(debugview_program, "fbo.vert", "", "fbo.frag");
+	shader_reloader->add(fxaa_program, "fbo.vert", "", "fbo.frag", ShaderReloader::ReloadCallback(), fxaa_defines);
+	shader_reloader->add(upscale_program, "fbo.vert", "", "fbo.frag", ShaderReloader::ReloadCallback(), upscale_defines);
+	shader_reloader->add(cube_program, "cube_map.vert", "", "cube_map.frag");
 }
 
 void GameManager::createVAO() {
 	// We wan two VAO pointers, we tell OpenGL where it can start counting (to two)
 	// look inside the header to alter the size of our vao array.
-	glGenVertexArrays(2, &main_scene_vao[0]);
+	glGenVertexArrays(1, &main_scene_vao[0]);
 	glBindVertexArray(main_scene_vao[0]);
 	CHECK_GL_ERROR();
 
 	// Seperate VBOs
-	model.reset(new Model("models/bunny.obj", false));
+	// Streamed straight into the buffers, so large scans fit in memory,
+	// and split into clusters that are culled separately
+	Timer load_timer;
+	model.reset(new Model("models/bunny.obj", false, job_system.get(), true, true));
+	std::cout << "Model loaded in " << load_timer.elapsed()*1000.0 << " ms, peak resident memory "
+		<< MemoryUsage::getPeakResidentBytes() / (1024*1024) << " MB" << std::endl;
 
 	model->getVertices()->bind();
 	program->setAttributePointer("position", 3);
@@ -235,23 +218,81 @@ void GameManager::createVAO() {
 	program->setAttributePointer("normal", 3);
 	CHECK_GL_ERROR();
 
-	// Setting up cube VBO data with its own VAO reference
-	glBindVertexArray(main_scene_vao[1]);
-	cube_vertices.reset(new VBO<GL_ARRAY_BUFFER>(cube_vertices_data, sizeof(cube_vertices_data)));
-	cube_normals.reset(new VBO<GL_ARRAY_BUFFER>(cube_normals_data, sizeof(cube_normals_data)));
+	model->getVertices()->unbind(); //Unbinds both vertices and normals
 
-	cube_vertices->bind();
-	program->setAttributePointer("position", 3);
+	glBindVertexArray(0);
 
-	cube_normals->bind();
-	program->setAttributePointer("normal", 3);
+	// Centered and scaled to paged_model_size across, so the camera
+	// can move around inside it
+	if (!paged_model_filename.empty()) {
+		Timer paging_timer;
+		geometry_pager.reset(new GeometryPager(paged_model_filename, paged_model_filename + ".chunks", job_system.get()));
+		glm::vec3 extent = geometry_pager->getMax() - geometry_pager->getMin();
+		float size = std::max(extent.x, std::max(extent.y, extent.z));
+		paged_model_matrix = glm::scale(glm::mat4(1.0f), glm::vec3(paged_model_size / std::max(size, 1e-6f)));
+		paged_model_matrix = glm::translate(paged_model_matrix, -0.5f*(geometry_pager->getMin() + geometry_pager->getMax()));
+		std::cout << "Paged model: " << geometry_pager->getNumChunks() << " chunks "
+			<< (geometry_pager->wasCached() ? "opened from cache" : "split and cached") << " in " << paging_timer.elapsed()*1000.0
+			<< " ms, " << geometry_pager->getNumSlots() << " resident at most" << std::endl;
+	}
 
-	model->getVertices()->unbind(); //Unbinds both vertices and normals
+	// A grid of characters on the floor around the model, out of step
+	// with each other, and half of them blending in a second clip
+	if (!animated_model_filename.empty()) {
+		Timer animated_timer;
+		animated_model.reset(new Model(animated_model_filename, false, job_system.get()));
+		Program& skinned_program = *phong_variants->getVariant(ShaderVariants::FEATURE_LIGHTING
+			| ShaderVariants::FEATURE_INSTANCING | ShaderVariants::FEATURE_SKINNING);
+		animated_crowd.reset(new AnimatedCrowd(animated_model.get(), job_system.get(), skinned_program, crowd_size*crowd_size));
+
+		std::mt19937 random(4711);
+		std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+		unsigned int num_clips = static_cast<unsigned int>(animated_model->getSkeleton()->getClips().size());
+		for (unsigned int i=0; i<crowd_size*crowd_size; ++i) {
+			AnimatedCrowd::Character character;
+			glm::vec3 position((i % crowd_size + 0.5f - 0.5f*crowd_size) * 0.6f, -0.75f, (i / crowd_size + 0.5f - 0.5f*crowd_size) * 0.6f);
+			character.transform = glm::scale(glm::translate(glm::mat4(1.0f), position), glm::vec3(0.5f));
+			character.transform = glm::rotate(character.transform, 360.0f*unit(random), glm::vec3(0.0f, 1.0f, 0.0f));
+			character.time_offset = 10.0f*unit(random);
+			character.speed = 0.8f + 0.4f*unit(random);
+			if (num_clips > 0) {
+				character.clip = i % num_clips;
+				character.blend_clip = (i + 1) % num_clips;
+				character.blend_weight = (i % 2 == 0) ? 0.0f : unit(random);
+			}
+			animated_crowd->addCharacter(character);
+		}
+		std::cout << "Animated model: " << animated_model->getSkeleton()->getNumBones() << " bones, " << num_clips
+			<< " clips, " << animated_crowd->getNumCharacters() << " characters, loaded in " << animated_timer.elapsed()*1000.0
+			<< " ms" << std::endl;
+	}
 
-	glBindVertexArray(0);
+	// Rows of baked copies behind the model, all drawn with one call
+	if (!baked_model_filename.empty()) {
+		Timer baked_timer;
+		baked_model.reset(new Model(baked_model_filename, false, job_system.get()));
+		Program& baked_program = *phong_variants->getVariant(ShaderVariants::FEATURE_LIGHTING
+			| ShaderVariants::FEATURE_INSTANCING | ShaderVariants::FEATURE_VERTEX_ANIMATION);
+		vertex_animation.reset(new VertexAnimation(baked_model.get(), 0, job_system.get(), baked_program, 30.0f,
+			baked_crowd_size*baked_crowd_size));
+
+		std::mt19937 random(1729);
+		std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+		for (unsigned int i=0; i<baked_crowd_size*baked_crowd_size; ++i) {
+			glm::vec3 position((i % baked_crowd_size + 0.5f - 0.5f*baked_crowd_size) * 0.3f, -0.75f, -6.0f - (i / baked_crowd_size) * 0.3f);
+			glm::mat4 transform = glm::scale(glm::translate(glm::mat4(1.0f), position), glm::vec3(0.25f));
+			transform = glm::rotate(transform, 360.0f*unit(random), glm::vec3(0.0f, 1.0f, 0.0f));
+			vertex_animation->addInstance(transform, 10.0f*unit(random));
+		}
+		std::cout << "Baked model: " << vertex_animation->getNumFrames() << " frames in "
+			<< vertex_animation->getTextureBytes() / 1024 << " KiB, baked in " << vertex_animation->getBakeTime()*1000.0 << " ms, "
+			<< vertex_animation->getNumInstances() << " instances, loaded in " << baked_timer.elapsed()*1000.0 << " ms" << std::endl;
+	}
 
 	initDebugView();
-	screenshot_fbo.reset(new ScreenshotFBO(1024, 1024));
+	screenshot_fbo.reset(new ScreenshotFBO(window_width, window_height));
+	aa_timer.reset(new GLUtils::TimerQuery());
+	dynamic_resolution.reset(new DynamicResolution(gpu_time_target));
 
 	// Interleaved VBOs
 	/*
@@ -268,6 +309,23 @@ void GameManager::createVAO() {
 	CHECK_GL_ERROR();
 }
 
+void GameManager::createPointLights() {
+	// A fixed seed, so every run shows the same lights
+	std::mt19937 random(1234);
+	std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+	point_lights.resize(num_point_lights);
+	point_light_speeds.resize(num_point_lights);
+	for (unsigned int i=0; i<num_point_lights; ++i) {
+		float angle = unit(random) * 6.2831853f;
+		float distance = 1.5f + 4.5f * unit(random);
+		point_lights[i].position = glm::vec3(distance * cosf(angle), 4.0f * unit(random) - 2.0f, distance * sinf(angle));
+		point_lights[i].radius = 0.5f + unit(random);
+		point_lights[i].colour = glm::vec3(unit(random), unit(random), unit(random));
+		point_light_speeds[i] = 10.0f + 50.0f * unit(random);
+	}
+}
+
 void GameManager::init() {
 	// Initialize SDL
 	if (SDL_Init(SDL_INIT_EVERYTHING) < 0) {
@@ -280,11 +338,15 @@ void GameManager::init() {
 	ilInit();
 	iluInit();
 
+	job_system.reset(new JobSystem());
+	frame_arenas.resize(job_system->getNumThreads());
+
 	createOpenGLContext();
 	setOpenGLStates();
 	createMatrices();
 	createSimpleProgram();
 	createVAO();
+	createPointLights();
 }
 
 void GameManager::initDebugView(){
@@ -310,36 +372,209 @@ void GameManager::initDebugView(){
 	glBindBuffer(GL_ARRAY_BUFFER, 0);
 }
 
-void GameManager::renderMeshRecursive(MeshPart& mesh, const std::shared_ptr<Program>& program, 
-		const glm::mat4& view_matrix, const glm::mat4& model_matrix, glm::mat4& projection_matrix, glm::vec3 light_position) {
-	//Create modelview matrix
-	glm::mat4 meshpart_model_matrix = model_matrix * mesh.transform;
-	glm::mat4 model_view_mat = view_matrix*meshpart_model_matrix;
-	glm::mat4 model_mat_inverse = glm::inverse(meshpart_model_matrix);
-	glm::mat4 model_view_mat_inverse = glm::inverse(model_view_mat);
+void GameManager::recordDrawList(const FrameSnapshot& frame, glm::vec3 light_position) {
+	const glm::mat4& view_matrix = frame.camera.view;
+	Frustum frustum(frame.camera.projection);
+
+	// One loop over the parts of all objects, so many small objects
+	// are spread over the threads as well as one big one
+	std::vector<unsigned int, ArenaAllocator<unsigned int> > object_part_offsets(ArenaAllocator<unsigned int>(&frame_arenas[0]));
+	object_part_offsets.reserve(frame.objects.size());
+	unsigned int total_parts = 0;
+	for (size_t i=0; i<frame.objects.size(); ++i) {
+		object_part_offsets.push_back(total_parts);
+		total_parts += static_cast<unsigned int>(frame.objects[i].model->getFlatParts().size());
+	}
+
+	static const unsigned int grain = 64;
+	draw_list.reset(frame_arenas.data(), static_cast<unsigned int>(frame_arenas.size()));
+	job_system->parallelFor(total_parts, grain, [&](unsigned int begin, unsigned int end, unsigned int thread_index) {
+		size_t object = std::upper_bound(object_part_offsets.begin(), object_part_offsets.end(), begin) - object_part_offsets.begin() - 1;
+
+		// The transforms of each object's run of parts are computed as a batch,
+		// as all parts and the objects are affine. Runs are cut at grain parts,
+		// as chunks may be longer
+		TransformBatch::Result transforms[grain];
+		unsigned long long cluster_triangles = 0, culled_triangles = 0;
+		unsigned int run_begin = begin;
+		while (run_begin < end) {
+			unsigned int object_end = (object + 1 < object_part_offsets.size()) ? object_part_offsets[object + 1] : total_parts;
+			if (object_end == run_begin) {
+				++object; // Done with the object, or it has no parts
+				continue;
+			}
+			unsigned int run_end = std::min(std::min(end, object_end), run_begin + grain);
+			const RenderObject& render_object = frame.objects[object];
+			unsigned int offset = object_part_offsets[object];
+			render_object.model->getPartTransforms().compute(render_object.transform, view_matrix, light_position,
+				run_begin - offset, run_end - offset, transforms);
+
+			for (unsigned int i=run_begin; i<run_end; ++i) {
+				const TransformBatch::Result& transform = transforms[i - run_begin];
+				if (!frustum.intersectsSphere(transform.view_center, transform.view_radius))
+					continue;
+
+				const FlatMeshPart& part = render_object.model->getFlatParts()[i - offset];
+				DrawPacket packet;
+				packet.sort_key = DrawList::makeSortKey(0, -transform.view_center.z);
+				packet.model_view = transform.model_view;
+				packet.light_position = transform.light_position;
+				packet.camera_position = transform.camera_position;
+				packet.colour = glm::vec3(.0f, 1.8f, .8f);
+				const std::vector<MeshCluster>& clusters = render_object.model->getClusters();
+				if (clusters.empty()) {
+					packet.first = part.first;
+					packet.count = part.count;
+					draw_list.record(thread_index, packet);
+					continue;
+				}
+
+				// Cull the clusters of the part, and draw runs of
+				// consecutive survivors with one call each
+				const glm::mat4& model_view = transform.model_view;
+				float scale = Frustum::getMaxScale(model_view);
+				bool mirrored = glm::dot(glm::cross(glm::vec3(model_view[0]), glm::vec3(model_view[1])), glm::vec3(model_view[2])) < 0.0f;
+				packet.count = 0;
+				for (unsigned int c=part.first_cluster; c<part.first_cluster + part.num_clusters; ++c) {
+					const MeshCluster& cluster = clusters[c];
+					cluster_triangles += cluster.count / 3;
+					if (cluster.isBackFacing(transform.camera_position, mirrored)
+							|| !frustum.intersectsSphere(glm::vec3(model_view * glm::vec4(cluster.center, 1.0f)), cluster.radius*scale)) {
+						culled_triangles += cluster.count / 3;
+						continue;
+					}
+					if (packet.count > 0 && packet.first + packet.count == cluster.first) {
+						packet.count += cluster.count;
+						continue;
+					}
+					if (packet.count > 0)
+						draw_list.record(thread_index, packet);
+					packet.first = cluster.first;
+					packet.count = cluster.count;
+				}
+				if (packet.count > 0)
+					draw_list.record(thread_index, packet);
+			}
+			run_begin = run_end;
+		}
+		cluster_stats.triangles += cluster_triangles;
+		cluster_stats.culled_triangles += culled_triangles;
+	});
+
+	draw_list.sort();
+
+	if (geometry_pager) {
+		paged_draw_list.reset(frame_arenas.data(), static_cast<unsigned int>(frame_arenas.size()));
+		geometry_pager->record(paged_draw_list, 0, paged_model_matrix, view_matrix, light_position);
+		paged_draw_list.sort();
+	}
+}
+
+void GameManager::submitDrawLists(Program& program, const glm::mat4& projection) {
+	glBindVertexArray(main_scene_vao[0]);
+	draw_list.submit(program, projection);
+	if (geometry_pager) {
+		glBindVertexArray(geometry_pager->getVAO());
+		paged_draw_list.submit(program, projection);
+		glBindVertexArray(main_scene_vao[0]);
+	}
+}
+
+void GameManager::renderDebugDraw(const FrameSnapshot& frame, const glm::vec3& light_position) {
+#ifdef DEBUGDRAW_ENABLED
+	debug_draw->begin(frame.camera.projection * frame.camera.view, screenshot_fbo->getWidth(), screenshot_fbo->getHeight());
+
+	// The world axes turn with the trackball
+	debug_draw->axes(glm::mat4(1.0f), 1.0f);
+
+	// Bounding spheres of the parts, and the cone axes of their
+	// clusters, which show which way the surface faces
+	for (size_t i=0; i<frame.objects.size(); ++i) {
+		const Model* object_model = frame.objects[i].model;
+		const std::vector<MeshCluster>& clusters = object_model->getClusters();
+		for (size_t j=0; j<object_model->getFlatParts().size(); ++j) {
+			const FlatMeshPart& part = object_model->getFlatParts()[j];
+			glm::mat4 transform = frame.objects[i].transform * part.transform;
+			debug_draw->sphere(part.center, part.radius, glm::vec3(1.0f, 1.0f, 0.0f), transform);
+			for (unsigned int c=part.first_cluster; c<part.first_cluster + part.num_clusters; ++c) {
+				glm::vec3 center = glm::vec3(transform * glm::vec4(clusters[c].center, 1.0f));
+				glm::vec3 axis = glm::vec3(transform * glm::vec4(clusters[c].cone_axis * clusters[c].radius, 0.0f));
+				debug_draw->line(center, center + axis, glm::vec3(0.0f, 1.0f, 1.0f));
+			}
+		}
+	}
+
+	if (frame.directional_light) {
+		debug_draw->line(glm::vec3(0.0f), light_position, glm::vec3(1.0f));
+	}
+	else {
+		debug_draw->sphere(light_position, 0.2f, glm::vec3(1.0f));
+		debug_draw->text(light_position, "LIGHT", glm::vec3(1.0f));
+	}
+	for (size_t i=0; i<frame.point_lights.size(); ++i)
+		debug_draw->sphere(frame.point_lights[i].position, frame.point_lights[i].radius, frame.point_lights[i].colour);
 
-	glm::vec3 light_pos = glm::mat3(model_mat_inverse) * light_position / model_mat_inverse[3].w;
-	glm::vec3 camera_pos = glm::vec3(model_view_mat_inverse[3] / model_view_mat_inverse[3].w);
+	if (geometry_pager)
+		debug_draw->box(geometry_pager->getMin(), geometry_pager->getMax(), glm::vec3(1.0f, 0.5f, 0.0f), paged_model_matrix);
 
-	program->use();
+	static const char* mode_names[4] = { "PHONG", "WIREFRAME", "HIDDEN LINE", "FLAT" };
+	std::stringstream status;
+	status << mode_names[frame.render_mode] << "  " << frame_pacer.getAverageFrameTime()*1000.0 << " MS";
+	debug_draw->screenText(DebugDraw::glyph_size, screenshot_fbo->getHeight() - 2.0f*DebugDraw::glyph_size, status.str(), glm::vec3(1.0f));
 
-	glUniformMatrix4fv(program->getUniform("model_view_mat"), 1, 0, glm::value_ptr(model_view_mat));
-	glUniformMatrix4fv(program->getUniform("proj_mat"), 1, 0, glm::value_ptr(projection_matrix));
+	debug_draw->render();
+#endif
+}
 
-	glUniform3fv(program->getUniform("colour"), 1, glm::value_ptr(glm::vec3(.0f, 1.8f, .8f)));
-	glUniform3fv(program->getUniform("light_position"), 1, glm::value_ptr(light_pos));
-	glUniform3fv(program->getUniform("camera_position"), 1, glm::value_ptr(camera_pos));
+void GameManager::createParticleSystem() {
+	// A fountain from the top of the model, which follows the model around.
+	// Without a node, the emitter is placed in the centered model space
+	particle_system.reset(new ParticleSystem(program_cache.get(), shader_reloader.get(), fountain_particles));
+	ParticleSystem::Emitter fountain;
+	fountain.model = model.get();
+	fountain.position = glm::vec3(0.0f, 0.5f, 0.0f);
+	fountain.velocity = glm::vec3(0.0f, 1.0f, 0.0f);
+	fountain.spread = 0.3f;
+	fountain.lifetime = 3.0f;
+	fountain.size = 0.01f;
+	fountain.colour = glm::vec3(0.05f, 0.02f, 0.005f);
+	fountain.num_particles = fountain_particles;
+	particle_system->addEmitter(fountain);
+}
 
-	glDrawArrays(GL_TRIANGLES, mesh.first, mesh.count);
-	for (int i=0; i<(int)mesh.children.size(); ++i)
-		renderMeshRecursive(mesh.children.at(i), program, view_matrix, meshpart_model_matrix, projection_matrix, light_position);
+void GameManager::renderCrowd(const FrameSnapshot& frame, const glm::vec3& light_position) {
+	double time = Timer::getCurrentTime();
+	unsigned int features = ShaderVariants::FEATURE_LIGHTING | ShaderVariants::FEATURE_INSTANCING;
+	if (frame.render_mode == RENDERMODE_PHONG) {
+		features |= ShaderVariants::FEATURE_SHADOWS;
+		if (frame.directional_light)
+			features |= ShaderVariants::FEATURE_DIRECTIONAL_LIGHT;
+		if (!frame.point_lights.empty())
+			features |= ShaderVariants::FEATURE_CLUSTERED_LIGHTS;
+	}
 
-	program->disuse();
+	// The variants differ only in how the vertices are animated
+	auto getProgram = [&](unsigned int animation) -> Program& {
+		Program& program = *phong_variants->getVariant(features | animation);
+		if (frame.render_mode == RENDERMODE_PHONG) {
+			shadow_maps->apply(program, frame.camera.view);
+			if (!frame.point_lights.empty())
+				clustered_lights->apply(program);
+		}
+		return program;
+	};
+	if (animated_crowd) {
+		animated_crowd->update(time);
+		animated_crowd->render(getProgram(ShaderVariants::FEATURE_SKINNING), frame.camera.view, frame.camera.projection, light_position);
+	}
+	if (vertex_animation)
+		vertex_animation->render(getProgram(ShaderVariants::FEATURE_VERTEX_ANIMATION), frame.camera.view, frame.camera.projection,
+			light_position, time);
 }
 
-void GameManager::renderDebugView()
+void GameManager::renderDebugView(unsigned int width, unsigned int height)
 {
-	glViewport(0, 0, window_width, window_height);
+	glViewport(0, 0, width, height);
 	glBindFramebufferEXT(GL_FRAMEBUFFER, 0);
 
 	glEnable(GL_BLEND);
@@ -350,6 +585,9 @@ void GameManager::renderDebugView()
 
 	glUniform1i(debugview_program->getUniform("texture"), 0);
 	glBindTexture(GL_TEXTURE_2D, screenshot_fbo->getTexture());
+	glm::vec2 tex_scale(screenshot_fbo->getWidth() / static_cast<float>(screenshot_fbo->getAllocatedWidth()),
+		screenshot_fbo->getHeight() / static_cast<float>(screenshot_fbo->getAllocatedHeight()));
+	glProgramUniform2fv(debugview_program->name, debugview_program->getUniform("tex_scale"), 1, glm::value_ptr(tex_scale));
 
 	// this is independent of the transformations to the world
 	// we are talking about window space
@@ -365,77 +603,91 @@ void GameManager::renderDebugView()
 	glDisable(GL_BLEND);
 }
 
-void GameManager::renderCubeMap(glm::mat4 view){
-	cube_program->use();
-
-	glActiveTexture(GL_TEXTURE0);
-	diffuse_cubemap->bindTexture(GL_TEXTURE0);
-
-	glBindVertexArray(main_scene_vao[1]);
-
-	glm::mat4 model_mat = glm::scale(glm::mat4(1.0f), glm::vec3(far_plane*0.75f));
-	glm::mat4 model_view_mat = view * model_mat;
+void GameManager::update(float dt) {
+	light.previous_position = light.position;
 
-	glm::mat4 model_mat_inverse = glm::inverse(model_mat);
-	glm::mat4 model_view_mat_inverse = glm::inverse(model_view_mat);
-	glm::mat3 normal_mat = glm::transpose(glm::mat3(model_view_mat_inverse));
-
-	glm::vec3 light_pos = glm::mat3(model_mat_inverse) * light.position / model_mat_inverse[3].w;
-	glm::vec3 camera_pos = glm::vec3(model_view_mat_inverse[3] / model_view_mat_inverse[3].w);
-	
-	cube_program->use();
-	glUniform3fv(cube_program->getUniform("colour"), 1, glm::value_ptr(glm::vec3(1.0f, 0.8f, 0.8f)));
-
-	glUniform3fv(cube_program->getUniform("light_position"), 1, glm::value_ptr(light_pos));
-	glUniform3fv(cube_program->getUniform("camera_position"), 1, glm::value_ptr(camera_pos));
-
-	glUniformMatrix4fv(cube_program->getUniform("model_view_mat"), 1, 0, glm::value_ptr(model_view_mat));
-	glUniformMatrix4fv(cube_program->getUniform("proj_mat"), 1, 0, glm::value_ptr(camera.projection));
-	// glUniformMatrix3fv(cube_program->getUniform("normal_mat"), 1, 0, glm::value_ptr(normal_mat));
-	glDrawArrays(GL_TRIANGLES, 0, 36);
-	cube_program->disuse();
-}
-
-void GameManager::render() {
-	float elapsed = fps_timer.elapsedAndRestart();
-
-	glm::mat4 rotation = glm::rotate(elapsed*20.f, 0.0f, 1.0f, 0.0f);
+	glm::mat4 rotation = glm::rotate(dt*20.f, 0.0f, 1.0f, 0.0f);
 	light.position = glm::mat3(rotation) * light.position;
 	light.view = glm::lookAt(light.position, glm::vec3(0), glm::vec3(0.0, 1.0, 0.0));
 
-	// change camera orientation
-	glm::mat4 view = camera.view * cam_trackball.getTransform();
+	if (point_lights_enabled) {
+		for (size_t i=0; i<point_lights.size(); ++i) {
+			glm::mat4 light_rotation = glm::rotate(dt*point_light_speeds[i], 0.0f, 1.0f, 0.0f);
+			point_lights[i].position = glm::mat3(light_rotation) * point_lights[i].position;
+		}
+	}
+}
 
-	// just showcasing how we would render to a framebuffer
-	// we render the textures written to our FBO on the debugview
-	if (!showDebugView) {
-		// Default: to window rendering
-		glViewport(0, 0, window_width, window_height);
-		glBindFramebufferEXT(GL_FRAMEBUFFER, 0);
+void GameManager::render(const FrameSnapshot& frame) {
+	// The simulation runs at its own pace, so find out how far we are past
+	// the latest step. The light orbits the origin, so blend the two last
+	// steps and keep the radius
+	float interpolation = static_cast<float>((Timer::getCurrentTime() - frame.step_time) / simulation_timestep);
+	interpolation = glm::clamp(interpolation, 0.0f, 1.0f);
+	glm::vec3 light_position = glm::mix(frame.light.previous_position, frame.light.position, interpolation);
+	light_position = glm::normalize(light_position) * glm::length(frame.light.position);
+
+	const glm::mat4& view = frame.camera.view;
+
+	// Results arrive a few frames late, so they are collected before
+	// the frame that the mode may have changed in
+	double gpu_time;
+	unsigned int aa_mode;
+	while (aa_timer->getResult(gpu_time, aa_mode)) {
+		aa_timings[aa_mode].total += gpu_time;
+		++aa_timings[aa_mode].frames;
+		if (frame.dynamic_resolution)
+			dynamic_resolution->addMeasurement(gpu_time);
 	}
-	else {
-		// Render to FBO and set the viewport to cover the pixels in the FBO texture
-		screenshot_fbo->bind();
-		glViewport(0, 0, screenshot_fbo->getWidth(), screenshot_fbo->getHeight());
+
+	// Changing the rendered part of the buffers is free, they are only
+	// reallocated when the window grows past them
+	float scale = frame.dynamic_resolution ? dynamic_resolution->getScale() : 1.0f;
+	screenshot_fbo->resize(static_cast<unsigned int>(frame.window_width * scale + 0.5f),
+		static_cast<unsigned int>(frame.window_height * scale + 0.5f));
+
+	// Shadow maps first, as they use their own framebuffers and viewports.
+	// They are cached, so this only renders when something has moved
+	if (frame.render_mode == RENDERMODE_PHONG) {
+		shadow_casters.clear();
+		for (size_t i=0; i<frame.objects.size(); ++i) {
+			ShadowMaps::Caster caster = { frame.objects[i].model, frame.objects[i].transform, main_scene_vao[0] };
+			shadow_casters.push_back(caster);
+		}
+		shadow_maps->setFilter(frame.shadow_filter);
+		if (frame.directional_light)
+			shadow_maps->updateDirectionalLight(light_position, view, frame.camera.projection, shadow_casters.data(),
+				static_cast<unsigned int>(shadow_casters.size()));
+		else
+			shadow_maps->updatePointLight(light_position, near_plane, far_plane, shadow_casters.data(),
+				static_cast<unsigned int>(shadow_casters.size()));
 	}
 
+	// The scene is always rendered offscreen, and the anti-aliased
+	// result is copied to the window, the debug view and screenshots
+	aa_timer->begin(frame.anti_aliasing);
+	screenshot_fbo->bind(frame.anti_aliasing);
+	glViewport(0, 0, screenshot_fbo->getWidth(), screenshot_fbo->getHeight());
+
 	//Clear screen, and set the correct program
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-	renderCubeMap(view);
+	// Paging follows the camera, so chunks that come into view are
+	// read while the frame is being drawn
+	if (geometry_pager)
+		geometry_pager->update(paged_model_matrix, view, frame.camera.projection, screenshot_fbo->getHeight());
+	recordDrawList(frame, light_position);
+	environment_lighting->apply(*cube_program);
 
 	// program->use();
 	// glUniform3fv(program->getUniform("light_position"), 1, glm::value_ptr(light.position));
 
-	//Use lighting as default
-//	glUniform1i(program->getUniform("lighting"), 1);
-
 	//Render geometry
 	glBindVertexArray(main_scene_vao[0]);
-	switch (render_mode) {
+	switch (frame.render_mode) {
 	case RENDERMODE_WIREFRAME:
 		glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
-		glUniform1i(program->getUniform("lighting"), 0);
+		submitDrawLists(*phong_variants->getVariant(0), frame.camera.projection);
 		break;
 	case RENDERMODE_HIDDEN_LINE:
 		//first, render filled polygons with an offset in negative z-direction
@@ -444,30 +696,75 @@ void GameManager::render() {
 		glEnable(GL_POLYGON_OFFSET_FILL);
 		glPolygonOffset(1.1f, 4.0f);
 		//Render geometry to be offset here
-		renderMeshRecursive(model->getMesh(), cube_program, view, model_matrix, camera.projection, light.position);
+		submitDrawLists(*cube_program, frame.camera.projection);
 		glDisable(GL_POLYGON_OFFSET_FILL);
 
 		//then, render wireframe, without lighting
 		glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
-		glUniform1i(program->getUniform("lighting"), 0);
+		submitDrawLists(*phong_variants->getVariant(0), frame.camera.projection);
 		break;
 	case RENDERMODE_FLAT:
 		// TODO
+		glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+		submitDrawLists(*cube_program, frame.camera.projection);
 		break;
-	case RENDERMODE_PHONG:
+	case RENDERMODE_PHONG: {
+		unsigned int features = ShaderVariants::FEATURE_LIGHTING | ShaderVariants::FEATURE_SHADOWS;
+		if (frame.directional_light)
+			features |= ShaderVariants::FEATURE_DIRECTIONAL_LIGHT;
+		if (!frame.point_lights.empty())
+			features |= ShaderVariants::FEATURE_CLUSTERED_LIGHTS;
+		Program& phong_program = *phong_variants->getVariant(features);
+		shadow_maps->apply(phong_program, view);
+
+		if (!frame.point_lights.empty()) {
+			clustered_lights->update(frame.point_lights.data(), static_cast<unsigned int>(frame.point_lights.size()),
+				view, frame.camera.projection, screenshot_fbo->getWidth(), screenshot_fbo->getHeight());
+			clustered_lights->apply(phong_program);
+		}
+
 		glCullFace(GL_BACK);
 		glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+		submitDrawLists(phong_program, frame.camera.projection);
 		break;
+	}
 	default:
 		THROW_EXCEPTION("Rendermode not supported");
 	}
 
-	renderMeshRecursive(model->getMesh(), cube_program, view, model_matrix, camera.projection, light.position);
-
-	if(showDebugView)
-		renderDebugView();
+	// In the polygon mode of the render mode. The characters are skinned
+	// or baked on the GPU, so they cast no shadows into the cached shadow maps
+	if (animated_crowd || vertex_animation)
+		renderCrowd(frame, light_position);
 
+	// Last, so it only shades pixels the geometry left uncovered
+	glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+	skybox->render(view, frame.camera.projection);
 	glBindVertexArray(0);
+
+	// After everything opaque, as they do not write depth. They stop
+	// while turned off, and pick up where they were
+	double now = Timer::getCurrentTime();
+	if (frame.particles) {
+		if (!particle_system)
+			createParticleSystem();
+		for (size_t i=0; i<frame.objects.size(); ++i)
+			particle_system->setModelTransform(frame.objects[i].model, frame.objects[i].transform);
+		particle_system->update(std::min(static_cast<float>(now - particle_time), max_frame_time));
+		particle_system->render(view, frame.camera.projection);
+	}
+	particle_time = now;
+
+	// Into the scene, so the lines are anti-aliased with it
+	if (frame.show_debug_draw)
+		renderDebugDraw(frame, light_position);
+
+	screenshot_fbo->resolve(frame.anti_aliasing, *fxaa_program, debugview_vao);
+	aa_timer->end();
+	screenshot_fbo->present(frame.window_width, frame.window_height, *upscale_program, debugview_vao);
+
+	if(frame.show_debug_view)
+		renderDebugView(frame.window_width, frame.window_height);
 	CHECK_GL_ERROR();
 }
 
@@ -483,89 +780,283 @@ void GameManager::zoomOut() {
 		window_width / (float)window_height, near_plane, far_plane);
 }
 
+void GameManager::handleEvent(const SDL_Event& event) {
+	switch (event.type) {
+	case SDL_MOUSEBUTTONDOWN:
+		cam_trackball.rotateBegin(event.motion.x, event.motion.y);
+		break;
+	case SDL_MOUSEBUTTONUP:
+		cam_trackball.rotateEnd(event.motion.x, event.motion.y);
+		break;
+	case SDL_MOUSEMOTION:
+		cam_trackball.rotate(event.motion.x, event.motion.y, zoom);
+		break;
+	case SDL_KEYDOWN:
+		switch(event.key.keysym.sym) {
+		case SDLK_ESCAPE:
+			running = false;
+			break;
+		case SDLK_q:
+			if (event.key.keysym.mod & KMOD_CTRL) running = false; //Ctrl+q
+			break;
+		case SDLK_m:
+			showDebugView = !showDebugView;
+			break;
+		case SDLK_p:
+			++screenshot_requests;
+			break;
+		case SDLK_RIGHT:
+			camera.view = glm::translate(camera.view, glm::vec3(-0.1, 0.0, 0.0));
+			break;
+		case SDLK_LEFT:
+			camera.view = glm::translate(camera.view, glm::vec3(0.1, 0.0, 0.0));
+			break;
+		case SDLK_UP:
+			camera.view = glm::translate(camera.view, glm::vec3(0.0, -0.1, 0.0));
+			break;
+		case SDLK_DOWN:
+			camera.view = glm::translate(camera.view, glm::vec3(0.0, 0.1, 0.0));
+			break;
+		case SDLK_w:
+			camera.view = glm::translate(camera.view, glm::vec3(0.0, 0.0, 0.1));
+			break;
+		case SDLK_s:
+			camera.view = glm::translate(camera.view, glm::vec3(0.0, 0.0, -0.1));
+			break;
+		case SDLK_PLUS:
+			zoomIn();
+			break;
+		case SDLK_MINUS:
+			zoomOut();
+			break;
+		case SDLK_1:
+			render_mode = RENDERMODE_FLAT;
+			break;
+		case SDLK_2:
+			render_mode = RENDERMODE_PHONG;
+			break;
+		case SDLK_3:
+			render_mode = RENDERMODE_WIREFRAME;
+			break;
+		case SDLK_4:
+			render_mode = RENDERMODE_HIDDEN_LINE;
+			break;
+		case SDLK_v:
+			swap_mode = static_cast<FramePacer::SwapMode>((swap_mode + 1) % 3);
+			break;
+		case SDLK_c:
+			frame_rate_cap = (frame_rate_cap > 0.0) ? 0.0 : 60.0;
+			break;
+		case SDLK_l:
+			directional_light = !directional_light;
+			break;
+		case SDLK_f:
+			shadow_filter = static_cast<ShadowMaps::Filter>((shadow_filter + 1) % 3);
+			break;
+		case SDLK_k:
+			point_lights_enabled = !point_lights_enabled;
+			break;
+		case SDLK_a:
+			anti_aliasing = static_cast<ScreenshotFBO::AntiAliasing>((anti_aliasing + 1) % 3);
+			break;
+		case SDLK_r:
+			dynamic_resolution_enabled = !dynamic_resolution_enabled;
+			break;
+		case SDLK_b:
+			showDebugDraw = !showDebugDraw;
+			break;
+		case SDLK_e:
+			particles_enabled = !particles_enabled;
+			break;
+		}
+		break;
+	case SDL_WINDOWEVENT:
+		if (event.window.event == SDL_WINDOWEVENT_RESIZED && event.window.data1 > 0 && event.window.data2 > 0) {
+			window_width = event.window.data1;
+			window_height = event.window.data2;
+			cam_trackball.setWindowSize(window_width, window_height);
+			camera.projection = glm::perspective(fovy / zoom,
+				window_width / (float)window_height, near_plane, far_plane);
+		}
+		break;
+	case SDL_QUIT: //e.g., user clicks the upper right x
+		running = false;
+		break;
+	}
+}
+
+void GameManager::publishSnapshot(double input_time, double step_time) {
+	FrameSnapshot& frame = snapshots.getWriteBuffer();
+
+	frame.input_time = input_time;
+	frame.step_time = step_time;
+
+	frame.camera.projection = camera.projection;
+	frame.camera.view = camera.view * cam_trackball.getTransform();
+	frame.light.position = light.position;
+	frame.light.previous_position = light.previous_position;
+	frame.directional_light = directional_light;
+	frame.shadow_filter = shadow_filter;
+
+	frame.render_mode = render_mode;
+	frame.show_debug_view = showDebugView;
+	frame.show_debug_draw = showDebugDraw;
+	frame.particles = particles_enabled;
+	frame.screenshot_requests = screenshot_requests;
+	frame.swap_mode = swap_mode;
+	frame.frame_rate_cap = frame_rate_cap;
+	frame.anti_aliasing = anti_aliasing;
+	frame.window_width = window_width;
+	frame.window_height = window_height;
+	frame.dynamic_resolution = dynamic_resolution_enabled;
+
+	// clear() keeps the capacity, so this does not allocate once warmed up
+	frame.objects.clear();
+	frame.objects.push_back(RenderObject(model.get(), model_matrix));
+	frame.point_lights.clear();
+	if (point_lights_enabled)
+		frame.point_lights.insert(frame.point_lights.end(), point_lights.begin(), point_lights.end());
+
+	snapshots.publish();
+}
+
+void GameManager::renderLoop() {
+	try {
+		SDL_GL_MakeCurrent(main_window, main_context);
+
+		FramePacer::SwapMode requested_swap_mode = frame_pacer.getSwapMode();
+		unsigned int screenshots_taken = 0;
+		unsigned long frame_number = 0;
+		unsigned long allocations = AllocationCounter::getCount();
+
+		while (running) {
+			snapshots.update();
+			const FrameSnapshot& frame = snapshots.getReadBuffer();
+
+			frame_pacer.beginFrame(frame.input_time);
+			shader_reloader->update();
+			// Compare against what was asked for, as the driver may not support the mode
+			if (frame.swap_mode != requested_swap_mode) {
+				requested_swap_mode = frame.swap_mode;
+				frame_pacer.setSwapMode(requested_swap_mode);
+			}
+			if (frame.frame_rate_cap != frame_pacer.getFrameRateCap())
+				frame_pacer.setFrameRateCap(frame.frame_rate_cap);
+
+			render(frame);
+			for (; screenshots_taken != frame.screenshot_requests; ++screenshots_taken)
+				screenshot();
+
+			//Swap front and back buffers
+			frame_pacer.waitForNextFrame();
+			SDL_GL_SwapWindow(main_window);
+			frame_pacer.endFrame();
+
+			// Everything recorded for this frame has been submitted
+			for (size_t i=0; i<frame_arenas.size(); ++i)
+				frame_arenas[i].reset();
+
+			// Counts allocations by all threads, which should all be
+			// in their steady state once the first frames are done
+			unsigned long frame_allocations = AllocationCounter::getCount() - allocations;
+			allocations += frame_allocations;
+			if (++frame_number > warm_up_frames) {
+				++allocation_stats.frames;
+				if (frame_allocations > 0)
+					++allocation_stats.frames_allocating;
+				allocation_stats.max_allocations = std::max(allocation_stats.max_allocations, frame_allocations);
+			}
+		}
+	}
+	catch (...) {
+		render_error = std::current_exception();
+		running = false;
+	}
+
+	SDL_GL_MakeCurrent(main_window, nullptr);
+}
+
 void GameManager::play() {
-	bool doExit = false;
+	float accumulator = 0.0f;
+	double input_time = Timer::getCurrentTime();
+	double step_time = input_time;
+
+	// The render thread must have something to draw before the first step
+	publishSnapshot(input_time, step_time);
+
+	// Hand the OpenGL context over to the render thread. The window
+	// and the event queue stay with us, as SDL requires
+	SDL_GL_MakeCurrent(main_window, nullptr);
+	running = true;
+	render_thread = std::thread(&GameManager::renderLoop, this);
+
+	fps_timer.restart();
 
 	//SDL main loop
-	while (!doExit) {
+	while (running) {
+		// Sleep until the next simulation step is due, but wake up
+		// immediately on input so it reaches the renderer right away
 		SDL_Event event;
-		while (SDL_PollEvent(&event)) {// poll for pending events
-			switch (event.type) {
-			case SDL_MOUSEBUTTONDOWN:
-				cam_trackball.rotateBegin(event.motion.x, event.motion.y);
-				break;
-			case SDL_MOUSEBUTTONUP:
-				cam_trackball.rotateEnd(event.motion.x, event.motion.y);
-				break;
-			case SDL_MOUSEMOTION:
-				cam_trackball.rotate(event.motion.x, event.motion.y, zoom);
-				break;
-			case SDL_KEYDOWN:
-				switch(event.key.keysym.sym) {
-				case SDLK_ESCAPE:
-					doExit = true;
-					break;
-				case SDLK_q:
-					if (event.key.keysym.mod & KMOD_CTRL) doExit = true; //Ctrl+q
-					break;
-				case SDLK_m:
-					showDebugView = !showDebugView;
-					break;
-				case SDLK_p:
-					screenshot();
-					break;
-				case SDLK_RIGHT:
-					camera.view = glm::translate(camera.view, glm::vec3(-0.1, 0.0, 0.0));
-					break;
-				case SDLK_LEFT:
-					camera.view = glm::translate(camera.view, glm::vec3(0.1, 0.0, 0.0));
-					break;
-				case SDLK_UP:
-					camera.view = glm::translate(camera.view, glm::vec3(0.0, -0.1, 0.0));
-					break;
-				case SDLK_DOWN:
-					camera.view = glm::translate(camera.view, glm::vec3(0.0, 0.1, 0.0));
-					break;
-				case SDLK_w:
-					camera.view = glm::translate(camera.view, glm::vec3(0.0, 0.0, 0.1));
-					break;
-				case SDLK_s:
-					camera.view = glm::translate(camera.view, glm::vec3(0.0, 0.0, -0.1));
-					break;
-				case SDLK_PLUS:
-					zoomIn();
-					break;
-				case SDLK_MINUS:
-					zoomOut();
-					break;
-				case SDLK_1:
-					render_mode = RENDERMODE_FLAT;
-					break;
-				case SDLK_2:
-					render_mode = RENDERMODE_PHONG;
-					break;
-				case SDLK_3:
-					render_mode = RENDERMODE_WIREFRAME;
-					break;
-				case SDLK_4:
-					render_mode = RENDERMODE_HIDDEN_LINE;
-					break;
-				}
-				break;
-			case SDL_QUIT: //e.g., user clicks the upper right x
-				doExit = true;
-				break;
-			}
+		int timeout = static_cast<int>((simulation_timestep - accumulator) * 1000.0f);
+		if (SDL_WaitEventTimeout(&event, std::max(timeout, 0))) {
+			input_time = Timer::getCurrentTime();
+			do {
+				handleEvent(event);
+			} while (SDL_PollEvent(&event));
+		}
+
+		// Step the simulation with a fixed timestep, and drop time
+		// if we fall too far behind (e.g., while dragging the window)
+		accumulator += std::min(static_cast<float>(fps_timer.elapsedAndRestart()), max_frame_time);
+		while (accumulator >= simulation_timestep) {
+			update(simulation_timestep);
+			accumulator -= simulation_timestep;
 		}
+		step_time = Timer::getCurrentTime() - accumulator;
 
-		//Render, and swap front and back buffers
-		render();
-		SDL_GL_SwapWindow(main_window);
+		publishSnapshot(input_time, step_time);
 	}
+
+	render_thread.join();
+	SDL_GL_MakeCurrent(main_window, main_context);
 	quit();
+
+	if (render_error)
+		std::rethrow_exception(render_error);
 }
 
 void GameManager::quit() {
+	std::cout << "Average frame time: " << frame_pacer.getAverageFrameTime()*1000.0 << " ms, "
+		<< "input latency: " << frame_pacer.getAverageLatency()*1000.0 << " ms "
+		<< "(max " << frame_pacer.getMaxLatency()*1000.0 << " ms)" << std::endl;
+	if (AllocationCounter::isEnabled())
+		std::cout << "Frames with heap allocations: " << allocation_stats.frames_allocating
+			<< " of " << allocation_stats.frames << " (max " << allocation_stats.max_allocations << " in one frame)" << std::endl;
+	phong_variants->printReport(std::cout);
+	std::cout << "Shadow map updates: " << shadow_maps->getRenderedUpdates() << " rendered, "
+		<< shadow_maps->getCachedUpdates() << " skipped as nothing had moved" << std::endl;
+	if (clustered_lights->getNumLights() > 0)
+		std::cout << "Clustered lights: " << clustered_lights->getNumLights() << " lights, at most "
+			<< clustered_lights->getMaxLightsPerCluster() << " in one cluster" << std::endl;
+	static const char* aa_names[3] = { "none", "MSAA", "FXAA" };
+	for (unsigned int i=0; i<3; ++i)
+		if (aa_timings[i].frames > 0)
+			std::cout << "Anti-aliasing " << aa_names[i] << ": " << aa_timings[i].total / aa_timings[i].frames * 1000.0
+				<< " ms GPU time per frame (" << aa_timings[i].frames << " frames)" << std::endl;
+	std::cout << "Dynamic resolution: average scale " << dynamic_resolution->getAverageScale() << ", "
+		<< dynamic_resolution->getNumChanges() << " changes, render target reallocated "
+		<< screenshot_fbo->getReallocations() << " times" << std::endl;
+	if (cluster_stats.triangles > 0)
+		std::cout << "Cluster culling: " << 100.0 * cluster_stats.culled_triangles / cluster_stats.triangles
+			<< "% of the triangles in visible parts rejected" << std::endl;
+	if (geometry_pager)
+		std::cout << "Geometry paging: " << geometry_pager->getPageIns() << " chunks paged in, " << geometry_pager->getPageOuts()
+			<< " paged out, " << geometry_pager->getMissingFrames() << " frames with visible chunks missing" << std::endl;
+	if (animated_crowd)
+		std::cout << "Animated crowd: " << animated_crowd->getNumCharacters() << " characters posed in "
+			<< animated_crowd->getUpdateTime()*1000.0 << " ms in the last frame" << std::endl;
+	if (debug_draw->getDroppedLines() > 0)
+		std::cout << "Debug drawing: " << debug_draw->getDroppedLines() << " lines dropped over capacity" << std::endl;
 	std::cout << "Bye bye..." << std::endl;
 }
 
@@ -580,11 +1071,10 @@ void GameManager::screenshot() {
 	int height = screenshot_fbo->getHeight();
 
 	// need to store the data on the CPU before writing to file
-	std::vector<unsigned char> screenshot_data;
 	screenshot_data.resize(width * height *4);
 
-	// read pixels from FBO
-	screenshot_fbo->bind();
+	// read the anti-aliased pixels from the FBO
+	screenshot_fbo->bindForReading();
 	glReadPixels(0, 0, width, height, GL_BGRA, GL_UNSIGNED_BYTE, (void*)screenshot_data.data());
 	glBindFramebufferEXT(GL_FRAMEBUFFER, 0);
 	CHECK_GL_ERROR();
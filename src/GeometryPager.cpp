@@ -0,0 +1,506 @@
+#include "GeometryPager.h"
+
+#include "GameException.h"
+#include "GLUtils/GLUtils.hpp"
+
+#include <algorithm>
+#include <limits>
+#include <utility>
+
+#include <sys/stat.h>
+
+#include <assimp/cimport.h>
+#include <assimp/scene.h>
+#include <assimp/postprocess.h>
+
+namespace {
+	/**
+	 * A mesh with the transforms of all its parents applied
+	 */
+	struct MeshInstance {
+		const aiMesh* mesh;
+		glm::mat4 transform;
+		glm::mat3 normal_transform;
+	};
+
+	struct Triangle {
+		glm::vec3 centroid; //< In model space
+		unsigned int instance;
+		unsigned int face;
+	};
+
+	void collectInstances(const aiScene* scene, const aiNode* node, const glm::mat4& parent_transform,
+			std::vector<MeshInstance>& instances) {
+		//Assimp matrices are row major
+		glm::mat4 local;
+		aiMatrix4x4 m = node->mTransformation;
+		for (int j=0; j<4; ++j)
+			for (int i=0; i<4; ++i)
+				local[j][i] = m[i][j];
+		glm::mat4 transform = parent_transform * local;
+
+		for (unsigned int n=0; n<node->mNumMeshes; ++n) {
+			const aiMesh* mesh = scene->mMeshes[node->mMeshes[n]];
+			if (mesh->mPrimitiveTypes != aiPrimitiveType_TRIANGLE)
+				THROW_EXCEPTION("Only triangle meshes are supported");
+			MeshInstance instance;
+			instance.mesh = mesh;
+			instance.transform = transform;
+			instance.normal_transform = glm::transpose(glm::inverse(glm::mat3(transform)));
+			instances.push_back(instance);
+		}
+
+		for (unsigned int n=0; n<node->mNumChildren; ++n)
+			collectInstances(scene, node->mChildren[n], transform, instances);
+	}
+
+	inline glm::vec3 toVec3(const aiVector3D& v) {
+		return glm::vec3(v.x, v.y, v.z);
+	}
+
+	/**
+	 * Writes the triangles as interleaved positions and normals, and
+	 * returns their bounds
+	 */
+	void expandTriangles(const std::vector<MeshInstance>& instances, const Triangle* triangles, unsigned int count,
+			std::vector<float>& out, glm::vec3& min_v, glm::vec3& max_v) {
+		out.resize(count*3*6);
+		min_v = glm::vec3(std::numeric_limits<float>::max());
+		max_v = glm::vec3(-std::numeric_limits<float>::max());
+		float* v = out.data();
+		for (unsigned int t=0; t<count; ++t) {
+			const MeshInstance& instance = instances[triangles[t].instance];
+			const aiMesh* mesh = instance.mesh;
+			const aiFace& face = mesh->mFaces[triangles[t].face];
+
+			glm::vec3 positions[3];
+			for (unsigned int k=0; k<3; ++k)
+				positions[k] = glm::vec3(instance.transform * glm::vec4(toVec3(mesh->mVertices[face.mIndices[k]]), 1.0f));
+			glm::vec3 face_normal = glm::cross(positions[1] - positions[0], positions[2] - positions[0]);
+
+			for (unsigned int k=0; k<3; ++k) {
+				glm::vec3 normal = mesh->HasNormals() ? instance.normal_transform * toVec3(mesh->mNormals[face.mIndices[k]]) : face_normal;
+				float length = glm::length(normal);
+				if (length > 0.0f)
+					normal /= length;
+				v[0] = positions[k].x; v[1] = positions[k].y; v[2] = positions[k].z;
+				v[3] = normal.x; v[4] = normal.y; v[5] = normal.z;
+				v += 6;
+				min_v = glm::min(min_v, positions[k]);
+				max_v = glm::max(max_v, positions[k]);
+			}
+		}
+	}
+
+	template <typename T>
+	inline void writeValue(std::ofstream& file, const T& value) {
+		file.write(reinterpret_cast<const char*>(&value), sizeof(value));
+	}
+
+	template <typename T>
+	inline void readValue(std::ifstream& file, T& value) {
+		file.read(reinterpret_cast<char*>(&value), sizeof(value));
+	}
+}
+
+GeometryPager::GeometryPager(const std::string& model_filename, const std::string& cache_filename, JobSystem* job_system,
+		size_t vram_budget, unsigned int triangles_per_chunk)
+		: cache_filename(cache_filename), job_system(job_system), triangles_per_chunk(triangles_per_chunk) {
+	slot_vertices = triangles_per_chunk*3;
+	resident_distance = 2.0f;
+	num_resident = 0;
+	page_ins = 0;
+	page_outs = 0;
+	missing_frames = 0;
+
+	uint64_t key = computeKey(model_filename);
+	cached = loadCache(key);
+	if (!cached) {
+		buildCache(model_filename, key);
+		if (!loadCache(key))
+			THROW_EXCEPTION("Unable to write the chunk cache " + cache_filename);
+	}
+
+	for (unsigned int i=0; i<max_reads; ++i) {
+		reads[i].file.open(cache_filename.c_str(), std::ios::binary);
+		if (!reads[i].file.good())
+			THROW_EXCEPTION("Unable to open the chunk cache " + cache_filename);
+	}
+	ranked.reserve(chunks.size());
+
+	// All slots fit the largest chunk, so any chunk can replace any other
+	size_t slot_bytes = slot_vertices*floats_per_vertex*sizeof(float);
+	size_t num_slots = std::min(chunks.size(), std::max<size_t>(vram_budget / slot_bytes, 1));
+	slots.assign(num_slots, -1);
+	vertices.reset(new GLUtils::VBO<GL_ARRAY_BUFFER>(NULL, static_cast<GLsizeiptr>(num_slots*slot_bytes), GL_DYNAMIC_DRAW));
+
+	// ProgramCache binds position to 0 and normal to 1
+	glGenVertexArrays(1, &vao);
+	glBindVertexArray(vao);
+	vertices->bind();
+	const GLsizei stride = floats_per_vertex*sizeof(float);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride, NULL);
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, stride, reinterpret_cast<void*>(3*sizeof(float)));
+	glEnableVertexAttribArray(1);
+	glBindVertexArray(0);
+	vertices->unbind();
+	CHECK_GL_ERROR();
+}
+
+GeometryPager::~GeometryPager() {
+	// The reads write into our buffers
+	for (unsigned int i=0; i<max_reads; ++i)
+		if (reads[i].job)
+			job_system->wait(reads[i].job);
+	glDeleteVertexArrays(1, &vao);
+}
+
+uint64_t GeometryPager::computeKey(const std::string& model_filename) const {
+	// Hashing the contents of a huge model would take as long as loading
+	// it, so the file size and modification time stand in for them
+	int64_t size = 0, modified = 0;
+	struct stat info;
+	if (stat(model_filename.c_str(), &info) == 0) {
+		size = static_cast<int64_t>(info.st_size);
+		modified = static_cast<int64_t>(info.st_mtime);
+	}
+	uint64_t key = GLUtils::hash(model_filename.data(), model_filename.size());
+	key = GLUtils::hash(&size, sizeof(size), key);
+	key = GLUtils::hash(&modified, sizeof(modified), key);
+	return GLUtils::hash(&triangles_per_chunk, sizeof(triangles_per_chunk), key);
+}
+
+/**
+ * Cache layout: version, key, triangles per chunk, number of chunks,
+ * offset of the chunk table and the model bounds, then the vertices of
+ * all chunks, then the table with the bounding sphere, offset and
+ * number of vertices of every chunk
+ */
+bool GeometryPager::loadCache(uint64_t key) {
+	std::ifstream file(cache_filename.c_str(), std::ios::binary);
+	if (!file.good())
+		return false;
+
+	uint32_t version = 0, file_triangles = 0, num_chunks = 0;
+	uint64_t file_key = 0, table_offset = 0;
+	readValue(file, version);
+	readValue(file, file_key);
+	readValue(file, file_triangles);
+	readValue(file, num_chunks);
+	readValue(file, table_offset);
+	readValue(file, min_dim);
+	readValue(file, max_dim);
+	if (!file.good() || version != cache_version || file_key != key || file_triangles != triangles_per_chunk)
+		return false;
+
+	file.seekg(table_offset);
+	chunks.resize(num_chunks);
+	for (uint32_t i=0; i<num_chunks; ++i) {
+		Chunk& chunk = chunks[i];
+		uint32_t num_vertices = 0;
+		readValue(file, chunk.center);
+		readValue(file, chunk.radius);
+		readValue(file, chunk.offset);
+		readValue(file, num_vertices);
+		chunk.num_vertices = num_vertices;
+		chunk.state = CHUNK_ON_DISK;
+		chunk.slot = -1;
+		chunk.priority = 0.0f;
+		chunk.distance = 0.0f;
+		chunk.view_depth = 0.0f;
+		chunk.visible = false;
+	}
+	if (!file.good()) {
+		chunks.clear();
+		return false;
+	}
+	return true;
+}
+
+void GeometryPager::buildCache(const std::string& model_filename, uint64_t key) {
+	const aiScene* scene = aiImportFile(model_filename.c_str(), aiProcessPreset_TargetRealtime_Quality);
+	if (!scene)
+		THROW_EXCEPTION("Unable to load mesh from " + model_filename);
+	// Released also when splitting throws, e.g. on a mesh that is not triangles
+	std::shared_ptr<const aiScene> scene_guard(scene, aiReleaseImport);
+
+	std::vector<MeshInstance> instances;
+	collectInstances(scene, scene->mRootNode, glm::mat4(1.0f), instances);
+
+	std::vector<Triangle> triangles;
+	size_t num_triangles = 0;
+	for (size_t i=0; i<instances.size(); ++i)
+		num_triangles += instances[i].mesh->mNumFaces;
+	triangles.reserve(num_triangles);
+	for (unsigned int i=0; i<instances.size(); ++i) {
+		const MeshInstance& instance = instances[i];
+		for (unsigned int f=0; f<instance.mesh->mNumFaces; ++f) {
+			const aiFace& face = instance.mesh->mFaces[f];
+			glm::vec3 sum = toVec3(instance.mesh->mVertices[face.mIndices[0]]) + toVec3(instance.mesh->mVertices[face.mIndices[1]])
+				+ toVec3(instance.mesh->mVertices[face.mIndices[2]]);
+			Triangle triangle;
+			triangle.centroid = glm::vec3(instance.transform * glm::vec4(sum / 3.0f, 1.0f));
+			triangle.instance = i;
+			triangle.face = f;
+			triangles.push_back(triangle);
+		}
+	}
+
+	// Depth first, so neighbouring chunks end up close in the file
+	typedef std::pair<unsigned int, unsigned int> Range;
+	std::vector<Range> leaves, stack;
+	stack.push_back(Range(0, static_cast<unsigned int>(triangles.size())));
+	while (!stack.empty()) {
+		Range range = stack.back();
+		stack.pop_back();
+		if (range.second - range.first <= triangles_per_chunk) {
+			if (range.second > range.first)
+				leaves.push_back(range);
+			continue;
+		}
+
+		glm::vec3 min_c(std::numeric_limits<float>::max()), max_c(-std::numeric_limits<float>::max());
+		for (unsigned int i=range.first; i<range.second; ++i) {
+			min_c = glm::min(min_c, triangles[i].centroid);
+			max_c = glm::max(max_c, triangles[i].centroid);
+		}
+		glm::vec3 extent = max_c - min_c;
+		int axis = (extent.x > extent.y) ? ((extent.x > extent.z) ? 0 : 2) : ((extent.y > extent.z) ? 1 : 2);
+		unsigned int middle = range.first + (range.second - range.first) / 2;
+		std::nth_element(triangles.begin() + range.first, triangles.begin() + middle, triangles.begin() + range.second,
+			[axis](const Triangle& a, const Triangle& b) { return a.centroid[axis] < b.centroid[axis]; });
+		stack.push_back(Range(middle, range.second));
+		stack.push_back(Range(range.first, middle));
+	}
+
+	// The header is written last, so an interrupted build is never
+	// mistaken for a valid cache
+	std::ofstream file(cache_filename.c_str(), std::ios::binary | std::ios::trunc);
+	if (!file.good())
+		THROW_EXCEPTION("Unable to create the chunk cache " + cache_filename);
+	const uint64_t header_size = 3*sizeof(uint32_t) + 2*sizeof(uint64_t) + 2*sizeof(glm::vec3);
+	std::vector<char> header(header_size, 0);
+	file.write(header.data(), header.size());
+
+	// Expand a batch of chunks in parallel, then write them in order
+	unsigned int batch_size = job_system ? job_system->getNumThreads()*2 : 1;
+	std::vector<std::vector<float> > batch(batch_size);
+	std::vector<glm::vec3> batch_min(batch_size), batch_max(batch_size);
+	std::vector<Chunk> table(leaves.size());
+	uint64_t offset = header_size;
+	min_dim = glm::vec3(std::numeric_limits<float>::max());
+	max_dim = glm::vec3(-std::numeric_limits<float>::max());
+	for (unsigned int begin=0; begin<leaves.size(); begin+=batch_size) {
+		unsigned int count = std::min(batch_size, static_cast<unsigned int>(leaves.size()) - begin);
+		JobSystem::RangeFunction expand = [&](unsigned int batch_begin, unsigned int batch_end, unsigned int) {
+			for (unsigned int i=batch_begin; i<batch_end; ++i) {
+				const Range& leaf = leaves[begin + i];
+				expandTriangles(instances, &triangles[leaf.first], leaf.second - leaf.first, batch[i], batch_min[i], batch_max[i]);
+			}
+		};
+		if (job_system)
+			job_system->parallelFor(count, 1, expand);
+		else
+			expand(0, count, 0);
+
+		for (unsigned int i=0; i<count; ++i) {
+			Chunk& chunk = table[begin + i];
+			chunk.center = 0.5f*(batch_min[i] + batch_max[i]);
+			chunk.radius = 0.5f*glm::length(batch_max[i] - batch_min[i]);
+			chunk.offset = offset;
+			chunk.num_vertices = static_cast<unsigned int>(batch[i].size() / floats_per_vertex);
+			file.write(reinterpret_cast<const char*>(batch[i].data()), batch[i].size()*sizeof(float));
+			offset += batch[i].size()*sizeof(float);
+			min_dim = glm::min(min_dim, batch_min[i]);
+			max_dim = glm::max(max_dim, batch_max[i]);
+		}
+	}
+	scene_guard.reset();
+
+	uint64_t table_offset = offset;
+	for (size_t i=0; i<table.size(); ++i) {
+		uint32_t num_vertices = table[i].num_vertices;
+		writeValue(file, table[i].center);
+		writeValue(file, table[i].radius);
+		writeValue(file, table[i].offset);
+		writeValue(file, num_vertices);
+	}
+
+	uint32_t version = cache_version;
+	uint32_t file_triangles = triangles_per_chunk;
+	uint32_t num_chunks = static_cast<uint32_t>(table.size());
+	file.seekp(0);
+	writeValue(file, version);
+	writeValue(file, key);
+	writeValue(file, file_triangles);
+	writeValue(file, num_chunks);
+	writeValue(file, table_offset);
+	writeValue(file, min_dim);
+	writeValue(file, max_dim);
+}
+
+void GeometryPager::update(const glm::mat4& model, const glm::mat4& view, const glm::mat4& projection, unsigned int viewport_height) {
+	glm::mat4 model_view = view * model;
+	float scale = Frustum::getMaxScale(model_view);
+	float pixels_per_unit = 0.5f * projection[1][1] * viewport_height; //< At a distance of one
+	frustum = Frustum(projection);
+
+	bool missing = false;
+	ranked.clear();
+	for (unsigned int i=0; i<chunks.size(); ++i) {
+		Chunk& chunk = chunks[i];
+		glm::vec3 center = glm::vec3(model_view * glm::vec4(chunk.center, 1.0f));
+		float radius = chunk.radius * scale;
+		chunk.distance = glm::length(center);
+		chunk.view_depth = -center.z;
+		chunk.visible = frustum.intersectsSphere(center, radius);
+
+		// Projected radius, or the whole screen from inside the sphere.
+		// Nearby chunks behind the camera count a quarter
+		float size = (chunk.distance > radius) ? radius * pixels_per_unit / chunk.distance : static_cast<float>(viewport_height);
+		if (chunk.visible)
+			chunk.priority = size;
+		else if (chunk.distance - radius < resident_distance)
+			chunk.priority = 0.25f * size;
+		else
+			chunk.priority = 0.0f;
+
+		if (chunk.priority > 0.0f)
+			ranked.push_back(i);
+		missing = missing || (chunk.visible && chunk.state != CHUNK_RESIDENT);
+	}
+	if (missing)
+		++missing_frames;
+
+	// Only as many chunks as there are slots can be wanted
+	auto by_priority = [this](unsigned int a, unsigned int b) { return chunks[a].priority > chunks[b].priority; };
+	if (ranked.size() > slots.size()) {
+		std::nth_element(ranked.begin(), ranked.begin() + slots.size(), ranked.end(), by_priority);
+		for (size_t i=slots.size(); i<ranked.size(); ++i)
+			chunks[ranked[i]].priority = 0.0f;
+		ranked.resize(slots.size());
+	}
+	std::sort(ranked.begin(), ranked.end(), by_priority);
+
+	// Reads of chunks that are no longer wanted are dropped
+	unsigned int uploads = 0;
+	for (unsigned int r=0; r<max_reads; ++r) {
+		Read& read = reads[r];
+		if (read.chunk < 0 || !read.done)
+			continue;
+		read.job.reset();
+		if (read.failed)
+			THROW_EXCEPTION("Unable to read a chunk from " + cache_filename);
+		if (chunks[read.chunk].priority <= 0.0f) {
+			chunks[read.chunk].state = CHUNK_ON_DISK;
+			read.chunk = -1;
+		}
+		else if (uploads < max_uploads_per_frame) {
+			upload(read);
+			++uploads;
+		}
+	}
+
+	unsigned int r = 0;
+	for (size_t i=0; i<ranked.size(); ++i) {
+		if (chunks[ranked[i]].state != CHUNK_ON_DISK)
+			continue;
+		while (r < max_reads && reads[r].chunk >= 0)
+			++r;
+		if (r == max_reads)
+			break;
+		startRead(reads[r], ranked[i]);
+	}
+}
+
+int GeometryPager::allocateSlot() {
+	// Unwanted chunks stay resident until their slot is needed, and
+	// then the farthest one goes first
+	int victim = -1;
+	for (unsigned int i=0; i<slots.size(); ++i) {
+		if (slots[i] < 0)
+			return i;
+		const Chunk& chunk = chunks[slots[i]];
+		if (chunk.priority <= 0.0f && (victim < 0 || chunk.distance > chunks[slots[victim]].distance))
+			victim = i;
+	}
+
+	if (victim >= 0) {
+		Chunk& chunk = chunks[slots[victim]];
+		chunk.state = CHUNK_ON_DISK;
+		chunk.slot = -1;
+		slots[victim] = -1;
+		--num_resident;
+		++page_outs;
+	}
+	return victim;
+}
+
+void GeometryPager::upload(Read& read) {
+	// There is always a slot, as there are no more wanted chunks than slots
+	int slot = allocateSlot();
+	if (slot < 0)
+		return;
+
+	Chunk& chunk = chunks[read.chunk];
+	GLintptr offset = static_cast<GLintptr>(slot) * slot_vertices*floats_per_vertex*sizeof(float);
+	vertices->bind();
+	glBufferSubData(GL_ARRAY_BUFFER, offset, chunk.num_vertices*floats_per_vertex*sizeof(float), read.vertices.data());
+	vertices->unbind();
+
+	chunk.state = CHUNK_RESIDENT;
+	chunk.slot = slot;
+	slots[slot] = read.chunk;
+	read.chunk = -1;
+	++num_resident;
+	++page_ins;
+}
+
+void GeometryPager::startRead(Read& read, unsigned int chunk_index) {
+	Chunk& chunk = chunks[chunk_index];
+	chunk.state = CHUNK_LOADING;
+	read.chunk = chunk_index;
+	read.done = false;
+	read.failed = false;
+
+	Read* target = &read;
+	uint64_t offset = chunk.offset;
+	size_t count = chunk.num_vertices*floats_per_vertex;
+	JobSystem::Function load = [target, offset, count]() {
+		// The buffer keeps its capacity, so it stops growing once it has held a full chunk
+		target->vertices.resize(count);
+		target->file.clear();
+		target->file.seekg(offset);
+		target->file.read(reinterpret_cast<char*>(target->vertices.data()), count*sizeof(float));
+		target->failed = !target->file.good();
+		target->done = true;
+	};
+	if (job_system)
+		read.job = job_system->submit(load);
+	else
+		load();
+}
+
+void GeometryPager::record(DrawList& draw_list, unsigned int thread_index, const glm::mat4& model, const glm::mat4& view,
+		const glm::vec3& light_position) const {
+	// All chunks share the model transform
+	glm::mat4 model_view = view * model;
+	glm::vec3 light = glm::inverse(glm::mat3(model)) * light_position;
+	glm::vec3 camera = -(glm::inverse(glm::mat3(model_view)) * glm::vec3(model_view[3]));
+
+	for (unsigned int i=0; i<slots.size(); ++i) {
+		if (slots[i] < 0 || !chunks[slots[i]].visible)
+			continue;
+		const Chunk& chunk = chunks[slots[i]];
+		DrawPacket packet;
+		packet.sort_key = DrawList::makeSortKey(0, chunk.view_depth);
+		packet.model_view = model_view;
+		packet.light_position = light;
+		packet.camera_position = camera;
+		packet.colour = glm::vec3(.8f, .8f, .7f);
+		packet.first = i*slot_vertices;
+		packet.count = chunk.num_vertices;
+		draw_list.record(thread_index, packet);
+	}
+}
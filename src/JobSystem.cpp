@@ -0,0 +1,267 @@
+#include "JobSystem.h"
+
+#include <algorithm>
+
+namespace {
+	// Which job system the current thread is a worker of, and its index there
+	thread_local const JobSystem* current_system = nullptr;
+	thread_local unsigned int current_thread_index = 0;
+
+	// Rounds of stealing attempts before an idle worker goes to sleep
+	const unsigned int spin_rounds = 64;
+}
+
+/**
+ * State of one parallelFor call. Lives on the stack of the calling
+ * thread, which does not return before every helper task has run.
+ */
+struct JobSystem::ParallelFor {
+	RangeEntry entry;
+	const void* function;
+	unsigned int count;
+	unsigned int grain;
+	std::atomic<unsigned int> next_index;
+	std::atomic<unsigned int> active_helpers;
+
+	void runChunks(unsigned int thread_index) {
+		while (true) {
+			unsigned int begin = next_index.fetch_add(grain);
+			if (begin >= count)
+				break;
+			entry(function, begin, std::min(begin + grain, count), thread_index);
+		}
+	}
+};
+
+void JobSystem::TaskQueue::pushBack(const Task& task) {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (size == tasks.size()) {
+		// Unroll the ring into a buffer twice the size
+		std::vector<Task> grown(tasks.size() * 2);
+		for (size_t i=0; i<size; ++i)
+			grown[i] = tasks[(head + i) % tasks.size()];
+		tasks.swap(grown);
+		head = 0;
+	}
+	tasks[(head + size) % tasks.size()] = task;
+	++size;
+}
+
+bool JobSystem::TaskQueue::popBack(Task& task) {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (size == 0)
+		return false;
+	--size;
+	task = tasks[(head + size) % tasks.size()];
+	return true;
+}
+
+bool JobSystem::TaskQueue::popFront(Task& task) {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (size == 0)
+		return false;
+	task = tasks[head];
+	head = (head + 1) % tasks.size();
+	--size;
+	return true;
+}
+
+JobSystem::JobSystem(unsigned int num_workers) {
+	quit = false;
+	queued_tasks = 0;
+	sleeping_workers = 0;
+
+	for (unsigned int i=0; i<=num_workers; ++i)
+		queues.push_back(std::unique_ptr<TaskQueue>(new TaskQueue()));
+	for (unsigned int i=0; i<num_workers; ++i)
+		workers.push_back(std::thread(&JobSystem::workerLoop, this, i + 1));
+}
+
+JobSystem::~JobSystem() {
+	{
+		std::lock_guard<std::mutex> lock(sleep_mutex);
+		quit = true;
+	}
+	wake_workers.notify_all();
+	for (size_t i=0; i<workers.size(); ++i)
+		workers[i].join();
+}
+
+unsigned int JobSystem::getDefaultWorkerCount() {
+	unsigned int hardware_threads = std::thread::hardware_concurrency();
+	return (hardware_threads > 1) ? hardware_threads - 1 : 0;
+}
+
+unsigned int JobSystem::getThreadIndex() const {
+	return (current_system == this) ? current_thread_index : 0;
+}
+
+void JobSystem::push(const Task& task) {
+	queues[getThreadIndex()]->pushBack(task);
+
+	// Counting before checking for sleepers (and the opposite order in
+	// workerLoop) makes sure a worker never sleeps through new work
+	queued_tasks.fetch_add(1);
+	if (sleeping_workers.load() > 0) {
+		std::lock_guard<std::mutex> lock(sleep_mutex);
+		wake_workers.notify_one();
+	}
+}
+
+bool JobSystem::findTask(unsigned int thread_index, Task& task) {
+	// Newest own work first, as its data is most likely still in cache
+	bool found = queues[thread_index]->popBack(task);
+
+	// Then the oldest work of others, as it tends to be the largest
+	for (size_t i=1; i<queues.size() && !found; ++i)
+		found = queues[(thread_index + i) % queues.size()]->popFront(task);
+
+	if (found)
+		queued_tasks.fetch_sub(1);
+	return found;
+}
+
+bool JobSystem::runOneTask(unsigned int thread_index) {
+	Task task;
+	if (!findTask(thread_index, task))
+		return false;
+	task.run(this, task.data, thread_index);
+	return true;
+}
+
+void JobSystem::workerLoop(unsigned int thread_index) {
+	current_system = this;
+	current_thread_index = thread_index;
+
+	unsigned int idle_rounds = 0;
+	while (!quit) {
+		if (runOneTask(thread_index)) {
+			idle_rounds = 0;
+			continue;
+		}
+
+		if (++idle_rounds < spin_rounds) {
+			std::this_thread::yield();
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(sleep_mutex);
+		sleeping_workers.fetch_add(1);
+		while (!quit && queued_tasks.load() == 0)
+			wake_workers.wait(lock);
+		sleeping_workers.fetch_sub(1);
+		idle_rounds = 0;
+	}
+}
+
+JobSystem::JobHandle JobSystem::submit(const Function& function) {
+	return submit(function, std::vector<JobHandle>());
+}
+
+JobSystem::JobHandle JobSystem::submit(const Function& function, const std::vector<JobHandle>& dependencies) {
+	JobHandle job(new Job(function));
+
+	for (size_t i=0; i<dependencies.size(); ++i) {
+		Job& dependency = *dependencies[i];
+		std::lock_guard<std::mutex> lock(dependency.mutex);
+		if (!dependency.finished) {
+			job->pending.fetch_add(1);
+			dependency.continuations.push_back(job);
+		}
+	}
+
+	// Drop the reference submit() itself holds, and run now if nothing is left
+	if (job->pending.fetch_sub(1) == 1)
+		schedule(job);
+	return job;
+}
+
+void JobSystem::schedule(const JobHandle& job) {
+	job->self = job;
+	Task task = { &JobSystem::runJob, job.get() };
+	push(task);
+}
+
+void JobSystem::runJob(JobSystem* system, void* data, unsigned int thread_index) {
+	Job* job = static_cast<Job*>(data);
+	JobHandle keep_alive;
+	keep_alive.swap(job->self);
+
+	try {
+		job->function();
+	}
+	catch (...) {
+		job->error = std::current_exception();
+	}
+
+	std::vector<JobHandle> continuations;
+	{
+		std::lock_guard<std::mutex> lock(job->mutex);
+		job->finished.store(true, std::memory_order_release);
+		continuations.swap(job->continuations);
+	}
+	for (size_t i=0; i<continuations.size(); ++i)
+		if (continuations[i]->pending.fetch_sub(1) == 1)
+			system->schedule(continuations[i]);
+}
+
+void JobSystem::wait(const JobHandle& job) {
+	unsigned int thread_index = getThreadIndex();
+	while (!job->isFinished())
+		if (!runOneTask(thread_index))
+			std::this_thread::yield();
+
+	if (job->error)
+		std::rethrow_exception(job->error);
+}
+
+void JobSystem::runRange(JobSystem* system, void* data, unsigned int thread_index) {
+	ParallelFor* loop = static_cast<ParallelFor*>(data);
+	loop->runChunks(thread_index);
+	loop->active_helpers.fetch_sub(1, std::memory_order_release);
+}
+
+void JobSystem::parallelFor(unsigned int count, unsigned int grain, RangeEntry entry, const void* function) {
+	if (count == 0)
+		return;
+
+	unsigned int thread_index = getThreadIndex();
+	if (grain == 0)
+		grain = std::max(count / (4 * getNumThreads()), 1u);
+
+	// Not worth waking anyone up for a single chunk. Without workers the
+	// chunks still run one at a time, as callers may size scratch by grain
+	unsigned int chunks = (count + grain - 1) / grain;
+	if (chunks == 1) {
+		entry(function, 0, count, thread_index);
+		return;
+	}
+	if (workers.empty()) {
+		for (unsigned int begin=0; begin<count; begin+=grain)
+			entry(function, begin, std::min(begin + grain, count), thread_index);
+		return;
+	}
+
+	ParallelFor loop;
+	loop.entry = entry;
+	loop.function = function;
+	loop.count = count;
+	loop.grain = grain;
+	loop.next_index = 0;
+
+	// Helpers just pull chunks from the shared counter, so one per
+	// thread is enough and idle workers steal them right away
+	unsigned int helpers = std::min(chunks - 1, static_cast<unsigned int>(workers.size()));
+	loop.active_helpers = helpers;
+	Task task = { &JobSystem::runRange, &loop };
+	for (unsigned int i=0; i<helpers; ++i)
+		push(task);
+
+	loop.runChunks(thread_index);
+
+	// Helpers still in a queue find no chunks left, but must run
+	// before the loop state on our stack goes away
+	while (loop.active_helpers.load(std::memory_order_acquire) > 0)
+		if (!runOneTask(thread_index))
+			std::this_thread::yield();
+}
@@ -0,0 +1,43 @@
+#include "LinearAllocator.h"
+
+#include <algorithm>
+#include <cstdint>
+
+LinearAllocator::LinearAllocator(size_t block_size) {
+	blocks.push_back(std::vector<char>(std::max(block_size, static_cast<size_t>(64))));
+	offset = 0;
+	used = 0;
+}
+
+void* LinearAllocator::allocate(size_t bytes, size_t alignment) {
+	std::vector<char>* block = &blocks.back();
+	uintptr_t base = reinterpret_cast<uintptr_t>(block->data());
+	size_t aligned = ((base + offset + alignment - 1) & ~(uintptr_t)(alignment - 1)) - base;
+
+	if (aligned + bytes > block->size()) {
+		// Out of space: add a block at least as big as all before it, so
+		// a frame that keeps growing needs few extra blocks
+		size_t size = std::max(bytes + alignment, blocks.back().size() * 2);
+		blocks.push_back(std::vector<char>(size));
+		block = &blocks.back();
+		base = reinterpret_cast<uintptr_t>(block->data());
+		offset = 0;
+		aligned = ((base + alignment - 1) & ~(uintptr_t)(alignment - 1)) - base;
+	}
+
+	used += aligned + bytes - offset;
+	offset = aligned + bytes;
+	return block->data() + aligned;
+}
+
+void LinearAllocator::reset() {
+	if (blocks.size() > 1) {
+		size_t total = 0;
+		for (size_t i=0; i<blocks.size(); ++i)
+			total += blocks[i].size();
+		blocks.clear();
+		blocks.push_back(std::vector<char>(total));
+	}
+	offset = 0;
+	used = 0;
+}
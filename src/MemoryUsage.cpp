@@ -0,0 +1,47 @@
+#include "MemoryUsage.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <cstdio>
+#include <unistd.h>
+#include <sys/resource.h>
+#endif
+
+size_t MemoryUsage::getResidentBytes() {
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+		return 0;
+	return counters.WorkingSetSize;
+#else
+	// The second field of statm is the resident set, in pages
+	size_t pages = 0;
+	FILE* statm = std::fopen("/proc/self/statm", "r");
+	if (statm == NULL)
+		return 0;
+	if (std::fscanf(statm, "%*s %zu", &pages) != 1)
+		pages = 0;
+	std::fclose(statm);
+	return pages * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#endif
+}
+
+size_t MemoryUsage::getPeakResidentBytes() {
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+		return 0;
+	return counters.PeakWorkingSetSize;
+#else
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0)
+		return 0;
+#ifdef __APPLE__
+	return static_cast<size_t>(usage.ru_maxrss);
+#else
+	return static_cast<size_t>(usage.ru_maxrss) * 1024; // Kilobytes on Linux
+#endif
+#endif
+}
@@ -3,26 +3,120 @@
 #include "GameException.h"
 
 #include <iostream>
+#include <algorithm>
+#include <limits>
+#include <cmath>
+#include <utility>
+#include <cstdint>
+#include <cstring>
+#include <map>
 #include <glm/gtc/matrix_transform.hpp>
 
-Model::Model(std::string filename, bool invert) {
-	std::vector<float> vertex_data, normal_data, color_data;
-	aiMatrix4x4 trafo;
-	aiIdentityMatrix4(&trafo);
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define MODEL_SSE
+#endif
 
-	scene = aiImportFile(filename.c_str(), aiProcessPreset_TargetRealtime_Quality);// | aiProcess_FlipWindingOrder);
+const unsigned int Model::faces_per_chunk = 16384;
+const unsigned int Model::vertices_per_upload = 1 << 20;
+const unsigned int Model::cluster_faces = 128;
+
+Model::Model(std::string filename, bool invert, JobSystem* job_system, bool streaming, bool clustered) {
+	std::vector<MeshChunk> chunks;
+	unsigned int n_loaded = 0;
+	unsigned int n_clusters = 0;
+	bool has_normals = true;
+	bool has_colors = true;
+
+	const aiScene* scene = aiImportFile(filename.c_str(), aiProcessPreset_TargetRealtime_Quality);// | aiProcess_FlipWindingOrder);
 	if (!scene) {
 		std::string log = "Unable to load mesh from ";
 		log.append(filename);
 		THROW_EXCEPTION(log);
 	}
+	//Released also when loading throws, e.g. if a buffer cannot be mapped
+	std::shared_ptr<const aiScene> scene_guard(scene, aiReleaseImport);
 
 	//Load the model recursively into data
+	root = part_pool.create();
+	loadRecursive(*root, glm::mat4(1.0f), scene, scene->mRootNode, chunks, n_loaded, n_clusters, has_normals, has_colors);
+	if (clustered)
+		clusters.resize(n_clusters);
+
+	//Animated models get a skeleton, and the bones of each vertex. The
+	//tables are per mesh and node, as meshes without bones follow their node
+	std::map<std::pair<unsigned int, const aiNode*>, std::vector<uint8_t> > influences;
+	bool animated = scene->mNumAnimations > 0;
+	for (unsigned int m=0; m<scene->mNumMeshes; ++m)
+		animated = animated || scene->mMeshes[m]->mNumBones > 0;
+	if (animated) {
+		skeleton.reset(new Skeleton(scene));
+		for (size_t i=0; i<chunks.size(); ++i) {
+			std::vector<uint8_t>& table = influences[std::make_pair(chunks[i].mesh_index, chunks[i].node)];
+			if (table.empty())
+				skeleton->getInfluences(scene, chunks[i].mesh_index, chunks[i].node, table);
+			chunks[i].influences = table.data();
+		}
+		for (size_t i=0; i<chunks.size() && vertex_sources.empty(); ++i)
+			if (chunks[i].mesh->mNumAnimMeshes > 0)
+				vertex_sources.resize(n_loaded);
+	}
+
+	//Expand the indexed meshes into the buffers, and find the bounds
+	//of the chunks. Assimp's copy is not needed after that
+	if (streaming)
+		uploadStreaming(chunks, n_loaded, invert, has_normals, has_colors, job_system);
+	else
+		uploadAll(chunks, n_loaded, invert, has_normals, has_colors, job_system);
+
+	//Copy out the anim meshes, once per copy of their mesh, which
+	//starts with the chunk of its first face
+	const float normal_sign = invert ? -1.0f : 1.0f;
+	for (size_t i=0; i<chunks.size() && !vertex_sources.empty(); ++i) {
+		const aiMesh* mesh = chunks[i].mesh;
+		if (chunks[i].first_face != 0 || mesh->mNumAnimMeshes == 0)
+			continue;
+		morph_meshes.push_back(MorphMesh());
+		MorphMesh& morph = morph_meshes.back();
+		morph.name = mesh->mName.data;
+		morph.first = chunks[i].first_vertex;
+		morph.count = mesh->mNumFaces*3;
+		morph.sources.assign(vertex_sources.begin() + morph.first, vertex_sources.begin() + morph.first + morph.count);
+		morph.positions.resize(mesh->mNumAnimMeshes);
+		morph.normals.resize(mesh->mNumAnimMeshes);
+		for (unsigned int a=0; a<mesh->mNumAnimMeshes; ++a) {
+			// Anim meshes leave out what they do not change
+			const aiAnimMesh* shape = mesh->mAnimMeshes[a];
+			const aiVector3D* positions = (shape->mVertices != NULL) ? shape->mVertices : mesh->mVertices;
+			const aiVector3D* normals = (shape->mNormals != NULL) ? shape->mNormals : mesh->mNormals;
+			morph.positions[a].resize(mesh->mNumVertices);
+			morph.normals[a].resize(mesh->mNumVertices, glm::vec3(0.0f));
+			for (unsigned int v=0; v<mesh->mNumVertices; ++v) {
+				morph.positions[a][v] = glm::vec3(positions[v].x, positions[v].y, positions[v].z);
+				if (normals != NULL)
+					morph.normals[a][v] = normal_sign*glm::normalize(glm::vec3(normals[v].x, normals[v].y, normals[v].z));
+			}
+		}
+	}
+	std::vector<unsigned int>().swap(vertex_sources);
+	scene_guard.reset();
+
+	//Merge the bounds. The chunks of a part are consecutive
 	min_dim = glm::vec3(std::numeric_limits<float>::max());
-	max_dim = glm::vec3(std::numeric_limits<float>::min());
-	findBBoxRecursive(scene, scene->mRootNode, min_dim, max_dim, &trafo);
-	//std::cout << min_dim.x << ", " << min_dim.y << ", " << min_dim.z << " - "  << max_dim.x << ", " << max_dim.y << ", " << max_dim.z << std::endl;
-	loadRecursive(root, invert, vertex_data, normal_data, color_data, scene, scene->mRootNode);
+	max_dim = glm::vec3(-std::numeric_limits<float>::max());
+	for (size_t i=0; i<chunks.size(); ) {
+		MeshPart* part = chunks[i].part;
+		glm::vec3 part_min = chunks[i].part_min;
+		glm::vec3 part_max = chunks[i].part_max;
+		for (; i<chunks.size() && chunks[i].part == part; ++i) {
+			part_min = glm::min(part_min, chunks[i].part_min);
+			part_max = glm::max(part_max, chunks[i].part_max);
+			min_dim = glm::min(min_dim, chunks[i].model_min);
+			max_dim = glm::max(max_dim, chunks[i].model_max);
+		}
+		part->center = 0.5f*(part_min + part_max);
+		part->radius = 0.5f*glm::length(part_max - part_min);
+	}
 
 	//Translate to center
 	glm::vec3 translation = (max_dim - min_dim) / glm::vec3(2.0f) + min_dim;
@@ -30,120 +124,550 @@ Model::Model(std::string filename, bool invert) {
 	glm::vec3 scale = glm::vec3(std::min(scale_helper.x, std::min(scale_helper.y, scale_helper.z)));
 	if (invert) scale = -scale;
 	
-	root.transform = glm::scale(root.transform, scale);
-	root.transform = glm::translate(root.transform, -translation);
+	root->transform = glm::scale(root->transform, scale);
+	root->transform = glm::translate(root->transform, -translation);
+	if (skeleton)
+		skeleton->setRootTransform(glm::translate(glm::scale(glm::mat4(1.0f), scale), -translation));
+	flattenRecursive(*root, glm::mat4(1.0f), flat_parts);
+	part_transforms.resize(static_cast<unsigned int>(flat_parts.size()));
+	for (unsigned int i=0; i<flat_parts.size(); ++i)
+		part_transforms.set(i, flat_parts[i].transform, flat_parts[i].center, flat_parts[i].radius);
 
-	n_vertices = vertex_data.size();
+	n_vertices = n_loaded;
+}
 
-	//Create the VBOs from the data.
-	if (fmod(static_cast<float>(n_vertices), 3.0f) < 0.000001f) 
-		vertices.reset(new GLUtils::VBO<GL_ARRAY_BUFFER>(vertex_data.data(), n_vertices*sizeof(float)));
+void Model::loadChunks(std::vector<MeshChunk>& chunks, unsigned int begin, unsigned int end, bool invert,
+		const VertexArrays& arrays, JobSystem* job_system) {
+	JobSystem::RangeFunction load_chunks = [&](unsigned int chunk_begin, unsigned int chunk_end, unsigned int) {
+		for (unsigned int i=begin + chunk_begin; i<begin + chunk_end; ++i)
+			loadChunk(chunks[i], invert, arrays);
+	};
+	if (job_system)
+		job_system->parallelFor(end - begin, 1, load_chunks);
 	else
-		THROW_EXCEPTION("The number of vertices in the mesh is wrong");
-	if (normal_data.size() == n_vertices) 
-		normals.reset(new GLUtils::VBO<GL_ARRAY_BUFFER>(normal_data.data(), n_vertices*sizeof(float)));
-	if (color_data.size() == 4*n_vertices/3) 
-		colors.reset(new GLUtils::VBO<GL_ARRAY_BUFFER>(color_data.data(), n_vertices*sizeof(float)));
+		load_chunks(0, end - begin, 0);
 }
 
-Model::~Model() {
+void Model::uploadAll(std::vector<MeshChunk>& chunks, unsigned int n_loaded, bool invert,
+		bool has_normals, bool has_colors, JobSystem* job_system) {
+	std::vector<float> vertex_data, normal_data, tangent_data, color_data;
+	vertex_data.resize(n_loaded*3);
+	if (has_normals) {
+		normal_data.resize(n_loaded*3);
+		tangent_data.resize(n_loaded*3);
+	}
+	if (has_colors)
+		color_data.resize(n_loaded*4);
+	std::vector<uint8_t> bone_data;
+	if (skeleton)
+		bone_data.resize(n_loaded*2*Skeleton::max_influences);
 
+	VertexArrays arrays;
+	arrays.first_vertex = 0;
+	arrays.vertices = vertex_data.data();
+	arrays.normals = has_normals ? normal_data.data() : NULL;
+	arrays.tangents = has_normals ? tangent_data.data() : NULL;
+	arrays.colors = has_colors ? color_data.data() : NULL;
+	arrays.bones = skeleton ? bone_data.data() : NULL;
+	arrays.clusters = clusters.empty() ? NULL : clusters.data();
+	arrays.sources = vertex_sources.empty() ? NULL : vertex_sources.data();
+	loadChunks(chunks, 0, static_cast<unsigned int>(chunks.size()), invert, arrays, job_system);
+
+	//Create the VBOs from the data.
+	vertices.reset(new GLUtils::VBO<GL_ARRAY_BUFFER>(vertex_data.data(), vertex_data.size()*sizeof(float)));
+	if (has_normals) {
+		normals.reset(new GLUtils::VBO<GL_ARRAY_BUFFER>(normal_data.data(), normal_data.size()*sizeof(float)));
+		tangents.reset(new GLUtils::VBO<GL_ARRAY_BUFFER>(tangent_data.data(), tangent_data.size()*sizeof(float)));
+	}
+	if (has_colors)
+		colors.reset(new GLUtils::VBO<GL_ARRAY_BUFFER>(color_data.data(), color_data.size()*sizeof(float)));
+	if (skeleton)
+		bones.reset(new GLUtils::VBO<GL_ARRAY_BUFFER>(bone_data.data(), bone_data.size()));
 }
 
-void Model::findBBoxRecursive(const aiScene* scene, const aiNode* node,
-	glm::vec3& min_dim, glm::vec3& max_dim, aiMatrix4x4* trafo) {
-	aiMatrix4x4 prev;
+void Model::uploadStreaming(std::vector<MeshChunk>& chunks, unsigned int n_loaded, bool invert,
+		bool has_normals, bool has_colors, JobSystem* job_system) {
+	vertices.reset(new GLUtils::VBO<GL_ARRAY_BUFFER>(NULL, n_loaded*3*sizeof(float)));
+	if (has_normals) {
+		normals.reset(new GLUtils::VBO<GL_ARRAY_BUFFER>(NULL, n_loaded*3*sizeof(float)));
+		tangents.reset(new GLUtils::VBO<GL_ARRAY_BUFFER>(NULL, n_loaded*3*sizeof(float)));
+	}
+	if (has_colors)
+		colors.reset(new GLUtils::VBO<GL_ARRAY_BUFFER>(NULL, n_loaded*4*sizeof(float)));
+	const unsigned int bone_stride = 2*Skeleton::max_influences;
+	if (skeleton)
+		bones.reset(new GLUtils::VBO<GL_ARRAY_BUFFER>(NULL, n_loaded*bone_stride));
 
-	prev = *trafo;
-	aiMultiplyMatrix4(trafo, &node->mTransformation);
+	// Nothing has been drawn from the new buffers, so the driver
+	// need not synchronize, nor keep what was there
+	const GLbitfield access = GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT;
+	std::shared_ptr<GLUtils::VBO<GL_ARRAY_BUFFER>> buffers[4] = { vertices, normals, tangents, colors };
+	const unsigned int components[4] = { 3, 3, 3, 4 };
 
-	for (unsigned int n=0; n < node->mNumMeshes; ++n) {
-		const struct aiMesh* mesh = scene->mMeshes[node->mMeshes[n]];
-		for (unsigned int t = 0; t < mesh->mNumVertices; ++t) {
+	for (unsigned int begin=0; begin<chunks.size(); ) {
+		// As many whole chunks as fit in the budget, but at least one
+		unsigned int end = begin + 1;
+		unsigned int first_vertex = chunks[begin].first_vertex;
+		while (end < chunks.size() && chunks[end].first_vertex + chunks[end].num_faces*3 - first_vertex <= vertices_per_upload)
+			++end;
+		unsigned int count = chunks[end - 1].first_vertex + chunks[end - 1].num_faces*3 - first_vertex;
 
-			aiVector3D tmp = mesh->mVertices[t];
-			aiTransformVecByMatrix4(&tmp,trafo);
+		float* mapped[4] = { NULL, NULL, NULL, NULL };
+		for (unsigned int i=0; i<4; ++i) {
+			if (!buffers[i])
+				continue;
+			GLsizeiptr bytes = count*components[i]*sizeof(float);
+			mapped[i] = static_cast<float*>(buffers[i]->mapRange(first_vertex*components[i]*sizeof(float), bytes, access));
+			if (mapped[i] == NULL)
+				THROW_EXCEPTION("Unable to map the vertex buffer");
+		}
+		uint8_t* mapped_bones = NULL;
+		if (bones) {
+			mapped_bones = static_cast<uint8_t*>(bones->mapRange(first_vertex*bone_stride, count*bone_stride, access));
+			if (mapped_bones == NULL)
+				THROW_EXCEPTION("Unable to map the vertex buffer");
+		}
 
-			min_dim.x = std::min(min_dim.x,tmp.x);
-			min_dim.y = std::min(min_dim.y,tmp.y);
-			min_dim.z = std::min(min_dim.z,tmp.z);
+		VertexArrays arrays;
+		arrays.first_vertex = first_vertex;
+		arrays.vertices = mapped[0];
+		arrays.normals = mapped[1];
+		arrays.tangents = mapped[2];
+		arrays.colors = mapped[3];
+		arrays.bones = mapped_bones;
+		arrays.clusters = clusters.empty() ? NULL : clusters.data();
+		arrays.sources = vertex_sources.empty() ? NULL : vertex_sources.data();
+		loadChunks(chunks, begin, end, invert, arrays, job_system);
 
-			max_dim.x = std::max(max_dim.x,tmp.x);
-			max_dim.y = std::max(max_dim.y,tmp.y);
-			max_dim.z = std::max(max_dim.z,tmp.z);
-		}
+		for (unsigned int i=0; i<4; ++i)
+			if (buffers[i] && !buffers[i]->unmap())
+				THROW_EXCEPTION("The vertex buffer was lost while it was mapped");
+		if (bones && !bones->unmap())
+			THROW_EXCEPTION("The vertex buffer was lost while it was mapped");
+		begin = end;
 	}
+	GLUtils::VBO<GL_ARRAY_BUFFER>::unbind();
+}
 
-	for (unsigned int n = 0; n < node->mNumChildren; ++n)
-		findBBoxRecursive(scene, node->mChildren[n],min_dim,max_dim,trafo);
-	*trafo = prev;
+Model::~Model() {
+
+}
+
+void Model::flattenRecursive(const MeshPart& part, const glm::mat4& parent_transform, std::vector<FlatMeshPart>& flat_parts) {
+	glm::mat4 transform = parent_transform * part.transform;
+
+	if (part.count > 0) {
+		FlatMeshPart flat;
+		flat.transform = transform;
+		flat.center = part.center;
+		flat.radius = part.radius;
+		flat.first = part.first;
+		flat.count = part.count;
+		flat.first_cluster = part.first_cluster;
+		flat.num_clusters = part.num_clusters;
+		flat_parts.push_back(flat);
+	}
+
+	for (const MeshPart* child=part.first_child; child != NULL; child=child->next_sibling)
+		flattenRecursive(*child, transform, flat_parts);
 }
 
-void Model::loadRecursive(MeshPart& part, bool invert,
-			std::vector<float>& vertex_data, std::vector<float>& normal_data, 
-			std::vector<float>& color_data, const aiScene* scene, const aiNode* node) {
+bool Model::getNodeTransform(const MeshPart& node, glm::mat4& transform) const {
+	return findNodeRecursive(*root, node, glm::mat4(1.0f), transform);
+}
+
+bool Model::findNodeRecursive(const MeshPart& part, const MeshPart& node, const glm::mat4& parent_transform, glm::mat4& transform) {
+	glm::mat4 part_transform = parent_transform * part.transform;
+	if (&part == &node) {
+		transform = part_transform;
+		return true;
+	}
+
+	for (const MeshPart* child=part.first_child; child != NULL; child=child->next_sibling)
+		if (findNodeRecursive(*child, node, part_transform, transform))
+			return true;
+	return false;
+}
+
+void Model::loadRecursive(MeshPart& part, const glm::mat4& parent_transform, const aiScene* scene, const aiNode* node,
+			std::vector<MeshChunk>& chunks, unsigned int& n_loaded, unsigned int& n_clusters, bool& has_normals, bool& has_colors) {
 	//update transform matrix. notice that we also transpose it
 	aiMatrix4x4 m = node->mTransformation;
 	for (int j=0; j<4; ++j)
 		for (int i=0; i<4; ++i)
 			part.transform[j][i] = m[i][j];
+	glm::mat4 transform = parent_transform * part.transform;
 
 	// draw all meshes assigned to this node
+	// they are stored back to back, so the part covers all of them
+	part.first = n_loaded;
+	part.count = 0;
+	part.first_cluster = n_clusters;
+
 	for (unsigned int n=0; n < node->mNumMeshes; ++n) {
 		const struct aiMesh* mesh = scene->mMeshes[node->mMeshes[n]];
 
 		//apply_material(scene->mMaterials[mesh->mMaterialIndex]);
 
-		part.first = vertex_data.size()/3;
-		part.count = mesh->mNumFaces*3;
-
-		//Allocate data
-		vertex_data.reserve(vertex_data.size() + part.count*3);
-		if (mesh->HasNormals()) 
-			normal_data.reserve(normal_data.size() + part.count*3);
-		if (mesh->mColors[0] != NULL) 
- 			color_data.reserve(color_data.size() + part.count*4);
-
-		//Add the vertices from file
-		for (unsigned int t = 0; t < mesh->mNumFaces; ++t) {
-			const struct aiFace* face = &mesh->mFaces[t];
-
-			if(face->mNumIndices != 3)
-				THROW_EXCEPTION("Only triangle meshes are supported");
-
-			for(unsigned int i = 0; i < face->mNumIndices; i++) {
-				int index = face->mIndices[i];
-				vertex_data.push_back(mesh->mVertices[index].x);
-				vertex_data.push_back(mesh->mVertices[index].y);
-				vertex_data.push_back(mesh->mVertices[index].z);
-				
-				if (mesh->HasNormals()) {
-					if (!invert) {
-						normal_data.push_back(mesh->mNormals[index].x);
-						normal_data.push_back(mesh->mNormals[index].y);
-						normal_data.push_back(mesh->mNormals[index].z);
-					}
-					else {
-						normal_data.push_back(-mesh->mNormals[index].x);
-						normal_data.push_back(-mesh->mNormals[index].y);
-						normal_data.push_back(-mesh->mNormals[index].z);
-					}
-				}
-				
-				if (mesh->mColors[0] != NULL) {
-					color_data.push_back(mesh->mColors[0][index].r);
-					color_data.push_back(mesh->mColors[0][index].g);
-					color_data.push_back(mesh->mColors[0][index].b);
-					color_data.push_back(mesh->mColors[0][index].a);
-				}
-			}
+		if (mesh->mPrimitiveTypes != aiPrimitiveType_TRIANGLE)
+			THROW_EXCEPTION("Only triangle meshes are supported");
+
+		has_normals = has_normals && mesh->HasNormals();
+		has_colors = has_colors && (mesh->mColors[0] != NULL);
+
+		//Split the faces into chunks that can be expanded independently
+		for (unsigned int t = 0; t < mesh->mNumFaces; t += faces_per_chunk) {
+			MeshChunk chunk;
+			chunk.mesh = mesh;
+			chunk.mesh_index = node->mMeshes[n];
+			chunk.node = node;
+			chunk.influences = NULL;
+			chunk.part = &part;
+			chunk.transform = transform;
+			chunk.first_face = t;
+			chunk.num_faces = std::min(faces_per_chunk, mesh->mNumFaces - t);
+			chunk.first_vertex = n_loaded + t*3;
+			chunk.first_cluster = n_clusters;
+			chunks.push_back(chunk);
+			n_clusters += (chunk.num_faces + cluster_faces - 1) / cluster_faces;
 		}
+
+		part.count += mesh->mNumFaces*3;
+		n_loaded += mesh->mNumFaces*3;
 	}
+	part.num_clusters = n_clusters - part.first_cluster;
 
 	// load all children
 	std::cout << node->mNumChildren << std::endl;
+	MeshPart** link = &part.first_child;
 	for (unsigned int n = 0; n < node->mNumChildren; ++n) {
-		part.children.push_back(MeshPart());
-		loadRecursive(part.children.back(), invert, vertex_data, normal_data, color_data, scene, node->mChildren[n]);
+		*link = part_pool.create();
+		loadRecursive(**link, transform, scene, node->mChildren[n], chunks, n_loaded, n_clusters, has_normals, has_colors);
+		link = &(*link)->next_sibling;
+	}
+}
+
+namespace {
+	/**
+	 * Builds a unit tangent perpendicular to the unit normal n, following
+	 * Duff et al., "Building an Orthonormal Basis, Revisited". Used where
+	 * the mesh has no texture coordinates to derive tangents from.
+	 */
+	inline glm::vec3 orthonormalTangent(const glm::vec3& n) {
+		float sign = (n.z >= 0.0f) ? 1.0f : -1.0f;
+		float a = -1.0f / (sign + n.z);
+		float b = n.x*n.y*a;
+		return glm::vec3(1.0f + sign*n.x*n.x*a, sign*b, -sign*n.x);
+	}
+
+	/**
+	 * Spreads the lower 10 bits of x out to every third bit
+	 */
+	inline uint32_t spreadBits(uint32_t x) {
+		x &= 0x3ff;
+		x = (x | (x << 16)) & 0x030000ff;
+		x = (x | (x << 8)) & 0x0300f00f;
+		x = (x | (x << 4)) & 0x030c30c3;
+		x = (x | (x << 2)) & 0x09249249;
+		return x;
+	}
+
+	/**
+	 * Sorts the faces along a Morton curve through their centroids, so
+	 * that runs of consecutive faces are compact patches of the surface
+	 */
+	void orderFaces(const aiFace* faces, const aiVector3D* positions, unsigned int num_faces, std::vector<unsigned int>& order) {
+		std::vector<std::pair<uint32_t, unsigned int> > keys(num_faces);
+		std::vector<glm::vec3> centroids(num_faces);
+		glm::vec3 min_c(std::numeric_limits<float>::max()), max_c(-std::numeric_limits<float>::max());
+		for (unsigned int f=0; f<num_faces; ++f) {
+			glm::vec3 sum(0.0f);
+			for (unsigned int k=0; k<3; ++k) {
+				const aiVector3D& position = positions[faces[f].mIndices[k]];
+				sum += glm::vec3(position.x, position.y, position.z);
+			}
+			centroids[f] = sum / 3.0f;
+			min_c = glm::min(min_c, centroids[f]);
+			max_c = glm::max(max_c, centroids[f]);
+		}
+
+		glm::vec3 extent = max_c - min_c;
+		float scale = 1023.0f / std::max(extent.x, std::max(extent.y, std::max(extent.z, 1e-30f)));
+		for (unsigned int f=0; f<num_faces; ++f) {
+			glm::vec3 cell = (centroids[f] - min_c) * scale;
+			uint32_t code = spreadBits(static_cast<uint32_t>(cell.x)) | (spreadBits(static_cast<uint32_t>(cell.y)) << 1)
+				| (spreadBits(static_cast<uint32_t>(cell.z)) << 2);
+			keys[f] = std::make_pair(code, f);
+		}
+		std::sort(keys.begin(), keys.end());
+
+		order.resize(num_faces);
+		for (unsigned int f=0; f<num_faces; ++f)
+			order[f] = keys[f].second;
+	}
+
+#ifdef MODEL_SSE
+	/**
+	 * Writes four vertices given as structure of arrays to out, three floats each
+	 */
+	inline void storeVertices3(float* out, __m128 x, __m128 y, __m128 z) {
+		__m128 w = _mm_setzero_ps();
+		_MM_TRANSPOSE4_PS(x, y, z, w);
+		float lanes[16];
+		_mm_storeu_ps(lanes, x);
+		_mm_storeu_ps(lanes + 4, y);
+		_mm_storeu_ps(lanes + 8, z);
+		_mm_storeu_ps(lanes + 12, w);
+		for (unsigned int i=0; i<4; ++i)
+			for (unsigned int k=0; k<3; ++k)
+				out[3*i + k] = lanes[4*i + k];
+	}
+
+	inline __m128 inverseLength(__m128 x, __m128 y, __m128 z) {
+		// Zero vectors stay zero instead of turning into NaNs
+		__m128 length2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_mul_ps(z, z));
+		return _mm_div_ps(_mm_set1_ps(1.0f), _mm_sqrt_ps(_mm_max_ps(length2, _mm_set1_ps(1e-30f))));
+	}
+#endif
+}
+
+void Model::loadChunk(MeshChunk& chunk, bool invert, const VertexArrays& arrays) {
+	const struct aiMesh* mesh = chunk.mesh;
+	const struct aiFace* faces = &mesh->mFaces[chunk.first_face];
+	const float normal_sign = invert ? -1.0f : 1.0f;
+	const unsigned int count = chunk.num_faces*3;
+	const unsigned int first_vertex = chunk.first_vertex - arrays.first_vertex;
+	const glm::mat4& m = chunk.transform;
+	const unsigned int bone_stride = 2*Skeleton::max_influences;
+
+	glm::vec3 part_min(std::numeric_limits<float>::max()), part_max(-std::numeric_limits<float>::max());
+	glm::vec3 model_min(std::numeric_limits<float>::max()), model_max(-std::numeric_limits<float>::max());
+	unsigned int k = 0;
+
+	// Clusters are runs of faces, so the faces are reordered into
+	// compact patches first, which keeps the normal cones narrow
+	std::vector<unsigned int> order;
+	if (arrays.clusters != NULL) {
+		orderFaces(faces, mesh->mVertices, chunk.num_faces, order);
+		computeClusters(chunk, order.data(), arrays.clusters + chunk.first_cluster);
+	}
+	const unsigned int* face_order = order.empty() ? NULL : order.data();
+
+#ifdef MODEL_SSE
+	// Four expanded vertices at a time, gathered into structure of arrays
+	__m128 min_x = _mm_set1_ps(part_min.x), min_y = min_x, min_z = min_x;
+	__m128 max_x = _mm_set1_ps(part_max.x), max_y = max_x, max_z = max_x;
+	__m128 model_min_x = min_x, model_min_y = min_x, model_min_z = min_x;
+	__m128 model_max_x = max_x, model_max_y = max_x, model_max_z = max_x;
+	__m128 sign = _mm_set1_ps(normal_sign);
+	__m128 one = _mm_set1_ps(1.0f);
+	__m128 sign_bit = _mm_set1_ps(-0.0f);
+	__m128 columns[4][3];
+	for (unsigned int c=0; c<4; ++c)
+		for (unsigned int r=0; r<3; ++r)
+			columns[c][r] = _mm_set1_ps(m[c][r]);
+
+	for (; k + 4 <= count; k += 4) {
+		unsigned int index[4];
+		for (unsigned int i=0; i<4; ++i)
+			index[i] = faces[face_order ? face_order[(k + i)/3] : (k + i)/3].mIndices[(k + i)%3];
+		unsigned int v = first_vertex + k;
+
+		const aiVector3D* p = mesh->mVertices;
+		__m128 x = _mm_set_ps(p[index[3]].x, p[index[2]].x, p[index[1]].x, p[index[0]].x);
+		__m128 y = _mm_set_ps(p[index[3]].y, p[index[2]].y, p[index[1]].y, p[index[0]].y);
+		__m128 z = _mm_set_ps(p[index[3]].z, p[index[2]].z, p[index[1]].z, p[index[0]].z);
+		storeVertices3(&arrays.vertices[3*v], x, y, z);
+
+		min_x = _mm_min_ps(min_x, x); max_x = _mm_max_ps(max_x, x);
+		min_y = _mm_min_ps(min_y, y); max_y = _mm_max_ps(max_y, y);
+		min_z = _mm_min_ps(min_z, z); max_z = _mm_max_ps(max_z, z);
+
+		__m128 model[3];
+		for (unsigned int r=0; r<3; ++r)
+			model[r] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(columns[0][r], x), _mm_mul_ps(columns[1][r], y)),
+				_mm_add_ps(_mm_mul_ps(columns[2][r], z), columns[3][r]));
+		model_min_x = _mm_min_ps(model_min_x, model[0]); model_max_x = _mm_max_ps(model_max_x, model[0]);
+		model_min_y = _mm_min_ps(model_min_y, model[1]); model_max_y = _mm_max_ps(model_max_y, model[1]);
+		model_min_z = _mm_min_ps(model_min_z, model[2]); model_max_z = _mm_max_ps(model_max_z, model[2]);
+
+		if (arrays.normals != NULL) {
+			const aiVector3D* n = mesh->mNormals;
+			__m128 nx = _mm_set_ps(n[index[3]].x, n[index[2]].x, n[index[1]].x, n[index[0]].x);
+			__m128 ny = _mm_set_ps(n[index[3]].y, n[index[2]].y, n[index[1]].y, n[index[0]].y);
+			__m128 nz = _mm_set_ps(n[index[3]].z, n[index[2]].z, n[index[1]].z, n[index[0]].z);
+			__m128 scale = _mm_mul_ps(sign, inverseLength(nx, ny, nz));
+			nx = _mm_mul_ps(nx, scale);
+			ny = _mm_mul_ps(ny, scale);
+			nz = _mm_mul_ps(nz, scale);
+			storeVertices3(&arrays.normals[3*v], nx, ny, nz);
+
+			__m128 tx, ty, tz;
+			if (mesh->mTangents != NULL) {
+				// Make the imported tangents orthonormal to the normals
+				const aiVector3D* t = mesh->mTangents;
+				tx = _mm_set_ps(t[index[3]].x, t[index[2]].x, t[index[1]].x, t[index[0]].x);
+				ty = _mm_set_ps(t[index[3]].y, t[index[2]].y, t[index[1]].y, t[index[0]].y);
+				tz = _mm_set_ps(t[index[3]].z, t[index[2]].z, t[index[1]].z, t[index[0]].z);
+				__m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, tx), _mm_mul_ps(ny, ty)), _mm_mul_ps(nz, tz));
+				tx = _mm_sub_ps(tx, _mm_mul_ps(nx, d));
+				ty = _mm_sub_ps(ty, _mm_mul_ps(ny, d));
+				tz = _mm_sub_ps(tz, _mm_mul_ps(nz, d));
+				__m128 length = inverseLength(tx, ty, tz);
+				tx = _mm_mul_ps(tx, length);
+				ty = _mm_mul_ps(ty, length);
+				tz = _mm_mul_ps(tz, length);
+			}
+			else {
+				__m128 s = _mm_or_ps(one, _mm_and_ps(nz, sign_bit));
+				__m128 a = _mm_div_ps(_mm_sub_ps(_mm_setzero_ps(), one), _mm_add_ps(s, nz));
+				__m128 b = _mm_mul_ps(_mm_mul_ps(nx, ny), a);
+				tx = _mm_add_ps(one, _mm_mul_ps(_mm_mul_ps(s, _mm_mul_ps(nx, nx)), a));
+				ty = _mm_mul_ps(s, b);
+				tz = _mm_sub_ps(_mm_setzero_ps(), _mm_mul_ps(s, nx));
+			}
+			storeVertices3(&arrays.tangents[3*v], tx, ty, tz);
+		}
+
+		if (arrays.colors != NULL) {
+			for (unsigned int i=0; i<4; ++i) {
+				const aiColor4D& colour = mesh->mColors[0][index[i]];
+				float* out = &arrays.colors[4*(v + i)];
+				out[0] = colour.r; out[1] = colour.g; out[2] = colour.b; out[3] = colour.a;
+			}
+		}
+
+		if (arrays.bones != NULL)
+			for (unsigned int i=0; i<4; ++i)
+				std::memcpy(&arrays.bones[bone_stride*(v + i)], chunk.influences + bone_stride*index[i], bone_stride);
+		if (arrays.sources != NULL)
+			for (unsigned int i=0; i<4; ++i)
+				arrays.sources[chunk.first_vertex + k + i] = index[i];
 	}
-}
\ No newline at end of file
+
+	float lanes[4];
+	__m128 reduce[12] = { min_x, min_y, min_z, max_x, max_y, max_z, model_min_x, model_min_y, model_min_z, model_max_x, model_max_y, model_max_z };
+	glm::vec3* bounds[4] = { &part_min, &part_max, &model_min, &model_max };
+	for (unsigned int i=0; i<12; ++i) {
+		_mm_storeu_ps(lanes, reduce[i]);
+		float value = lanes[0];
+		for (unsigned int lane=1; lane<4; ++lane)
+			value = (i/3 % 2 == 0) ? std::min(value, lanes[lane]) : std::max(value, lanes[lane]);
+		(*bounds[i/3])[i%3] = value;
+	}
+#endif
+
+	// The rest, or everything without SSE
+	for (; k < count; ++k) {
+		unsigned int index = faces[face_order ? face_order[k/3] : k/3].mIndices[k%3];
+		unsigned int v = first_vertex + k;
+
+		glm::vec3 position(mesh->mVertices[index].x, mesh->mVertices[index].y, mesh->mVertices[index].z);
+		arrays.vertices[3*v+0] = position.x;
+		arrays.vertices[3*v+1] = position.y;
+		arrays.vertices[3*v+2] = position.z;
+		part_min = glm::min(part_min, position);
+		part_max = glm::max(part_max, position);
+		glm::vec3 model_position = glm::vec3(m * glm::vec4(position, 1.0f));
+		model_min = glm::min(model_min, model_position);
+		model_max = glm::max(model_max, model_position);
+
+		if (arrays.normals != NULL) {
+			glm::vec3 normal(mesh->mNormals[index].x, mesh->mNormals[index].y, mesh->mNormals[index].z);
+			normal *= normal_sign / std::sqrt(std::max(glm::dot(normal, normal), 1e-30f));
+			arrays.normals[3*v+0] = normal.x;
+			arrays.normals[3*v+1] = normal.y;
+			arrays.normals[3*v+2] = normal.z;
+
+			glm::vec3 tangent;
+			if (mesh->mTangents != NULL) {
+				tangent = glm::vec3(mesh->mTangents[index].x, mesh->mTangents[index].y, mesh->mTangents[index].z);
+				tangent = tangent - normal*glm::dot(normal, tangent);
+				tangent *= 1.0f / std::sqrt(std::max(glm::dot(tangent, tangent), 1e-30f));
+			}
+			else
+				tangent = orthonormalTangent(normal);
+			arrays.tangents[3*v+0] = tangent.x;
+			arrays.tangents[3*v+1] = tangent.y;
+			arrays.tangents[3*v+2] = tangent.z;
+		}
+
+		if (arrays.colors != NULL) {
+			arrays.colors[4*v+0] = mesh->mColors[0][index].r;
+			arrays.colors[4*v+1] = mesh->mColors[0][index].g;
+			arrays.colors[4*v+2] = mesh->mColors[0][index].b;
+			arrays.colors[4*v+3] = mesh->mColors[0][index].a;
+		}
+
+		if (arrays.bones != NULL)
+			std::memcpy(&arrays.bones[bone_stride*v], chunk.influences + bone_stride*index, bone_stride);
+		if (arrays.sources != NULL)
+			arrays.sources[chunk.first_vertex + k] = index;
+	}
+
+	chunk.part_min = part_min;
+	chunk.part_max = part_max;
+	chunk.model_min = model_min;
+	chunk.model_max = model_max;
+}
+
+void Model::computeClusters(const MeshChunk& chunk, const unsigned int* order, MeshCluster* clusters) {
+	const struct aiMesh* mesh = chunk.mesh;
+	const aiVector3D* p = mesh->mVertices;
+
+	for (unsigned int first_face=0; first_face<chunk.num_faces; first_face+=cluster_faces) {
+		const struct aiFace* chunk_faces = &mesh->mFaces[chunk.first_face];
+		const unsigned int* faces = order + first_face;
+		unsigned int num_faces = std::min(cluster_faces, chunk.num_faces - first_face);
+		MeshCluster& cluster = clusters[first_face / cluster_faces];
+
+		glm::vec3 min_v(std::numeric_limits<float>::max()), max_v(-std::numeric_limits<float>::max());
+		glm::vec3 normal_sum(0.0f);
+		for (unsigned int f=0; f<num_faces; ++f) {
+			glm::vec3 v[3];
+			for (unsigned int k=0; k<3; ++k) {
+				const aiVector3D& position = p[chunk_faces[faces[f]].mIndices[k]];
+				v[k] = glm::vec3(position.x, position.y, position.z);
+				min_v = glm::min(min_v, v[k]);
+				max_v = glm::max(max_v, v[k]);
+			}
+			glm::vec3 normal = glm::cross(v[1] - v[0], v[2] - v[0]);
+			float length = glm::length(normal);
+			if (length > 0.0f)
+				normal_sum += normal / length;
+		}
+
+		// The sphere around the box centre, shrunk to the farthest vertex
+		cluster.center = 0.5f*(min_v + max_v);
+		float radius2 = 0.0f;
+		for (unsigned int f=0; f<num_faces; ++f) {
+			for (unsigned int k=0; k<3; ++k) {
+				const aiVector3D& position = p[chunk_faces[faces[f]].mIndices[k]];
+				glm::vec3 offset = glm::vec3(position.x, position.y, position.z) - cluster.center;
+				radius2 = std::max(radius2, glm::dot(offset, offset));
+			}
+		}
+		cluster.radius = std::sqrt(radius2);
+
+		// The cone is as wide as the normal farthest from the average. Past
+		// 90 degrees some triangle always faces the camera, so never cull
+		float axis_length = glm::length(normal_sum);
+		cluster.cone_axis = (axis_length > 0.0f) ? normal_sum / axis_length : glm::vec3(0.0f, 0.0f, 1.0f);
+		float min_cos = (axis_length > 0.0f) ? 1.0f : -1.0f;
+		for (unsigned int f=0; f<num_faces && min_cos > 0.0f; ++f) {
+			glm::vec3 v[3];
+			for (unsigned int k=0; k<3; ++k) {
+				const aiVector3D& position = p[chunk_faces[faces[f]].mIndices[k]];
+				v[k] = glm::vec3(position.x, position.y, position.z);
+			}
+			glm::vec3 normal = glm::cross(v[1] - v[0], v[2] - v[0]);
+			float length = glm::length(normal);
+			if (length > 0.0f)
+				min_cos = std::min(min_cos, glm::dot(normal, cluster.cone_axis) / length);
+		}
+		cluster.cone_cutoff = (min_cos > 0.0f) ? std::sqrt(1.0f - min_cos*min_cos) : 1.0f;
+
+		cluster.first = chunk.first_vertex + first_face*3;
+		cluster.count = num_faces*3;
+	}
+}
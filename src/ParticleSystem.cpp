@@ -0,0 +1,172 @@
+#include "ParticleSystem.h"
+
+#include <string>
+#include <sstream>
+
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/type_ptr.hpp>
+
+ParticleSystem::ParticleSystem(GLUtils::ProgramCache* cache, ShaderReloader* reloader, unsigned int max_particles)
+		: current(0), max_particles(max_particles), num_particles(0), gravity(0.0f, -1.0f, 0.0f), seed(0) {
+	std::vector<std::string> varyings;
+	varyings.push_back("out_position_age");
+	varyings.push_back("out_velocity_emitter");
+	update_program = cache->getFeedbackProgram(GLUtils::readFile("shaders/particle_update.vert"), varyings);
+	render_program = cache->getProgram(GLUtils::readFile("shaders/particle.vert"), GLUtils::readFile("shaders/particle.frag"));
+	if (reloader != NULL) {
+		reloader->add(update_program, "particle_update.vert", "", "");
+		reloader->add(render_program, "particle.vert", "", "particle.frag");
+	}
+
+	// Drawn as a strip, counter-clockwise when facing the camera
+	static const float corners[8] = { -1.0f, -1.0f, 1.0f, -1.0f, -1.0f, 1.0f, 1.0f, 1.0f };
+	quad.reset(new GLUtils::VBO<GL_ARRAY_BUFFER>(corners, sizeof(corners)));
+
+	const GLsizei stride = floats_per_particle*sizeof(float);
+	const GLvoid* velocity_offset = reinterpret_cast<const GLvoid*>(4*sizeof(float));
+	glGenVertexArrays(2, update_vaos);
+	glGenVertexArrays(2, render_vaos);
+	for (unsigned int i=0; i<2; ++i) {
+		buffers[i].reset(new GLUtils::VBO<GL_ARRAY_BUFFER>(NULL, max_particles*stride, GL_DYNAMIC_COPY));
+
+		glBindVertexArray(update_vaos[i]);
+		buffers[i]->bind();
+		update_program->setAttributePointer("position_age", 4, GL_FLOAT, GL_FALSE, stride, NULL);
+		update_program->setAttributePointer("velocity_emitter", 4, GL_FLOAT, GL_FALSE, stride, const_cast<GLvoid*>(velocity_offset));
+
+		glBindVertexArray(render_vaos[i]);
+		quad->bind();
+		render_program->setAttributePointer("corner", 2);
+		buffers[i]->bind();
+		render_program->setAttributePointer("position_age", 4, GL_FLOAT, GL_FALSE, stride, NULL);
+		render_program->setAttributePointer("velocity_emitter", 4, GL_FLOAT, GL_FALSE, stride, const_cast<GLvoid*>(velocity_offset));
+		glVertexAttribDivisor(glGetAttribLocation(render_program->name, "position_age"), 1);
+		glVertexAttribDivisor(glGetAttribLocation(render_program->name, "velocity_emitter"), 1);
+	}
+	glBindVertexArray(0);
+	GLUtils::VBO<GL_ARRAY_BUFFER>::unbind();
+	CHECK_GL_ERROR();
+}
+
+ParticleSystem::~ParticleSystem() {
+	glDeleteVertexArrays(2, update_vaos);
+	glDeleteVertexArrays(2, render_vaos);
+}
+
+unsigned int ParticleSystem::addEmitter(const Emitter& emitter) {
+	if (emitters.size() == max_emitters) {
+		std::stringstream err;
+		err << "A particle system can have at most " << max_emitters << " emitters";
+		THROW_EXCEPTION(err.str());
+	}
+	if (emitter.num_particles > max_particles - num_particles) {
+		std::stringstream err;
+		err << "Not room for " << emitter.num_particles << " more particles, " << num_particles << " of " << max_particles << " are in use";
+		THROW_EXCEPTION(err.str());
+	}
+
+	// Negative ages count down to birth, spread over one lifetime so the
+	// emitter starts out at its steady rate
+	unsigned int index = static_cast<unsigned int>(emitters.size());
+	std::vector<float> particles(emitter.num_particles*floats_per_particle, 0.0f);
+	for (unsigned int i=0; i<emitter.num_particles; ++i) {
+		particles[i*floats_per_particle + 3] = -emitter.lifetime * (i + 1) / emitter.num_particles;
+		particles[i*floats_per_particle + 7] = static_cast<float>(index);
+	}
+	GLintptr offset = num_particles*floats_per_particle*sizeof(float);
+	GLsizeiptr bytes = particles.size()*sizeof(float);
+	for (unsigned int i=0; i<2; ++i) {
+		buffers[i]->bind();
+		glBufferSubData(GL_ARRAY_BUFFER, offset, bytes, particles.data());
+	}
+	GLUtils::VBO<GL_ARRAY_BUFFER>::unbind();
+
+	EmitterState state;
+	state.emitter = emitter;
+	state.model_transform = glm::mat4(1.0f);
+	emitters.push_back(state);
+	num_particles += emitter.num_particles;
+	return index;
+}
+
+void ParticleSystem::setModelTransform(const Model* model, const glm::mat4& transform) {
+	for (size_t i=0; i<emitters.size(); ++i)
+		if (emitters[i].emitter.model == model)
+			emitters[i].model_transform = transform;
+}
+
+void ParticleSystem::update(float dt) {
+	if (num_particles == 0)
+		return;
+
+	// Nodes do not move within their model, but looking them up every
+	// frame costs next to nothing for a handful of emitters
+	glm::mat4 transforms[max_emitters];
+	glm::vec4 velocities[max_emitters];
+	float lifetimes[max_emitters];
+	for (size_t i=0; i<emitters.size(); ++i) {
+		const Emitter& emitter = emitters[i].emitter;
+		glm::mat4 node_transform(1.0f);
+		if (emitter.model != NULL && emitter.node != NULL)
+			emitter.model->getNodeTransform(*emitter.node, node_transform);
+		transforms[i] = glm::translate(emitters[i].model_transform * node_transform, emitter.position);
+		velocities[i] = glm::vec4(emitter.velocity, emitter.spread);
+		lifetimes[i] = emitter.lifetime;
+	}
+
+	GLuint name = update_program->name;
+	GLsizei count = static_cast<GLsizei>(emitters.size());
+	glProgramUniformMatrix4fv(name, update_program->getUniform("emitter_transforms"), count, 0, glm::value_ptr(transforms[0]));
+	glProgramUniform4fv(name, update_program->getUniform("emitter_velocities"), count, glm::value_ptr(velocities[0]));
+	glProgramUniform1fv(name, update_program->getUniform("emitter_lifetimes"), count, lifetimes);
+	glProgramUniform3fv(name, update_program->getUniform("gravity"), 1, glm::value_ptr(gravity));
+	glProgramUniform1f(name, update_program->getUniform("dt"), dt);
+	glProgramUniform1ui(name, update_program->getUniform("seed"), seed++);
+
+	// Nothing is rasterized; the new states only go to the other buffer
+	glEnable(GL_RASTERIZER_DISCARD);
+	update_program->use();
+	glBindVertexArray(update_vaos[current]);
+	glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, buffers[1 - current]->name());
+	glBeginTransformFeedback(GL_POINTS);
+	glDrawArrays(GL_POINTS, 0, num_particles);
+	glEndTransformFeedback();
+	glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, 0);
+	glBindVertexArray(0);
+	update_program->disuse();
+	glDisable(GL_RASTERIZER_DISCARD);
+
+	current = 1 - current;
+}
+
+void ParticleSystem::render(const glm::mat4& view, const glm::mat4& projection) {
+	if (num_particles == 0)
+		return;
+
+	glm::vec4 appearances[max_emitters];
+	float lifetimes[max_emitters];
+	for (size_t i=0; i<emitters.size(); ++i) {
+		appearances[i] = glm::vec4(emitters[i].emitter.colour, emitters[i].emitter.size);
+		lifetimes[i] = emitters[i].emitter.lifetime;
+	}
+
+	GLuint name = render_program->name;
+	GLsizei count = static_cast<GLsizei>(emitters.size());
+	glProgramUniformMatrix4fv(name, render_program->getUniform("view_mat"), 1, 0, glm::value_ptr(view));
+	glProgramUniformMatrix4fv(name, render_program->getUniform("proj_mat"), 1, 0, glm::value_ptr(projection));
+	glProgramUniform4fv(name, render_program->getUniform("emitter_appearances"), count, glm::value_ptr(appearances[0]));
+	glProgramUniform1fv(name, render_program->getUniform("emitter_lifetimes"), count, lifetimes);
+
+	glDepthMask(GL_FALSE);
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_ONE, GL_ONE);
+
+	render_program->use();
+	glBindVertexArray(render_vaos[current]);
+	glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, num_particles);
+	glBindVertexArray(0);
+	render_program->disuse();
+
+	glDisable(GL_BLEND);
+	glDepthMask(GL_TRUE);
+}
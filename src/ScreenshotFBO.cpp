@@ -1,60 +1,183 @@
 #include "ScreenshotFBO.h"
 #include "GLUtils/GLUtils.hpp"
 
-ScreenshotFBO::ScreenshotFBO(unsigned int width, unsigned int height) {
-	this->width = width;
-	this->height = height;
+#include <algorithm>
 
-	// Initialize Depth Texture
-	glGenTextures(1, &texture);
-	glBindTexture(GL_TEXTURE_2D, texture);
+#include <glm/glm.hpp>
+#include <glm/gtc/type_ptr.hpp>
 
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, width, height, 0, GL_BGRA, GL_UNSIGNED_BYTE, nullptr);
-	CHECK_GL_ERROR();
+ScreenshotFBO::ScreenshotFBO(unsigned int width, unsigned int height, unsigned int samples) {
+	this->width = width;
+	this->height = height;
 
-	/* shadow texture
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+	GLint max_samples = 1;
+	glGetIntegerv(GL_MAX_SAMPLES, &max_samples);
+	this->samples = std::min(samples, static_cast<unsigned int>(max_samples));
 
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT32, width, height, 0, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
+	allocate(width, height);
+	reallocations = 0;
+}
 
-	glGenFramebuffersEXT(1, &fbo);
-	glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, fbo);
-	glDrawBuffer(GL_NONE);
-	glFramebufferTexture2DEXT(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT_EXT, GL_TEXTURE_2D, texture, 0);
+ScreenshotFBO::~ScreenshotFBO()
+{
+	release();
+}
 
-	glClear(GL_DEPTH_BUFFER_BIT);
-	*/
+void ScreenshotFBO::resize(unsigned int width, unsigned int height) {
+	this->width = std::max(width, 1u);
+	this->height = std::max(height, 1u);
+	if (this->width <= allocated_width && this->height <= allocated_height)
+		return;
+
+	// Dragging the window edge resizes a few pixels at a time, so leave
+	// room to avoid reallocating on every step
+	unsigned int new_width = std::max(allocated_width, (this->width + granularity - 1) / granularity * granularity);
+	unsigned int new_height = std::max(allocated_height, (this->height + granularity - 1) / granularity * granularity);
+	release();
+	allocate(new_width, new_height);
+	++reallocations;
+}
 
+void ScreenshotFBO::allocate(unsigned int width, unsigned int height) {
+	allocated_width = width;
+	allocated_height = height;
 
+	// Without anti-aliasing, the scene goes straight into the final texture.
+	// Both formats must match the multisampled ones for the resolve blit
+	texture = createTexture(width, height);
+	glGenRenderbuffers(1, &depth);
+	glBindRenderbuffer(GL_RENDERBUFFER, depth);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
 
-	//Generate an FBO, and attach the texture and render buffer
 	glGenFramebuffers(1, &fbo);
 	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
 	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depth);
+	CHECK_GL_FBO_COMPLETENESS();
 
-	glBindFramebuffer(GL_FRAMEBUFFER_EXT, 0);
-	glBindTexture(GL_TEXTURE_2D, 0);
+	glGenRenderbuffers(1, &msaa_colour);
+	glBindRenderbuffer(GL_RENDERBUFFER, msaa_colour);
+	glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples, GL_RGBA8, width, height);
+	glGenRenderbuffers(1, &msaa_depth);
+	glBindRenderbuffer(GL_RENDERBUFFER, msaa_depth);
+	glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples, GL_DEPTH_COMPONENT24, width, height);
+
+	glGenFramebuffers(1, &msaa_fbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, msaa_fbo);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, msaa_colour);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, msaa_depth);
+	CHECK_GL_FBO_COMPLETENESS();
 
-	//Check for completeness
-	CHECK_GL_ERRORS();
+	fxaa_texture = createTexture(width, height);
+	glGenFramebuffers(1, &fxaa_fbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, fxaa_fbo);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, fxaa_texture, 0);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depth);
 	CHECK_GL_FBO_COMPLETENESS();
+
+	glBindRenderbuffer(GL_RENDERBUFFER, 0);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	CHECK_GL_ERRORS();
 }
 
+void ScreenshotFBO::release() {
+	glDeleteFramebuffers(1, &fbo);
+	glDeleteFramebuffers(1, &msaa_fbo);
+	glDeleteFramebuffers(1, &fxaa_fbo);
+	glDeleteRenderbuffers(1, &depth);
+	glDeleteRenderbuffers(1, &msaa_colour);
+	glDeleteRenderbuffers(1, &msaa_depth);
+	glDeleteTextures(1, &texture);
+	glDeleteTextures(1, &fxaa_texture);
+}
 
-ScreenshotFBO::~ScreenshotFBO()
-{
-	glDeleteFramebuffersEXT(1, &fbo);
+GLuint ScreenshotFBO::createTexture(unsigned int width, unsigned int height) {
+	// FXAA samples between texels, so filter linearly
+	GLuint name;
+	glGenTextures(1, &name);
+	glBindTexture(GL_TEXTURE_2D, name);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_BGRA, GL_UNSIGNED_BYTE, nullptr);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	return name;
 }
 
-void ScreenshotFBO::bind() {
-	glBindFramebufferEXT(GL_FRAMEBUFFER, fbo);
+void ScreenshotFBO::bind(AntiAliasing mode) {
+	switch (mode) {
+	case AA_MSAA:
+		glBindFramebuffer(GL_FRAMEBUFFER, msaa_fbo);
+		break;
+	case AA_FXAA:
+		glBindFramebuffer(GL_FRAMEBUFFER, fxaa_fbo);
+		break;
+	default:
+		glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+		break;
+	}
 }
 
 void ScreenshotFBO::unbind() {
-	glBindFramebufferEXT(GL_FRAMEBUFFER, 0);
-}
\ No newline at end of file
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+void ScreenshotFBO::drawQuad(GLUtils::Program& program, GLuint source, GLuint quad_vao) {
+	GLboolean depth_test = glIsEnabled(GL_DEPTH_TEST);
+	glDisable(GL_DEPTH_TEST);
+
+	// Texture coordinates only cover the rendered part, and samples
+	// are kept half a texel inside it
+	glm::mat3 identity;
+	glm::vec2 texel_size(1.0f / allocated_width, 1.0f / allocated_height);
+	glm::vec2 tex_scale(width * texel_size.x, height * texel_size.y);
+	glm::vec2 tex_max = tex_scale - 0.5f * texel_size;
+	program.use();
+	glUniformMatrix3fv(program.getUniform("transform"), 1, 0, glm::value_ptr(identity));
+	glUniform2fv(program.getUniform("tex_scale"), 1, glm::value_ptr(tex_scale));
+	glUniform2fv(program.getUniform("tex_max"), 1, glm::value_ptr(tex_max));
+	glUniform2fv(program.getUniform("texel_size"), 1, glm::value_ptr(texel_size));
+	glUniform1i(program.getUniform("texture"), 0);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, source);
+	glBindVertexArray(quad_vao);
+	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+	glBindVertexArray(0);
+	program.disuse();
+
+	if (depth_test)
+		glEnable(GL_DEPTH_TEST);
+}
+
+void ScreenshotFBO::resolve(AntiAliasing mode, GLUtils::Program& fxaa_program, GLuint quad_vao) {
+	if (mode == AA_MSAA) {
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, msaa_fbo);
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, fbo);
+		glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+	}
+	else if (mode == AA_FXAA) {
+		glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+		glViewport(0, 0, width, height);
+		drawQuad(fxaa_program, fxaa_texture, quad_vao);
+	}
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+void ScreenshotFBO::present(unsigned int window_width, unsigned int window_height, GLUtils::Program& upscale_program, GLuint quad_vao) {
+	if (width == window_width && height == window_height) {
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+		glBlitFramebuffer(0, 0, width, height, 0, 0, window_width, window_height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+	}
+	else {
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		glViewport(0, 0, window_width, window_height);
+		drawQuad(upscale_program, texture, quad_vao);
+	}
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+void ScreenshotFBO::bindForReading() {
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+}
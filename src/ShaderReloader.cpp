@@ -0,0 +1,194 @@
+#include "ShaderReloader.h"
+
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+
+#include "GLUtils/GLUtils.hpp"
+
+ShaderReloader::ShaderReloader(std::string directory) : directory(directory), watcher(directory), parallel_compile(false) {
+#ifdef GL_KHR_parallel_shader_compile
+	if (GLEW_KHR_parallel_shader_compile) {
+		// Let the driver use as many threads as it likes
+		glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);
+		parallel_compile = true;
+	}
+#endif
+}
+
+ShaderReloader::~ShaderReloader() {
+	for (size_t i=0; i<entries.size(); ++i)
+		discardBuild(entries[i].build);
+}
+
+void ShaderReloader::add(std::shared_ptr<GLUtils::Program> program, std::string vs, std::string gs, std::string fs,
+		ReloadCallback on_reload, const std::vector<std::string>& defines) {
+	Entry entry;
+	entry.program = program;
+	entry.on_reload = on_reload;
+	entry.defines = defines;
+	entry.changed = false;
+
+	std::string filenames[] = { vs, gs, fs };
+	GLenum types[] = { GL_VERTEX_SHADER, GL_GEOMETRY_SHADER, GL_FRAGMENT_SHADER };
+	for (unsigned int i=0; i<3; ++i) {
+		if (filenames[i].empty())
+			continue;
+
+		std::string path = directory + "/" + filenames[i];
+		bool watched = false;
+		for (size_t j=0; j<entries.size() && !watched; ++j)
+			watched = std::find(entries[j].paths.begin(), entries[j].paths.end(), path) != entries[j].paths.end();
+		if (!watched)
+			watcher.addFile(filenames[i]);
+
+		entry.paths.push_back(path);
+		entry.types.push_back(types[i]);
+	}
+
+	entries.push_back(entry);
+}
+
+void ShaderReloader::update() {
+	changed_files.clear();
+	watcher.poll(changed_files);
+	for (size_t i=0; i<changed_files.size(); ++i)
+		for (size_t j=0; j<entries.size(); ++j)
+			if (std::find(entries[j].paths.begin(), entries[j].paths.end(), changed_files[i]) != entries[j].paths.end())
+				entries[j].changed = true;
+
+	for (size_t i=0; i<entries.size(); ++i) {
+		Entry& entry = entries[i];
+
+		// A file changing during a build restarts it once the build is done
+		if (entry.changed && entry.build.program == 0) {
+			entry.changed = false;
+			startBuild(entry);
+		}
+
+		if (entry.build.program != 0 && isBuildDone(entry.build))
+			finishBuild(entry);
+	}
+}
+
+void ShaderReloader::startBuild(Entry& entry) {
+	std::vector<std::string> sources;
+	try {
+		for (size_t i=0; i<entry.paths.size(); ++i)
+			sources.push_back(GLUtils::insertDefines(GLUtils::readFile(entry.paths[i]), entry.defines));
+	}
+	catch (const std::exception& e) {
+		// The file may be saved again in a moment
+		std::cerr << e.what() << std::endl << "Keeping the previous program" << std::endl;
+		return;
+	}
+
+	// Only issue the work here; asking for the status would wait for it
+	Build& build = entry.build;
+	build.program = glCreateProgram();
+	for (size_t i=0; i<sources.size(); ++i) {
+		GLuint shader = glCreateShader(entry.types[i]);
+		const GLchar* src_list[1] = { sources[i].c_str() };
+		glShaderSource(shader, 1, src_list, NULL);
+		glCompileShader(shader);
+		glAttachShader(build.program, shader);
+		build.shaders.push_back(shader);
+	}
+
+	// The vertex arrays were set up with the old attribute locations
+	GLuint old_program = entry.program->name;
+	GLint num_attributes = 0, max_length = 0;
+	glGetProgramiv(old_program, GL_ACTIVE_ATTRIBUTES, &num_attributes);
+	glGetProgramiv(old_program, GL_ACTIVE_ATTRIBUTE_MAX_LENGTH, &max_length);
+	std::vector<GLchar> attribute_name(max_length + 1);
+	for (GLint i=0; i<num_attributes; ++i) {
+		GLint size;
+		GLenum type;
+		glGetActiveAttrib(old_program, i, max_length + 1, NULL, &size, &type, attribute_name.data());
+		GLint location = glGetAttribLocation(old_program, attribute_name.data());
+		if (location >= 0)
+			glBindAttribLocation(build.program, location, attribute_name.data());
+	}
+
+	// And the transform feedback buffers with the old outputs
+	GLint num_varyings = 0;
+	glGetProgramiv(old_program, GL_TRANSFORM_FEEDBACK_VARYINGS, &num_varyings);
+	if (num_varyings > 0) {
+		GLint buffer_mode = GL_INTERLEAVED_ATTRIBS;
+		glGetProgramiv(old_program, GL_TRANSFORM_FEEDBACK_BUFFER_MODE, &buffer_mode);
+		glGetProgramiv(old_program, GL_TRANSFORM_FEEDBACK_VARYING_MAX_LENGTH, &max_length);
+		std::vector<GLchar> varying_name(max_length + 1);
+		std::vector<std::string> varyings(num_varyings);
+		std::vector<const GLchar*> varying_names(num_varyings);
+		for (GLint i=0; i<num_varyings; ++i) {
+			GLsizei size;
+			GLenum type;
+			glGetTransformFeedbackVarying(old_program, i, max_length + 1, NULL, &size, &type, varying_name.data());
+			varyings[i] = varying_name.data();
+			varying_names[i] = varyings[i].c_str();
+		}
+		glTransformFeedbackVaryings(build.program, num_varyings, varying_names.data(), buffer_mode);
+	}
+
+	glLinkProgram(build.program);
+}
+
+bool ShaderReloader::isBuildDone(const Build& build) const {
+#ifdef GL_KHR_parallel_shader_compile
+	if (parallel_compile) {
+		GLint done = GL_FALSE;
+		glGetProgramiv(build.program, GL_COMPLETION_STATUS_KHR, &done);
+		return done == GL_TRUE;
+	}
+#endif
+	// Without the extension, the status queries simply wait
+	return true;
+}
+
+void ShaderReloader::finishBuild(Entry& entry) {
+	Build& build = entry.build;
+	std::stringstream log;
+
+	for (size_t i=0; i<build.shaders.size(); ++i) {
+		GLint compile_status;
+		glGetShaderiv(build.shaders[i], GL_COMPILE_STATUS, &compile_status);
+		if (compile_status != GL_TRUE)
+			log << "Compiling " << entry.paths[i] << " failed!" << std::endl << GLUtils::Program::getShaderLog(build.shaders[i]);
+	}
+
+	GLint link_status;
+	glGetProgramiv(build.program, GL_LINK_STATUS, &link_status);
+	if (log.str().empty() && link_status != GL_TRUE)
+		log << "Linking failed!" << std::endl << GLUtils::Program::getProgramLog(build.program);
+
+	if (!log.str().empty()) {
+		std::cerr << log.str() << "Keeping the previous program" << std::endl;
+		discardBuild(build);
+		return;
+	}
+
+	for (size_t i=0; i<build.shaders.size(); ++i) {
+		glDetachShader(build.program, build.shaders[i]);
+		glDeleteShader(build.shaders[i]);
+	}
+	build.shaders.clear();
+
+	entry.program->replace(build.program);
+	build.program = 0;
+	if (entry.on_reload)
+		entry.on_reload(*entry.program);
+
+	std::cout << "Reloaded";
+	for (size_t i=0; i<entry.paths.size(); ++i)
+		std::cout << " " << entry.paths[i];
+	std::cout << std::endl;
+}
+
+void ShaderReloader::discardBuild(Build& build) {
+	for (size_t i=0; i<build.shaders.size(); ++i)
+		glDeleteShader(build.shaders[i]);
+	build.shaders.clear();
+	if (build.program != 0)
+		glDeleteProgram(build.program);
+	build.program = 0;
+}
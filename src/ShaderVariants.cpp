@@ -0,0 +1,77 @@
+#include "ShaderVariants.h"
+
+#include "GLUtils/GLUtils.hpp"
+#include "Timer.h"
+
+const char* const ShaderVariants::feature_names[num_features] = {
+	"LIGHTING",
+	"INSTANCING",
+	"SHADOWS",
+	"DIRECTIONAL_LIGHT",
+	"CLUSTERED_LIGHTS",
+	"SKINNING",
+	"VERTEX_ANIMATION",
+};
+
+ShaderVariants::ShaderVariants(GLUtils::ProgramCache* cache, std::string directory, std::string vs, std::string gs, std::string fs,
+		ShaderReloader* reloader) : cache(cache), reloader(reloader), vs_file(vs), gs_file(gs), fs_file(fs) {
+	vs_src = GLUtils::readFile(directory + "/" + vs);
+	if (!gs.empty())
+		gs_src = GLUtils::readFile(directory + "/" + gs);
+	fs_src = GLUtils::readFile(directory + "/" + fs);
+
+	variants.resize(1 << num_features);
+	compile_times.resize(1 << num_features, 0.0);
+}
+
+std::vector<std::string> ShaderVariants::getDefines(unsigned int features) {
+	std::vector<std::string> defines;
+	for (unsigned int i=0; i<num_features; ++i)
+		if (features & (1 << i))
+			defines.push_back(feature_names[i]);
+	return defines;
+}
+
+void ShaderVariants::compileVariant(unsigned int features) {
+	Timer compile_timer;
+	std::vector<std::string> defines = getDefines(features);
+
+	// Stages that do not use a feature get no define for it, so the
+	// cache can share them between variants
+	std::string vs = GLUtils::insertDefines(vs_src, defines);
+	std::string fs = GLUtils::insertDefines(fs_src, defines);
+	if (gs_src.empty()) {
+		variants[features] = cache->getProgram(vs, fs);
+	}
+	else {
+		std::string gs = GLUtils::insertDefines(gs_src, defines);
+		variants[features] = cache->getProgram(vs, gs, fs);
+	}
+
+	if (reloader != NULL)
+		reloader->add(variants[features], vs_file, gs_file, fs_file, ShaderReloader::ReloadCallback(), defines);
+
+	compile_times[features] = compile_timer.elapsed();
+}
+
+void ShaderVariants::printReport(std::ostream& out) const {
+	unsigned int num_variants = 0;
+	double total_time = 0.0;
+	for (size_t i=0; i<variants.size(); ++i) {
+		if (!variants[i])
+			continue;
+		++num_variants;
+		total_time += compile_times[i];
+	}
+
+	out << fs_file << ": " << num_variants << " variants in " << total_time*1000.0 << " ms" << std::endl;
+	for (size_t i=0; i<variants.size(); ++i) {
+		if (!variants[i])
+			continue;
+		out << "  [";
+		std::vector<std::string> defines = getDefines(static_cast<unsigned int>(i));
+		for (size_t j=0; j<defines.size(); ++j)
+			out << (j > 0 ? " " : "") << defines[j];
+		out << "] " << compile_times[i]*1000.0 << " ms" << std::endl;
+	}
+}
@@ -0,0 +1,292 @@
+#include "ShadowMaps.h"
+
+#include <cmath>
+#include <algorithm>
+
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/type_ptr.hpp>
+
+using GLUtils::Program;
+
+ShadowMaps::ShadowMaps(GLUtils::ProgramCache* cache, ShaderReloader* reloader,
+		unsigned int cube_size, unsigned int cascade_size, unsigned int num_cascades)
+		: cube_size(cube_size), cascade_size(cascade_size), num_cascades(num_cascades < max_cascades ? num_cascades : max_cascades) {
+	filter = FILTER_PCF3X3;
+	directional = false;
+	point_near = 0.1f;
+	point_far = 1.0f;
+	for (unsigned int i=0; i<max_cascades; ++i)
+		cascade_splits[i] = 0.0f;
+	rendered_updates = 0;
+	cached_updates = 0;
+
+	cube_program = cache->getProgram(GLUtils::readFile("shaders/shadow_cube.vert"),
+		GLUtils::readFile("shaders/shadow_cube.geom"), GLUtils::readFile("shaders/shadow_cube.frag"));
+	depth_program = cache->getProgram(GLUtils::readFile("shaders/shadow_depth.vert"), GLUtils::readFile("shaders/shadow_depth.frag"));
+	if (reloader != NULL) {
+		// The maps were rendered with the old shaders
+		ShaderReloader::ReloadCallback invalidate = [this](Program&) { last_state.clear(); };
+		reloader->add(cube_program, "shadow_cube.vert", "shadow_cube.geom", "shadow_cube.frag", invalidate);
+		reloader->add(depth_program, "shadow_depth.vert", "", "shadow_depth.frag", invalidate);
+	}
+
+	// One layered attachment, so all six faces are rendered in one pass
+	glGenTextures(1, &cube_texture);
+	glBindTexture(GL_TEXTURE_CUBE_MAP, cube_texture);
+	for (unsigned int i=0; i<6; ++i)
+		glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_DEPTH_COMPONENT24, cube_size, cube_size, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+	createDepthTexture(cube_texture, GL_TEXTURE_CUBE_MAP);
+	glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+
+	glGenFramebuffers(1, &cube_fbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, cube_fbo);
+	glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, cube_texture, 0);
+	glDrawBuffer(GL_NONE);
+	glReadBuffer(GL_NONE);
+	CHECK_GL_FBO_COMPLETENESS();
+
+	glGenTextures(1, &cascade_texture);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, cascade_texture);
+	glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_DEPTH_COMPONENT24, cascade_size, cascade_size, this->num_cascades, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+	createDepthTexture(cascade_texture, GL_TEXTURE_2D_ARRAY);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+	// Cascades are attached one layer at a time while rendering
+	glGenFramebuffers(1, &cascade_fbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, cascade_fbo);
+	glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, cascade_texture, 0, 0);
+	glDrawBuffer(GL_NONE);
+	glReadBuffer(GL_NONE);
+	CHECK_GL_FBO_COMPLETENESS();
+
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	CHECK_GL_ERROR();
+}
+
+ShadowMaps::~ShadowMaps() {
+	glDeleteFramebuffers(1, &cube_fbo);
+	glDeleteFramebuffers(1, &cascade_fbo);
+	glDeleteTextures(1, &cube_texture);
+	glDeleteTextures(1, &cascade_texture);
+}
+
+void ShadowMaps::createDepthTexture(GLuint texture, GLenum target) {
+	// Linear filtering of a compared texture gives a 2x2 PCF for free
+	glTexParameteri(target, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(target, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(target, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(target, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(target, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+	glTexParameteri(target, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+	glTexParameteri(target, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+}
+
+bool ShadowMaps::hasChanged() {
+	if (state == last_state) {
+		++cached_updates;
+		return false;
+	}
+
+	// Swapping keeps both vectors' capacity, so this does not allocate once warmed up
+	state.swap(last_state);
+	++rendered_updates;
+	return true;
+}
+
+void ShadowMaps::addCasterState(const Caster* casters, unsigned int num_casters) {
+	state.push_back(static_cast<float>(num_casters));
+	for (unsigned int i=0; i<num_casters; ++i) {
+		const float* transform = glm::value_ptr(casters[i].transform);
+		state.insert(state.end(), transform, transform + 16);
+	}
+}
+
+void ShadowMaps::renderCasters(GLint matrix_loc, const glm::mat4& pre_transform, const Frustum* frustum,
+		const Caster* casters, unsigned int num_casters) const {
+	for (unsigned int i=0; i<num_casters; ++i) {
+		const std::vector<FlatMeshPart>& parts = casters[i].model->getFlatParts();
+		glBindVertexArray(casters[i].vao);
+		for (size_t j=0; j<parts.size(); ++j) {
+			glm::mat4 model_matrix = casters[i].transform * parts[j].transform;
+			if (frustum != NULL) {
+				glm::vec3 center = glm::vec3(model_matrix * glm::vec4(parts[j].center, 1.0f));
+				if (!frustum->intersectsSphere(center, parts[j].radius * Frustum::getMaxScale(model_matrix)))
+					continue;
+			}
+
+			glm::mat4 matrix = pre_transform * model_matrix;
+			glUniformMatrix4fv(matrix_loc, 1, 0, glm::value_ptr(matrix));
+			glDrawArrays(GL_TRIANGLES, parts[j].first, parts[j].count);
+		}
+	}
+	glBindVertexArray(0);
+}
+
+void ShadowMaps::updatePointLight(const glm::vec3& position, float z_near, float z_far, const Caster* casters, unsigned int num_casters) {
+	directional = false;
+	point_position = position;
+	point_near = z_near;
+	point_far = z_far;
+
+	state.clear();
+	state.push_back(0.0f);
+	state.push_back(position.x);
+	state.push_back(position.y);
+	state.push_back(position.z);
+	state.push_back(z_near);
+	state.push_back(z_far);
+	addCasterState(casters, num_casters);
+	if (!hasChanged())
+		return;
+
+	// Faces in the order and orientation of the cube map targets
+	static const glm::vec3 directions[6] = {
+		glm::vec3(1, 0, 0), glm::vec3(-1, 0, 0), glm::vec3(0, 1, 0),
+		glm::vec3(0, -1, 0), glm::vec3(0, 0, 1), glm::vec3(0, 0, -1),
+	};
+	static const glm::vec3 ups[6] = {
+		glm::vec3(0, -1, 0), glm::vec3(0, -1, 0), glm::vec3(0, 0, 1),
+		glm::vec3(0, 0, -1), glm::vec3(0, -1, 0), glm::vec3(0, -1, 0),
+	};
+	glm::mat4 projection = glm::perspective(90.0f, 1.0f, z_near, z_far);
+	glm::mat4 face_matrices[6];
+	for (unsigned int i=0; i<6; ++i)
+		face_matrices[i] = projection * glm::lookAt(position, position + directions[i], ups[i]);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, cube_fbo);
+	glViewport(0, 0, cube_size, cube_size);
+	glClear(GL_DEPTH_BUFFER_BIT);
+	glEnable(GL_POLYGON_OFFSET_FILL);
+	glPolygonOffset(1.1f, 4.0f);
+
+	cube_program->use();
+	glUniformMatrix4fv(cube_program->getUniform("face_matrices"), 6, 0, glm::value_ptr(face_matrices[0]));
+	renderCasters(cube_program->getUniform("model_mat"), glm::mat4(), NULL, casters, num_casters);
+	cube_program->disuse();
+
+	glDisable(GL_POLYGON_OFFSET_FILL);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	CHECK_GL_ERROR();
+}
+
+void ShadowMaps::updateDirectionalLight(const glm::vec3& to_light, const glm::mat4& camera_view, const glm::mat4& camera_projection,
+		const Caster* casters, unsigned int num_casters) {
+	directional = true;
+
+	state.clear();
+	state.push_back(1.0f);
+	state.push_back(to_light.x);
+	state.push_back(to_light.y);
+	state.push_back(to_light.z);
+	state.insert(state.end(), glm::value_ptr(camera_view), glm::value_ptr(camera_view) + 16);
+	state.insert(state.end(), glm::value_ptr(camera_projection), glm::value_ptr(camera_projection) + 16);
+	addCasterState(casters, num_casters);
+	if (!hasChanged())
+		return;
+
+	// Near and far plane of a glm::perspective matrix
+	float z_near = camera_projection[3][2] / (camera_projection[2][2] - 1.0f);
+	float z_far = camera_projection[3][2] / (camera_projection[2][2] + 1.0f);
+
+	// Corners of the near and far plane, in world space
+	glm::mat4 clip_to_world = glm::inverse(camera_projection * camera_view);
+	glm::vec3 near_corners[4], far_corners[4];
+	for (unsigned int i=0; i<4; ++i) {
+		float x = (i & 1) ? 1.0f : -1.0f;
+		float y = (i & 2) ? 1.0f : -1.0f;
+		glm::vec4 near_corner = clip_to_world * glm::vec4(x, y, -1.0f, 1.0f);
+		glm::vec4 far_corner = clip_to_world * glm::vec4(x, y, 1.0f, 1.0f);
+		near_corners[i] = glm::vec3(near_corner) / near_corner.w;
+		far_corners[i] = glm::vec3(far_corner) / far_corner.w;
+	}
+
+	glm::vec3 light_dir = glm::normalize(to_light);
+	glm::vec3 up = (std::abs(light_dir.y) < 0.99f) ? glm::vec3(0, 1, 0) : glm::vec3(1, 0, 0);
+	glm::mat4 bias = glm::translate(glm::mat4(), glm::vec3(0.5f)) * glm::scale(glm::mat4(), glm::vec3(0.5f));
+
+	glBindFramebuffer(GL_FRAMEBUFFER, cascade_fbo);
+	glViewport(0, 0, cascade_size, cascade_size);
+	glEnable(GL_POLYGON_OFFSET_FILL);
+	glPolygonOffset(1.1f, 4.0f);
+	depth_program->use();
+	GLint matrix_loc = depth_program->getUniform("model_view_projection");
+
+	float split_begin = z_near;
+	for (unsigned int i=0; i<num_cascades; ++i) {
+		// Practical split scheme: mostly logarithmic, so every cascade
+		// gets about the same texels per screen pixel, blended with uniform
+		float fraction = (i + 1) / static_cast<float>(num_cascades);
+		float split_log = z_near * std::pow(z_far / z_near, fraction);
+		float split_uniform = z_near + (z_far - z_near) * fraction;
+		float split_end = 0.75f * split_log + 0.25f * split_uniform;
+		cascade_splits[i] = split_end;
+
+		// Bounding sphere of the slice, which does not change size as the camera rotates
+		glm::vec3 corners[8];
+		glm::vec3 center(0.0f);
+		for (unsigned int j=0; j<4; ++j) {
+			corners[j] = glm::mix(near_corners[j], far_corners[j], (split_begin - z_near) / (z_far - z_near));
+			corners[j + 4] = glm::mix(near_corners[j], far_corners[j], (split_end - z_near) / (z_far - z_near));
+		}
+		for (unsigned int j=0; j<8; ++j)
+			center += corners[j] / 8.0f;
+		float radius = 0.0f;
+		for (unsigned int j=0; j<8; ++j)
+			radius = std::max(radius, glm::length(corners[j] - center));
+		radius = std::ceil(radius * 16.0f) / 16.0f;
+
+		// Casters between the light and the slice must be included, so
+		// the box reaches one camera far distance towards the light
+		glm::mat4 light_view = glm::lookAt(center + light_dir * (radius + z_far), center, up);
+		glm::mat4 light_projection = glm::ortho(-radius, radius, -radius, radius, 0.0f, 2.0f * radius + z_far);
+
+		// Move in whole texels only, so shadow edges do not shimmer
+		glm::mat4 light_matrix = light_projection * light_view;
+		glm::vec4 origin = light_matrix * glm::vec4(0.0f, 0.0f, 0.0f, 1.0f) * (cascade_size * 0.5f);
+		glm::vec2 offset = (glm::floor(glm::vec2(origin) + 0.5f) - glm::vec2(origin)) * (2.0f / cascade_size);
+		light_projection[3][0] += offset.x;
+		light_projection[3][1] += offset.y;
+		light_matrix = light_projection * light_view;
+
+		cascade_matrices[i] = bias * light_matrix;
+
+		glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, cascade_texture, 0, i);
+		glClear(GL_DEPTH_BUFFER_BIT);
+		Frustum frustum(light_matrix);
+		renderCasters(matrix_loc, light_matrix, &frustum, casters, num_casters);
+
+		split_begin = split_end;
+	}
+
+	depth_program->disuse();
+	glDisable(GL_POLYGON_OFFSET_FILL);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	CHECK_GL_ERROR();
+}
+
+void ShadowMaps::apply(Program& program, const glm::mat4& camera_view) const {
+	glm::mat4 view_to_world = glm::inverse(camera_view);
+	glProgramUniformMatrix4fv(program.name, glGetUniformLocation(program.name, "view_to_world"), 1, 0, glm::value_ptr(view_to_world));
+	glProgramUniform1i(program.name, glGetUniformLocation(program.name, "pcf_radius"), static_cast<GLint>(filter));
+
+	if (directional) {
+		glActiveTexture(GL_TEXTURE2);
+		glBindTexture(GL_TEXTURE_2D_ARRAY, cascade_texture);
+		glProgramUniform1i(program.name, glGetUniformLocation(program.name, "cascade_map"), 2);
+		glProgramUniform1f(program.name, glGetUniformLocation(program.name, "shadow_texel_size"), 1.0f / cascade_size);
+		glProgramUniformMatrix4fv(program.name, glGetUniformLocation(program.name, "cascade_matrices"), num_cascades, 0,
+			glm::value_ptr(cascade_matrices[0]));
+		glProgramUniform1fv(program.name, glGetUniformLocation(program.name, "cascade_splits"), num_cascades, cascade_splits);
+		glProgramUniform1i(program.name, glGetUniformLocation(program.name, "num_cascades"), num_cascades);
+	}
+	else {
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_CUBE_MAP, cube_texture);
+		glProgramUniform1i(program.name, glGetUniformLocation(program.name, "cube_shadow_map"), 1);
+		glProgramUniform1f(program.name, glGetUniformLocation(program.name, "shadow_texel_size"), 1.0f / cube_size);
+		glProgramUniform3fv(program.name, glGetUniformLocation(program.name, "shadow_light_position"), 1, glm::value_ptr(point_position));
+		glProgramUniform2f(program.name, glGetUniformLocation(program.name, "shadow_depth_range"), point_near, point_far);
+	}
+	glActiveTexture(GL_TEXTURE0);
+	CHECK_GL_ERROR();
+}
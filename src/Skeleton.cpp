@@ -0,0 +1,363 @@
+#include "Skeleton.h"
+
+#include "GameException.h"
+
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define SKELETON_SSE
+#endif
+
+namespace {
+	inline glm::mat4 toMat4(const aiMatrix4x4& m) {
+		// Assimp's matrices are row major
+		glm::mat4 result;
+		for (int j=0; j<4; ++j)
+			for (int i=0; i<4; ++i)
+				result[j][i] = m[i][j];
+		return result;
+	}
+
+	/**
+	 * The transform that scales, then rotates by the unit quaternion
+	 * q, then translates
+	 */
+	inline glm::mat4 composeTransform(const glm::vec4& t, const glm::vec4& q, const glm::vec4& s) {
+		float xx = q.x*q.x, yy = q.y*q.y, zz = q.z*q.z;
+		float xy = q.x*q.y, xz = q.x*q.z, yz = q.y*q.z;
+		float wx = q.w*q.x, wy = q.w*q.y, wz = q.w*q.z;
+		glm::mat4 m;
+		m[0] = glm::vec4(1.0f - 2.0f*(yy + zz), 2.0f*(xy + wz), 2.0f*(xz - wy), 0.0f) * s.x;
+		m[1] = glm::vec4(2.0f*(xy - wz), 1.0f - 2.0f*(xx + zz), 2.0f*(yz + wx), 0.0f) * s.y;
+		m[2] = glm::vec4(2.0f*(xz + wy), 2.0f*(yz - wx), 1.0f - 2.0f*(xx + yy), 0.0f) * s.z;
+		m[3] = glm::vec4(t.x, t.y, t.z, 1.0f);
+		return m;
+	}
+
+	/**
+	 * Normalized linear interpolation between unit quaternions, the
+	 * short way round. Close enough to slerp between animation keys,
+	 * and much cheaper.
+	 */
+	inline glm::vec4 nlerp(const glm::vec4& a, glm::vec4 b, float t) {
+		if (glm::dot(a, b) < 0.0f)
+			b = -b;
+		glm::vec4 q = a + (b - a)*t;
+		return q / std::sqrt(std::max(glm::dot(q, q), 1e-30f));
+	}
+
+	/**
+	 * @return The last key at or before time, with how far time is
+	 * towards the next key in fraction
+	 */
+	inline size_t findKey(const std::vector<float>& times, float time, float& fraction) {
+		size_t next = std::upper_bound(times.begin(), times.end(), time) - times.begin();
+		fraction = 0.0f;
+		if (next == 0)
+			return 0;
+		if (next == times.size())
+			return next - 1;
+		float span = times[next] - times[next - 1];
+		if (span > 0.0f)
+			fraction = (time - times[next - 1]) / span;
+		return next - 1;
+	}
+
+	inline glm::vec3 sampleKeys(const std::vector<float>& times, const std::vector<glm::vec3>& values, float time) {
+		float fraction;
+		size_t key = findKey(times, time, fraction);
+		return (fraction > 0.0f) ? glm::mix(values[key], values[key + 1], fraction) : values[key];
+	}
+}
+
+Skeleton::Skeleton(const aiScene* scene) : root_transform(1.0f) {
+	addNodeRecursive(scene, scene->mRootNode, -1);
+
+	// A bone in several meshes is the same bone, as long as the meshes
+	// agree on its offset
+	mesh_bones.resize(scene->mNumMeshes);
+	for (unsigned int m=0; m<scene->mNumMeshes; ++m) {
+		const aiMesh* mesh = scene->mMeshes[m];
+		for (unsigned int b=0; b<mesh->mNumBones; ++b) {
+			const aiBone* bone = mesh->mBones[b];
+			mesh_bones[m].push_back(addBone(findNode(bone->mName.data), toMat4(bone->mOffsetMatrix)));
+		}
+	}
+
+	for (unsigned int a=0; a<scene->mNumAnimations; ++a) {
+		const aiAnimation* animation = scene->mAnimations[a];
+		float ticks_per_second = (animation->mTicksPerSecond > 0.0) ? static_cast<float>(animation->mTicksPerSecond) : 25.0f;
+
+		Clip clip;
+		clip.name = animation->mName.data;
+		clip.duration = static_cast<float>(animation->mDuration) / ticks_per_second;
+		clip.channels.resize(animation->mNumChannels);
+		for (unsigned int c=0; c<animation->mNumChannels; ++c) {
+			const aiNodeAnim* source = animation->mChannels[c];
+			Channel& channel = clip.channels[c];
+			channel.node = findNode(source->mNodeName.data);
+			for (unsigned int k=0; k<source->mNumPositionKeys; ++k) {
+				const aiVectorKey& key = source->mPositionKeys[k];
+				channel.translation_times.push_back(static_cast<float>(key.mTime) / ticks_per_second);
+				channel.translations.push_back(glm::vec3(key.mValue.x, key.mValue.y, key.mValue.z));
+			}
+			for (unsigned int k=0; k<source->mNumRotationKeys; ++k) {
+				const aiQuatKey& key = source->mRotationKeys[k];
+				channel.rotation_times.push_back(static_cast<float>(key.mTime) / ticks_per_second);
+				channel.rotations.push_back(glm::vec4(key.mValue.x, key.mValue.y, key.mValue.z, key.mValue.w));
+			}
+			for (unsigned int k=0; k<source->mNumScalingKeys; ++k) {
+				const aiVectorKey& key = source->mScalingKeys[k];
+				channel.scale_times.push_back(static_cast<float>(key.mTime) / ticks_per_second);
+				channel.scales.push_back(glm::vec3(key.mValue.x, key.mValue.y, key.mValue.z));
+			}
+		}
+
+		clip.mesh_channels.resize(animation->mNumMeshChannels);
+		for (unsigned int c=0; c<animation->mNumMeshChannels; ++c) {
+			const aiMeshAnim* source = animation->mMeshChannels[c];
+			MeshChannel& channel = clip.mesh_channels[c];
+			channel.mesh = source->mName.data;
+			for (unsigned int k=0; k<source->mNumKeys; ++k) {
+				channel.times.push_back(static_cast<float>(source->mKeys[k].mTime) / ticks_per_second);
+				channel.shapes.push_back(source->mKeys[k].mValue);
+			}
+		}
+		clips.push_back(clip);
+	}
+}
+
+void Skeleton::addNodeRecursive(const aiScene* scene, const aiNode* node, int parent) {
+	aiVector3D scale, translation;
+	aiQuaternion rotation;
+	node->mTransformation.Decompose(scale, rotation, translation);
+
+	Node result;
+	result.parent = parent;
+	result.translation = glm::vec3(translation.x, translation.y, translation.z);
+	result.rotation = glm::vec4(rotation.x, rotation.y, rotation.z, rotation.w);
+	result.scale = glm::vec3(scale.x, scale.y, scale.z);
+	result.name = node->mName.data;
+	int index = static_cast<int>(nodes.size());
+	nodes.push_back(result);
+
+	// Meshes without bones are moved by their node alone
+	unsigned int node_bone = max_bones;
+	for (unsigned int n=0; n<node->mNumMeshes; ++n)
+		if (node_bone == max_bones && scene->mMeshes[node->mMeshes[n]]->mNumBones == 0)
+			node_bone = addBone(index, glm::mat4(1.0f));
+	node_bones.push_back(node_bone);
+
+	for (unsigned int n=0; n<node->mNumChildren; ++n)
+		addNodeRecursive(scene, node->mChildren[n], index);
+}
+
+unsigned int Skeleton::findNode(const std::string& name) const {
+	for (size_t i=0; i<nodes.size(); ++i)
+		if (nodes[i].name == name)
+			return static_cast<unsigned int>(i);
+	THROW_EXCEPTION("The skeleton has no node named " + name);
+}
+
+unsigned int Skeleton::addBone(unsigned int node, const glm::mat4& offset) {
+	for (size_t i=0; i<bones.size(); ++i)
+		if (bones[i].node == node && bones[i].offset == offset)
+			return static_cast<unsigned int>(i);
+
+	if (bones.size() == max_bones) {
+		std::stringstream err;
+		err << "A skeleton can have at most " << max_bones << " bones";
+		THROW_EXCEPTION(err.str());
+	}
+	Bone bone;
+	bone.node = node;
+	bone.offset = offset;
+	bones.push_back(bone);
+	return static_cast<unsigned int>(bones.size() - 1);
+}
+
+void Skeleton::getInfluences(const aiScene* scene, unsigned int mesh_index, const aiNode* node, std::vector<uint8_t>& influences) const {
+	const aiMesh* mesh = scene->mMeshes[mesh_index];
+	const unsigned int stride = 2*max_influences;
+	influences.assign(mesh->mNumVertices*stride, 0);
+
+	if (mesh->mNumBones == 0) {
+		uint8_t bone = static_cast<uint8_t>(node_bones[findNode(node->mName.data)]);
+		for (unsigned int v=0; v<mesh->mNumVertices; ++v) {
+			influences[v*stride] = bone;
+			influences[v*stride + max_influences] = 255;
+		}
+		return;
+	}
+
+	// Keep the strongest influences of each vertex
+	std::vector<float> weights(mesh->mNumVertices*max_influences, 0.0f);
+	for (unsigned int b=0; b<mesh->mNumBones; ++b) {
+		const aiBone* bone = mesh->mBones[b];
+		uint8_t index = static_cast<uint8_t>(mesh_bones[mesh_index][b]);
+		for (unsigned int w=0; w<bone->mNumWeights; ++w) {
+			unsigned int v = bone->mWeights[w].mVertexId;
+			float* vertex_weights = &weights[v*max_influences];
+			unsigned int weakest = 0;
+			for (unsigned int k=1; k<max_influences; ++k)
+				if (vertex_weights[k] < vertex_weights[weakest])
+					weakest = k;
+			if (bone->mWeights[w].mWeight > vertex_weights[weakest]) {
+				vertex_weights[weakest] = bone->mWeights[w].mWeight;
+				influences[v*stride + weakest] = index;
+			}
+		}
+	}
+
+	// Rounded so they add up to exactly 255, with what rounding lost or
+	// added on the strongest. Vertices no bone moves follow the first bone
+	for (unsigned int v=0; v<mesh->mNumVertices; ++v) {
+		const float* vertex_weights = &weights[v*max_influences];
+		uint8_t* quantized = &influences[v*stride + max_influences];
+		float sum = 0.0f;
+		unsigned int strongest = 0;
+		for (unsigned int k=0; k<max_influences; ++k) {
+			sum += vertex_weights[k];
+			if (vertex_weights[k] > vertex_weights[strongest])
+				strongest = k;
+		}
+		if (sum <= 0.0f) {
+			quantized[0] = 255;
+			continue;
+		}
+		int total = 0;
+		for (unsigned int k=0; k<max_influences; ++k) {
+			quantized[k] = static_cast<uint8_t>(vertex_weights[k] / sum * 255.0f + 0.5f);
+			total += quantized[k];
+		}
+		quantized[strongest] = static_cast<uint8_t>(quantized[strongest] + 255 - total);
+	}
+}
+
+int Skeleton::findClip(const std::string& name) const {
+	for (size_t i=0; i<clips.size(); ++i)
+		if (clips[i].name == name)
+			return static_cast<int>(i);
+	return -1;
+}
+
+void Skeleton::getBindPose(Pose& pose) const {
+	pose.translations.resize(nodes.size());
+	pose.rotations.resize(nodes.size());
+	pose.scales.resize(nodes.size());
+	for (size_t i=0; i<nodes.size(); ++i) {
+		pose.translations[i] = glm::vec4(nodes[i].translation, 0.0f);
+		pose.rotations[i] = nodes[i].rotation;
+		pose.scales[i] = glm::vec4(nodes[i].scale, 0.0f);
+	}
+}
+
+void Skeleton::samplePose(unsigned int clip_index, float time, Pose& pose) const {
+	getBindPose(pose);
+
+	const Clip& clip = clips[clip_index];
+	if (clip.duration > 0.0f) {
+		time = std::fmod(time, clip.duration);
+		if (time < 0.0f)
+			time += clip.duration;
+	}
+
+	for (size_t c=0; c<clip.channels.size(); ++c) {
+		const Channel& channel = clip.channels[c];
+		if (!channel.translations.empty())
+			pose.translations[channel.node] = glm::vec4(sampleKeys(channel.translation_times, channel.translations, time), 0.0f);
+		if (!channel.scales.empty())
+			pose.scales[channel.node] = glm::vec4(sampleKeys(channel.scale_times, channel.scales, time), 0.0f);
+		if (!channel.rotations.empty()) {
+			float fraction;
+			size_t key = findKey(channel.rotation_times, time, fraction);
+			pose.rotations[channel.node] = (fraction > 0.0f)
+				? nlerp(channel.rotations[key], channel.rotations[key + 1], fraction) : channel.rotations[key];
+		}
+	}
+}
+
+void Skeleton::sampleShapes(const MeshChannel& channel, float time, unsigned int& shape_a, unsigned int& shape_b, float& fraction) {
+	size_t key = findKey(channel.times, time, fraction);
+	shape_a = channel.shapes[key];
+	shape_b = (fraction > 0.0f) ? channel.shapes[key + 1] : shape_a;
+}
+
+void Skeleton::blendPoses(const Pose& a, const Pose& b, float weight, Pose& out) {
+	const size_t count = a.rotations.size();
+	out.translations.resize(count);
+	out.rotations.resize(count);
+	out.scales.resize(count);
+	size_t i = 0;
+
+#ifdef SKELETON_SSE
+	// Four quaternions at a time, transposed so each register holds one
+	// component of all four, and the dot products need no shuffles
+	__m128 t = _mm_set1_ps(weight);
+	__m128 sign_bit = _mm_set1_ps(-0.0f);
+	for (; i + 4 <= count; i += 4) {
+		__m128 ax = _mm_loadu_ps(&a.rotations[i][0]), ay = _mm_loadu_ps(&a.rotations[i + 1][0]);
+		__m128 az = _mm_loadu_ps(&a.rotations[i + 2][0]), aw = _mm_loadu_ps(&a.rotations[i + 3][0]);
+		__m128 bx = _mm_loadu_ps(&b.rotations[i][0]), by = _mm_loadu_ps(&b.rotations[i + 1][0]);
+		__m128 bz = _mm_loadu_ps(&b.rotations[i + 2][0]), bw = _mm_loadu_ps(&b.rotations[i + 3][0]);
+		_MM_TRANSPOSE4_PS(ax, ay, az, aw);
+		_MM_TRANSPOSE4_PS(bx, by, bz, bw);
+
+		// Flip b where it is on the other side of the hypersphere
+		__m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ax, bx), _mm_mul_ps(ay, by)), _mm_add_ps(_mm_mul_ps(az, bz), _mm_mul_ps(aw, bw)));
+		__m128 flip = _mm_and_ps(d, sign_bit);
+		bx = _mm_xor_ps(bx, flip); by = _mm_xor_ps(by, flip);
+		bz = _mm_xor_ps(bz, flip); bw = _mm_xor_ps(bw, flip);
+
+		__m128 x = _mm_add_ps(ax, _mm_mul_ps(_mm_sub_ps(bx, ax), t));
+		__m128 y = _mm_add_ps(ay, _mm_mul_ps(_mm_sub_ps(by, ay), t));
+		__m128 z = _mm_add_ps(az, _mm_mul_ps(_mm_sub_ps(bz, az), t));
+		__m128 w = _mm_add_ps(aw, _mm_mul_ps(_mm_sub_ps(bw, aw), t));
+		__m128 length2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_add_ps(_mm_mul_ps(z, z), _mm_mul_ps(w, w)));
+		__m128 scale = _mm_div_ps(_mm_set1_ps(1.0f), _mm_sqrt_ps(_mm_max_ps(length2, _mm_set1_ps(1e-30f))));
+		x = _mm_mul_ps(x, scale); y = _mm_mul_ps(y, scale);
+		z = _mm_mul_ps(z, scale); w = _mm_mul_ps(w, scale);
+		_MM_TRANSPOSE4_PS(x, y, z, w);
+		_mm_storeu_ps(&out.rotations[i][0], x);
+		_mm_storeu_ps(&out.rotations[i + 1][0], y);
+		_mm_storeu_ps(&out.rotations[i + 2][0], z);
+		_mm_storeu_ps(&out.rotations[i + 3][0], w);
+
+		for (size_t k=i; k<i + 4; ++k) {
+			__m128 at = _mm_loadu_ps(&a.translations[k][0]), bt = _mm_loadu_ps(&b.translations[k][0]);
+			_mm_storeu_ps(&out.translations[k][0], _mm_add_ps(at, _mm_mul_ps(_mm_sub_ps(bt, at), t)));
+			__m128 as = _mm_loadu_ps(&a.scales[k][0]), bs = _mm_loadu_ps(&b.scales[k][0]);
+			_mm_storeu_ps(&out.scales[k][0], _mm_add_ps(as, _mm_mul_ps(_mm_sub_ps(bs, as), t)));
+		}
+	}
+#endif
+
+	// The rest, or everything without SSE
+	for (; i < count; ++i) {
+		out.translations[i] = glm::mix(a.translations[i], b.translations[i], weight);
+		out.rotations[i] = nlerp(a.rotations[i], b.rotations[i], weight);
+		out.scales[i] = glm::mix(a.scales[i], b.scales[i], weight);
+	}
+}
+
+void Skeleton::computePalette(Pose& pose, float* palette) const {
+	pose.node_transforms.resize(nodes.size());
+	for (size_t i=0; i<nodes.size(); ++i) {
+		glm::mat4 local = composeTransform(pose.translations[i], pose.rotations[i], pose.scales[i]);
+		if (nodes[i].parent < 0)
+			pose.node_transforms[i] = local * root_transform;
+		else
+			pose.node_transforms[i] = pose.node_transforms[nodes[i].parent] * local;
+	}
+
+	for (size_t b=0; b<bones.size(); ++b) {
+		glm::mat4 skin = pose.node_transforms[bones[b].node] * bones[b].offset;
+		float* rows = palette + b*floats_per_bone;
+		for (unsigned int r=0; r<3; ++r)
+			for (unsigned int c=0; c<4; ++c)
+				rows[4*r + c] = skin[c][r];
+	}
+}
@@ -0,0 +1,58 @@
+#include "Skybox.h"
+
+#include <vector>
+
+#include <glm/gtc/type_ptr.hpp>
+
+#include "GeometryManager.h"
+
+Skybox::Skybox(GLUtils::ProgramCache* cache, std::shared_ptr<GLUtils::CubeMap> cubemap, ShaderReloader* reloader) : cubemap(cubemap) {
+	program = cache->getProgram(GLUtils::readFile("shaders/skybox.vert"), GLUtils::readFile("shaders/skybox.frag"));
+	glProgramUniform1i(program->name, program->getUniform("cubemap"), 0);
+	if (reloader != NULL)
+		reloader->add(program, "skybox.vert", "", "skybox.frag", [](GLUtils::Program& reloaded) {
+			glProgramUniform1i(reloaded.name, reloaded.getUniform("cubemap"), 0);
+		});
+
+	// The unit cube, centered on the camera
+	n_vertices = GeometryManager::getCubeNVertices();
+	std::vector<float> positions(GeometryManager::getCubeVertices(), GeometryManager::getCubeVertices() + 3*n_vertices);
+	for (size_t i=0; i<positions.size(); ++i)
+		positions[i] -= 0.5f;
+
+	glGenVertexArrays(1, &vao);
+	glBindVertexArray(vao);
+	vertices.reset(new GLUtils::VBO<GL_ARRAY_BUFFER>(positions.data(), static_cast<unsigned int>(positions.size()*sizeof(float))));
+	vertices->bind();
+	program->setAttributePointer("position", 3);
+	glBindVertexArray(0);
+	vertices->unbind();
+	CHECK_GL_ERROR();
+}
+
+Skybox::~Skybox() {
+	glDeleteVertexArrays(1, &vao);
+}
+
+void Skybox::render(const glm::mat4& view, const glm::mat4& projection) {
+	// Only the rotation, so the sky stays infinitely far away
+	glm::mat4 rotation = glm::mat4(glm::mat3(view));
+	glm::mat4 rotation_projection = projection * rotation;
+
+	// We look at the cube from the inside
+	GLboolean cull_face = glIsEnabled(GL_CULL_FACE);
+	glDisable(GL_CULL_FACE);
+	glDepthMask(GL_FALSE);
+
+	program->use();
+	cubemap->bindTexture(GL_TEXTURE0);
+	glUniformMatrix4fv(program->getUniform("rotation_projection"), 1, 0, glm::value_ptr(rotation_projection));
+	glBindVertexArray(vao);
+	glDrawArrays(GL_TRIANGLES, 0, n_vertices);
+	glBindVertexArray(0);
+	program->disuse();
+
+	glDepthMask(GL_TRUE);
+	if (cull_face)
+		glEnable(GL_CULL_FACE);
+}
@@ -0,0 +1,193 @@
+#include "TransformBatch.h"
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define TRANSFORMBATCH_SSE
+#endif
+
+void TransformBatch::resize(unsigned int count) {
+	// Padding lets the kernel load whole SSE vectors from any start
+	// index without a scalar tail
+	this->count = count;
+	stride = (count + 3) & ~3u;
+	data.assign(NUM_STREAMS*stride + 3, 0.0f);
+}
+
+void TransformBatch::set(unsigned int i, const glm::mat4& transform, const glm::vec3& center, float radius) {
+	for (unsigned int r=0; r<3; ++r)
+		for (unsigned int c=0; c<4; ++c)
+			data[(STREAM_TRANSFORM + r*4 + c)*stride + i] = transform[c][r];
+	for (unsigned int k=0; k<3; ++k)
+		data[(STREAM_CENTER + k)*stride + i] = center[k];
+	data[STREAM_RADIUS*stride + i] = radius;
+}
+
+glm::mat4 TransformBatch::getTransform(unsigned int i) const {
+	glm::mat4 transform;
+	for (unsigned int r=0; r<3; ++r)
+		for (unsigned int c=0; c<4; ++c)
+			transform[c][r] = data[(STREAM_TRANSFORM + r*4 + c)*stride + i];
+	return transform;
+}
+
+TransformBatch::Shared TransformBatch::computeShared(const glm::mat4& model, const glm::mat4& view, const glm::vec3& light_position) {
+	Shared shared;
+	glm::mat4 view_model = view * model;
+	for (unsigned int r=0; r<3; ++r)
+		for (unsigned int c=0; c<4; ++c)
+			shared.view_model[r*4 + c] = view_model[c][r];
+
+	glm::vec3 light = glm::inverse(glm::mat3(model)) * light_position;
+	glm::vec3 camera = -(glm::inverse(glm::mat3(view_model)) * glm::vec3(view_model[3]));
+	for (unsigned int k=0; k<3; ++k) {
+		shared.light[k] = light[k];
+		shared.camera[k] = camera[k];
+	}
+	return shared;
+}
+
+void TransformBatch::computeScalar(const glm::mat4& model, const glm::mat4& view, const glm::vec3& light_position,
+		unsigned int begin, unsigned int end, Result* results) const {
+	Shared shared = computeShared(model, view, light_position);
+	const float* vm = shared.view_model;
+
+	for (unsigned int i=begin; i<end; ++i) {
+		Result& result = results[i - begin];
+		float a[12];
+		for (unsigned int k=0; k<12; ++k)
+			a[k] = data[(STREAM_TRANSFORM + k)*stride + i];
+
+		// Model view is the shared view * model times the part transform
+		float mv[12];
+		for (unsigned int r=0; r<3; ++r) {
+			for (unsigned int c=0; c<4; ++c)
+				mv[r*4 + c] = vm[r*4]*a[c] + vm[r*4 + 1]*a[4 + c] + vm[r*4 + 2]*a[8 + c];
+			mv[r*4 + 3] += vm[r*4 + 3];
+		}
+		result.model_view = glm::mat4(1.0f);
+		for (unsigned int r=0; r<3; ++r)
+			for (unsigned int c=0; c<4; ++c)
+				result.model_view[c][r] = mv[r*4 + c];
+
+		float center[3] = { data[STREAM_CENTER*stride + i], data[(STREAM_CENTER + 1)*stride + i], data[(STREAM_CENTER + 2)*stride + i] };
+		float max_scale = 0.0f;
+		for (unsigned int k=0; k<3; ++k) {
+			result.view_center[k] = mv[k*4]*center[0] + mv[k*4 + 1]*center[1] + mv[k*4 + 2]*center[2] + mv[k*4 + 3];
+			max_scale = std::max(max_scale, mv[k]*mv[k] + mv[4 + k]*mv[4 + k] + mv[8 + k]*mv[8 + k]);
+		}
+		result.view_radius = data[STREAM_RADIUS*stride + i] * std::sqrt(max_scale);
+
+		// The columns of the inverse are the cross products of the rows over the determinant
+		glm::vec3 row0(a[0], a[1], a[2]), row1(a[4], a[5], a[6]), row2(a[8], a[9], a[10]);
+		glm::vec3 col0 = glm::cross(row1, row2), col1 = glm::cross(row2, row0), col2 = glm::cross(row0, row1);
+		float inv_det = 1.0f / glm::dot(row0, col0);
+		glm::vec3 camera(shared.camera[0] - a[3], shared.camera[1] - a[7], shared.camera[2] - a[11]);
+		result.light_position = (col0*shared.light[0] + col1*shared.light[1] + col2*shared.light[2]) * inv_det;
+		result.camera_position = (col0*camera.x + col1*camera.y + col2*camera.z) * inv_det;
+	}
+}
+
+void TransformBatch::compute(const glm::mat4& model, const glm::mat4& view, const glm::vec3& light_position,
+		unsigned int begin, unsigned int end, Result* results) const {
+#ifdef TRANSFORMBATCH_SSE
+	Shared shared = computeShared(model, view, light_position);
+	__m128 vm[12];
+	for (unsigned int k=0; k<12; ++k)
+		vm[k] = _mm_set1_ps(shared.view_model[k]);
+	__m128 light[3], camera[3];
+	for (unsigned int k=0; k<3; ++k) {
+		light[k] = _mm_set1_ps(shared.light[k]);
+		camera[k] = _mm_set1_ps(shared.camera[k]);
+	}
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.0f);
+
+	// Lanes past end read padding or other parts, and are not stored
+	for (unsigned int i=begin; i<end; i+=4) {
+		__m128 a[12];
+		for (unsigned int k=0; k<12; ++k)
+			a[k] = _mm_loadu_ps(stream(STREAM_TRANSFORM + k) + i);
+
+		__m128 mv[12];
+		for (unsigned int r=0; r<3; ++r) {
+			for (unsigned int c=0; c<4; ++c)
+				mv[r*4 + c] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(vm[r*4], a[c]), _mm_mul_ps(vm[r*4 + 1], a[4 + c])),
+					_mm_mul_ps(vm[r*4 + 2], a[8 + c]));
+			mv[r*4 + 3] = _mm_add_ps(mv[r*4 + 3], vm[r*4 + 3]);
+		}
+
+		__m128 cx = _mm_loadu_ps(stream(STREAM_CENTER) + i);
+		__m128 cy = _mm_loadu_ps(stream(STREAM_CENTER + 1) + i);
+		__m128 cz = _mm_loadu_ps(stream(STREAM_CENTER + 2) + i);
+		__m128 view_center[3], scale[3];
+		for (unsigned int k=0; k<3; ++k) {
+			view_center[k] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(mv[k*4], cx), _mm_mul_ps(mv[k*4 + 1], cy)),
+				_mm_add_ps(_mm_mul_ps(mv[k*4 + 2], cz), mv[k*4 + 3]));
+			scale[k] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(mv[k], mv[k]), _mm_mul_ps(mv[4 + k], mv[4 + k])), _mm_mul_ps(mv[8 + k], mv[8 + k]));
+		}
+		__m128 view_radius = _mm_mul_ps(_mm_loadu_ps(stream(STREAM_RADIUS) + i),
+			_mm_sqrt_ps(_mm_max_ps(scale[0], _mm_max_ps(scale[1], scale[2]))));
+
+		// Columns of the adjugate: cross products of the rows
+		__m128 col[9];
+		const unsigned int rows[3][2] = { {1, 2}, {2, 0}, {0, 1} };
+		for (unsigned int c=0; c<3; ++c) {
+			const __m128* p = &a[rows[c][0]*4];
+			const __m128* q = &a[rows[c][1]*4];
+			col[c*3] = _mm_sub_ps(_mm_mul_ps(p[1], q[2]), _mm_mul_ps(p[2], q[1]));
+			col[c*3 + 1] = _mm_sub_ps(_mm_mul_ps(p[2], q[0]), _mm_mul_ps(p[0], q[2]));
+			col[c*3 + 2] = _mm_sub_ps(_mm_mul_ps(p[0], q[1]), _mm_mul_ps(p[1], q[0]));
+		}
+		__m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(a[0], col[0]), _mm_mul_ps(a[1], col[1])), _mm_mul_ps(a[2], col[2]));
+		// Padding lanes are all zero; keep them from producing infinities
+		det = _mm_or_ps(det, _mm_and_ps(_mm_cmpeq_ps(det, zero), one));
+		__m128 inv_det = _mm_div_ps(one, det);
+
+		__m128 camera_local[3] = { _mm_sub_ps(camera[0], a[3]), _mm_sub_ps(camera[1], a[7]), _mm_sub_ps(camera[2], a[11]) };
+		__m128 light_out[3], camera_out[3];
+		for (unsigned int k=0; k<3; ++k) {
+			light_out[k] = _mm_mul_ps(inv_det, _mm_add_ps(_mm_add_ps(_mm_mul_ps(col[k], light[0]), _mm_mul_ps(col[3 + k], light[1])),
+				_mm_mul_ps(col[6 + k], light[2])));
+			camera_out[k] = _mm_mul_ps(inv_det, _mm_add_ps(_mm_add_ps(_mm_mul_ps(col[k], camera_local[0]), _mm_mul_ps(col[3 + k], camera_local[1])),
+				_mm_mul_ps(col[6 + k], camera_local[2])));
+		}
+
+		// Transposing four lanes of four streams gives one column per part.
+		// The last row of the model view matrix is (0, 0, 0, 1)
+		__m128 columns[4][4];
+		for (unsigned int c=0; c<4; ++c) {
+			columns[c][0] = mv[c];
+			columns[c][1] = mv[4 + c];
+			columns[c][2] = mv[8 + c];
+			columns[c][3] = (c == 3) ? one : zero;
+			_MM_TRANSPOSE4_PS(columns[c][0], columns[c][1], columns[c][2], columns[c][3]);
+		}
+		__m128 sphere[4] = { view_center[0], view_center[1], view_center[2], view_radius };
+		_MM_TRANSPOSE4_PS(sphere[0], sphere[1], sphere[2], sphere[3]);
+
+		float light_lanes[3][4], camera_lanes[3][4];
+		for (unsigned int k=0; k<3; ++k) {
+			_mm_storeu_ps(light_lanes[k], light_out[k]);
+			_mm_storeu_ps(camera_lanes[k], camera_out[k]);
+		}
+
+		unsigned int lanes = std::min(end - i, 4u);
+		for (unsigned int lane=0; lane<lanes; ++lane) {
+			Result& result = results[i - begin + lane];
+			for (unsigned int c=0; c<4; ++c)
+				_mm_storeu_ps(&result.model_view[c][0], columns[c][lane]);
+			float sphere_lane[4];
+			_mm_storeu_ps(sphere_lane, sphere[lane]);
+			result.view_center = glm::vec3(sphere_lane[0], sphere_lane[1], sphere_lane[2]);
+			result.view_radius = sphere_lane[3];
+			result.light_position = glm::vec3(light_lanes[0][lane], light_lanes[1][lane], light_lanes[2][lane]);
+			result.camera_position = glm::vec3(camera_lanes[0][lane], camera_lanes[1][lane], camera_lanes[2][lane]);
+		}
+	}
+#else
+	computeScalar(model, view, light_position, begin, end, results);
+#endif
+}
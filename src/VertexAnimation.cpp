@@ -0,0 +1,252 @@
+#include "VertexAnimation.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <sstream>
+
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/type_ptr.hpp>
+
+#include "Timer.h"
+
+namespace {
+	/**
+	 * Copies the contents of a buffer of the model back from OpenGL,
+	 * which only happens once per bake
+	 */
+	template <typename T>
+	void readBuffer(std::shared_ptr<GLUtils::VBO<GL_ARRAY_BUFFER> > buffer, size_t count, std::vector<T>& data) {
+		data.resize(count);
+		buffer->bind();
+		glGetBufferSubData(GL_ARRAY_BUFFER, 0, count*sizeof(T), data.data());
+		GLUtils::VBO<GL_ARRAY_BUFFER>::unbind();
+	}
+
+	/**
+	 * Applies the blended rows of the bones of a vertex to a point, or
+	 * to a direction if w is 0
+	 */
+	inline glm::vec3 skin(const float* palette, const uint8_t* bones, const glm::vec3& v, float w) {
+		glm::vec3 result(0.0f);
+		for (unsigned int i=0; i<Skeleton::max_influences; ++i) {
+			float weight = bones[Skeleton::max_influences + i] / 255.0f;
+			if (weight == 0.0f)
+				continue;
+			const float* rows = palette + bones[i]*Skeleton::floats_per_bone;
+			for (unsigned int r=0; r<3; ++r)
+				result[r] += weight*(rows[4*r]*v.x + rows[4*r + 1]*v.y + rows[4*r + 2]*v.z + rows[4*r + 3]*w);
+		}
+		return result;
+	}
+}
+
+VertexAnimation::VertexAnimation(Model* model, unsigned int clip, JobSystem* job_system, GLUtils::Program& program,
+		float frame_rate, unsigned int max_instances, GLenum unit) : model(model), max_instances(max_instances), unit(unit),
+		frame_rate(frame_rate), instances_changed(false), colour(0.6f, 0.7f, 0.8f), bake_time(0.0) {
+	const Skeleton* skeleton = model->getSkeleton();
+	if (skeleton == NULL)
+		THROW_EXCEPTION("Vertex animation needs an animated model");
+	if (clip >= skeleton->getClips().size()) {
+		std::stringstream err;
+		err << "The model has no clip " << clip << " to bake, only " << skeleton->getClips().size();
+		THROW_EXCEPTION(err.str());
+	}
+	if (!model->getNormals())
+		THROW_EXCEPTION("Vertex animation needs a model with normals");
+
+	// Whole frames, so that the last one interpolates into the first
+	duration = skeleton->getClips()[clip].duration;
+	num_frames = std::max(1u, static_cast<unsigned int>(std::ceil(duration*frame_rate)));
+	if (duration > 0.0f)
+		this->frame_rate = num_frames / duration;
+
+	// Rows of an even width, so both texels of a vertex are in one row
+	GLint max_size = 0;
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+	const size_t num_texels = 2*static_cast<size_t>(model->getNumVertices())*num_frames;
+	const GLsizei width = std::min(4096, max_size) & ~1;
+	const size_t height = (num_texels + width - 1) / width;
+	if (height > static_cast<size_t>(max_size)) {
+		std::stringstream err;
+		err << num_frames << " frames of " << model->getNumVertices() << " vertices do not fit in a texture of "
+			<< max_size << "x" << max_size << " texels";
+		THROW_EXCEPTION(err.str());
+	}
+
+	Timer bake_timer;
+	std::vector<float> texels(width*height*4, 0.0f);
+	bake(model, clip, job_system, texels);
+	bake_time = bake_timer.elapsed();
+
+	// Half floats are plenty for a model that fits in the unit cube
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, width, static_cast<GLsizei>(height), 0, GL_RGBA, GL_FLOAT, texels.data());
+	glBindTexture(GL_TEXTURE_2D, 0);
+	texture_bytes = width*height*4*sizeof(uint16_t);
+
+	instances.reset(new GLUtils::VBO<GL_ARRAY_BUFFER>(NULL, max_instances*floats_per_instance*sizeof(float)));
+
+	// The positions and normals come from the texture, but compatibility
+	// contexts only draw with attribute 0 enabled, so position stays
+	const GLsizei stride = floats_per_instance*sizeof(float);
+	glGenVertexArrays(1, &vao);
+	glBindVertexArray(vao);
+	model->getVertices()->bind();
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, NULL);
+	glEnableVertexAttribArray(0);
+
+	// A mat4 attribute is four columns at consecutive locations
+	instances->bind();
+	GLint transform_location = glGetAttribLocation(program.name, "instance_transform");
+	for (GLint i=0; i<4; ++i) {
+		glVertexAttribPointer(transform_location + i, 4, GL_FLOAT, GL_FALSE, stride, reinterpret_cast<GLvoid*>(i*sizeof(glm::vec4)));
+		glEnableVertexAttribArray(transform_location + i);
+		glVertexAttribDivisor(transform_location + i, 1);
+	}
+	GLint offset_location = glGetAttribLocation(program.name, "instance_time_offset");
+	glVertexAttribPointer(offset_location, 1, GL_FLOAT, GL_FALSE, stride, reinterpret_cast<GLvoid*>(sizeof(glm::mat4)));
+	glEnableVertexAttribArray(offset_location);
+	glVertexAttribDivisor(offset_location, 1);
+	glBindVertexArray(0);
+	GLUtils::VBO<GL_ARRAY_BUFFER>::unbind();
+	CHECK_GL_ERROR();
+}
+
+VertexAnimation::~VertexAnimation() {
+	glDeleteVertexArrays(1, &vao);
+	glDeleteTextures(1, &texture);
+}
+
+void VertexAnimation::bake(Model* model, unsigned int clip, JobSystem* job_system, std::vector<float>& texels) {
+	const Skeleton* skeleton = model->getSkeleton();
+	const Skeleton::Clip& source = skeleton->getClips()[clip];
+	const std::vector<MorphMesh>& morph_meshes = model->getMorphMeshes();
+	const unsigned int num_vertices = model->getNumVertices();
+	const unsigned int bone_stride = 2*Skeleton::max_influences;
+
+	std::vector<glm::vec3> positions, normals;
+	std::vector<uint8_t> bones;
+	readBuffer(model->getVertices(), num_vertices, positions);
+	readBuffer(model->getNormals(), num_vertices, normals);
+	readBuffer(model->getBones(), num_vertices*bone_stride, bones);
+
+	// The channel of each morph mesh in the clip, if it has one
+	std::vector<int> morph_channels(morph_meshes.size(), -1);
+	for (size_t m=0; m<morph_meshes.size(); ++m)
+		for (size_t c=0; c<source.mesh_channels.size(); ++c)
+			if (source.mesh_channels[c].mesh == morph_meshes[m].name && !source.mesh_channels[c].shapes.empty())
+				morph_channels[m] = static_cast<int>(c);
+
+	// Each thread morphs a frame into its own copy of the vertices,
+	// then skins them straight into the texels
+	unsigned int num_threads = job_system ? job_system->getNumThreads() : 1;
+	std::vector<Skeleton::Pose> thread_poses(num_threads);
+	std::vector<std::vector<float> > thread_palettes(num_threads, std::vector<float>(skeleton->getNumBones()*Skeleton::floats_per_bone));
+	std::vector<std::vector<glm::vec3> > thread_vertices(num_threads);
+	JobSystem::RangeFunction bake_frames = [&](unsigned int begin, unsigned int end, unsigned int thread_index) {
+		Skeleton::Pose& pose = thread_poses[thread_index];
+		float* palette = thread_palettes[thread_index].data();
+		std::vector<glm::vec3>& vertices = thread_vertices[thread_index];
+		for (unsigned int f=begin; f<end; ++f) {
+			float time = duration*f / num_frames;
+			skeleton->samplePose(clip, time, pose);
+			skeleton->computePalette(pose, palette);
+
+			vertices.assign(positions.begin(), positions.end());
+			vertices.insert(vertices.end(), normals.begin(), normals.end());
+			for (size_t m=0; m<morph_meshes.size(); ++m) {
+				if (morph_channels[m] < 0)
+					continue;
+				const MorphMesh& morph = morph_meshes[m];
+				unsigned int shape_a, shape_b;
+				float fraction;
+				Skeleton::sampleShapes(source.mesh_channels[morph_channels[m]], time, shape_a, shape_b, fraction);
+				if (shape_a >= morph.positions.size() || shape_b >= morph.positions.size())
+					continue;
+				for (unsigned int v=0; v<morph.count; ++v) {
+					unsigned int index = morph.sources[v];
+					vertices[morph.first + v] = glm::mix(morph.positions[shape_a][index], morph.positions[shape_b][index], fraction);
+					vertices[num_vertices + morph.first + v] = glm::mix(morph.normals[shape_a][index], morph.normals[shape_b][index], fraction);
+				}
+			}
+
+			float* out = &texels[8*static_cast<size_t>(f)*num_vertices];
+			for (unsigned int v=0; v<num_vertices; ++v) {
+				glm::vec3 position = skin(palette, &bones[bone_stride*v], vertices[v], 1.0f);
+				glm::vec3 normal = skin(palette, &bones[bone_stride*v], vertices[num_vertices + v], 0.0f);
+				normal *= 1.0f / std::sqrt(std::max(glm::dot(normal, normal), 1e-30f));
+				out[8*v + 0] = position.x; out[8*v + 1] = position.y; out[8*v + 2] = position.z; out[8*v + 3] = 1.0f;
+				out[8*v + 4] = normal.x; out[8*v + 5] = normal.y; out[8*v + 6] = normal.z; out[8*v + 7] = 0.0f;
+			}
+		}
+	};
+	if (job_system)
+		job_system->parallelFor(num_frames, 1, bake_frames);
+	else
+		bake_frames(0, num_frames, 0);
+}
+
+unsigned int VertexAnimation::addInstance(const glm::mat4& transform, float time_offset) {
+	unsigned int index = getNumInstances();
+	if (index == max_instances) {
+		std::stringstream err;
+		err << "Vertex animation can have at most " << max_instances << " instances";
+		THROW_EXCEPTION(err.str());
+	}
+	instance_data.resize(instance_data.size() + floats_per_instance);
+	setInstance(index, transform, time_offset);
+	return index;
+}
+
+void VertexAnimation::setInstance(unsigned int index, const glm::mat4& transform, float time_offset) {
+	float* out = &instance_data[index*floats_per_instance];
+	std::memcpy(out, glm::value_ptr(transform), sizeof(glm::mat4));
+	out[16] = time_offset;
+	instances_changed = true;
+}
+
+void VertexAnimation::render(GLUtils::Program& program, const glm::mat4& view, const glm::mat4& projection, const glm::vec3& light_position, double time) {
+	if (instance_data.empty())
+		return;
+
+	if (instances_changed) {
+		instances->bind();
+		glBufferSubData(GL_ARRAY_BUFFER, 0, instance_data.size()*sizeof(float), instance_data.data());
+		GLUtils::VBO<GL_ARRAY_BUFFER>::unbind();
+		instances_changed = false;
+	}
+
+	// Wrapped in double precision, so the animation does not start to
+	// stutter after running for hours
+	float animation_time = (duration > 0.0f) ? static_cast<float>(std::fmod(time, static_cast<double>(duration))) : 0.0f;
+
+	// The instance transforms take the model to world space, which is
+	// the space the lighting of the variant works in
+	GLuint name = program.name;
+	glm::vec3 camera_position = glm::vec3(glm::inverse(view)[3]);
+	glProgramUniformMatrix4fv(name, glGetUniformLocation(name, "proj_mat"), 1, 0, glm::value_ptr(projection));
+	glProgramUniformMatrix4fv(name, glGetUniformLocation(name, "model_view_mat"), 1, 0, glm::value_ptr(view));
+	glProgramUniform3fv(name, glGetUniformLocation(name, "light_position"), 1, glm::value_ptr(light_position));
+	glProgramUniform3fv(name, glGetUniformLocation(name, "camera_position"), 1, glm::value_ptr(camera_position));
+	glProgramUniform3fv(name, glGetUniformLocation(name, "colour"), 1, glm::value_ptr(colour));
+	glProgramUniform1i(name, glGetUniformLocation(name, "vertex_animation"), unit - GL_TEXTURE0);
+	glProgramUniform1i(name, glGetUniformLocation(name, "animation_vertices"), model->getNumVertices());
+	glProgramUniform1i(name, glGetUniformLocation(name, "animation_frames"), num_frames);
+	glProgramUniform1f(name, glGetUniformLocation(name, "animation_frame_rate"), frame_rate);
+	glProgramUniform1f(name, glGetUniformLocation(name, "animation_time"), animation_time);
+
+	glActiveTexture(unit);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glActiveTexture(GL_TEXTURE0);
+
+	program.use();
+	glBindVertexArray(vao);
+	glDrawArraysInstanced(GL_TRIANGLES, 0, model->getNumVertices(), getNumInstances());
+	glBindVertexArray(0);
+	program.disuse();
+}
@@ -1,6 +1,9 @@
 #include "GameManager.h"
+#include "Benchmarks.h"
 #include <iostream>
 #include <memory>
+#include <string>
+#include <cstdio>
 
 #ifdef _WIN32
 #include <Windows.h>
@@ -10,8 +13,56 @@
  * Simple program that starts our game manager
  */
 int main(int argc, char *argv[]) {
+	if (argc > 2 && std::string(argv[1]) == "--benchmark") {
+		if (!Benchmarks::run(argv[2])) {
+			std::cerr << "Unknown benchmark " << argv[2] << std::endl;
+			return 1;
+		}
+		return 0;
+	}
+
+	// "--window <width>x<height>" sets the initial window size,
+	// "--paged <file>" adds a model that is paged in from disk, and
+	// "--animated <file>" adds a crowd playing the model's animations, and
+	// "--baked <file>" a larger one playing its first, baked, animation
+	unsigned int window_width = 800;
+	unsigned int window_height = 600;
+	std::string paged_model, animated_model, baked_model;
+	for (int i=1; i<argc; i+=2) {
+		std::string option(argv[i]);
+		if (i + 1 == argc) {
+			std::cerr << "Missing value for option " << option << std::endl;
+			return 1;
+		}
+		if (option == "--window") {
+			if (std::sscanf(argv[i+1], "%ux%u", &window_width, &window_height) != 2 || window_width == 0 || window_height == 0) {
+				std::cerr << "Invalid window size " << argv[i+1] << ", expected e.g. 1280x720" << std::endl;
+				return 1;
+			}
+		}
+		else if (option == "--paged") {
+			paged_model = argv[i+1];
+		}
+		else if (option == "--animated") {
+			animated_model = argv[i+1];
+		}
+		else if (option == "--baked") {
+			baked_model = argv[i+1];
+		}
+		else {
+			std::cerr << "Unknown option " << option << std::endl;
+			return 1;
+		}
+	}
+
 	std::shared_ptr<GameManager> game;
-	game.reset(new GameManager());
+	game.reset(new GameManager(window_width, window_height));
+	if (!paged_model.empty())
+		game->setPagedModel(paged_model);
+	if (!animated_model.empty())
+		game->setAnimatedModel(animated_model);
+	if (!baked_model.empty())
+		game->setBakedModel(baked_model);
 	game->init();
 	game->play();
 	game.reset();